@@ -0,0 +1,42 @@
+/*
+ * Counting of memory allocations. The allocator functions are interposed
+ * and forwarded to the glibc allocator.
+ */
+
+#include "bench.h"
+
+#include <string.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+uint64_t bench_num_allocs;
+uint64_t bench_alloc_bytes;
+
+void *malloc(size_t size)
+{
+	bench_num_allocs++;
+	bench_alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	bench_num_allocs++;
+	bench_alloc_bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	bench_num_allocs++;
+	bench_alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
@@ -0,0 +1,192 @@
+/*
+ * Benchmarks of string formatting and the RRD logger.
+ */
+
+#include "bench.h"
+#include "fake-rrd.h"
+#include "log.h"
+#include "rrd-logger.h"
+#include "strbuf.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	RRD_LATENCY_US		100	/* simulated disk latency of an update */
+
+struct rrd_arg
+{
+	struct rrd_logger *logger;
+	struct wmr_reading reading;
+	struct wmr_reading batch[SERIES_MAX];	/* a reading of every series */
+};
+
+static void printf_short(void *arg, size_t iters)
+{
+	struct strbuf *buf = (struct strbuf *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++) {
+		strbuf_reset(buf);
+		strbuf_printf(buf, "%.1f:%.1f", 3.4f, 12.7f);
+	}
+}
+
+static void put_fixed_short(void *arg, size_t iters)
+{
+	struct strbuf *buf = (struct strbuf *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++) {
+		strbuf_reset(buf);
+		strbuf_put_fixed(buf, 3.4f, 1);
+		strbuf_putc(buf, ':');
+		strbuf_put_fixed(buf, 12.7f, 1);
+	}
+}
+
+static void printf_line(void *arg, size_t iters)
+{
+	struct strbuf *buf = (struct strbuf *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++) {
+		strbuf_reset(buf);
+		strbuf_printf(buf, "stats\tsensor=%s\tfield=%s\twindow=%u s\t"
+			"min=%.1f\tmax=%.1f\tmean=%.1f\tcount=%zu\n",
+			"temp1", "humidity", 3600, 12.5f, 31.0f, 20.25f, (size_t)3600);
+	}
+}
+
+static void debug_disabled(void *arg, size_t iters)
+{
+	struct wmr_reading *reading = (struct wmr_reading *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++)
+		log_debug("Received reading of type %u at %li", reading->type,
+			(long)reading->time);
+}
+
+static void log_reading(void *arg, size_t iters)
+{
+	struct rrd_arg *r = (struct rrd_arg *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++)
+		rrd_log_reading(NULL, &r->reading, r->logger);
+}
+
+static void log_batch(void *arg, size_t iters)
+{
+	struct rrd_arg *r = (struct rrd_arg *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++)
+		rrd_log_batch(NULL, r->batch, SERIES_MAX, true, r->logger);
+}
+
+static void rrd_set_cfg(struct rrd_logger *logger, char *root)
+{
+	logger->cfg.rrd_root = root;
+	logger->cfg.wind_rrd = "wind.rrd";
+	logger->cfg.rain_rrd = "rain.rrd";
+	logger->cfg.uvi_rrd = "uvi.rrd";
+	logger->cfg.baro_rrd = "baro.rrd";
+	logger->cfg.temp_N_rrd = "temp%u.rrd";
+}
+
+/*
+ * Benchmark batches of readings of all series, such as during a backfill
+ * of historic data, written with @num_writers writer threads. Every update
+ * takes RRD_LATENCY_US.
+ */
+static void bench_rrd_batch(struct wmr_latest_data *data, unsigned num_writers)
+{
+	struct rrd_logger logger;
+	struct rrd_arg r = { .logger = &logger };
+	char name[64];
+	size_t i;
+
+	r.batch[SERIES_WIND] = data->wind;
+	r.batch[SERIES_RAIN] = data->rain;
+	r.batch[SERIES_UVI] = data->uvi;
+	r.batch[SERIES_BARO] = data->baro;
+	for (i = 0; i < WMR200_MAX_TEMP_SENSORS; i++) {
+		r.batch[SERIES_TEMP0 + i] = data->temp[1];
+		r.batch[SERIES_TEMP0 + i].temp.sensor_id = i;
+	}
+
+	rrd_logger_init(&logger);
+	rrd_set_cfg(&logger, "/nonexistent");
+	logger.cfg.num_writers = num_writers;
+	if (rrd_logger_start(&logger) != 0)
+		return;
+
+	fake_rrd_set_latency(RRD_LATENCY_US);
+	snprintf(name, sizeof(name), "rrd_log_batch_%u_writers", num_writers);
+	bench_run(name, log_batch, &r);
+	fake_rrd_set_latency(0);
+
+	rrd_logger_free(&logger);
+}
+
+/*
+ * Benchmark the RRD logger with readings of @data, with root @root.
+ */
+static void bench_rrd(const char *suffix, struct wmr_latest_data *data, char *root)
+{
+	struct rrd_logger logger;
+	struct rrd_arg r = { .logger = &logger };
+	char name[64];
+
+	rrd_logger_init(&logger);
+	rrd_set_cfg(&logger, root);
+
+	r.reading = data->wind;
+	snprintf(name, sizeof(name), "rrd_log_reading_wind_%s", suffix);
+	bench_run(name, log_reading, &r);
+
+	r.reading = data->temp[1];
+	snprintf(name, sizeof(name), "rrd_log_reading_temp_%s", suffix);
+	bench_run(name, log_reading, &r);
+
+	rrd_logger_free(&logger);
+}
+
+void bench_misc(void)
+{
+	char tmpfs_root[] = "/dev/shm/meteod-bench.XXXXXX";
+	struct wmr_latest_data data;
+	struct strbuf buf;
+	char path[sizeof(tmpfs_root) + 16];
+
+	strbuf_init(&buf, 256);
+	bench_run("strbuf_printf_short", printf_short, &buf);
+	bench_run("strbuf_put_fixed_short", put_fixed_short, &buf);
+	bench_run("strbuf_printf_line", printf_line, &buf);
+	strbuf_free(&buf);
+
+	wmr_get_latest_data(bench_device(), &data);
+
+	log_set_level(LOG_INFO);
+	bench_run("log_debug_disabled", debug_disabled, &data.wind);
+
+	fake_rrd_set_files(false);
+	bench_rrd("stub", &data, "/nonexistent");
+	bench_rrd_batch(&data, 0);
+	bench_rrd_batch(&data, 4);
+
+	if (mkdtemp(tmpfs_root) == NULL)
+		return;
+
+	fake_rrd_set_files(true);
+	bench_rrd("tmpfs", &data, tmpfs_root);
+	fake_rrd_set_files(false);
+
+	snprintf(path, sizeof(path), "%s/wind.rrd", tmpfs_root);
+	(void) unlink(path);
+	snprintf(path, sizeof(path), "%s/temp1.rrd", tmpfs_root);
+	(void) unlink(path);
+	(void) rmdir(tmpfs_root);
+}
@@ -0,0 +1,197 @@
+/*
+ * Benchmarks of server response rendering. The server module is included,
+ * so that responses can be rendered without the network.
+ */
+
+#include "../src/server.c"
+
+#include "bench.h"
+#include "climate.h"
+#include "graph.h"
+#include "history.h"
+#include "metrics.h"
+#include "stats.h"
+
+#include <fcntl.h>
+
+#define	HISTORY_SAMPLES		3600	/* samples of each series in history */
+#define	CLIMATE_DAYS		365	/* days of calendar summaries */
+
+struct server_arg
+{
+	struct wmr_server *srv;
+	int fd;				/* /dev/null */
+	const char *query;		/* query to be run */
+};
+
+static void latest(void *arg, size_t iters)
+{
+	struct server_arg *s = (struct server_arg *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++)
+		serve_latest(s->srv, s->fd);
+}
+
+/*
+ * Admit connections from more addresses than there are buckets, so that
+ * buckets are being reused.
+ */
+static void admit(void *arg, size_t iters)
+{
+	struct admit *adm = (struct admit *)arg;
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	size_t i;
+
+	for (i = 0; i < iters; i++) {
+		addr.sin_addr.s_addr = htonl(0x0a000000 | (i % 10000));
+		(void) admit_connection(adm, (struct sockaddr *)&addr, false);
+	}
+}
+
+static void graph(void *arg, size_t iters)
+{
+	struct graph_cache *cache = (struct graph_cache *)arg;
+	struct strbuf out;
+	time_t now = time(NULL);
+	size_t i;
+
+	for (i = 0; i < iters; i++) {
+		strbuf_init(&out, 1024);
+		graph_render(cache, SERIES_WIND, GRAPH_DAY, now, &out);
+		strbuf_free(&out);
+	}
+}
+
+/*
+ * Log a reading a minute, so that a new day starts every 1440 readings.
+ */
+static void climate(void *arg, size_t iters)
+{
+	struct climate *clim = (struct climate *)arg;
+	struct wmr_reading reading;
+	size_t i;
+
+	memset(&reading, 0, sizeof(reading));
+	reading.type = WMR_TEMP;
+	reading.time = time(NULL);
+	for (i = 0; i < iters; i++) {
+		reading.time += 60;
+		reading.temp.temp = i % 40;
+		climate_log_reading(NULL, &reading, clim);
+	}
+}
+
+static void query(void *arg, size_t iters)
+{
+	struct server_arg *s = (struct server_arg *)arg;
+	char line[QUERY_MAX_LEN];
+	struct strbuf out;
+	size_t i;
+
+	for (i = 0; i < iters; i++) {
+		strbuf_init(&out, 1024);
+		strncpy(line, s->query, sizeof(line) - 1);
+		line[sizeof(line) - 1] = '\0';
+		run_query(s->srv, line, &out);
+		(void) write_all(s->fd, strbuf_get_string(&out), strbuf_strlen(&out));
+		strbuf_free(&out);
+	}
+}
+
+void bench_server(void)
+{
+	struct history_cfg hist_cfg = { .span = 7 * 24 * 3600, .capacity = 1 << 16 };
+	struct stats_cfg stats_cfg = { .windows = { 3600, 24 * 3600 } };
+	struct wmr_latest_data data;
+	struct wmr_reading reading;
+	struct wmr_server srv;
+	struct server_page *page;
+	struct server_cmd *cmd;
+	struct climate_cfg climate_cfg = { .path = NULL };
+	struct graph_cache graphs;
+	struct climate clim, live;
+	struct history hist;
+	struct stats stats;
+	struct server_arg s = { .srv = &srv };
+	time_t now = time(NULL);
+	size_t i;
+
+	wmr_get_latest_data(bench_device(), &data);
+
+	history_init(&hist, &hist_cfg);
+	stats_init(&stats, &stats_cfg);
+	for (i = 0; i < HISTORY_SAMPLES; i++) {
+		reading = data.wind;
+		reading.time = now - HISTORY_SAMPLES + i;
+		reading.wind.avg_speed = i % 20;
+		history_log_reading(NULL, &reading, &hist);
+		stats_log_reading(NULL, &reading, &stats);
+	}
+
+	(void) climate_open(&clim, &climate_cfg);
+	for (i = 0; i < 24 * CLIMATE_DAYS; i++) {
+		reading = data.wind;
+		reading.time = now - 24 * 3600 * CLIMATE_DAYS + 3600 * i;
+		climate_log_reading(NULL, &reading, &clim);
+	}
+
+	server_init(&srv);
+	server_set_device(&srv, bench_device());
+	server_set_stats(&srv, &stats);
+	graph_init(&graphs, &hist, NULL);
+	history_serve(&hist, &srv);
+	graph_serve(&graphs, &srv);
+	climate_serve(&clim, &srv);
+	metrics_serve(&srv);
+
+	if ((s.fd = open("/dev/null", O_WRONLY)) < 0)
+		return;
+
+	bench_run("serve_latest", latest, &s);
+
+	s.query = "range wind -3600 now";
+	bench_run("query_range", query, &s);
+
+	s.query = "downsample wind avg_speed -3600 now 60";
+	bench_run("query_downsample", query, &s);
+
+	s.query = "metrics";
+	bench_run("query_metrics", query, &s);
+
+	bench_run("graph_render", graph, &graphs);
+
+	s.query = "GET /graph/wind-day.svg HTTP/1.0";
+	bench_run("query_graph_cached", query, &s);
+
+	s.query = "summary month wind -31536000 now";
+	bench_run("query_summary_year", query, &s);
+
+	s.query = "records wind";
+	bench_run("query_records", query, &s);
+
+	admit_init(&srv.admit, &srv.cfg.admit);
+	bench_run("admit_connection", admit, &srv.admit);
+	admit_free(&srv.admit);
+
+	(void) climate_open(&live, &climate_cfg);
+	bench_run("climate_log_reading", climate, &live);
+	climate_close(&live);
+
+	(void) close(s.fd);
+
+	/* the server was never started, so server_stop() is not applicable */
+	while ((cmd = srv.cmds) != NULL) {
+		srv.cmds = cmd->next;
+		free(cmd);
+	}
+	while ((page = srv.pages) != NULL) {
+		srv.pages = page->next;
+		free(page);
+	}
+
+	graph_free(&graphs);
+	climate_close(&clim);
+	history_free(&hist);
+	stats_free(&stats);
+}
@@ -0,0 +1,136 @@
+/*
+ * Benchmarks of the WMR200 module. The module is included, so that its
+ * internal functions can be measured one by one.
+ */
+
+#include "../src/wmr200.c"
+
+#include "bench.h"
+#include "fake-hid.h"
+#include "synth.h"
+
+#define	STREAM_SIZE	4096
+#define	NOISE_INTERVAL	509	/* bytes between corrupted bytes of a noisy stream */
+
+static byte_t stream[STREAM_SIZE];
+static byte_t frames[SYNTH_FRAMES_SIZE(STREAM_SIZE)];
+static byte_t noisy_frames[SYNTH_FRAMES_SIZE(STREAM_SIZE)];
+static volatile bool verified;		/* keeps verify_packet from being optimized out */
+
+/*
+ * A packet to be processed over and over again.
+ */
+struct packet_arg
+{
+	struct wmr200 *wmr;
+	byte_t packet[SYNTH_MAX_PACKET];
+	size_t len;
+};
+
+/*
+ * Receive (and verify) packets from HID frames.
+ */
+static void receive(void *arg, size_t iters)
+{
+	struct wmr200 *wmr = (struct wmr200 *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++) {
+		while (!receive_packet(wmr));
+		pool_put(&wmr->packets, wmr->packet);
+	}
+}
+
+static void verify(void *arg, size_t iters)
+{
+	struct packet_arg *p = (struct packet_arg *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++)
+		verified = verify_packet(p->wmr);
+}
+
+static void process(void *arg, size_t iters)
+{
+	struct packet_arg *p = (struct packet_arg *)arg;
+	size_t i;
+
+	for (i = 0; i < iters; i++)
+		dispatch_packet(p->wmr);
+}
+
+static void set_packet(struct packet_arg *p, byte_t type)
+{
+	p->len = synth_packet(p->packet, type, time(NULL), 42);
+	p->wmr->packet = p->packet;
+	p->wmr->packet_type = type;
+	p->wmr->packet_len = p->len;
+}
+
+struct wmr200 *bench_device(void)
+{
+	static struct wmr200 *wmr;
+	static const byte_t types[] = {
+		HISTORIC_DATA, WMR_WIND, WMR_RAIN, WMR_UVI, WMR_BARO, WMR_TEMP,
+		WMR_STATUS,
+	};
+	struct packet_arg p;
+	size_t i;
+
+	if (wmr != NULL)
+		return wmr;
+
+	wmr = wmr_open();
+	p.wmr = wmr;
+	for (i = 0; i < ARRAY_SIZE(types); i++) {
+		set_packet(&p, types[i]);
+		dispatch_packet(wmr);
+	}
+	emit_meta_packet(wmr);
+
+	wmr->packet = NULL;
+	return wmr;
+}
+
+void bench_wmr200(void)
+{
+	static const struct
+	{
+		const char *name;
+		byte_t type;
+	}
+	packets[] = {
+		{ "process_historic_data", HISTORIC_DATA },
+		{ "process_wind_data", WMR_WIND },
+		{ "process_rain_data", WMR_RAIN },
+		{ "process_uvi_data", WMR_UVI },
+		{ "process_baro_data", WMR_BARO },
+		{ "process_temp_data", WMR_TEMP },
+		{ "process_status_data", WMR_STATUS },
+	};
+	struct packet_arg p;
+	size_t len, i;
+
+	len = synth_stream(stream, sizeof(stream), time(NULL), 0);
+	fake_hid_set_frames(frames, synth_frames(frames, stream, len));
+
+	p.wmr = wmr_open();
+	bench_run("receive_packet", receive, p.wmr);
+
+	/* the same stream with some bytes corrupted, time per valid packet */
+	for (i = NOISE_INTERVAL / 2; i < len; i += NOISE_INTERVAL)
+		stream[i] ^= 0x10;
+	fake_hid_set_frames(noisy_frames, synth_frames(noisy_frames, stream, len));
+	bench_run("receive_packet_noisy", receive, p.wmr);
+
+	set_packet(&p, HISTORIC_DATA);
+	bench_run("verify_packet", verify, &p);
+
+	for (i = 0; i < ARRAY_SIZE(packets); i++) {
+		set_packet(&p, packets[i].type);
+		bench_run(packets[i].name, process, &p);
+	}
+
+	p.wmr->packet = NULL;
+	wmr_close(p.wmr);
+}
@@ -0,0 +1,85 @@
+/*
+ * Microbenchmarks
+ *
+ * Usage: bench [filter]
+ *
+ * Runs all benchmarks whose name starts with filter (or all of them) and
+ * prints a line of JSON for each:
+ *
+ *	{"name": ..., "iters": ..., "ns_per_op": ..., "allocs_per_op": ...,
+ *	 "bytes_per_op": ...}
+ */
+
+#include "bench.h"
+#include "common.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define	MIN_TIME_NS	(10 * 1000 * 1000)	/* calibration run length */
+#define	RUN_TIME_NS	(200 * 1000 * 1000)	/* measured run length */
+
+static const char *filter;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_run(const char *name, bench_func_t *func, void *arg)
+{
+	uint64_t start, elapsed, allocs, bytes;
+	size_t iters = 1;
+
+	if (filter != NULL && strncmp(name, filter, strlen(filter)) != 0)
+		return;
+
+	/*
+	 * Calibrate: double the number of iterations until the run takes
+	 * long enough to be timed, then scale it up to the run time.
+	 */
+	while (1) {
+		start = now_ns();
+		func(arg, iters);
+		elapsed = now_ns() - start;
+		if (elapsed >= MIN_TIME_NS)
+			break;
+		iters *= 2;
+	}
+
+	iters = MAX(1, (double)iters * RUN_TIME_NS / elapsed);
+
+	allocs = bench_num_allocs;
+	bytes = bench_alloc_bytes;
+	start = now_ns();
+	func(arg, iters);
+	elapsed = now_ns() - start;
+	allocs = bench_num_allocs - allocs;
+	bytes = bench_alloc_bytes - bytes;
+
+	printf("{\"name\": \"%s\", \"iters\": %zu, \"ns_per_op\": %.1f, "
+		"\"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f}\n",
+		name, iters, (double)elapsed / iters,
+		(double)allocs / iters, (double)bytes / iters);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		filter = argv[1];
+
+	trace_set_dump_path(BENCH_TRACE_PATH);
+
+	bench_wmr200();
+	bench_server();
+	bench_misc();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,40 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Benchmark function prototype. The function should perform the measured
+ * operation @iters times.
+ */
+typedef void bench_func_t(void *arg, size_t iters);
+
+/*
+ * Run benchmark @name, unless it's filtered out on the command line.
+ *
+ * The number of iterations is chosen so that the benchmark runs for
+ * a while. The result is printed to standard output as a line of JSON
+ * with the time and number of allocations per iteration.
+ */
+void bench_run(const char *name, bench_func_t *func, void *arg);
+
+/*
+ * Number and total size of memory allocations made so far.
+ */
+extern uint64_t bench_num_allocs;
+extern uint64_t bench_alloc_bytes;
+
+/*
+ * Benchmark suites.
+ */
+void bench_wmr200(void);
+void bench_server(void);
+void bench_misc(void);
+
+/*
+ * A device with latest data of all kinds, see bench-wmr200.c.
+ */
+struct wmr200 *bench_device(void);
+
+#endif
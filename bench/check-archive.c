@@ -0,0 +1,227 @@
+/*
+ * Checks of the archive file format. The module is included, so that the
+ * block codec can be checked without the file system.
+ */
+
+#include "../src/archive.c"
+
+#include "check.h"
+
+#include <math.h>
+
+#define	NUM_BLOCKS	200	/* random blocks checked */
+#define	NUM_FLIPS	2000	/* corrupted blocks checked */
+#define	FILE_BLOCKS	3	/* blocks of the file checked for truncation */
+
+static struct archive_pending pending;
+static uint8_t scratch[SCRATCH_SIZE];
+static time_t dec_time[ARCHIVE_BLOCK_MAX];
+static float dec_values[SERIES_MAX_FIELDS][ARCHIVE_BLOCK_MAX];
+
+/*
+ * Fill @pending with @count samples of @num_fields fields. Times come in
+ * regular intervals with gaps, jitter and steps back; values of each field
+ * are taken from a pattern picked at random, special values included.
+ */
+static void make_samples(size_t count, size_t num_fields)
+{
+	static const float special[] = { 0.0f, -0.0f, INFINITY, -INFINITY, NAN,
+		1e-45f, -3.4e38f, 3.4e38f };
+	time_t t = 1500000000 + check_rand() % 100000;
+	size_t i, f;
+	float val;
+
+	pending.count = count;
+	for (i = 0; i < count; i++) {
+		switch (check_rand() % 8) {
+		case 0:
+			t += check_rand() % 100000;	/* gap */
+			break;
+		case 1:
+			t -= check_rand() % 3000;	/* step back */
+			break;
+		case 2:
+			t += check_rand() % 7;		/* jitter */
+			break;
+		default:
+			t += 60;
+		}
+		pending.time[i] = t;
+	}
+
+	for (f = 0; f < num_fields; f++) {
+		val = (float)(check_rand() % 2000) / 10 - 100;
+		for (i = 0; i < count; i++) {
+			switch (check_rand() % 8) {
+			case 0:
+				val = special[check_rand() % ARRAY_SIZE(special)];
+				break;
+			case 1:
+				val = bits_float(check_rand());
+				break;
+			case 2:
+			case 3:
+				val += (float)(check_rand() % 11) / 10 - 0.5f;
+				break;
+			}
+			pending.values[f][i] = val;
+		}
+	}
+}
+
+static bool same_float(float a, float b)
+{
+	return float_bits(a) == float_bits(b);
+}
+
+/*
+ * Encoded blocks decode to the samples they were encoded from, and their
+ * headers summarize the samples.
+ */
+static void check_round_trip(void)
+{
+	struct block_header *hdr = (struct block_header *)scratch;
+	size_t n, count, num_fields, i, f;
+	double sum;
+	float min, max;
+
+	for (n = 0; n < NUM_BLOCKS; n++) {
+		count = 1 + check_rand() % ARCHIVE_BLOCK_MAX;
+		num_fields = 1 + check_rand() % SERIES_MAX_FIELDS;
+		make_samples(count, num_fields);
+		(void) encode_block(&pending, num_fields, scratch);
+
+		CHECK(hdr->count == count && hdr->num_fields == num_fields,
+			"block %zu: header count", n);
+		CHECK(decode_block(hdr, dec_time, dec_values) == 0,
+			"block %zu: valid block rejected", n);
+
+		for (i = 0; i < count; i++)
+			CHECK(dec_time[i] == pending.time[i],
+				"block %zu: time %zu is %ld, not %ld", n, i,
+				(long)dec_time[i], (long)pending.time[i]);
+
+		for (f = 0; f < num_fields; f++) {
+			min = max = pending.values[f][0];
+			sum = 0;
+			for (i = 0; i < count; i++) {
+				CHECK(same_float(dec_values[f][i], pending.values[f][i]),
+					"block %zu: value %zu of field %zu is %a, not %a",
+					n, i, f, dec_values[f][i], pending.values[f][i]);
+				min = MIN(min, pending.values[f][i]);
+				max = MAX(max, pending.values[f][i]);
+				sum += pending.values[f][i];
+			}
+
+			CHECK(same_float(hdr->min[f], min) && same_float(hdr->max[f], max),
+				"block %zu: field %zu bounds", n, f);
+			CHECK(hdr->sum[f] == sum || (isnan(hdr->sum[f]) && isnan(sum)),
+				"block %zu: field %zu sum", n, f);
+		}
+
+		for (i = 0; i < count; i++) {
+			CHECK(hdr->t_min <= pending.time[i] && hdr->t_max >= pending.time[i],
+				"block %zu: time bounds", n);
+		}
+	}
+}
+
+/*
+ * Decoding corrupted blocks fails or yields garbage, but stays within the
+ * block and never shifts past the width of a value (which UBSan catches).
+ */
+static void check_corruption(void)
+{
+	struct block_header *hdr = (struct block_header *)scratch;
+	uint8_t *data = scratch + sizeof(*hdr);
+	struct bits b;
+	size_t n, i, size;
+
+	for (n = 0; n < NUM_FLIPS; n++) {
+		make_samples(1 + check_rand() % ARCHIVE_BLOCK_MAX, SERIES_MAX_FIELDS);
+		(void) encode_block(&pending, SERIES_MAX_FIELDS, scratch);
+
+		size = hdr->size;
+		if (n % 2 == 0) {
+			for (i = 0; i < 1 + n % 8; i++)
+				data[check_rand() % size] ^= 1 << (check_rand() % 8);
+		}
+		else {
+			for (i = 8; i < size; i++)
+				data[i] = check_rand();
+		}
+
+		/* the result does not matter, UBSan aborts on overflows */
+		(void) decode_block(hdr, dec_time, dec_values);
+	}
+
+	/*
+	 * A value window which ends past the value: leading zeros 31 and
+	 * length 2. Unchecked, this made the trailing zero count wrap around.
+	 */
+	memset(scratch, 0, SCRATCH_SIZE);
+	b.buf = data;
+	b.pos = 0;
+	put_bits(&b, 0, 64);	/* time of the first sample */
+	put_bits(&b, 0x0, 1);	/* dod of the second one */
+	put_bits(&b, 0x3F, 32);	/* first value */
+	put_bits(&b, 0x3, 2);	/* new window */
+	put_bits(&b, 31, 5);
+	put_bits(&b, 2 - 1, 5);
+	put_bits(&b, 0x3, 2);
+
+	hdr->magic = BLOCK_MAGIC;
+	hdr->count = 2;
+	hdr->num_fields = 1;
+	hdr->size = 16;
+	CHECK(decode_block(hdr, dec_time, dec_values) == -1,
+		"window past the value accepted");
+}
+
+/*
+ * valid_length finds the end of the last complete block of a file cut
+ * anywhere, and stops at a block which is not one.
+ */
+static void check_valid_length(void)
+{
+	static uint8_t file[sizeof(struct file_header) + FILE_BLOCKS * SCRATCH_SIZE];
+	struct file_header *fh = (struct file_header *)file;
+	size_t ends[FILE_BLOCKS + 1];
+	size_t size, len, b, expect;
+
+	memset(file, 0, sizeof(file));
+	fh->magic = ARCHIVE_MAGIC;
+	fh->version = ARCHIVE_VERSION;
+	fh->num_fields = SERIES_MAX_FIELDS;
+
+	ends[0] = size = sizeof(*fh);
+	for (b = 0; b < FILE_BLOCKS; b++) {
+		make_samples(1 + check_rand() % ARCHIVE_BLOCK_MAX, SERIES_MAX_FIELDS);
+		len = encode_block(&pending, SERIES_MAX_FIELDS, scratch);
+		memcpy(file + size, scratch, len);
+		ends[b + 1] = size += len;
+	}
+
+	for (len = 0; len <= size; len++) {
+		expect = 0;
+		for (b = 0; len >= sizeof(*fh) && b <= FILE_BLOCKS; b++)
+			if (ends[b] <= len)
+				expect = ends[b];
+		CHECK(valid_length(file, len) == expect,
+			"file cut at %zu: valid length %zu, not %zu", len,
+			valid_length(file, len), expect);
+	}
+
+	((struct block_header *)(file + ends[1]))->magic ^= 1;
+	CHECK(valid_length(file, size) == ends[1], "corrupt block magic accepted");
+
+	fh->magic ^= 1;
+	CHECK(valid_length(file, size) == 0, "corrupt file magic accepted");
+}
+
+void check_archive(void)
+{
+	check_round_trip();
+	check_corruption();
+	check_valid_length();
+}
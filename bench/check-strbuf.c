@@ -0,0 +1,114 @@
+/*
+ * Checks of fast number formatting against printf.
+ */
+
+#include "check.h"
+#include "common.h"
+#include "strbuf.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define	NUM_RANDOM	2000000		/* random values checked */
+#define	NUM_TIES	200000		/* ties (and their neighbours) checked */
+#define	MAX_DECIMALS	11		/* past the fast path, see strbuf.c */
+
+static struct strbuf buf;
+
+/*
+ * Check that strbuf_put_fixed formats @value exactly like "%.*f".
+ */
+static void check_fixed(double value, unsigned decimals)
+{
+	char expect[512];
+	size_t len;
+
+	(void) snprintf(expect, sizeof(expect), "%.*f", decimals, value);
+
+	strbuf_reset(&buf);
+	len = strbuf_put_fixed(&buf, value, decimals);
+	CHECK(strcmp(strbuf_get_string(&buf), expect) == 0 && len == strlen(expect),
+		"%a with %u decimals is \"%s\", not \"%s\"", value, decimals,
+		strbuf_get_string(&buf), expect);
+}
+
+static double random_double(double max)
+{
+	return (double)check_rand() / (double)(unsigned long)-1 * max;
+}
+
+static void check_special(void)
+{
+	static const double values[] = {
+		0.0, -0.0, 1e-300, -1e-300, 0.5, -0.5, 1.5, 2.5, -2.5, 0.05, 0.15,
+		0.125, 0.375, 1.005, 2.675, 9.995, 99.5, 999999.5, 4e9, -4e9,
+		4e9 - 0.5, 4294967295.5, 1e10, 1e15, 1e300, -1e300, DBL_MAX,
+		DBL_MIN, INFINITY, -INFINITY, NAN, -NAN,
+	};
+	size_t i;
+	unsigned d;
+
+	for (i = 0; i < ARRAY_SIZE(values); i++)
+		for (d = 0; d <= MAX_DECIMALS; d++)
+			check_fixed(values[i], d);
+
+	/* negative values which round to zero keep the sign */
+	for (d = 0; d <= MAX_DECIMALS; d++)
+		check_fixed(-0.4 * pow(10, -(double)d), d);
+}
+
+/*
+ * Values halfway between two outputs, which printf rounds by their exact
+ * binary value, and the values right next to them.
+ */
+static void check_ties(void)
+{
+	double tie;
+	size_t i;
+	unsigned d;
+
+	for (i = 0; i < NUM_TIES; i++) {
+		d = check_rand() % 6;
+		tie = ((double)(check_rand() % 100000000) + 0.5) / pow(10, d);
+		if (check_rand() % 2)
+			tie = -tie;
+
+		check_fixed(tie, d);
+		check_fixed(nextafter(tie, INFINITY), d);
+		check_fixed(nextafter(tie, -INFINITY), d);
+	}
+}
+
+/*
+ * Random values of all magnitudes around the bound of the fast path, and
+ * readings, which are floats.
+ */
+static void check_random(void)
+{
+	double value;
+	size_t i;
+	unsigned d;
+
+	for (i = 0; i < NUM_RANDOM; i++) {
+		d = check_rand() % (MAX_DECIMALS + 1);
+		value = random_double(pow(10, (double)(check_rand() % 12)));
+		if (check_rand() % 4 == 0)
+			value = (float)value;
+		if (check_rand() % 2)
+			value = -value;
+		check_fixed(value, d);
+	}
+}
+
+void check_strbuf(void)
+{
+	strbuf_init(&buf, 64);
+
+	check_special();
+	check_ties();
+	check_random();
+
+	strbuf_free(&buf);
+}
@@ -0,0 +1,73 @@
+/*
+ * Checks of on-disk formats and output formatting
+ *
+ * Usage: check
+ *
+ * Runs all check suites and prints a line of JSON for each:
+ *
+ *	{"check": ..., "cases": ..., "failed": ...}
+ *
+ * Failed checks are reported to standard error. The exit status is
+ * non-zero if any check failed.
+ */
+
+#include "check.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define	MAX_REPORTS	20	/* failures reported per suite */
+
+static size_t num_cases;
+static size_t num_failed;
+
+void check_report(bool ok, const char *file, int line, const char *fmt, ...)
+{
+	va_list args;
+
+	num_cases++;
+	if (ok)
+		return;
+
+	if (num_failed++ < MAX_REPORTS) {
+		fprintf(stderr, "%s:%d: ", file, line);
+		va_start(args, fmt);
+		vfprintf(stderr, fmt, args);
+		va_end(args);
+		fputc('\n', stderr);
+	}
+}
+
+unsigned long check_rand(void)
+{
+	static uint64_t state = 88172645463325252ULL;
+
+	/* xorshift64 */
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static bool run(const char *name, void (*suite)(void))
+{
+	num_cases = num_failed = 0;
+	suite();
+
+	printf("{\"check\": \"%s\", \"cases\": %zu, \"failed\": %zu}\n",
+		name, num_cases, num_failed);
+	fflush(stdout);
+	return num_failed == 0;
+}
+
+int main(void)
+{
+	bool ok = true;
+
+	ok &= run("archive", check_archive);
+	ok &= run("strbuf", check_strbuf);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,31 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Check that @cond holds. If it does not, the failure is reported along
+ * with the printf-like message.
+ */
+#define	CHECK(cond, ...) \
+	check_report((cond), __FILE__, __LINE__, __VA_ARGS__)
+
+/*
+ * Count a check and report it if it failed. Use CHECK instead.
+ */
+void check_report(bool ok, const char *file, int line, const char *fmt, ...);
+
+/*
+ * Pseudo-random number generator, seeded with a fixed seed so that
+ * failures are reproducible.
+ */
+unsigned long check_rand(void);
+
+/*
+ * Check suites.
+ */
+void check_archive(void);
+void check_strbuf(void);
+
+#endif
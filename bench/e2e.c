@@ -0,0 +1,454 @@
+/*
+ * End-to-end latency benchmark.
+ *
+ * Wind packets are injected one at a time into a synthetic HID transport
+ * (see fake_hid_push) and the time from injection is measured until the
+ * reading is:
+ *
+ *	- in the latest data of the WMR200 module ("latest"),
+ *	- logged by each of the loggers ("history", "stats", "rrd"); the RRD
+ *	  logger writes files (see fake-rrd.h) in the directory given by -D,
+ *	  or in a temporary directory on tmpfs,
+ *	- served by the TCP server to a client polling the latest data port
+ *	  ("served").
+ *
+ * Meanwhile, background load can be put on the server with -l connections
+ * issuing requests (or queries given by -q) in a closed loop.
+ *
+ * Injected readings are told apart by gust speed. The latency
+ * distribution of each stage is printed as a JSON line.
+ */
+
+#include "config.h"
+#include "fake-hid.h"
+#include "fake-rrd.h"
+#include "history.h"
+#include "rrd-logger.h"
+#include "server.h"
+#include "stats.h"
+#include "synth.h"
+#include "trace.h"
+#include "wmr200.h"
+
+#include <err.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	NS_PER_SEC		1000000000ULL
+#define	STAGE_TIMEOUT_NS	(5 * NS_PER_SEC)	/* give up a sample after this */
+#define	NUM_IDS			200			/* distinct gust speeds */
+
+enum stage
+{
+	STAGE_LATEST,
+	STAGE_HISTORY,
+	STAGE_STATS,
+	STAGE_RRD,
+	STAGE_SERVED,
+	STAGE_MAX
+};
+
+static const char *stage_names[STAGE_MAX] = {
+	[STAGE_LATEST] = "latest",
+	[STAGE_HISTORY] = "history",
+	[STAGE_STATS] = "stats",
+	[STAGE_RRD] = "rrd",
+	[STAGE_SERVED] = "served",
+};
+
+/*
+ * A logger whose calls are timed.
+ */
+struct probe
+{
+	wmr_logger_t *func;		/* the logger */
+	wmr_batch_logger_t *batch;	/* the batch logger (if @func is NULL) */
+	void *arg;			/* extra argument of the logger */
+	enum stage stage;		/* stage of the logger */
+};
+
+static struct
+{
+	unsigned samples;		/* number of packets to inject */
+	unsigned load;			/* number of background connections */
+	const char *query;		/* query of the background load */
+	char *rrd_root;			/* directory of RRD files */
+}
+opts = {
+	.samples = 1000,
+	.load = 0,
+	.query = NULL,
+	.rrd_root = NULL,
+};
+
+static atomic_int current_id = -1;		/* ID of the injected reading */
+static atomic_uint_fast64_t done[STAGE_MAX];	/* completion time of stages */
+static atomic_bool stop_load;			/* background load should stop */
+static struct addrinfo *latest_addr;		/* latest data port */
+static struct addrinfo *query_addr;		/* query port */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Gust speed of the reading with ID @id, as decoded from synth_packet.
+ */
+static float gust_of(int id)
+{
+	return id / 10.0;
+}
+
+static bool is_current(struct wmr_reading *reading)
+{
+	int id = atomic_load(&current_id);
+
+	return reading->type == WMR_WIND && id >= 0
+		&& fabsf(reading->wind.gust_speed - gust_of(id)) < 0.05;
+}
+
+static void mark_done(enum stage stage, struct wmr_reading *reading)
+{
+	if (is_current(reading))
+		atomic_store(&done[stage], now_ns());
+}
+
+static void probe_log(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct probe *probe = (struct probe *)arg;
+
+	probe->func(wmr, reading, probe->arg);
+	mark_done(probe->stage, reading);
+}
+
+static void probe_log_batch(struct wmr200 *wmr, struct wmr_reading *readings,
+	size_t count, bool flush, void *arg)
+{
+	struct probe *probe = (struct probe *)arg;
+	size_t i;
+
+	probe->batch(wmr, readings, count, flush, probe->arg);
+	for (i = 0; i < count; i++)
+		mark_done(probe->stage, &readings[i]);
+}
+
+/*
+ * Connect to @addr, send @query (if any) and read the response into @buf
+ * of @size bytes; the rest of the response is discarded.
+ *
+ * Return value:
+ *	Number of bytes stored in @buf, or -1 on failure.
+ */
+static ssize_t request(struct addrinfo *addr, const char *query, char *buf, size_t size)
+{
+	char discard[4096];
+	ssize_t ret, len = 0;
+	int fd;
+
+	if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) == -1)
+		return -1;
+
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1
+		|| (query && dprintf(fd, "%s\n", query) < 0)) {
+		(void) close(fd);
+		return -1;
+	}
+
+	while ((size_t)len < size - 1 && (ret = read(fd, buf + len, size - 1 - len)) > 0)
+		len += ret;
+	while (read(fd, discard, sizeof(discard)) > 0);
+
+	buf[len] = '\0';
+	(void) close(fd);
+	return len;
+}
+
+static void *load_pthread(void *arg)
+{
+	char buf[4096];
+
+	(void) arg;
+
+	while (!atomic_load(&stop_load))
+		(void) request(opts.query ? query_addr : latest_addr, opts.query,
+			buf, sizeof(buf));
+
+	return NULL;
+}
+
+/*
+ * Has the server served the current reading?
+ */
+static bool served(void)
+{
+	char buf[4096];
+	char *gust;
+
+	if (request(latest_addr, NULL, buf, sizeof(buf)) < 0)
+		return false;
+
+	if ((gust = strstr(buf, "gust_speed=")) == NULL)
+		return false;
+
+	return fabsf(strtof(gust + strlen("gust_speed="), NULL)
+		- gust_of(atomic_load(&current_id))) < 0.05;
+}
+
+static bool all_done(void)
+{
+	size_t i;
+
+	for (i = 0; i < STAGE_MAX; i++)
+		if (atomic_load(&done[i]) == 0)
+			return false;
+
+	return true;
+}
+
+/*
+ * Inject a wind reading and measure the latencies of all stages.
+ *
+ * Return value:
+ *	Zero on success, -1 if some stage timed out.
+ */
+static int run_sample(struct wmr200 *wmr, unsigned seq, uint64_t *lat)
+{
+	byte_t packet[SYNTH_MAX_PACKET];
+	byte_t frames[SYNTH_FRAMES_SIZE(SYNTH_MAX_PACKET)];
+	struct wmr_latest_data latest;
+	struct wmr_reading reading;
+	uint64_t start;
+	size_t len, i;
+
+	for (i = 0; i < STAGE_MAX; i++)
+		atomic_store(&done[i], 0);
+
+	/* the gust speed is derived from seq % NUM_IDS, see synth_packet */
+	len = synth_packet(packet, WMR_WIND, time(NULL), seq);
+	len = synth_frames(frames, packet, len);
+	atomic_store(&current_id, seq % NUM_IDS);
+
+	start = now_ns();
+	fake_hid_push(frames, len);
+
+	while (!all_done() && now_ns() - start < STAGE_TIMEOUT_NS) {
+		if (atomic_load(&done[STAGE_LATEST]) == 0) {
+			wmr_get_latest_data(wmr, &latest);
+			reading = latest.wind;
+			mark_done(STAGE_LATEST, &reading);
+		}
+		else if (atomic_load(&done[STAGE_SERVED]) == 0) {
+			if (served())
+				atomic_store(&done[STAGE_SERVED], now_ns());
+		}
+		else {
+			sched_yield();
+		}
+	}
+
+	atomic_store(&current_id, -1);
+	if (!all_done())
+		return -1;
+
+	for (i = 0; i < STAGE_MAX; i++)
+		lat[i] = atomic_load(&done[i]) - start;
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double quantile_us(uint64_t *lat, size_t n, double p)
+{
+	size_t i = p * n;
+
+	return n ? lat[i < n ? i : n - 1] / 1e3 : 0;
+}
+
+static void report(uint64_t *lat[STAGE_MAX], size_t n, size_t failed)
+{
+	size_t s;
+
+	for (s = 0; s < STAGE_MAX; s++) {
+		qsort(lat[s], n, sizeof(*lat[s]), cmp_u64);
+		printf("{\"stage\": \"%s\", \"load\": %u, \"query\": \"%s\", "
+			"\"samples\": %zu, \"failed\": %zu, \"p50_us\": %.1f, "
+			"\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n",
+			stage_names[s], opts.load, opts.query ? opts.query : "",
+			n, failed, quantile_us(lat[s], n, 0.5),
+			quantile_us(lat[s], n, 0.99), quantile_us(lat[s], n, 0.999),
+			n ? lat[s][n - 1] / 1e3 : 0);
+	}
+}
+
+static struct addrinfo *resolve(unsigned port)
+{
+	struct addrinfo hints, *addr;
+	char portstr[6];
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(portstr, sizeof(portstr), "%u", port);
+
+	if ((ret = getaddrinfo("localhost", portstr, &hints, &addr)) != 0)
+		errx(EXIT_FAILURE, "getaddrinfo: %s", gai_strerror(ret));
+
+	return addr;
+}
+
+static void usage(const char *prog)
+{
+	errx(EXIT_FAILURE, "Usage: %s [-n samples] [-l load_conns] [-q load_query] "
+		"[-D rrd_dir]", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct wmr200 *wmr;
+	struct wmr_server srv;
+	struct history hist;
+	struct stats stats;
+	struct rrd_logger rrd;
+	struct probe probes[] = {
+		{ history_log_reading, NULL, &hist, STAGE_HISTORY },
+		{ stats_log_reading, NULL, &stats, STAGE_STATS },
+		{ NULL, rrd_log_batch, &rrd, STAGE_RRD },
+	};
+	char tmp_root[] = "/dev/shm/meteod-e2e.XXXXXX";
+	char path[PATH_MAX];
+	uint64_t *lat[STAGE_MAX];
+	uint64_t sample[STAGE_MAX];
+	pthread_t *load;
+	size_t i, s, n = 0, failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:l:q:D:")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.samples = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			opts.load = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			opts.query = optarg;
+			break;
+		case 'D':
+			opts.rrd_root = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (opts.rrd_root == NULL && (opts.rrd_root = mkdtemp(tmp_root)) == NULL)
+		err(EXIT_FAILURE, "mkdtemp");
+
+	latest_addr = resolve(cfg.srv.port);
+	query_addr = resolve(cfg.srv.query_port);
+
+	for (s = 0; s < STAGE_MAX; s++)
+		if ((lat[s] = calloc(opts.samples + 1, sizeof(*lat[s]))) == NULL)
+			err(EXIT_FAILURE, "calloc");
+
+	/* queue mode, the reader waits for injected frames */
+	fake_hid_push(NULL, 0);
+	fake_rrd_set_files(true);
+
+	wmr_init();
+	trace_set_dump_path(BENCH_TRACE_PATH);
+	history_init(&hist, &cfg.history);
+	stats_init(&stats, &cfg.stats);
+	rrd_logger_init(&rrd);
+	rrd.cfg = cfg.rrd;
+	rrd.cfg.rrd_root = opts.rrd_root;
+	if (rrd_logger_start(&rrd) != 0)
+		errx(EXIT_FAILURE, "Cannot start RRD writer threads");
+
+	if ((wmr = wmr_open()) == NULL)
+		errx(EXIT_FAILURE, "Cannot open the synthetic station");
+
+	for (i = 0; i < ARRAY_SIZE(probes); i++) {
+		if (probes[i].func)
+			wmr_register_logger(wmr, probe_log, &probes[i]);
+		else
+			wmr_register_batch_logger(wmr, probe_log_batch, &probes[i]);
+	}
+
+	server_init(&srv);
+	server_set_device(&srv, wmr);
+	server_set_stats(&srv, &stats);
+	history_serve(&hist, &srv);
+
+	if (server_start(&srv) != 0)
+		errx(EXIT_FAILURE, "Cannot start the TCP/IP server, see the logs.");
+
+	if (wmr_start(wmr) != 0)
+		errx(EXIT_FAILURE, "Cannot start communication with the station");
+
+	if ((load = calloc(opts.load + 1, sizeof(*load))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	for (i = 0; i < opts.load; i++)
+		if (pthread_create(&load[i], NULL, load_pthread, NULL) != 0)
+			errx(EXIT_FAILURE, "Cannot start load thread");
+
+	for (i = 0; i < opts.samples; i++) {
+		if (run_sample(wmr, i, sample) != 0) {
+			failed++;
+			continue;
+		}
+
+		for (s = 0; s < STAGE_MAX; s++)
+			lat[s][n] = sample[s];
+		n++;
+	}
+
+	atomic_store(&stop_load, true);
+	for (i = 0; i < opts.load; i++)
+		pthread_join(load[i], NULL);
+
+	report(lat, n, failed);
+
+	server_stop(&srv);
+	wmr_stop(wmr);
+	wmr_close(wmr);
+	rrd_logger_free(&rrd);
+	history_free(&hist);
+	stats_free(&stats);
+	wmr_end();
+
+	snprintf(path, sizeof(path), "%s/%s", opts.rrd_root, cfg.rrd.wind_rrd);
+	(void) unlink(path);
+	if (opts.rrd_root == tmp_root)
+		(void) rmdir(tmp_root);
+
+	for (s = 0; s < STAGE_MAX; s++)
+		free(lat[s]);
+	free(load);
+	freeaddrinfo(latest_addr);
+	freeaddrinfo(query_addr);
+
+	return EXIT_SUCCESS;
+}
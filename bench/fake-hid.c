@@ -0,0 +1,210 @@
+/*
+ * Synthetic HID device, see fake-hid.h.
+ */
+
+#include "fake-hid.h"
+#include "synth.h"
+
+#include <errno.h>
+#include <hidapi.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define	QUEUE_FRAMES	1024	/* capacity of the queue in frames */
+
+struct hid_device_
+{
+	const byte_t *frames;		/* frames to play back */
+	size_t len;			/* length of @frames */
+	size_t pos;			/* position of the next frame */
+	unsigned interval;		/* minimum time between frames (us) */
+	void (*refill)(void);		/* called when playback starts over */
+	atomic_bool unplugged;		/* device is unplugged */
+
+	bool queued;			/* queue mode */
+	byte_t queue[QUEUE_FRAMES][SYNTH_FRAME_SIZE];
+	size_t head;			/* number of frames ever pushed */
+	size_t tail;			/* number of frames ever read */
+	pthread_mutex_t lock;		/* protects the queue */
+	pthread_cond_t cond;		/* queue state changed */
+};
+
+static struct hid_device_ device = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+void fake_hid_set_frames(const byte_t *frames, size_t len)
+{
+	device.frames = frames;
+	device.len = len;
+	device.pos = 0;
+}
+
+void fake_hid_push(const byte_t *frames, size_t len)
+{
+	size_t pos;
+
+	pthread_mutex_lock(&device.lock);
+	device.queued = true;
+	for (pos = 0; pos + SYNTH_FRAME_SIZE <= len; pos += SYNTH_FRAME_SIZE) {
+		while (device.head - device.tail == QUEUE_FRAMES)
+			pthread_cond_wait(&device.cond, &device.lock);
+		memcpy(device.queue[device.head++ % QUEUE_FRAMES], frames + pos,
+			SYNTH_FRAME_SIZE);
+	}
+	pthread_cond_broadcast(&device.cond);
+	pthread_mutex_unlock(&device.lock);
+}
+
+static void unlock(void *arg)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+/*
+ * Wait with @dev->lock held until there's a frame in the queue, at most
+ * until @deadline, or indefinitely if @timeout is negative. The reader may
+ * be cancelled while waiting, in which case the lock is released.
+ */
+static void wait_frame(hid_device *dev, int timeout, struct timespec *deadline)
+{
+	pthread_cleanup_push(unlock, &dev->lock);
+	while (dev->head == dev->tail && timeout != 0) {
+		if (timeout < 0)
+			pthread_cond_wait(&dev->cond, &dev->lock);
+		else if (pthread_cond_timedwait(&dev->cond, &dev->lock, deadline) == ETIMEDOUT)
+			break;
+	}
+	pthread_cleanup_pop(0);
+}
+
+/*
+ * Read a frame in queue mode, waiting at most @timeout ms for it, or
+ * indefinitely if @timeout is negative.
+ */
+static int read_queued(hid_device *dev, unsigned char *data, size_t length,
+	int timeout)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	wait_frame(dev, timeout, &deadline);
+
+	if (dev->head != dev->tail) {
+		length = MIN(length, (size_t)SYNTH_FRAME_SIZE);
+		memcpy(data, dev->queue[dev->tail++ % QUEUE_FRAMES], length);
+		pthread_cond_broadcast(&dev->cond);
+	}
+	else {
+		length = 0;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return length;
+}
+
+void fake_hid_set_interval(unsigned usec)
+{
+	device.interval = usec;
+}
+
+void fake_hid_set_refill(void (*refill)(void))
+{
+	device.refill = refill;
+}
+
+void fake_hid_set_present(bool present)
+{
+	if (present)
+		device.pos = 0;
+	atomic_store(&device.unplugged, !present);
+}
+
+int hid_init(void)
+{
+	return 0;
+}
+
+int hid_exit(void)
+{
+	return 0;
+}
+
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id,
+	const wchar_t *serial_number)
+{
+	(void) vendor_id;
+	(void) product_id;
+	(void) serial_number;
+
+	if (atomic_load(&device.unplugged))
+		return NULL;
+	return &device;
+}
+
+void hid_close(hid_device *dev)
+{
+	(void) dev;
+}
+
+int hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	(void) data;
+
+	if (atomic_load(&dev->unplugged))
+		return -1;
+	return length;
+}
+
+int hid_read_timeout(hid_device *dev, unsigned char *data, size_t length,
+	int milliseconds)
+{
+	struct timespec delay = {
+		.tv_sec = dev->interval / 1000000,
+		.tv_nsec = (dev->interval % 1000000) * 1000,
+	};
+	struct timespec failure_delay = { .tv_nsec = 1000000 };
+
+	if (atomic_load(&dev->unplugged)) {
+		/* like a failing device, but don't spin */
+		(void) nanosleep(&failure_delay, NULL);
+		return -1;
+	}
+
+	if (dev->queued)
+		return read_queued(dev, data, length, milliseconds);
+
+	if (dev->interval > 0)
+		(void) nanosleep(&delay, NULL);
+
+	if (dev->pos == dev->len) {
+		dev->pos = 0;
+		if (dev->refill)
+			dev->refill();
+	}
+
+	if (dev->len == 0)
+		return 0;
+
+	length = MIN(length, (size_t)SYNTH_FRAME_SIZE);
+	memcpy(data, dev->frames + dev->pos, length);
+	dev->pos += SYNTH_FRAME_SIZE;
+	return length;
+}
+
+int hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, -1);
+}
@@ -0,0 +1,40 @@
+#ifndef FAKE_HID_H
+#define FAKE_HID_H
+
+#include "common.h"
+
+#include <stdbool.h>
+
+/*
+ * Synthetic HID device. The device plays back @len bytes of HID @frames
+ * (see synth_frames) in a loop.
+ */
+void fake_hid_set_frames(const byte_t *frames, size_t len);
+
+/*
+ * Switch the device to queue mode and append @len bytes of @frames to the
+ * queue. In queue mode, reads wait for frames to be pushed (honoring the
+ * read timeout) instead of playing back a loop. Blocks while the queue is
+ * full. Pushing no frames just switches the mode.
+ */
+void fake_hid_push(const byte_t *frames, size_t len);
+
+/*
+ * Deliver a frame every @usec microseconds at most. By default, frames are
+ * delivered as fast as they are read.
+ */
+void fake_hid_set_interval(unsigned usec);
+
+/*
+ * Call @refill each time the playback is about to start over. The function
+ * may replace the frames with fake_hid_set_frames.
+ */
+void fake_hid_set_refill(void (*refill)(void));
+
+/*
+ * Plug the device in or out. While unplugged, the device cannot be opened
+ * and reads and writes fail. When plugged in, playback starts over.
+ */
+void fake_hid_set_present(bool present);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Stub librrd, see fake-rrd.h.
+ */
+
+#include "fake-rrd.h"
+
+#include <fcntl.h>
+#include <rrd.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	HEADER_SIZE	512		/* size of the "header" read by an update */
+
+static bool files;
+static unsigned latency;
+
+void fake_rrd_set_files(bool new_files)
+{
+	files = new_files;
+}
+
+void fake_rrd_set_latency(unsigned latency_us)
+{
+	latency = latency_us;
+}
+
+static int update(const char *filename, const char *data)
+{
+	char header[HEADER_SIZE];
+	int fd;
+
+	if (latency > 0)
+		(void) usleep(latency);
+
+	if (!files)
+		return 0;
+
+	if ((fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+
+	(void) pread(fd, header, sizeof(header), 0);
+	if (pwrite(fd, data, strlen(data), HEADER_SIZE) < 0) {
+		(void) close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+int rrd_update(int argc, char **argv)
+{
+	return argc < 3 ? -1 : update(argv[1], argv[2]);
+}
+
+int rrd_update_r(const char *filename, const char *tmplt, int argc,
+	const char **argv)
+{
+	(void) tmplt;
+
+	return argc < 1 ? -1 : update(filename, argv[0]);
+}
+
+char *rrd_get_error(void)
+{
+	return "stub error";
+}
+
+void rrd_clear_error(void)
+{
+}
@@ -0,0 +1,20 @@
+#ifndef FAKE_RRD_H
+#define FAKE_RRD_H
+
+#include <stdbool.h>
+
+/*
+ * Stub librrd. By default, updates do nothing. With @files set, every
+ * update opens the database file, reads its header, writes the update
+ * and closes it again, which is the I/O pattern of rrd_update, so that
+ * updates can be measured against a file system such as tmpfs.
+ */
+void fake_rrd_set_files(bool files);
+
+/*
+ * Make every update take at least @latency_us microseconds, to simulate
+ * the latency of a disk.
+ */
+void fake_rrd_set_latency(unsigned latency_us);
+
+#endif
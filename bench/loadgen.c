@@ -0,0 +1,337 @@
+/*
+ * Load generator for the meteod TCP server.
+ *
+ * Each request is a new connection: the generator connects, sends the query
+ * line (if any) and reads the response until the server closes the
+ * connection. Latency is measured from connect to the last byte.
+ *
+ * In closed-loop mode (the default), each of the connections issues
+ * a request as soon as its previous request has completed, which measures
+ * the maximum throughput. In open-loop mode (-r), requests are issued at
+ * a given rate, optionally in bursts (-b), regardless of how fast the
+ * server responds. Open-loop latency is measured from the time at which
+ * the request was due, so that a stalled server is not hidden by the
+ * generator slowing down with it.
+ *
+ * Results are printed as a JSON line.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	RECV_TIMEOUT_SEC	5	/* give up a request after this long */
+#define	NS_PER_SEC		1000000000ULL
+
+/*
+ * Load generator parameters.
+ */
+static struct
+{
+	const char *host;		/* server host */
+	const char *port;		/* server port */
+	const char *query;		/* query line, NULL for none */
+	unsigned conns;			/* number of concurrent connections */
+	unsigned duration;		/* test duration in seconds */
+	double rate;			/* open loop: requests per second */
+	unsigned burst;			/* open loop: requests per burst */
+}
+opts = {
+	.host = "localhost",
+	.port = "20892",
+	.query = NULL,
+	.conns = 16,
+	.duration = 10,
+	.rate = 0,
+	.burst = 1,
+};
+
+static struct addrinfo *addr;		/* server address */
+static char *request;			/* query line with newline */
+static size_t request_len;		/* length of @request */
+static uint64_t start_ns;		/* start of the test */
+static uint64_t end_ns;			/* end of the test */
+
+/*
+ * A connection. Each connection is a thread issuing requests one after
+ * another and collecting their latencies.
+ */
+struct worker
+{
+	pthread_t thread;		/* worker thread */
+	unsigned id;			/* index of the worker */
+	uint64_t *lat;			/* latencies of completed requests (ns) */
+	size_t count;			/* number of items in @lat */
+	size_t size;			/* capacity of @lat */
+	size_t errors;			/* number of failed requests */
+	uint64_t bytes;			/* number of bytes received */
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / NS_PER_SEC,
+		.tv_nsec = ns % NS_PER_SEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void record(struct worker *w, uint64_t lat)
+{
+	if (w->count == w->size) {
+		w->size = w->size ? 2 * w->size : 4096;
+		if ((w->lat = realloc(w->lat, w->size * sizeof(*w->lat))) == NULL)
+			err(EXIT_FAILURE, "realloc");
+	}
+
+	w->lat[w->count++] = lat;
+}
+
+/*
+ * Issue a single request and read the response.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+static int issue_request(struct worker *w)
+{
+	struct timeval timeout = { .tv_sec = RECV_TIMEOUT_SEC };
+	char buf[16384];
+	ssize_t ret;
+	size_t done;
+	int fd;
+
+	if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) == -1)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1)
+		goto fail;
+
+	for (done = 0; done < request_len; done += ret)
+		if ((ret = write(fd, request + done, request_len - done)) <= 0)
+			goto fail;
+
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		w->bytes += ret;
+
+	if (ret < 0)
+		goto fail;
+
+	(void) close(fd);
+	return 0;
+
+fail:
+	(void) close(fd);
+	return -1;
+}
+
+static void closed_loop(struct worker *w)
+{
+	uint64_t start;
+
+	while ((start = now_ns()) < end_ns) {
+		if (issue_request(w) == 0)
+			record(w, now_ns() - start);
+		else
+			w->errors++;
+	}
+}
+
+/*
+ * Requests are numbered in the order they are due and handed out to
+ * workers round-robin. Request i is due at the start of burst i / burst.
+ */
+static void open_loop(struct worker *w)
+{
+	uint64_t burst_ns = opts.burst * NS_PER_SEC / opts.rate;
+	uint64_t due;
+	size_t i;
+
+	for (i = w->id; ; i += opts.conns) {
+		due = start_ns + (i / opts.burst) * burst_ns;
+		if (due >= end_ns)
+			break;
+
+		sleep_until(due);
+		if (issue_request(w) == 0)
+			record(w, now_ns() - due);
+		else
+			w->errors++;
+	}
+}
+
+static void *worker_pthread(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+
+	if (opts.rate > 0)
+		open_loop(w);
+	else
+		closed_loop(w);
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * The @p-quantile of @n sorted values in @lat, in microseconds.
+ */
+static double quantile_us(uint64_t *lat, size_t n, double p)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0;
+
+	i = p * n;
+	return lat[i < n ? i : n - 1] / 1e3;
+}
+
+static void report(struct worker *workers, uint64_t elapsed_ns)
+{
+	uint64_t *lat, bytes = 0;
+	size_t i, n = 0, errors = 0;
+
+	for (i = 0; i < opts.conns; i++)
+		n += workers[i].count;
+
+	if ((lat = malloc((n + 1) * sizeof(*lat))) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	for (i = 0, n = 0; i < opts.conns; i++) {
+		memcpy(lat + n, workers[i].lat, workers[i].count * sizeof(*lat));
+		n += workers[i].count;
+		errors += workers[i].errors;
+		bytes += workers[i].bytes;
+	}
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+
+	printf("{\"mode\": \"%s\", \"port\": \"%s\", \"query\": \"%s\", "
+		"\"conns\": %u, \"rate\": %.0f, \"burst\": %u, "
+		"\"requests\": %zu, \"errors\": %zu, \"bytes_per_req\": %.0f, "
+		"\"req_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+		"\"p999_us\": %.1f, \"max_us\": %.1f}\n",
+		opts.rate > 0 ? "open" : "closed", opts.port,
+		opts.query ? opts.query : "", opts.conns, opts.rate, opts.burst,
+		n, errors, n ? (double)bytes / n : 0,
+		n * (double)NS_PER_SEC / elapsed_ns,
+		quantile_us(lat, n, 0.5), quantile_us(lat, n, 0.99),
+		quantile_us(lat, n, 0.999), n ? lat[n - 1] / 1e3 : 0);
+
+	free(lat);
+}
+
+static void usage(const char *prog)
+{
+	errx(EXIT_FAILURE, "Usage: %s [-h host] [-p port] [-q query] "
+		"[-c conns] [-d seconds] [-r rate [-b burst]]", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	struct worker *workers;
+	uint64_t elapsed;
+	unsigned i;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:p:q:c:d:r:b:")) != -1) {
+		switch (opt) {
+		case 'h':
+			opts.host = optarg;
+			break;
+		case 'p':
+			opts.port = optarg;
+			break;
+		case 'q':
+			opts.query = optarg;
+			break;
+		case 'c':
+			opts.conns = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			opts.duration = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			opts.rate = strtod(optarg, NULL);
+			break;
+		case 'b':
+			opts.burst = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (opts.conns == 0 || opts.burst == 0 || opts.rate < 0)
+		usage(argv[0]);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(opts.host, opts.port, &hints, &addr)) != 0)
+		errx(EXIT_FAILURE, "getaddrinfo: %s", gai_strerror(ret));
+
+	if (opts.query) {
+		request_len = strlen(opts.query) + 1;
+		if ((request = malloc(request_len + 1)) == NULL)
+			err(EXIT_FAILURE, "malloc");
+		snprintf(request, request_len + 1, "%s\n", opts.query);
+	}
+
+	if ((workers = calloc(opts.conns, sizeof(*workers))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	start_ns = now_ns();
+	end_ns = start_ns + opts.duration * NS_PER_SEC;
+
+	for (i = 0; i < opts.conns; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_pthread, &workers[i]) != 0)
+			errx(EXIT_FAILURE, "Cannot start worker thread");
+	}
+
+	for (i = 0; i < opts.conns; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	elapsed = now_ns() - start_ns;
+	report(workers, elapsed);
+
+	for (i = 0; i < opts.conns; i++)
+		free(workers[i].lat);
+	free(workers);
+	free(request);
+	freeaddrinfo(addr);
+
+	return EXIT_SUCCESS;
+}
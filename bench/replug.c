@@ -0,0 +1,268 @@
+/*
+ * Hotplug recovery benchmark.
+ *
+ * The synthetic station (see fake-hid.h) is unplugged, which makes the
+ * WMR200 module fail, and plugged in again. Hotplug uevents are faked
+ * by writing them into a socket the hotplug listener reads (see
+ * hotplug_open_fd), just like the kernel would. On the add event, the
+ * station is reconnected the way meteod does it.
+ *
+ * The recovery time is measured from plugging the station in until the
+ * first reading is logged after the reconnection. Its distribution is
+ * printed as a JSON line. Before that, uevents of other devices and
+ * other uevents of the station are checked to be ignored.
+ */
+
+#include "fake-hid.h"
+#include "hotplug.h"
+#include "synth.h"
+#include "trace.h"
+#include "wmr200.h"
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	NS_PER_SEC		1000000000ULL
+#define	TIMEOUT_SEC		5		/* give up waiting for an event */
+#define	STREAM_SIZE		4096
+
+#define	DEVPATH		"/devices/pci0000:00/0000:00:14.0/usb1/1-2"
+
+static byte_t stream[STREAM_SIZE];
+static byte_t frames[SYNTH_FRAMES_SIZE(STREAM_SIZE)];
+
+static sem_t added;			/* add event received */
+static sem_t removed;			/* remove event received */
+static sem_t failed;			/* the station failed */
+static sem_t logged;			/* first reading logged */
+static atomic_bool has_failed;
+static atomic_bool has_logged;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Wait for @sem at most TIMEOUT_SEC seconds, or @ms milliseconds if @ms
+ * is not zero.
+ *
+ * Return value:
+ *	true if @sem was posted.
+ */
+static bool wait_for(sem_t *sem, unsigned ms)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (ms == 0) {
+		deadline.tv_sec += TIMEOUT_SEC;
+	}
+	else {
+		deadline.tv_nsec += ms * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / NS_PER_SEC;
+		deadline.tv_nsec %= NS_PER_SEC;
+	}
+
+	while (sem_timedwait(sem, &deadline) != 0)
+		if (errno != EINTR)
+			return false;
+
+	return true;
+}
+
+/*
+ * Send a uevent the way the kernel formats it.
+ */
+static void send_uevent(int fd, const char *action, const char *devpath,
+	const char *devtype, const char *product)
+{
+	char msg[512];
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "%s@%s%c"
+		"ACTION=%s%cDEVPATH=%s%cSUBSYSTEM=usb%cDEVTYPE=%s%cPRODUCT=%s%cSEQNUM=1",
+		action, devpath, 0, action, 0, devpath, 0, 0, devtype, 0, product, 0);
+
+	if (send(fd, msg, len + 1, 0) != len + 1)
+		err(EXIT_FAILURE, "send");
+}
+
+static void handle_hotplug(enum hotplug_event event, void *arg)
+{
+	(void) arg;
+	sem_post(event == HOTPLUG_ADD ? &added : &removed);
+}
+
+static void handle_error(struct wmr200 *wmr, void *arg)
+{
+	(void) wmr;
+	(void) arg;
+
+	if (!atomic_exchange(&has_failed, true))
+		sem_post(&failed);
+}
+
+static void log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	(void) reading;
+	(void) arg;
+
+	if (!atomic_exchange(&has_logged, true))
+		sem_post(&logged);
+}
+
+static struct wmr200 *open_station(void)
+{
+	struct wmr200 *wmr;
+
+	atomic_store(&has_failed, false);
+	atomic_store(&has_logged, false);
+
+	if ((wmr = wmr_open()) == NULL)
+		errx(EXIT_FAILURE, "Cannot open the synthetic station");
+
+	wmr_set_error_handler(wmr, handle_error, NULL);
+	wmr_register_logger(wmr, log_reading, NULL);
+	if (wmr_start(wmr) != 0)
+		errx(EXIT_FAILURE, "Cannot start communication with the station");
+
+	return wmr;
+}
+
+static void close_station(struct wmr200 *wmr)
+{
+	wmr_stop(wmr);
+	wmr_close(wmr);
+}
+
+/*
+ * Check that uevents other than the ones which announce the station
+ * being ready or gone are ignored.
+ */
+static void check_ignored(int fd)
+{
+	send_uevent(fd, "bind", DEVPATH "/1-2:1.0", "usb_interface", "46d/c52b/1201");
+	send_uevent(fd, "add", DEVPATH, "usb_device", "fde/ca01/302");
+	send_uevent(fd, "remove", DEVPATH "/1-2:1.0", "usb_interface", "fde/ca01/302");
+	send_uevent(fd, "remove", DEVPATH, "usb_device", "fde/ca02/302");
+
+	if (wait_for(&added, 100) || wait_for(&removed, 1))
+		errx(EXIT_FAILURE, "Unexpected hotplug event");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double quantile_us(uint64_t *lat, size_t n, double p)
+{
+	size_t i = p * n;
+
+	return n ? lat[i < n ? i : n - 1] / 1e3 : 0;
+}
+
+static void usage(const char *prog)
+{
+	errx(EXIT_FAILURE, "Usage: %s [-n samples]", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hotplug hp;
+	struct wmr200 *wmr;
+	uint64_t *lat, start;
+	size_t i, samples = 100;
+	int fds[2];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			samples = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if ((lat = calloc(samples + 1, sizeof(*lat))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	sem_init(&added, 0, 0);
+	sem_init(&removed, 0, 0);
+	sem_init(&failed, 0, 0);
+	sem_init(&logged, 0, 0);
+
+	fake_hid_set_frames(frames, synth_frames(frames, stream,
+		synth_stream(stream, sizeof(stream), time(NULL), 0)));
+	fake_hid_set_interval(100);
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) != 0)
+		err(EXIT_FAILURE, "socketpair");
+	if (hotplug_open_fd(&hp, fds[0], WMR200_VENDOR_ID, WMR200_PRODUCT_ID,
+		handle_hotplug, NULL) != 0)
+		errx(EXIT_FAILURE, "Cannot listen for hotplug events");
+
+	check_ignored(fds[1]);
+
+	wmr_init();
+	trace_set_dump_path(BENCH_TRACE_PATH);
+	wmr = open_station();
+
+	for (i = 0; i < samples; i++) {
+		if (!wait_for(&logged, 0))
+			errx(EXIT_FAILURE, "No reading logged after reconnection");
+
+		/* USB glitch */
+		fake_hid_set_present(false);
+		send_uevent(fds[1], "remove", DEVPATH, "usb_device", "fde/ca01/302");
+		if (!wait_for(&failed, 0) || !wait_for(&removed, 0))
+			errx(EXIT_FAILURE, "Unplugging not noticed");
+		close_station(wmr);
+
+		start = now_ns();
+		fake_hid_set_present(true);
+		send_uevent(fds[1], "add", DEVPATH, "usb_device", "fde/ca01/302");
+		send_uevent(fds[1], "bind", DEVPATH "/1-2:1.0", "usb_interface", "fde/ca01/302");
+		if (!wait_for(&added, 0))
+			errx(EXIT_FAILURE, "Plugging in not noticed");
+
+		wmr = open_station();
+		if (!wait_for(&logged, 0))
+			errx(EXIT_FAILURE, "No reading logged after reconnection");
+		lat[i] = now_ns() - start;
+		sem_post(&logged);	/* for the next iteration */
+	}
+
+	close_station(wmr);
+	hotplug_close(&hp);
+	(void) close(fds[1]);
+	wmr_end();
+
+	qsort(lat, samples, sizeof(*lat), cmp_u64);
+	printf("{\"name\": \"hotplug_recovery\", \"samples\": %zu, \"p50_us\": %.1f, "
+		"\"p99_us\": %.1f, \"max_us\": %.1f}\n", samples,
+		quantile_us(lat, samples, 0.5), quantile_us(lat, samples, 0.99),
+		samples ? lat[samples - 1] / 1e3 : 0);
+
+	free(lat);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+/*
+ * The subset of HIDAPI used by meteod, for builds against the synthetic
+ * device in bench/fake-hid.c.
+ */
+
+#ifndef HIDAPI_H
+#define HIDAPI_H
+
+#include <stddef.h>
+#include <wchar.h>
+
+typedef struct hid_device_ hid_device;
+
+int hid_init(void);
+int hid_exit(void);
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id,
+	const wchar_t *serial_number);
+void hid_close(hid_device *device);
+int hid_write(hid_device *device, const unsigned char *data, size_t length);
+int hid_read(hid_device *device, unsigned char *data, size_t length);
+int hid_read_timeout(hid_device *device, unsigned char *data, size_t length,
+	int milliseconds);
+
+#endif
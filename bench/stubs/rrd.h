@@ -0,0 +1,15 @@
+/*
+ * The subset of librrd used by meteod, for builds against the stub
+ * in bench/fake-rrd.c.
+ */
+
+#ifndef RRD_H
+#define RRD_H
+
+int rrd_update(int argc, char **argv);
+int rrd_update_r(const char *filename, const char *tmplt, int argc,
+	const char **argv);
+char *rrd_get_error(void);
+void rrd_clear_error(void);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Synthetic WMR200 data for benchmarks and load tests.
+ */
+
+#include "synth.h"
+#include "wmr200.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define	HIST_SENSORS_OFFSET	33
+#define	HIST_SENSOR_LEN		7
+#define	HIST_NUM_EXT		2	/* external sensors in HISTORIC_DATA */
+
+/*
+ * Reading types in the order synth_stream writes them.
+ */
+static const byte_t stream_types[] = {
+	WMR_WIND, WMR_TEMP, WMR_RAIN, WMR_WIND, WMR_TEMP, WMR_BARO,
+	WMR_WIND, WMR_TEMP, WMR_UVI, WMR_STATUS, HISTORIC_DATA,
+};
+
+static size_t packet_len(byte_t type)
+{
+	switch (type) {
+	case HISTORIC_DATA:
+		return HIST_SENSORS_OFFSET + (1 + HIST_NUM_EXT) * HIST_SENSOR_LEN + 2;
+	case WMR_WIND:
+		return 16;
+	case WMR_RAIN:
+		return 22;
+	case WMR_UVI:
+		return 10;
+	case WMR_BARO:
+		return 13;
+	case WMR_TEMP:
+		return 16;
+	case WMR_STATUS:
+		return 8;
+	}
+
+	assert(0);
+	return 0;
+}
+
+/*
+ * Fill in a temperature record at @data (in the layout of WMR_TEMP).
+ */
+static void temp_record(byte_t *data, uint_t sensor_id, unsigned seq)
+{
+	uint_t temp = 150 + seq % 100;		/* 15.0 - 24.9 deg C */
+
+	data[7] = sensor_id;
+	data[8] = temp & 0xFF;
+	data[9] = (temp >> 8) & 0x0F;
+	data[10] = 40 + seq % 50;
+	data[11] = 80;
+	data[12] = 0;
+	data[13] = 0;
+}
+
+size_t synth_packet(byte_t *buf, byte_t type, time_t time, unsigned seq)
+{
+	size_t len = packet_len(type);
+	struct tm tm;
+	uint_t sum;
+	size_t i;
+
+	memset(buf, 0, len);
+	localtime_r(&time, &tm);
+
+	buf[0] = type;
+	buf[1] = len;
+	if (type != WMR_STATUS) {
+		buf[2] = tm.tm_min;
+		buf[3] = tm.tm_hour;
+		buf[4] = tm.tm_mday;
+		buf[5] = tm.tm_mon + 1;
+		buf[6] = tm.tm_year - 100;
+	}
+
+	switch (type) {
+	case HISTORIC_DATA:
+		buf[HIST_SENSORS_OFFSET - 1] = HIST_NUM_EXT;
+		for (i = 0; i < HIST_NUM_EXT; i++)
+			temp_record(buf + HIST_SENSORS_OFFSET + i * HIST_SENSOR_LEN, i + 1, seq);
+		break;
+	case WMR_WIND:
+		buf[7] = seq % 16;
+		buf[9] = seq % 200;
+		buf[10] = 0x20;
+		buf[11] = 0x01;
+		break;
+	case WMR_RAIN:
+		buf[7] = seq % 4;
+		buf[13] = seq & 0xFF;
+		buf[14] = (seq >> 8) & 0xFF;
+		break;
+	case WMR_UVI:
+		buf[7] = seq % 12;
+		break;
+	case WMR_BARO:
+		buf[7] = 0xF5;
+		buf[8] = 0x33;
+		buf[9] = 0xF9;
+		buf[10] = 0x03;
+		break;
+	case WMR_TEMP:
+		temp_record(buf, seq % 3, seq);
+		break;
+	case WMR_STATUS:
+		break;
+	}
+
+	for (i = 0, sum = 0; i < len - 2; i++)
+		sum += buf[i];
+	buf[len - 2] = sum & 0xFF;
+	buf[len - 1] = sum >> 8;
+
+	return len;
+}
+
+size_t synth_stream(byte_t *buf, size_t size, time_t time, unsigned seq)
+{
+	size_t len = 0;
+	byte_t type;
+
+	while (1) {
+		type = stream_types[seq % ARRAY_SIZE(stream_types)];
+		if (len + packet_len(type) > size)
+			break;
+		len += synth_packet(buf + len, type, time, seq++);
+	}
+
+	return len;
+}
+
+size_t synth_frames(byte_t *frames, const byte_t *data, size_t len)
+{
+	size_t pos, n, out = 0;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = MIN(len - pos, (size_t)SYNTH_FRAME_DATA);
+		memset(frames + out, 0, SYNTH_FRAME_SIZE);
+		frames[out] = n;
+		memcpy(frames + out + 1, data + pos, n);
+		out += SYNTH_FRAME_SIZE;
+	}
+
+	return out;
+}
@@ -0,0 +1,49 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "common.h"
+
+#include <time.h>
+
+/*
+ * Synthetic WMR200 data for benchmarks and load tests.
+ */
+
+#define	SYNTH_FRAME_SIZE	8	/* size of a HID frame */
+#define	SYNTH_FRAME_DATA	7	/* maximum payload of a HID frame */
+#define	SYNTH_MAX_PACKET	112	/* maximum length of a packet */
+
+/*
+ * Maximum number of bytes of frames carrying @len bytes of data.
+ */
+#define	SYNTH_FRAMES_SIZE(len) \
+	((((len) + SYNTH_FRAME_DATA - 1) / SYNTH_FRAME_DATA) * SYNTH_FRAME_SIZE)
+
+/*
+ * Write a valid packet of (reading) type @type into @buf. The reading
+ * will be timestamped with @time and values will be derived from @seq.
+ *
+ * Return value:
+ *	Length of the packet.
+ */
+size_t synth_packet(byte_t *buf, byte_t type, time_t time, unsigned seq);
+
+/*
+ * Write packets of all reading types in turn into @buf of @size bytes,
+ * starting with @seq and for as long as there's room in @buf.
+ *
+ * Return value:
+ *	Number of bytes written.
+ */
+size_t synth_stream(byte_t *buf, size_t size, time_t time, unsigned seq);
+
+/*
+ * Split @len bytes of @data into HID frames as the station sends them.
+ * @frames must have room for SYNTH_FRAMES_SIZE(@len) bytes.
+ *
+ * Return value:
+ *	Number of bytes of frames written.
+ */
+size_t synth_frames(byte_t *frames, const byte_t *data, size_t len);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Synthetic meteod: the TCP server with the history, statistics and metrics
+ * query commands, fed by the WMR200 module reading a synthetic station
+ * (see fake-hid.h). Used as the target of the load generator.
+ */
+
+#include "config.h"
+#include "fake-hid.h"
+#include "history.h"
+#include "log.h"
+#include "metrics.h"
+#include "server.h"
+#include "stats.h"
+#include "synth.h"
+#include "trace.h"
+#include "wmr200.h"
+
+#include <err.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	STREAM_SIZE	4096
+
+static byte_t stream[STREAM_SIZE];
+static byte_t frames[SYNTH_FRAMES_SIZE(STREAM_SIZE)];
+static unsigned seq;
+
+/*
+ * Generate next part of the stream, timestamped with current time.
+ */
+static void refill(void)
+{
+	size_t len;
+
+	len = synth_stream(stream, sizeof(stream), time(NULL), seq);
+	seq += 64;
+	fake_hid_set_frames(frames, synth_frames(frames, stream, len));
+}
+
+static void usage(const char *prog)
+{
+	errx(EXIT_FAILURE, "Usage: %s [-i frame_interval_us]", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct wmr200 *wmr;
+	struct wmr_server srv;
+	struct history hist;
+	struct stats stats;
+	unsigned interval = 1000;
+	sigset_t set;
+	int sig;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* signals are waited for below, threads must not handle them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	refill();
+	fake_hid_set_interval(interval);
+	fake_hid_set_refill(refill);
+
+	wmr_init();
+	trace_set_dump_path(BENCH_TRACE_PATH);
+	history_init(&hist, &cfg.history);
+	stats_init(&stats, &cfg.stats);
+
+	if ((wmr = wmr_open()) == NULL)
+		errx(EXIT_FAILURE, "Cannot open the synthetic station");
+
+	wmr_register_logger(wmr, history_log_reading, &hist);
+	wmr_register_logger(wmr, stats_log_reading, &stats);
+
+	server_init(&srv);
+	server_set_device(&srv, wmr);
+	server_set_stats(&srv, &stats);
+	history_serve(&hist, &srv);
+	metrics_serve(&srv);
+
+	if (server_start(&srv) != 0)
+		errx(EXIT_FAILURE, "Cannot start the TCP/IP server, see the logs.");
+
+	if (wmr_start(wmr) != 0)
+		errx(EXIT_FAILURE, "Cannot start communication with the station");
+
+	fprintf(stderr, "Serving synthetic data on ports %u and %u\n",
+		cfg.srv.port, cfg.srv.query_port);
+
+	while (sigwait(&set, &sig) != 0);
+
+	server_stop(&srv);
+	wmr_stop(wmr);
+	wmr_close(wmr);
+	history_free(&hist);
+	stats_free(&stats);
+	wmr_end();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,472 @@
+/*
+ * Virtual WMR200 station.
+ *
+ * Creates a HID device with the vendor and product IDs of the WMR200
+ * through Linux uhid and speaks the station's side of the protocol, so
+ * that the unmodified daemon, HIDAPI included, can be load-tested without
+ * the hardware. Running it takes write access to /dev/uhid.
+ *
+ * uhid devices are not USB devices, so they are only seen by the hidraw
+ * backend of HIDAPI; build the daemon with `make HIDAPI=hidapi-hidraw`.
+ *
+ * Like the real station, the virtual one keeps quiet until it's woken up,
+ * then sends a packet of live data every interval (-i), in bursts of
+ * several packets if asked to (-b). Unless it's sent a heartbeat every
+ * now and then, it stops sending live data. Historic records (-H) are
+ * announced with PACKET_HISTDATA_NOTIF and sent one per CMD_REQUEST_HISTDATA;
+ * CMD_ERASE throws them away, unless they're kept (-k) to load-test the
+ * transfer of a large backlog, as the daemon erases the logger on start.
+ * Some packets may be corrupted on purpose (-c) and the device may be
+ * unplugged every now and then (-d, -D).
+ *
+ * Statistics are printed as a JSON line on exit.
+ */
+
+#include "synth.h"
+#include "wmr200.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	UHID_PATH		"/dev/uhid"
+#define	HEARTBEAT_TIMEOUT_SEC	60	/* go quiet without a heartbeat */
+#define	NOTIF_INTERVAL_MS	1000	/* repeat of PACKET_HISTDATA_NOTIF */
+
+#define	MSG_WAKEUP		0x20	/* first byte of the wakeup message */
+#define	MSG_CMD			0x01	/* first byte of a command */
+
+#define	CMD_HEARTBEAT		0xD0
+#define	CMD_REQUEST_HISTDATA	0xDA
+#define	CMD_ERASE		0xDB
+#define	CMD_STOP		0xDF
+
+/*
+ * Vendor-defined application collection with 8-byte input and output
+ * reports and no report IDs, which is what the station has.
+ */
+static const byte_t report_desc[] = {
+	0x06, 0x00, 0xff,	/* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01,		/* Usage (1) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, 0x08,		/*   Report Count (8) */
+	0x09, 0x01,		/*   Usage (1) */
+	0x81, 0x02,		/*   Input (Data, Variable, Absolute) */
+	0x95, 0x08,		/*   Report Count (8) */
+	0x09, 0x01,		/*   Usage (1) */
+	0x91, 0x02,		/*   Output (Data, Variable, Absolute) */
+	0xc0,			/* End Collection */
+};
+
+/*
+ * Types of live packets in the order they are sent.
+ */
+static const byte_t live_types[] = {
+	WMR_WIND, WMR_TEMP, WMR_RAIN, WMR_WIND, WMR_TEMP, WMR_BARO,
+	WMR_WIND, WMR_TEMP, WMR_UVI, WMR_STATUS,
+};
+
+/*
+ * Emulator parameters.
+ */
+static struct
+{
+	unsigned interval;		/* live packet interval (ms) */
+	unsigned burst;			/* live packets per burst */
+	unsigned backlog;		/* historic records in the logger */
+	bool keep_backlog;		/* ignore CMD_ERASE */
+	double corrupt;			/* fraction of packets corrupted */
+	unsigned plugged;		/* unplug after this long (s), 0 = never */
+	unsigned unplugged;		/* stay unplugged this long (s) */
+	unsigned duration;		/* run this long (s), 0 = until signalled */
+}
+opts = {
+	.interval = 1000,
+	.burst = 1,
+	.backlog = 0,
+	.keep_backlog = false,
+	.corrupt = 0,
+	.plugged = 0,
+	.unplugged = 2,
+	.duration = 0,
+};
+
+/*
+ * State of the virtual station.
+ */
+static struct
+{
+	int fd;				/* /dev/uhid */
+	bool created;			/* the device exists */
+	bool opened;			/* the device is opened by a driver */
+	bool awake;			/* woken up and not stopped */
+	uint64_t heartbeat_ms;		/* time of the last heartbeat */
+	uint64_t live_ms;		/* time the next live packets are due */
+	uint64_t notif_ms;		/* time the next notification is due */
+	uint64_t plug_ms;		/* time the device is (un)plugged */
+	unsigned seq;			/* sequence of generated values */
+	unsigned backlog;		/* historic records left */
+}
+st;
+
+/*
+ * Statistics.
+ */
+static struct
+{
+	uint64_t packets;		/* live packets sent */
+	uint64_t histdata;		/* historic records sent */
+	uint64_t corrupted;		/* packets corrupted on purpose */
+	uint64_t frames;		/* HID frames sent */
+	uint64_t commands;		/* commands received */
+	uint64_t wakeups;		/* wakeups received */
+	uint64_t unplugs;		/* times unplugged */
+	uint64_t dropped;		/* frames dropped, the device not opened */
+}
+stats;
+
+static volatile sig_atomic_t quit;
+
+static void handle_signal(int sig)
+{
+	(void) sig;
+	quit = 1;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void write_event(struct uhid_event *ev)
+{
+	if (write(st.fd, ev, sizeof(*ev)) != sizeof(*ev))
+		err(EXIT_FAILURE, "write %s", UHID_PATH);
+}
+
+static void create_device(void)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char *)ev.u.create2.name, "Oregon Scientific WMR200 (virtual)");
+	strcpy((char *)ev.u.create2.phys, "vstation");
+	memcpy(ev.u.create2.rd_data, report_desc, sizeof(report_desc));
+	ev.u.create2.rd_size = sizeof(report_desc);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = WMR200_VENDOR_ID;
+	ev.u.create2.product = WMR200_PRODUCT_ID;
+	write_event(&ev);
+
+	st.created = true;
+	st.awake = false;
+}
+
+static void destroy_device(void)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	write_event(&ev);
+
+	st.created = st.opened = st.awake = false;
+}
+
+/*
+ * Send @len bytes of @data to the host, split into HID frames.
+ */
+static void send_data(const byte_t *data, size_t len)
+{
+	byte_t frames[SYNTH_FRAMES_SIZE(SYNTH_MAX_PACKET)];
+	struct uhid_event ev;
+	size_t i, frames_len;
+
+	frames_len = synth_frames(frames, data, len);
+	for (i = 0; i < frames_len; i += SYNTH_FRAME_SIZE) {
+		if (!st.opened) {
+			stats.dropped++;
+			continue;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_INPUT2;
+		ev.u.input2.size = SYNTH_FRAME_SIZE;
+		memcpy(ev.u.input2.data, frames + i, SYNTH_FRAME_SIZE);
+		write_event(&ev);
+		stats.frames++;
+	}
+}
+
+/*
+ * Send a packet of type @type, corrupting it if it's its turn.
+ */
+static void send_packet(byte_t type, time_t time)
+{
+	byte_t packet[SYNTH_MAX_PACKET];
+	size_t len;
+
+	len = synth_packet(packet, type, time, st.seq++);
+	if (opts.corrupt > 0 && drand48() < opts.corrupt) {
+		/* any byte but the type and length, so it fails the checksum */
+		packet[2 + lrand48() % (len - 2)] ^= 1 << (lrand48() % 8);
+		stats.corrupted++;
+	}
+
+	send_data(packet, len);
+}
+
+static void send_control(byte_t type)
+{
+	send_data(&type, 1);
+}
+
+/*
+ * Send the oldest historic record. Records are a minute apart, the newest
+ * one is from a minute ago.
+ */
+static void send_histdata(void)
+{
+	if (st.backlog == 0)
+		return;
+
+	send_packet(HISTORIC_DATA, time(NULL) - 60 * (time_t)st.backlog);
+	st.backlog--;
+	stats.histdata++;
+
+	/* ask the host to go on */
+	if (st.backlog > 0)
+		send_control(PACKET_HISTDATA_NOTIF);
+}
+
+static void handle_output(const byte_t *data, size_t len, uint64_t now)
+{
+	if (len >= 1 && data[0] == MSG_WAKEUP) {
+		stats.wakeups++;
+		st.awake = true;
+		st.heartbeat_ms = st.live_ms = st.notif_ms = now;
+		return;
+	}
+
+	if (len < 2 || data[0] != MSG_CMD) {
+		warnx("Ignoring unknown output report (len=%zu)", len);
+		return;
+	}
+
+	stats.commands++;
+	switch (data[1]) {
+	case CMD_HEARTBEAT:
+		st.heartbeat_ms = now;
+		break;
+	case CMD_REQUEST_HISTDATA:
+		send_histdata();
+		break;
+	case CMD_ERASE:
+		if (!opts.keep_backlog)
+			st.backlog = 0;
+		send_control(PACKET_ERASE_ACK);
+		break;
+	case CMD_STOP:
+		send_control(PACKET_STOP_ACK);
+		st.awake = false;
+		break;
+	default:
+		warnx("Ignoring unknown command 0x%02X", data[1]);
+	}
+}
+
+/*
+ * Handle an event of the uhid device.
+ */
+static void handle_event(uint64_t now)
+{
+	struct uhid_event ev, reply;
+	ssize_t ret;
+
+	if ((ret = read(st.fd, &ev, sizeof(ev))) < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		err(EXIT_FAILURE, "read %s", UHID_PATH);
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	switch (ev.type) {
+	case UHID_OPEN:
+		st.opened = true;
+		break;
+	case UHID_CLOSE:
+		st.opened = st.awake = false;
+		break;
+	case UHID_OUTPUT:
+		handle_output(ev.u.output.data, ev.u.output.size, now);
+		break;
+	case UHID_GET_REPORT:
+		/* the station has no feature reports */
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = EIO;
+		write_event(&reply);
+		break;
+	case UHID_SET_REPORT:
+		reply.type = UHID_SET_REPORT_REPLY;
+		reply.u.set_report_reply.id = ev.u.set_report.id;
+		reply.u.set_report_reply.err = EIO;
+		write_event(&reply);
+		break;
+	}
+}
+
+/*
+ * Do whatever is due at @now and return when something will be due next.
+ */
+static uint64_t tick(uint64_t now)
+{
+	uint64_t next = now + NOTIF_INTERVAL_MS;
+	unsigned i;
+
+	if (opts.plugged > 0 && now >= st.plug_ms) {
+		if (st.created) {
+			destroy_device();
+			stats.unplugs++;
+			st.plug_ms = now + 1000ULL * opts.unplugged;
+		}
+		else {
+			create_device();
+			st.plug_ms = now + 1000ULL * opts.plugged;
+		}
+	}
+	if (opts.plugged > 0)
+		next = MIN(next, st.plug_ms);
+
+	if (!st.awake || now - st.heartbeat_ms > 1000ULL * HEARTBEAT_TIMEOUT_SEC)
+		return next;
+
+	if (now >= st.live_ms) {
+		for (i = 0; i < opts.burst; i++) {
+			send_packet(live_types[st.seq % ARRAY_SIZE(live_types)], time(NULL));
+			stats.packets++;
+		}
+		st.live_ms += (uint64_t)opts.interval * opts.burst;
+		if (st.live_ms < now)
+			st.live_ms = now;
+	}
+	next = MIN(next, st.live_ms);
+
+	if (st.backlog > 0 && now >= st.notif_ms) {
+		send_control(PACKET_HISTDATA_NOTIF);
+		st.notif_ms = now + NOTIF_INTERVAL_MS;
+	}
+
+	return next;
+}
+
+static void print_stats(void)
+{
+	printf("{\"packets\": %" PRIu64 ", \"histdata\": %" PRIu64
+		", \"corrupted\": %" PRIu64 ", \"frames\": %" PRIu64
+		", \"dropped\": %" PRIu64 ", \"commands\": %" PRIu64
+		", \"wakeups\": %" PRIu64 ", \"unplugs\": %" PRIu64 "}\n",
+		stats.packets, stats.histdata, stats.corrupted,
+		stats.frames, stats.dropped, stats.commands,
+		stats.wakeups, stats.unplugs);
+}
+
+static void usage(const char *prog)
+{
+	errx(EXIT_FAILURE, "Usage: %s [-i interval_ms] [-b burst] [-H backlog] [-k] "
+		"[-c corrupt_fraction] [-d plugged_sec] [-D unplugged_sec] [-t duration_sec]",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct sigaction sa = { .sa_handler = handle_signal };
+	uint64_t now, next, end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:b:H:kc:d:D:t:")) != -1) {
+		switch (opt) {
+		case 'i':
+			opts.interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			opts.burst = MAX(strtoul(optarg, NULL, 10), 1UL);
+			break;
+		case 'H':
+			opts.backlog = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			opts.keep_backlog = true;
+			break;
+		case 'c':
+			opts.corrupt = strtod(optarg, NULL);
+			break;
+		case 'd':
+			opts.plugged = strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			opts.unplugged = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			opts.duration = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	srand48(time(NULL));
+
+	if ((st.fd = open(UHID_PATH, O_RDWR | O_CLOEXEC)) == -1)
+		err(EXIT_FAILURE, "open %s", UHID_PATH);
+	pfd.fd = st.fd;
+
+	st.backlog = opts.backlog;
+	now = now_ms();
+	create_device();
+	st.plug_ms = now + 1000ULL * opts.plugged;
+	end = opts.duration > 0 ? now + 1000ULL * opts.duration : UINT64_MAX;
+
+	fprintf(stderr, "Virtual WMR200 %04x:%04x created\n",
+		WMR200_VENDOR_ID, WMR200_PRODUCT_ID);
+
+	while (!quit && now < end) {
+		next = MIN(tick(now), end);
+		now = now_ms();
+		if (poll(&pfd, 1, next > now ? next - now : 0) == -1 && errno != EINTR)
+			err(EXIT_FAILURE, "poll");
+
+		now = now_ms();
+		if (pfd.revents & POLLIN)
+			handle_event(now);
+	}
+
+	if (st.created)
+		destroy_device();
+	(void) close(st.fd);
+
+	print_stats();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/*
+ * Admission control of server connections.
+ */
+
+#include "admit.h"
+#include "common.h"
+#include "metrics.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	ADMIT_BUCKETS		4096	/* size of the bucket table, power of 2 */
+#define	ADMIT_PROBES		8	/* buckets an address may use */
+
+#define	NS_PER_SEC		1000000000.0
+
+/*
+ * Token bucket of a source address.
+ */
+struct admit_bucket
+{
+	uint64_t key;		/* address key, see address_key */
+	uint64_t last_ns;	/* time of the last refill, zero if unused */
+	double tokens;		/* tokens available at @last_ns */
+};
+
+/*
+ * Compute bucket key of @addr (IPv4 or IPv6). IPv4 addresses, mapped or
+ * not, are distinguished from IPv6 networks by a prefix no IPv6 network
+ * which is routed uses.
+ *
+ * Return value:
+ *	True if the address is local and has priority.
+ */
+static bool address_key(const struct sockaddr *addr, uint64_t *key)
+{
+	const struct sockaddr_in6 *sin6;
+	const uint8_t *a;
+	uint32_t ip4;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		ip4 = ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+		break;
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *)addr;
+		if (IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr))
+			return true;
+
+		a = sin6->sin6_addr.s6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			ip4 = (uint32_t)a[12] << 24 | a[13] << 16 | a[14] << 8 | a[15];
+			break;
+		}
+
+		/* the /64 network */
+		memcpy(key, a, sizeof(*key));
+		return false;
+	default:
+		/* Unix sockets */
+		return true;
+	}
+
+	*key = 0xffffULL << 32 | ip4;
+	return (ip4 >> 24) == 127;
+}
+
+/*
+ * Find the bucket of @key, or reuse the least recently used bucket.
+ */
+static struct admit_bucket *find_bucket(struct admit *adm, uint64_t key)
+{
+	struct admit_bucket *bucket, *lru = NULL;
+	size_t i, h;
+
+	h = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+	for (i = 0; i < ADMIT_PROBES; i++) {
+		bucket = &adm->buckets[(h + i) & (ADMIT_BUCKETS - 1)];
+		if (bucket->last_ns != 0 && bucket->key == key)
+			return bucket;
+		if (lru == NULL || bucket->last_ns < lru->last_ns)
+			lru = bucket;
+	}
+
+	lru->key = key;
+	lru->last_ns = 0;
+	return lru;
+}
+
+/*
+ * Take a token of @key's bucket, if there's any.
+ */
+static bool take_token(struct admit *adm, uint64_t key)
+{
+	struct admit_bucket *bucket = find_bucket(adm, key);
+	uint64_t now = metrics_now();
+
+	if (bucket->last_ns == 0)
+		bucket->tokens = adm->cfg.burst;
+	else
+		bucket->tokens = MIN((double)adm->cfg.burst, bucket->tokens
+			+ (now - bucket->last_ns) * adm->cfg.rate / NS_PER_SEC);
+	bucket->last_ns = now;
+
+	if (bucket->tokens < 1)
+		return false;
+
+	bucket->tokens -= 1;
+	return true;
+}
+
+void admit_init(struct admit *adm, struct admit_cfg *cfg)
+{
+	adm->cfg = *cfg;
+	adm->buckets = malloc_safe(ADMIT_BUCKETS * sizeof(*adm->buckets));
+	memset(adm->buckets, 0, ADMIT_BUCKETS * sizeof(*adm->buckets));
+	atomic_init(&adm->num_conns, 0);
+}
+
+void admit_free(struct admit *adm)
+{
+	free(adm->buckets);
+	adm->buckets = NULL;
+}
+
+enum admit_verdict admit_connection(struct admit *adm, const struct sockaddr *addr,
+	bool slot)
+{
+	unsigned max_conns = adm->cfg.max_conns;
+	uint64_t key;
+
+	if (address_key(addr, &key))
+		max_conns += adm->cfg.priority_conns;
+	else if (adm->cfg.rate > 0 && !take_token(adm, key)) {
+		metrics_count(METRIC_REJECTED_RATE, 1);
+		return ADMIT_RATE_LIMITED;
+	}
+
+	if (!slot)
+		return ADMIT_OK;
+
+	/* only this thread takes slots, so the count cannot grow meanwhile */
+	if (atomic_load(&adm->num_conns) >= max_conns) {
+		metrics_count(METRIC_REJECTED_OVERLOAD, 1);
+		return ADMIT_OVERLOADED;
+	}
+
+	atomic_fetch_add(&adm->num_conns, 1);
+	return ADMIT_OK;
+}
+
+void admit_release(struct admit *adm)
+{
+	atomic_fetch_sub(&adm->num_conns, 1);
+}
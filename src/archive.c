@@ -0,0 +1,853 @@
+/*
+ * Compressed columnar on-disk archive of readings.
+ *
+ * Timestamps are compressed using delta-of-delta encoding and fields
+ * using XOR encoding of consecutive values, as described in [1].
+ *
+ * [1] Pelkonen et al.: Gorilla: A Fast, Scalable, In-Memory Time Series
+ *     Database. VLDB 2015.
+ */
+
+#include "archive.h"
+#include "common.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define	ARCHIVE_MAGIC		0x41524d57	/* "WMRA" */
+#define	BLOCK_MAGIC		0x4b4c4257	/* "WBLK" */
+#define	ARCHIVE_VERSION		1
+
+#define	DAY_SEC			(24 * 3600)
+
+#define	DIR_MODE		0750	/* mode of series directories */
+#define	FILE_MODE		0640	/* mode of partition files */
+
+/*
+ * Upper bound on the size of an encoded block: 64 bits for the first
+ * timestamp, at most 68 bits per other timestamp, 32 bits for the first
+ * value of each field and at most 44 bits per other value.
+ */
+#define	SCRATCH_SIZE		(sizeof(struct block_header) + 8 \
+	+ ARCHIVE_BLOCK_MAX * (68 + 44 * SERIES_MAX_FIELDS) / 8 + 8 * (1 + SERIES_MAX_FIELDS))
+
+/*
+ * Partition file header.
+ */
+struct file_header
+{
+	uint32_t magic;		/* ARCHIVE_MAGIC */
+	uint16_t version;	/* ARCHIVE_VERSION */
+	uint8_t series;		/* series stored in the file */
+	uint8_t num_fields;	/* number of fields of the series */
+	uint8_t reserved[8];
+};
+
+/*
+ * Block header. The header is followed by @size bytes of compressed
+ * data: timestamps first, then each of the fields. @size is a multiple
+ * of 8, so that block headers are aligned within the mapped file.
+ */
+struct block_header
+{
+	uint32_t magic;				/* BLOCK_MAGIC */
+	uint16_t count;				/* number of samples */
+	uint16_t num_fields;			/* number of fields */
+	uint32_t size;				/* size of compressed data */
+	uint32_t reserved;
+	int64_t t_min;				/* time of the oldest sample */
+	int64_t t_max;				/* time of the newest sample */
+	float min[SERIES_MAX_FIELDS];		/* per-field minimum */
+	float max[SERIES_MAX_FIELDS];		/* per-field maximum */
+	double sum[SERIES_MAX_FIELDS];		/* per-field sum */
+};
+
+/*
+ * A bit stream, most significant bit first.
+ */
+struct bits
+{
+	uint8_t *buf;		/* the stream */
+	size_t pos;		/* current position (in bits) */
+	size_t len;		/* length of the stream (in bits) */
+	bool overrun;		/* attempt to read past @len */
+};
+
+static void put_bits(struct bits *b, uint64_t val, unsigned n)
+{
+	unsigned off, take;
+
+	while (n > 0) {
+		off = b->pos % 8;
+		take = MIN(8 - off, n);
+		b->buf[b->pos / 8] |= ((val >> (n - take)) & ((1U << take) - 1))
+			<< (8 - off - take);
+		b->pos += take;
+		n -= take;
+	}
+}
+
+static uint64_t get_bits(struct bits *b, unsigned n)
+{
+	uint64_t val = 0;
+	unsigned off, take;
+
+	if (b->pos + n > b->len) {
+		b->overrun = true;
+		return 0;
+	}
+
+	while (n > 0) {
+		off = b->pos % 8;
+		take = MIN(8 - off, n);
+		val = (val << take)
+			| ((b->buf[b->pos / 8] >> (8 - off - take)) & ((1U << take) - 1));
+		b->pos += take;
+		n -= take;
+	}
+
+	return val;
+}
+
+/*
+ * Timestamp compression. The first timestamp is stored verbatim, each
+ * of the following ones as the difference of its delta and the previous
+ * delta. As readings come in regular intervals, most of these are zero
+ * and take a single bit.
+ */
+
+static void put_dod(struct bits *b, int64_t dod)
+{
+	if (dod == 0) {
+		put_bits(b, 0x0, 1);
+	}
+	else if (dod >= -63 && dod <= 64) {
+		put_bits(b, 0x2, 2);
+		put_bits(b, dod + 63, 7);
+	}
+	else if (dod >= -255 && dod <= 256) {
+		put_bits(b, 0x6, 3);
+		put_bits(b, dod + 255, 9);
+	}
+	else if (dod >= -2047 && dod <= 2048) {
+		put_bits(b, 0xE, 4);
+		put_bits(b, dod + 2047, 12);
+	}
+	else {
+		put_bits(b, 0xF, 4);
+		put_bits(b, (uint64_t)dod, 64);
+	}
+}
+
+static int64_t get_dod(struct bits *b)
+{
+	if (get_bits(b, 1) == 0)
+		return 0;
+	if (get_bits(b, 1) == 0)
+		return (int64_t)get_bits(b, 7) - 63;
+	if (get_bits(b, 1) == 0)
+		return (int64_t)get_bits(b, 9) - 255;
+	if (get_bits(b, 1) == 0)
+		return (int64_t)get_bits(b, 12) - 2047;
+	return (int64_t)get_bits(b, 64);
+}
+
+static void encode_times(struct bits *b, time_t *time, size_t count)
+{
+	int64_t delta, prev_delta = 0;
+	size_t i;
+
+	put_bits(b, (uint64_t)time[0], 64);
+	for (i = 1; i < count; i++) {
+		delta = time[i] - time[i - 1];
+		put_dod(b, delta - prev_delta);
+		prev_delta = delta;
+	}
+}
+
+static void decode_times(struct bits *b, time_t *time, size_t count)
+{
+	int64_t delta = 0;
+	size_t i;
+
+	/* corrupt deltas may overflow, which is only defined unsigned */
+	time[0] = (int64_t)get_bits(b, 64);
+	for (i = 1; i < count; i++) {
+		delta = (int64_t)((uint64_t)delta + (uint64_t)get_dod(b));
+		time[i] = (int64_t)((uint64_t)time[i - 1] + (uint64_t)delta);
+	}
+}
+
+/*
+ * Value compression. The first value is stored verbatim. For each of the
+ * following values, XOR with the previous value is computed. Zero XOR
+ * takes a single bit. Otherwise, only the meaningful bits of the XOR are
+ * stored, reusing the previous leading/trailing zero counts if possible.
+ */
+
+static inline uint32_t float_bits(float val)
+{
+	uint32_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+	return bits;
+}
+
+static inline float bits_float(uint32_t bits)
+{
+	float val;
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+static void encode_values(struct bits *b, float *values, size_t count)
+{
+	unsigned lead, trail, prev_lead = 32, prev_trail = 0;
+	uint32_t prev, cur, xor;
+	size_t i;
+
+	prev = float_bits(values[0]);
+	put_bits(b, prev, 32);
+
+	for (i = 1; i < count; i++) {
+		cur = float_bits(values[i]);
+		xor = cur ^ prev;
+		prev = cur;
+
+		if (xor == 0) {
+			put_bits(b, 0x0, 1);
+			continue;
+		}
+
+		lead = MIN(__builtin_clz(xor), 31);
+		trail = __builtin_ctz(xor);
+
+		if (prev_lead < 32 && lead >= prev_lead && trail >= prev_trail) {
+			put_bits(b, 0x2, 2);
+			put_bits(b, xor >> prev_trail, 32 - prev_lead - prev_trail);
+		}
+		else {
+			put_bits(b, 0x3, 2);
+			put_bits(b, lead, 5);
+			put_bits(b, 32 - lead - trail - 1, 5);
+			put_bits(b, xor >> trail, 32 - lead - trail);
+			prev_lead = lead;
+			prev_trail = trail;
+		}
+	}
+}
+
+static void decode_values(struct bits *b, float *values, size_t count)
+{
+	unsigned lead = 32, trail = 0, len;
+	uint32_t prev;
+	size_t i;
+
+	prev = get_bits(b, 32);
+	values[0] = bits_float(prev);
+
+	for (i = 1; i < count; i++) {
+		if (get_bits(b, 1) == 1) {
+			if (get_bits(b, 1) == 1) {
+				lead = get_bits(b, 5);
+				len = get_bits(b, 5) + 1;
+				if (lead + len > 32) { /* window past the value */
+					b->overrun = true;
+					return;
+				}
+				trail = 32 - lead - len;
+			}
+
+			if (lead >= 32) { /* reuse of undefined window */
+				b->overrun = true;
+				return;
+			}
+
+			prev ^= (uint32_t)get_bits(b, 32 - lead - trail) << trail;
+		}
+		values[i] = bits_float(prev);
+	}
+}
+
+/*
+ * Encode pending samples @p of a series with @num_fields fields into
+ * @buf, header included. Return the size of the encoded block.
+ */
+static size_t encode_block(struct archive_pending *p, size_t num_fields, uint8_t *buf)
+{
+	struct block_header *hdr = (struct block_header *)buf;
+	struct bits b;
+	size_t f, i;
+
+	assert(p->count > 0);
+	memset(buf, 0, SCRATCH_SIZE);
+
+	hdr->magic = BLOCK_MAGIC;
+	hdr->count = p->count;
+	hdr->num_fields = num_fields;
+	hdr->t_min = hdr->t_max = p->time[0];
+	for (i = 1; i < p->count; i++) {
+		hdr->t_min = MIN(hdr->t_min, p->time[i]);
+		hdr->t_max = MAX(hdr->t_max, p->time[i]);
+	}
+
+	for (f = 0; f < num_fields; f++) {
+		hdr->min[f] = hdr->max[f] = p->values[f][0];
+		for (i = 0; i < p->count; i++) {
+			hdr->min[f] = MIN(hdr->min[f], p->values[f][i]);
+			hdr->max[f] = MAX(hdr->max[f], p->values[f][i]);
+			hdr->sum[f] += p->values[f][i];
+		}
+	}
+
+	b.buf = buf + sizeof(*hdr);
+	b.pos = 0;
+	encode_times(&b, p->time, p->count);
+	for (f = 0; f < num_fields; f++)
+		encode_values(&b, p->values[f], p->count);
+
+	hdr->size = ((b.pos + 63) / 64) * 8;
+	assert(sizeof(*hdr) + hdr->size <= SCRATCH_SIZE);
+	return sizeof(*hdr) + hdr->size;
+}
+
+/*
+ * Decode block @hdr into @time and @values.
+ *
+ * Return value:
+ *	Zero on success, -1 if the block is corrupt.
+ */
+static int decode_block(struct block_header *hdr, time_t *time,
+	float values[][ARCHIVE_BLOCK_MAX])
+{
+	struct bits b = {
+		.buf = (uint8_t *)(hdr + 1),
+		.pos = 0,
+		.len = 8 * (size_t)hdr->size,
+		.overrun = false
+	};
+	size_t f;
+
+	if (hdr->count == 0 || hdr->count > ARCHIVE_BLOCK_MAX
+		|| hdr->num_fields > SERIES_MAX_FIELDS)
+		return -1;
+
+	decode_times(&b, time, hdr->count);
+	for (f = 0; f < hdr->num_fields; f++)
+		decode_values(&b, values[f], hdr->count);
+
+	return b.overrun ? -1 : 0;
+}
+
+/*
+ * Partition files.
+ */
+
+static time_t day_of(time_t time)
+{
+	return time - (((time % DAY_SEC) + DAY_SEC) % DAY_SEC);
+}
+
+static void partition_path(struct archive *arch, int series, time_t day,
+	char *path, size_t size)
+{
+	struct tm tm;
+	char date[16];
+
+	gmtime_r(&day, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+	snprintf(path, size, "%s/%s/%s.col", arch->cfg.root, series_name(series), date);
+}
+
+/*
+ * Return the length of the well-formed prefix of a mapped partition file,
+ * i.e. the offset just past its last complete block. Zero is returned if
+ * the file header is invalid.
+ */
+static size_t valid_length(uint8_t *map, size_t size)
+{
+	struct file_header *fh = (struct file_header *)map;
+	struct block_header *hdr;
+	size_t off;
+
+	if (size < sizeof(*fh) || fh->magic != ARCHIVE_MAGIC
+		|| fh->version != ARCHIVE_VERSION)
+		return 0;
+
+	for (off = sizeof(*fh); off + sizeof(*hdr) <= size; off += sizeof(*hdr) + hdr->size) {
+		hdr = (struct block_header *)(map + off);
+		if (hdr->magic != BLOCK_MAGIC || hdr->size > size - off - sizeof(*hdr))
+			break;
+	}
+
+	return off;
+}
+
+static int map_file(int fd, uint8_t **map, size_t *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+	*size = st.st_size;
+	if (*size == 0) {
+		*map = NULL;
+		return 0;
+	}
+
+	*map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	return *map == MAP_FAILED ? -1 : 0;
+}
+
+static void make_dir(const char *path)
+{
+	if (mkdir(path, DIR_MODE) != 0) {
+		if (errno != EEXIST)
+			log_error("mkdir: cannot create %s: %s", path, strerror(errno));
+		return;
+	}
+
+	/* creating partitions takes write permission, which umask may have taken */
+	if (chmod(path, DIR_MODE) != 0)
+		log_warning("chmod %s: %s", path, strerror(errno));
+}
+
+/*
+ * Open partition @day of @series for appending. A new file is given a file
+ * header; a partial block at the end of an existing file (left behind by
+ * a crash) is truncated away.
+ */
+static int open_partition(struct archive *arch, int series, time_t day)
+{
+	struct file_header fh = {
+		.magic = ARCHIVE_MAGIC,
+		.version = ARCHIVE_VERSION,
+		.series = series,
+		.num_fields = series_num_fields(series),
+	};
+	char path[PATH_MAX];
+	uint8_t *map;
+	size_t size, valid;
+	int fd;
+
+	make_dir(arch->cfg.root);
+	snprintf(path, sizeof(path), "%s/%s", arch->cfg.root, series_name(series));
+	make_dir(path);
+
+	partition_path(arch, series, day, path, sizeof(path));
+	if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, FILE_MODE)) == -1) {
+		log_error("open: cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (map_file(fd, &map, &size) != 0) {
+		log_error("mmap: cannot map %s: %s", path, strerror(errno));
+		goto out_close;
+	}
+
+	if (size == 0) {
+		/* the file is reopened for writing, see make_dir */
+		if (fchmod(fd, FILE_MODE) != 0)
+			log_warning("chmod %s: %s", path, strerror(errno));
+		if (write(fd, &fh, sizeof(fh)) != sizeof(fh)) {
+			log_error("write: cannot write to %s", path);
+			goto out_close;
+		}
+		return fd;
+	}
+
+	valid = valid_length(map, size);
+	munmap(map, size);
+
+	if (valid == 0) {
+		log_error("%s is not an archive file", path);
+		goto out_close;
+	}
+
+	if (valid < size) {
+		log_warning("Truncating partial block at the end of %s", path);
+		if (ftruncate(fd, valid) != 0)
+			goto out_close;
+	}
+
+	return fd;
+
+out_close:
+	(void) close(fd);
+	return -1;
+}
+
+/*
+ * Write pending samples of @series as a new block.
+ */
+static void flush_pending(struct archive *arch, int series)
+{
+	struct archive_pending *p = &arch->pending[series];
+	size_t len;
+
+	if (p->count == 0)
+		return;
+
+	if (p->fd == -1)
+		p->fd = open_partition(arch, series, p->day);
+
+	if (p->fd != -1) {
+		len = encode_block(p, series_num_fields(series), arch->scratch);
+		if (write(p->fd, arch->scratch, len) != (ssize_t)len)
+			log_error("write: cannot archive %s block: %s",
+				series_name(series), strerror(errno));
+	}
+	else {
+		log_error("Dropping %zu %s samples", p->count, series_name(series));
+	}
+
+	p->count = 0;
+}
+
+void archive_init(struct archive *arch, struct archive_cfg *cfg)
+{
+	int s;
+
+	arch->cfg = *cfg;
+	if (arch->cfg.block_len == 0 || arch->cfg.block_len > ARCHIVE_BLOCK_MAX)
+		arch->cfg.block_len = ARCHIVE_BLOCK_MAX;
+
+	pthread_mutex_init(&arch->lock, NULL);
+	arch->scratch = malloc_safe(SCRATCH_SIZE);
+
+	for (s = 0; s < SERIES_MAX; s++) {
+		arch->pending[s].day = -1;
+		arch->pending[s].fd = -1;
+		arch->pending[s].count = 0;
+	}
+}
+
+void archive_flush(struct archive *arch)
+{
+	int s;
+
+	pthread_mutex_lock(&arch->lock);
+	for (s = 0; s < SERIES_MAX; s++)
+		flush_pending(arch, s);
+	pthread_mutex_unlock(&arch->lock);
+}
+
+void archive_sync(void *arg)
+{
+	struct archive *arch = (struct archive *)arg;
+	int s;
+
+	pthread_mutex_lock(&arch->lock);
+	for (s = 0; s < SERIES_MAX; s++) {
+		flush_pending(arch, s);
+		if (arch->pending[s].fd != -1 && fdatasync(arch->pending[s].fd) != 0)
+			log_error("fdatasync: cannot sync %s partition: %s",
+				series_name(s), strerror(errno));
+	}
+	pthread_mutex_unlock(&arch->lock);
+}
+
+void archive_free(struct archive *arch)
+{
+	int s;
+
+	archive_flush(arch);
+	for (s = 0; s < SERIES_MAX; s++)
+		if (arch->pending[s].fd != -1)
+			(void) close(arch->pending[s].fd);
+
+	free(arch->scratch);
+	pthread_mutex_destroy(&arch->lock);
+}
+
+void archive_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	struct archive *arch = (struct archive *)arg;
+	struct archive_pending *p;
+	float values[SERIES_MAX_FIELDS];
+	size_t num_fields, f;
+	time_t day;
+	int series;
+
+	if ((series = series_of(reading)) < 0)
+		return;
+
+	num_fields = series_get_values(reading, values);
+	day = day_of(reading->time);
+	p = &arch->pending[series];
+
+	pthread_mutex_lock(&arch->lock);
+
+	/* partitions are synced before they're closed, see archive_sync */
+	if (day != p->day) {
+		flush_pending(arch, series);
+		if (p->fd != -1 && fdatasync(p->fd) != 0)
+			log_error("fdatasync: cannot sync %s partition: %s",
+				series_name(series), strerror(errno));
+		if (p->fd != -1)
+			(void) close(p->fd);
+		p->fd = -1;
+		p->day = day;
+	}
+
+	p->time[p->count] = reading->time;
+	for (f = 0; f < num_fields; f++)
+		p->values[f][p->count] = values[f];
+	p->count++;
+
+	if (p->count >= arch->cfg.block_len
+		|| reading->time - p->time[0] >= (time_t)arch->cfg.flush_interval)
+		flush_pending(arch, series);
+
+	pthread_mutex_unlock(&arch->lock);
+}
+
+/*
+ * Queries.
+ */
+
+/*
+ * Block visitor for walk. Called with a block which overlaps the queried
+ * range; @hdr is NULL for pending samples, which are passed decoded.
+ */
+typedef void block_visit_t(struct block_header *hdr, time_t *time,
+	float values[][ARCHIVE_BLOCK_MAX], size_t count, void *arg);
+
+/*
+ * Walk all blocks of @series which overlap [@from, @to), including samples
+ * which are yet to be written.
+ */
+static void walk(struct archive *arch, int series, time_t from, time_t to,
+	block_visit_t *visit, void *arg)
+{
+	struct archive_pending *p = &arch->pending[series];
+	static __thread time_t time[ARCHIVE_BLOCK_MAX];
+	static __thread float values[SERIES_MAX_FIELDS][ARCHIVE_BLOCK_MAX];
+	struct block_header *hdr;
+	char path[PATH_MAX];
+	uint8_t *map;
+	size_t size, valid, off;
+	time_t day;
+	int fd;
+
+	for (day = day_of(from); day < to; day += DAY_SEC) {
+		partition_path(arch, series, day, path, sizeof(path));
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+
+		if (map_file(fd, &map, &size) != 0 || size == 0) {
+			(void) close(fd);
+			continue;
+		}
+		(void) close(fd);
+
+		valid = valid_length(map, size);
+		for (off = sizeof(struct file_header); off < valid; off += sizeof(*hdr) + hdr->size) {
+			hdr = (struct block_header *)(map + off);
+			if (hdr->t_max < from || hdr->t_min >= to)
+				continue;
+			visit(hdr, NULL, NULL, hdr->count, arg);
+		}
+
+		munmap(map, size);
+	}
+
+	pthread_mutex_lock(&arch->lock);
+	if (p->count > 0) {
+		memcpy(time, p->time, p->count * sizeof(*time));
+		memcpy(values, p->values, sizeof(values));
+		visit(NULL, time, values, p->count, arg);
+	}
+	pthread_mutex_unlock(&arch->lock);
+}
+
+struct range_ctx
+{
+	time_t from;
+	time_t to;
+	series_visit_t *visit;
+	void *arg;
+	size_t num_fields;
+	size_t count;
+};
+
+static void range_block(struct block_header *hdr, time_t *time,
+	float values[][ARCHIVE_BLOCK_MAX], size_t count, void *arg)
+{
+	struct range_ctx *ctx = (struct range_ctx *)arg;
+	static __thread time_t dec_time[ARCHIVE_BLOCK_MAX];
+	static __thread float dec_values[SERIES_MAX_FIELDS][ARCHIVE_BLOCK_MAX];
+	float sample[SERIES_MAX_FIELDS];
+	size_t i, f;
+
+	if (hdr != NULL) {
+		if (decode_block(hdr, dec_time, dec_values) != 0) {
+			log_error("Skipping corrupt archive block");
+			return;
+		}
+		time = dec_time;
+		values = dec_values;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (time[i] < ctx->from || time[i] >= ctx->to)
+			continue;
+
+		for (f = 0; f < ctx->num_fields; f++)
+			sample[f] = values[f][i];
+		ctx->visit(time[i], sample, ctx->num_fields, ctx->arg);
+		ctx->count++;
+	}
+}
+
+size_t archive_range(struct archive *arch, int series, time_t from, time_t to,
+	series_visit_t *visit, void *arg)
+{
+	struct range_ctx ctx = {
+		.from = from,
+		.to = to,
+		.visit = visit,
+		.arg = arg,
+		.num_fields = series_num_fields(series),
+		.count = 0
+	};
+
+	walk(arch, series, from, to, range_block, &ctx);
+	return ctx.count;
+}
+
+static void hwm_sample(time_t time, float *values, size_t num_fields, void *arg)
+{
+	(void) values;
+	(void) num_fields;
+
+	series_hwm_add((struct series_hwm *)arg, time, 1);
+}
+
+void archive_hwm(void *arg, int series, time_t since, struct series_hwm *hwm)
+{
+	struct archive *arch = (struct archive *)arg;
+
+	hwm->time = 0;
+	hwm->count = 0;
+	(void) archive_range(arch, series, since, MAX(since, time(NULL)) + DAY_SEC,
+		hwm_sample, hwm);
+}
+
+struct agg_ctx
+{
+	time_t from;
+	time_t to;
+	size_t field;
+	struct series_agg *agg;
+};
+
+static void agg_block(struct block_header *hdr, time_t *time,
+	float values[][ARCHIVE_BLOCK_MAX], size_t count, void *arg)
+{
+	struct agg_ctx *ctx = (struct agg_ctx *)arg;
+	static __thread time_t dec_time[ARCHIVE_BLOCK_MAX];
+	static __thread float dec_values[SERIES_MAX_FIELDS][ARCHIVE_BLOCK_MAX];
+	struct series_agg *agg = ctx->agg;
+	size_t i;
+
+	if (hdr != NULL) {
+		if (ctx->field >= hdr->num_fields)
+			return;
+
+		/* the whole block is in the range, use the summary */
+		if (hdr->t_min >= ctx->from && hdr->t_max < ctx->to) {
+			agg->min = MIN(agg->min, hdr->min[ctx->field]);
+			agg->max = MAX(agg->max, hdr->max[ctx->field]);
+			agg->sum += hdr->sum[ctx->field];
+			agg->count += hdr->count;
+			return;
+		}
+
+		if (decode_block(hdr, dec_time, dec_values) != 0) {
+			log_error("Skipping corrupt archive block");
+			return;
+		}
+		time = dec_time;
+		values = dec_values;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (time[i] < ctx->from || time[i] >= ctx->to)
+			continue;
+
+		agg->min = MIN(agg->min, values[ctx->field][i]);
+		agg->max = MAX(agg->max, values[ctx->field][i]);
+		agg->sum += values[ctx->field][i];
+		agg->count++;
+	}
+}
+
+void archive_aggregate(struct archive *arch, int series, size_t field,
+	time_t from, time_t to, struct series_agg *agg)
+{
+	struct agg_ctx ctx = {
+		.from = from,
+		.to = to,
+		.field = field,
+		.agg = agg
+	};
+
+	assert(field < series_num_fields(series));
+	series_agg_reset(agg, from);
+	walk(arch, series, from, to, agg_block, &ctx);
+}
+
+/*
+ * Server interface.
+ */
+
+/*
+ * archive-range <series> <from> <to>
+ */
+static void cmd_range(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct archive *arch = (struct archive *)arg;
+	struct series_print_ctx ctx = { .out = out };
+	time_t from, to;
+
+	if (series_parse_args(argc, argv, false, &ctx.series, NULL, &from, &to, out) == 0)
+		(void) archive_range(arch, ctx.series, from, to, series_print_sample, &ctx);
+}
+
+/*
+ * archive-aggregate <series> <field> <from> <to>
+ */
+static void cmd_aggregate(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct archive *arch = (struct archive *)arg;
+	struct series_agg agg;
+	int series, field;
+	time_t from, to;
+
+	if (series_parse_args(argc, argv, true, &series, &field, &from, &to, out) != 0)
+		return;
+
+	archive_aggregate(arch, series, field, from, to, &agg);
+	series_print_agg(out, &agg);
+}
+
+void archive_serve(struct archive *arch, struct wmr_server *srv)
+{
+	server_register_command(srv, "archive-range", cmd_range, arch);
+	server_register_command(srv, "archive-aggregate", cmd_aggregate, arch);
+}
@@ -0,0 +1,157 @@
+/*
+ * Arena and pool allocators.
+ */
+
+#include "arena.h"
+#include "common.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
+
+#define	ALIGN			alignof(max_align_t)
+#define	ALIGN_UP(n)		(((n) + ALIGN - 1) & ~(ALIGN - 1))
+#define	THREAD_CHUNK_SIZE	(64 * 1024)
+
+struct arena_chunk
+{
+	struct arena_chunk *next;	/* next (older) chunk */
+	size_t size;			/* size of @data */
+	alignas(max_align_t) unsigned char data[];
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static __thread struct arena *my_arena;		/* arena of this thread */
+
+void arena_init(struct arena *arena, size_t chunk_size)
+{
+	arena->chunks = arena->current = NULL;
+	arena->pos = 0;
+	arena->chunk_size = chunk_size;
+}
+
+void arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+
+	arena->current = NULL;
+	arena->pos = 0;
+}
+
+/*
+ * Make a chunk with at least @size bytes current. Chunks are ordered by
+ * age, so that a reset can go back in the list; the chunks after the
+ * current one are those released by a reset, which are reused first.
+ */
+static void next_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk **link, *chunk;
+
+	/* the chunks following @current are unused */
+	link = arena->current ? &arena->current->next : &arena->chunks;
+	while ((chunk = *link) != NULL && chunk->size < size)
+		link = &chunk->next;
+
+	if (chunk != NULL) {
+		/* move it right after the current chunk */
+		*link = chunk->next;
+	}
+	else {
+		size = MAX(size, arena->chunk_size);
+		chunk = malloc_safe(offsetof(struct arena_chunk, data) + size);
+		chunk->size = size;
+	}
+
+	link = arena->current ? &arena->current->next : &arena->chunks;
+	chunk->next = *link;
+	*link = chunk;
+
+	arena->current = chunk;
+	arena->pos = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *mem;
+
+	size = ALIGN_UP(size);
+	if (arena->current == NULL || arena->pos + size > arena->current->size)
+		next_chunk(arena, size);
+
+	mem = arena->current->data + arena->pos;
+	arena->pos += size;
+	return mem;
+}
+
+struct arena_mark arena_save(struct arena *arena)
+{
+	return (struct arena_mark) { arena->current, arena->pos };
+}
+
+void arena_reset(struct arena *arena, struct arena_mark mark)
+{
+	arena->current = mark.chunk;
+	arena->pos = mark.pos;
+}
+
+static void free_thread_arena(void *arg)
+{
+	struct arena *arena = (struct arena *)arg;
+
+	arena_free(arena);
+	free(arena);
+}
+
+static void create_key(void)
+{
+	(void) pthread_key_create(&arena_key, free_thread_arena);
+}
+
+struct arena *arena_thread(void)
+{
+	if (my_arena != NULL)
+		return my_arena;
+
+	pthread_once(&once, create_key);
+
+	my_arena = malloc_safe(sizeof(*my_arena));
+	arena_init(my_arena, THREAD_CHUNK_SIZE);
+	(void) pthread_setspecific(arena_key, my_arena);
+	return my_arena;
+}
+
+void pool_init(struct pool *pool, size_t obj_size, size_t objs_per_chunk)
+{
+	pool->obj_size = ALIGN_UP(MAX(obj_size, sizeof(void *)));
+	pool->free_list = NULL;
+	arena_init(&pool->arena, pool->obj_size * objs_per_chunk);
+}
+
+void pool_free(struct pool *pool)
+{
+	arena_free(&pool->arena);
+	pool->free_list = NULL;
+}
+
+void *pool_get(struct pool *pool)
+{
+	void *obj;
+
+	if ((obj = pool->free_list) == NULL)
+		return arena_alloc(&pool->arena, pool->obj_size);
+
+	pool->free_list = *(void **)obj;
+	return obj;
+}
+
+void pool_put(struct pool *pool, void *obj)
+{
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+}
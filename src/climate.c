@@ -0,0 +1,642 @@
+/*
+ * Calendar summaries and records of series.
+ */
+
+#include "climate.h"
+#include "common.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	CLIMATE_MAGIC		0x494c434d	/* "MCLI" */
+#define	CLIMATE_VERSION		2
+#define	ENTRY_MAGIC		0x544e4543	/* "CENT" */
+
+#define	RAIN_TOTAL_FIELD	3		/* accum_2007 */
+
+/*
+ * Summary file header. Entries follow the header.
+ */
+struct climate_header
+{
+	uint32_t magic;		/* CLIMATE_MAGIC */
+	uint32_t version;	/* CLIMATE_VERSION */
+	uint8_t reserved[8];
+};
+
+/*
+ * Summary file entry, a (partial) summary of a series over a day.
+ */
+struct climate_entry
+{
+	uint32_t magic;		/* ENTRY_MAGIC */
+	uint32_t checksum;	/* checksum of the rest of the entry */
+	uint32_t day;		/* start of the day (UNIX time) */
+	uint8_t series;		/* the series */
+	uint8_t reserved[3];
+	uint32_t newest;	/* time of the newest reading summarized */
+	uint32_t newest_count;	/* number of readings of @newest */
+	struct climate_agg agg[SERIES_MAX_FIELDS];	/* per-field summaries */
+};
+
+static const char *unit_names[CLIMATE_UNIT_MAX] = {
+	[CLIMATE_DAY] = "day",
+	[CLIMATE_MONTH] = "month",
+	[CLIMATE_YEAR] = "year",
+};
+
+/*
+ * FNV-1a hash of the entry, magic and checksum excluded.
+ */
+static uint32_t entry_checksum(struct climate_entry *entry)
+{
+	uint8_t *p = (uint8_t *)&entry->day;
+	uint8_t *end = (uint8_t *)(entry + 1);
+	uint32_t hash = 2166136261U;
+
+	for (; p < end; p++)
+		hash = (hash ^ *p) * 16777619U;
+
+	return hash;
+}
+
+/*
+ * Compute the @unit (of local time) which contains @time.
+ */
+static void period_bounds(enum climate_unit unit, time_t time, struct climate_bounds *b)
+{
+	struct tm tm;
+
+	localtime_r(&time, &tm);
+	tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
+	if (unit == CLIMATE_YEAR)
+		tm.tm_mon = 0;
+	if (unit != CLIMATE_DAY)
+		tm.tm_mday = 1;
+	tm.tm_isdst = -1;
+	b->start = mktime(&tm);
+
+	switch (unit) {
+	case CLIMATE_DAY:
+		tm.tm_mday++;
+		break;
+	case CLIMATE_MONTH:
+		tm.tm_mon++;
+		break;
+	default:
+		tm.tm_year++;
+		break;
+	}
+	tm.tm_isdst = -1;
+	b->end = mktime(&tm);
+}
+
+static void agg_add(struct climate_agg *agg, float value, time_t time)
+{
+	if (agg->count == 0 || value < agg->min) {
+		agg->min = value;
+		agg->min_time = time;
+	}
+	if (agg->count == 0 || value > agg->max) {
+		agg->max = value;
+		agg->max_time = time;
+	}
+	agg->sum += value;
+	agg->count++;
+}
+
+static void agg_merge(struct climate_agg *dst, struct climate_agg *src)
+{
+	if (src->count == 0)
+		return;
+
+	if (dst->count == 0 || src->min < dst->min) {
+		dst->min = src->min;
+		dst->min_time = src->min_time;
+	}
+	if (dst->count == 0 || src->max > dst->max) {
+		dst->max = src->max;
+		dst->max_time = src->max_time;
+	}
+	dst->sum += src->sum;
+	dst->count += src->count;
+}
+
+/*
+ * Find the period of @table which starts at @start. If there's none and
+ * @create is true, insert an empty one.
+ */
+static struct climate_period *find_period(struct climate_table *table, time_t start,
+	bool create)
+{
+	size_t lo = 0, hi = table->count, mid;
+	struct climate_period *period;
+
+	/* readings mostly come in order, so try the last period first */
+	if (hi > 0 && table->periods[hi - 1].start <= start)
+		lo = hi - 1;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (table->periods[mid].start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < table->count && table->periods[lo].start == start)
+		return &table->periods[lo];
+	if (!create)
+		return NULL;
+
+	if (table->count == table->size) {
+		table->size = MAX(2 * table->size, 16);
+		table->periods = realloc_safe(table->periods,
+			table->size * sizeof(*table->periods));
+	}
+
+	period = &table->periods[lo];
+	memmove(period + 1, period, (table->count - lo) * sizeof(*period));
+	table->count++;
+
+	memset(period, 0, sizeof(*period));
+	period->start = start;
+	return period;
+}
+
+static void table_free(struct climate_table *table)
+{
+	free(table->periods);
+	table->periods = NULL;
+	table->count = table->size = 0;
+}
+
+/*
+ * Merge the summaries @agg of @series over the day which starts at @day
+ * into the daily, monthly and yearly summaries and the records.
+ */
+static void merge_day(struct climate *clim, int series, time_t day,
+	struct climate_agg *agg)
+{
+	struct climate_period *period;
+	struct climate_bounds b;
+	size_t f;
+	int unit;
+
+	for (unit = 0; unit < CLIMATE_UNIT_MAX; unit++) {
+		b.start = day;
+		if (unit != CLIMATE_DAY)
+			period_bounds(unit, day, &b);
+		period = find_period(&clim->tables[series][unit], b.start, true);
+		for (f = 0; f < SERIES_MAX_FIELDS; f++)
+			agg_merge(&period->agg[f], &agg[f]);
+	}
+
+	for (f = 0; f < SERIES_MAX_FIELDS; f++)
+		agg_merge(&clim->records[series][f], &agg[f]);
+}
+
+static int write_entry(int fd, off_t off, int series, struct climate_period *period,
+	struct series_hwm *newest)
+{
+	struct climate_entry entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.magic = ENTRY_MAGIC;
+	entry.day = period->start;
+	entry.series = series;
+	entry.newest = newest->time;
+	entry.newest_count = newest->count;
+	memcpy(entry.agg, period->agg, sizeof(entry.agg));
+	entry.checksum = entry_checksum(&entry);
+
+	if (pwrite(fd, &entry, sizeof(entry), off) != sizeof(entry))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Read the summary file into memory. Entries of the current day are
+ * rewritten in place, so a torn write corrupts only that entry; corrupt
+ * entries are skipped and the rest of the file is loaded.
+ */
+static int load(struct climate *clim)
+{
+	const char *path = clim->cfg.path;
+	struct climate_header hdr;
+	struct climate_entry entry;
+	size_t num_entries = 0;
+	size_t num_corrupt = 0;
+	ssize_t ret;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		if (errno == ENOENT)
+			return 0;
+		log_error("climate: cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != CLIMATE_MAGIC
+		|| hdr.version != CLIMATE_VERSION) {
+		log_warning("climate: ignoring invalid summary file %s", path);
+		goto out_close;
+	}
+
+	while ((ret = read(fd, &entry, sizeof(entry))) == sizeof(entry)) {
+		if (entry.magic != ENTRY_MAGIC || entry.checksum != entry_checksum(&entry)
+			|| entry.series >= SERIES_MAX) {
+			num_corrupt++;
+			continue;
+		}
+
+		merge_day(clim, entry.series, entry.day, entry.agg);
+		series_hwm_add(&clim->hwm[entry.series], entry.newest, entry.newest_count);
+		num_entries++;
+	}
+
+	if (num_corrupt > 0)
+		log_warning("climate: ignoring %zu corrupt entries of summary file %s",
+			num_corrupt, path);
+	if (ret != 0)
+		log_warning("climate: ignoring corrupt end of summary file %s", path);
+
+	log_info("climate: restored %zu summary entries", num_entries);
+
+out_close:
+	(void) close(fd);
+	return 0;
+}
+
+/*
+ * Rewrite the summary file with a single entry per day and series, and
+ * keep it open for writing.
+ */
+static int compact(struct climate *clim)
+{
+	struct climate_header hdr = {
+		.magic = CLIMATE_MAGIC,
+		.version = CLIMATE_VERSION,
+	};
+	struct series_hwm none = { 0, 0 };
+	struct climate_table *table;
+	char tmp_path[256];
+	off_t off = sizeof(hdr);
+	size_t i;
+	int series;
+	int fd;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", clim->cfg.path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		log_error("climate: cannot open %s: %s", tmp_path, strerror(errno));
+		return -1;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out_error;
+
+	/* the high-water mark of a series goes with its last entry */
+	for (series = 0; series < SERIES_MAX; series++) {
+		table = &clim->tables[series][CLIMATE_DAY];
+		for (i = 0; i < table->count; i++, off += sizeof(struct climate_entry))
+			if (write_entry(fd, off, series, &table->periods[i],
+				i + 1 == table->count ? &clim->hwm[series] : &none) != 0)
+				goto out_error;
+	}
+
+	if (fsync(fd) != 0 || rename(tmp_path, clim->cfg.path) != 0)
+		goto out_error;
+
+	clim->fd = fd;
+	clim->size = off;
+	return 0;
+
+out_error:
+	log_error("climate: cannot write %s: %s", tmp_path, strerror(errno));
+	(void) close(fd);
+	(void) unlink(tmp_path);
+	return -1;
+}
+
+int climate_open(struct climate *clim, struct climate_cfg *cfg)
+{
+	/* also makes @cur empty periods, which no reading falls into */
+	memset(clim, 0, sizeof(*clim));
+	clim->cfg = *cfg;
+	clim->fd = -1;
+	pthread_mutex_init(&clim->lock, NULL);
+
+	if (cfg->path == NULL)
+		return 0;
+
+	if (load(clim) != 0 || compact(clim) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Find the summary of @series over @day to be written, or add an empty one.
+ */
+static struct climate_pending *find_pending(struct climate *clim, int series, time_t day)
+{
+	struct climate_pending *pending;
+	size_t i;
+
+	/* there are only a few, mostly of the current day */
+	for (i = clim->num_pending; i > 0; i--) {
+		pending = &clim->pending[i - 1];
+		if (pending->series == series && pending->day.start == day)
+			return pending;
+	}
+
+	if (clim->num_pending == clim->pending_size) {
+		clim->pending_size = MAX(2 * clim->pending_size, SERIES_MAX);
+		clim->pending = realloc_safe(clim->pending,
+			clim->pending_size * sizeof(*clim->pending));
+	}
+
+	pending = &clim->pending[clim->num_pending++];
+	memset(pending, 0, sizeof(*pending));
+	pending->series = series;
+	pending->day.start = day;
+	pending->off = -1;
+	return pending;
+}
+
+/*
+ * Write summaries to the summary file. Summaries of past days are not
+ * kept once they are written, so the file is synced when there are any;
+ * their entries are not going to be rewritten. Caller holds the lock.
+ */
+static void write_pending(struct climate *clim)
+{
+	struct climate_pending *pending;
+	size_t i, j = 0;
+
+	for (i = 0; i < clim->num_pending; i++) {
+		pending = &clim->pending[i];
+		if (clim->fd >= 0 && pending->off < 0) {
+			pending->off = clim->size;
+			clim->size += sizeof(struct climate_entry);
+		}
+
+		if (clim->fd >= 0 && write_entry(clim->fd, pending->off,
+			pending->series, &pending->day, &pending->newest) != 0) {
+			log_error("climate: cannot write %s, summaries will not "
+				"be persisted: %s", clim->cfg.path, strerror(errno));
+			(void) close(clim->fd);
+			clim->fd = -1;
+		}
+
+		if (pending->day.start == clim->cur[CLIMATE_DAY].start)
+			clim->pending[j++] = *pending;
+	}
+
+	if (clim->fd >= 0 && j < clim->num_pending && fdatasync(clim->fd) != 0)
+		log_error("climate: fdatasync: %s", strerror(errno));
+
+	clim->num_pending = j;
+	clim->pending_since = 0;
+}
+
+void climate_flush(struct climate *clim)
+{
+	pthread_mutex_lock(&clim->lock);
+	write_pending(clim);
+	pthread_mutex_unlock(&clim->lock);
+}
+
+void climate_sync(void *arg)
+{
+	struct climate *clim = (struct climate *)arg;
+
+	pthread_mutex_lock(&clim->lock);
+	write_pending(clim);
+	if (clim->fd >= 0 && fdatasync(clim->fd) != 0)
+		log_error("climate: fdatasync: %s", strerror(errno));
+	pthread_mutex_unlock(&clim->lock);
+}
+
+void climate_close(struct climate *clim)
+{
+	int series, unit;
+
+	write_pending(clim);
+	if (clim->fd >= 0) {
+		if (fdatasync(clim->fd) != 0)
+			log_error("climate: fdatasync: %s", strerror(errno));
+		(void) close(clim->fd);
+	}
+
+	for (series = 0; series < SERIES_MAX; series++) {
+		for (unit = 0; unit < CLIMATE_UNIT_MAX; unit++)
+			table_free(&clim->tables[series][unit]);
+	}
+	free(clim->pending);
+
+	pthread_mutex_destroy(&clim->lock);
+}
+
+void climate_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	struct climate *clim = (struct climate *)arg;
+	float values[SERIES_MAX_FIELDS];
+	struct climate_pending *pending;
+	struct climate_period *period;
+	size_t num_fields, f;
+	time_t t = reading->time;
+	int series, unit;
+
+	if ((series = series_of(reading)) < 0)
+		return;
+	num_fields = series_get_values(reading, values);
+
+	pthread_mutex_lock(&clim->lock);
+
+	for (unit = 0; unit < CLIMATE_UNIT_MAX; unit++) {
+		if (t < clim->cur[unit].start || t >= clim->cur[unit].end)
+			period_bounds(unit, t, &clim->cur[unit]);
+
+		period = find_period(&clim->tables[series][unit], clim->cur[unit].start, true);
+		for (f = 0; f < num_fields; f++)
+			agg_add(&period->agg[f], values[f], t);
+	}
+
+	pending = find_pending(clim, series, clim->cur[CLIMATE_DAY].start);
+	series_hwm_add(&pending->newest, t, 1);
+	for (f = 0; f < num_fields; f++) {
+		agg_add(&pending->day.agg[f], values[f], t);
+		agg_add(&clim->records[series][f], values[f], t);
+	}
+
+	if (clim->pending_since == 0)
+		clim->pending_since = t;
+	else if (t - clim->pending_since >= (time_t)clim->cfg.flush_interval)
+		write_pending(clim);
+
+	pthread_mutex_unlock(&clim->lock);
+}
+
+void climate_hwm(void *arg, int series, time_t since, struct series_hwm *hwm)
+{
+	(void) since;
+	struct climate *clim = (struct climate *)arg;
+
+	pthread_mutex_lock(&clim->lock);
+	*hwm = clim->hwm[series];
+	pthread_mutex_unlock(&clim->lock);
+}
+
+int climate_get(struct climate *clim, int series, enum climate_unit unit,
+	time_t time, struct climate_period *period)
+{
+	struct climate_period *found;
+	struct climate_bounds b;
+
+	period_bounds(unit, time, &b);
+
+	pthread_mutex_lock(&clim->lock);
+	if ((found = find_period(&clim->tables[series][unit], b.start, false)) != NULL)
+		*period = *found;
+	pthread_mutex_unlock(&clim->lock);
+
+	return found != NULL ? 0 : -1;
+}
+
+/*
+ * Server interface.
+ */
+
+static void print_agg(struct strbuf *out, struct climate_agg *agg)
+{
+	strbuf_printf(out, "min=%.1f\tmin_time=%u\tmax=%.1f\tmax_time=%u\t"
+		"avg=%.1f\tcount=%u\n", agg->min, agg->min_time, agg->max,
+		agg->max_time, agg->sum / agg->count, agg->count);
+}
+
+/*
+ * Rain which fell during the @i-th period of rain summaries @table, from
+ * the rain counter. The counter at the end of the previous period is
+ * used if it's adjacent, so that no rain is lost between the periods.
+ */
+static float rain_total(struct climate_table *table, enum climate_unit unit, size_t i)
+{
+	struct climate_agg *agg = &table->periods[i].agg[RAIN_TOTAL_FIELD];
+	struct climate_agg *prev;
+	struct climate_bounds b;
+
+	if (i > 0) {
+		prev = &table->periods[i - 1].agg[RAIN_TOTAL_FIELD];
+		period_bounds(unit, table->periods[i - 1].start, &b);
+		/* the counter might have been reset meanwhile */
+		if (b.end == table->periods[i].start && prev->count > 0
+			&& agg->max >= prev->max)
+			return agg->max - prev->max;
+	}
+
+	return agg->max - agg->min;
+}
+
+static int unit_lookup(const char *name)
+{
+	int unit;
+
+	for (unit = 0; unit < CLIMATE_UNIT_MAX; unit++)
+		if (strcmp(unit_names[unit], name) == 0)
+			return unit;
+
+	return -1;
+}
+
+/*
+ * summary <day|month|year> <series> <from> <to>
+ */
+static void cmd_summary(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct climate *clim = (struct climate *)arg;
+	struct climate_table *table;
+	struct climate_period *period;
+	struct climate_bounds b;
+	time_t from, to;
+	int series, unit;
+	size_t i, f;
+
+	if (argc < 2 || (unit = unit_lookup(argv[1])) < 0) {
+		server_error(out, "Usage: summary <day|month|year> <series> <from> <to>");
+		return;
+	}
+
+	if (series_parse_args(argc - 1, argv + 1, false, &series, NULL, &from, &to, out) != 0)
+		return;
+
+	/* the period which contains @from is included */
+	period_bounds(unit, from, &b);
+
+	pthread_mutex_lock(&clim->lock);
+	table = &clim->tables[series][unit];
+	for (i = 0; i < table->count; i++) {
+		period = &table->periods[i];
+		if (period->start < b.start || period->start > to)
+			continue;
+
+		if (series == SERIES_RAIN && period->agg[RAIN_TOTAL_FIELD].count > 0)
+			strbuf_printf(out, "%li\ttotal\t%.1f\n", period->start,
+				rain_total(table, unit, i));
+
+		for (f = 0; f < series_num_fields(series); f++) {
+			if (period->agg[f].count == 0)
+				continue;
+			strbuf_printf(out, "%li\t%s\t", period->start,
+				series_field_name(series, f));
+			print_agg(out, &period->agg[f]);
+		}
+	}
+	pthread_mutex_unlock(&clim->lock);
+}
+
+/*
+ * records <series>
+ */
+static void cmd_records(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct climate *clim = (struct climate *)arg;
+	int series;
+	size_t f;
+
+	if (argc != 2) {
+		server_error(out, "Usage: records <series>");
+		return;
+	}
+
+	if ((series = series_lookup(argv[1])) < 0) {
+		server_error(out, "Unknown series '%s'", argv[1]);
+		return;
+	}
+
+	pthread_mutex_lock(&clim->lock);
+	for (f = 0; f < series_num_fields(series); f++) {
+		if (clim->records[series][f].count == 0)
+			continue;
+		strbuf_printf(out, "%s\t", series_field_name(series, f));
+		print_agg(out, &clim->records[series][f]);
+	}
+	pthread_mutex_unlock(&clim->lock);
+}
+
+void climate_serve(struct climate *clim, struct wmr_server *srv)
+{
+	server_register_command(srv, "summary", cmd_summary, clim);
+	server_register_command(srv, "records", cmd_records, clim);
+}
@@ -5,10 +5,14 @@
 #include "common.h"
 #include "log.h"
 
+#include <stdatomic.h>
 #include <stdlib.h>
 
+static atomic_uint_fast64_t num_allocs;		/* calls to realloc_safe */
+
 void *realloc_safe(void *x, size_t size)
 {
+	atomic_fetch_add_explicit(&num_allocs, 1, memory_order_relaxed);
 	x = realloc(x, size);
 	if (!x)
 		log_exit("Cannot allocate %zu bytes of memory", size);
@@ -19,3 +23,8 @@ void *malloc_safe(size_t size)
 {
 	return realloc_safe(NULL, size);
 }
+
+uint64_t alloc_count(void)
+{
+	return atomic_load_explicit(&num_allocs, memory_order_relaxed);
+}
@@ -0,0 +1,473 @@
+/*
+ * SVG graphs of series and a cache of them.
+ */
+
+#include "common.h"
+#include "graph.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <math.h>
+#include <string.h>
+
+#define	GRAPH_POINTS		360	/* steps (pixel columns) of a graph */
+#define	GRAPH_WIDTH		720
+#define	GRAPH_HEIGHT		240
+#define	MARGIN_LEFT		50
+#define	MARGIN_RIGHT		10
+#define	MARGIN_TOP		24
+#define	MARGIN_BOTTOM		24
+#define	PLOT_WIDTH		(GRAPH_WIDTH - MARGIN_LEFT - MARGIN_RIGHT)
+#define	PLOT_HEIGHT		(GRAPH_HEIGHT - MARGIN_TOP - MARGIN_BOTTOM)
+#define	Y_TICKS			4	/* horizontal grid lines, roughly */
+#define	MAX_LINES		2	/* lines of a graph */
+
+/*
+ * A line of a graph: a field, drawn as averages or maxima of the steps.
+ */
+struct line
+{
+	const char *field;		/* series field */
+	bool max;			/* draw the maxima rather than averages */
+	const char *color;		/* line color */
+};
+
+static const struct line temp_lines[] = {
+	{ "temp", false, "#d62728" },
+	{ "dew_point", false, "#1f77b4" },
+};
+
+static const struct line wind_lines[] = {
+	{ "avg_speed", false, "#2ca02c" },
+	{ "gust_speed", true, "#7f7f7f" },
+};
+
+static const struct line rain_lines[] = {
+	{ "rate", true, "#1f77b4" },
+};
+
+static const struct line baro_lines[] = {
+	{ "pressure", false, "#9467bd" },
+};
+
+static const struct line uvi_lines[] = {
+	{ "index", true, "#ff7f0e" },
+};
+
+static const struct
+{
+	const char *name;		/* name in requests */
+	time_t len;			/* length of the period */
+	time_t tick;			/* distance of time axis ticks */
+	const char *tick_fmt;		/* strftime format of tick labels */
+}
+periods[GRAPH_PERIOD_MAX] = {
+	[GRAPH_DAY] = { "day", 24 * 3600, 3 * 3600, "%H:%M" },
+	[GRAPH_WEEK] = { "week", 7 * 24 * 3600, 24 * 3600, "%a" },
+	[GRAPH_MONTH] = { "month", 30 * 24 * 3600, 5 * 24 * 3600, "%d %b" },
+};
+
+static const struct line *lines_of(int series, size_t *num_lines)
+{
+	switch (series) {
+	case SERIES_WIND:
+		*num_lines = ARRAY_SIZE(wind_lines);
+		return wind_lines;
+	case SERIES_RAIN:
+		*num_lines = ARRAY_SIZE(rain_lines);
+		return rain_lines;
+	case SERIES_UVI:
+		*num_lines = ARRAY_SIZE(uvi_lines);
+		return uvi_lines;
+	case SERIES_BARO:
+		*num_lines = ARRAY_SIZE(baro_lines);
+		return baro_lines;
+	}
+
+	*num_lines = ARRAY_SIZE(temp_lines);
+	return temp_lines;
+}
+
+static time_t period_step(enum graph_period period)
+{
+	return periods[period].len / GRAPH_POINTS;
+}
+
+/*
+ * End of the graph of @period drawn at @now, the end of the last
+ * complete step.
+ */
+static time_t period_end(enum graph_period period, time_t now)
+{
+	return now - now % period_step(period);
+}
+
+/*
+ * Aggregate @field of @series over GRAPH_POINTS steps of length @step
+ * starting at @from into @buckets. Steps the history store may not hold
+ * anymore are aggregated from the archive.
+ */
+static void collect(struct graph_cache *cache, int series, size_t field,
+	time_t from, time_t step, time_t now, struct series_agg *buckets)
+{
+	time_t hist_from = now - cache->hist->cfg.span;
+	size_t i = 0;
+
+	if (cache->arch != NULL) {
+		for (; i < GRAPH_POINTS && from + (time_t)i * step < hist_from; i++)
+			archive_aggregate(cache->arch, series, field,
+				from + i * step, from + (i + 1) * step, &buckets[i]);
+	}
+
+	if (i < GRAPH_POINTS)
+		(void) history_downsample(cache->hist, series, field, from + i * step,
+			from + GRAPH_POINTS * step, step, buckets + i, GRAPH_POINTS - i);
+}
+
+static float bucket_value(struct series_agg *agg, bool max)
+{
+	return max ? agg->max : agg->sum / agg->count;
+}
+
+/*
+ * Round @x up to 1, 2 or 5 times a power of ten.
+ */
+static double nice_step(double x)
+{
+	double p = pow(10, floor(log10(x)));
+
+	if (x <= p)
+		return p;
+	if (x <= 2 * p)
+		return 2 * p;
+	if (x <= 5 * p)
+		return 5 * p;
+	return 10 * p;
+}
+
+static void put_coord(struct strbuf *out, double x, double y)
+{
+	strbuf_put_fixed(out, x, 1);
+	strbuf_putc(out, ',');
+	strbuf_put_fixed(out, y, 1);
+	strbuf_putc(out, ' ');
+}
+
+/*
+ * Draw the time axis of [@from, @to) with ticks of @period, aligned
+ * to local time.
+ */
+static void draw_time_axis(enum graph_period period, time_t from, time_t to,
+	struct strbuf *out)
+{
+	time_t tick = periods[period].tick;
+	char label[32];
+	struct tm tm;
+	double x;
+	time_t t;
+
+	localtime_r(&from, &tm);
+	t = from + tm.tm_gmtoff;
+	t = t - t % tick + tick - tm.tm_gmtoff;
+
+	for (; t < to; t += tick) {
+		x = MARGIN_LEFT + (double)(t - from) / (to - from) * PLOT_WIDTH;
+		localtime_r(&t, &tm);
+		strftime(label, sizeof(label), periods[period].tick_fmt, &tm);
+
+		strbuf_puts(out, "<line class=\"grid\" x1=\"");
+		strbuf_put_fixed(out, x, 1);
+		strbuf_printf(out, "\" y1=\"%u\" x2=\"", MARGIN_TOP);
+		strbuf_put_fixed(out, x, 1);
+		strbuf_printf(out, "\" y2=\"%u\"/>\n", MARGIN_TOP + PLOT_HEIGHT);
+
+		strbuf_puts(out, "<text x=\"");
+		strbuf_put_fixed(out, x, 1);
+		strbuf_printf(out, "\" y=\"%u\" text-anchor=\"middle\">%s</text>\n",
+			GRAPH_HEIGHT - 8, label);
+	}
+}
+
+/*
+ * Draw the value axis from @ymin to @ymax with grid lines every @ystep.
+ */
+static void draw_value_axis(double ymin, double ymax, double ystep, struct strbuf *out)
+{
+	unsigned decimals = ystep >= 1 ? 0 : (ystep >= 0.1 ? 1 : 2);
+	double v, y;
+
+	for (v = ymin; v <= ymax + ystep / 2; v += ystep) {
+		y = MARGIN_TOP + (ymax - v) / (ymax - ymin) * PLOT_HEIGHT;
+
+		strbuf_printf(out, "<line class=\"grid\" x1=\"%u\" y1=\"", MARGIN_LEFT);
+		strbuf_put_fixed(out, y, 1);
+		strbuf_printf(out, "\" x2=\"%u\" y2=\"", MARGIN_LEFT + PLOT_WIDTH);
+		strbuf_put_fixed(out, y, 1);
+		strbuf_puts(out, "\"/>\n");
+
+		strbuf_printf(out, "<text x=\"%u\" y=\"", MARGIN_LEFT - 4);
+		strbuf_put_fixed(out, y + 4, 1);
+		strbuf_puts(out, "\" text-anchor=\"end\">");
+		strbuf_put_fixed(out, v, decimals);
+		strbuf_puts(out, "</text>\n");
+	}
+}
+
+/*
+ * Draw @line from @buckets. Steps without samples break the line.
+ */
+static void draw_line(const struct line *line, struct series_agg *buckets,
+	double ymin, double ymax, struct strbuf *out)
+{
+	bool open = false;
+	double x, y;
+	size_t i;
+
+	for (i = 0; i < GRAPH_POINTS; i++) {
+		if (buckets[i].count == 0) {
+			if (open)
+				strbuf_puts(out, "\"/>\n");
+			open = false;
+			continue;
+		}
+
+		if (!open)
+			strbuf_printf(out, "<polyline stroke=\"%s\" points=\"", line->color);
+		open = true;
+
+		x = MARGIN_LEFT + (i + 0.5) * PLOT_WIDTH / GRAPH_POINTS;
+		y = MARGIN_TOP + (ymax - bucket_value(&buckets[i], line->max))
+			/ (ymax - ymin) * PLOT_HEIGHT;
+		put_coord(out, x, y);
+	}
+
+	if (open)
+		strbuf_puts(out, "\"/>\n");
+}
+
+/*
+ * Draw the graph of @series over @period ending at @to.
+ */
+static void draw(struct graph_cache *cache, int series, enum graph_period period,
+	time_t to, time_t now, struct strbuf *out)
+{
+	struct series_agg buckets[MAX_LINES][GRAPH_POINTS];
+	time_t step = period_step(period);
+	time_t from = to - GRAPH_POINTS * step;
+	double vmin = INFINITY, vmax = -INFINITY;
+	double ymin, ymax, ystep;
+	const struct line *lines;
+	size_t num_lines, l, i;
+	int field;
+	float v;
+
+	lines = lines_of(series, &num_lines);
+	for (l = 0; l < num_lines; l++) {
+		field = series_field_lookup(series, lines[l].field);
+		collect(cache, series, field, from, step, now, buckets[l]);
+
+		for (i = 0; i < GRAPH_POINTS; i++) {
+			if (buckets[l][i].count == 0)
+				continue;
+			v = bucket_value(&buckets[l][i], lines[l].max);
+			vmin = MIN(vmin, v);
+			vmax = MAX(vmax, v);
+		}
+	}
+
+	if (vmin > vmax)
+		vmin = vmax = 0;
+	if (vmax - vmin < 1e-3) {
+		vmin -= 1;
+		vmax += 1;
+	}
+
+	ystep = nice_step((vmax - vmin) / Y_TICKS);
+	ymin = floor(vmin / ystep) * ystep;
+	ymax = ceil(vmax / ystep) * ystep;
+
+	strbuf_printf(out, "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+		"width=\"%u\" height=\"%u\" viewBox=\"0 0 %u %u\" "
+		"font-family=\"sans-serif\" font-size=\"11\">\n"
+		"<style>.grid { stroke: #ddd; } "
+		"polyline { fill: none; stroke-width: 1.5; }</style>\n"
+		"<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n",
+		GRAPH_WIDTH, GRAPH_HEIGHT, GRAPH_WIDTH, GRAPH_HEIGHT);
+
+	strbuf_printf(out, "<text x=\"%u\" y=\"16\" font-weight=\"bold\">%s, last %s</text>\n",
+		MARGIN_LEFT, series_name(series), periods[period].name);
+	for (l = 0; l < num_lines; l++)
+		strbuf_printf(out, "<text x=\"%zu\" y=\"16\" fill=\"%s\">%s</text>\n",
+			MARGIN_LEFT + 200 + 100 * l, lines[l].color, lines[l].field);
+
+	draw_value_axis(ymin, ymax, ystep, out);
+	draw_time_axis(period, from, to, out);
+	for (l = 0; l < num_lines; l++)
+		draw_line(&lines[l], buckets[l], ymin, ymax, out);
+
+	strbuf_printf(out, "<rect x=\"%u\" y=\"%u\" width=\"%u\" height=\"%u\" "
+		"fill=\"none\" stroke=\"#999\"/>\n</svg>\n",
+		MARGIN_LEFT, MARGIN_TOP, PLOT_WIDTH, PLOT_HEIGHT);
+}
+
+void graph_init(struct graph_cache *cache, struct history *hist, struct archive *arch)
+{
+	struct graph_entry *entry;
+	int s, p;
+
+	cache->hist = hist;
+	cache->arch = arch;
+
+	for (s = 0; s < SERIES_MAX; s++) {
+		for (p = 0; p < GRAPH_PERIOD_MAX; p++) {
+			entry = &cache->entries[s][p];
+			pthread_mutex_init(&entry->lock, NULL);
+			atomic_init(&entry->to, 0);
+			atomic_init(&entry->gen, 0);
+			entry->gen_drawn = 0;
+			strbuf_init(&entry->svg, 1);
+		}
+	}
+}
+
+void graph_free(struct graph_cache *cache)
+{
+	struct graph_entry *entry;
+	int s, p;
+
+	for (s = 0; s < SERIES_MAX; s++) {
+		for (p = 0; p < GRAPH_PERIOD_MAX; p++) {
+			entry = &cache->entries[s][p];
+			strbuf_free(&entry->svg);
+			pthread_mutex_destroy(&entry->lock);
+		}
+	}
+}
+
+void graph_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	struct graph_cache *cache = (struct graph_cache *)arg;
+	struct graph_entry *entry;
+	int series, p;
+
+	if ((series = series_of(reading)) < 0)
+		return;
+
+	/* live readings are past the graphs drawn, only late ones change them */
+	for (p = 0; p < GRAPH_PERIOD_MAX; p++) {
+		entry = &cache->entries[series][p];
+		if (reading->time < atomic_load(&entry->to))
+			atomic_fetch_add(&entry->gen, 1);
+	}
+}
+
+void graph_render(struct graph_cache *cache, int series, enum graph_period period,
+	time_t now, struct strbuf *out)
+{
+	draw(cache, series, period, period_end(period, now), now, out);
+}
+
+void graph_get(struct graph_cache *cache, int series, enum graph_period period,
+	struct strbuf *out)
+{
+	struct graph_entry *entry = &cache->entries[series][period];
+	time_t now = time(NULL);
+	time_t to = period_end(period, now);
+
+	pthread_mutex_lock(&entry->lock);
+	if (atomic_load(&entry->to) != to || atomic_load(&entry->gen) != entry->gen_drawn) {
+		/*
+		 * Publish the range before the data are read, so that readings
+		 * which arrive meanwhile invalidate the graph being drawn.
+		 */
+		atomic_store(&entry->to, to);
+		entry->gen_drawn = atomic_load(&entry->gen);
+
+		strbuf_reset(&entry->svg);
+		draw(cache, series, period, to, now, &entry->svg);
+		metrics_count(METRIC_GRAPHS_DRAWN, 1);
+	}
+	else {
+		metrics_count(METRIC_GRAPH_CACHE_HITS, 1);
+	}
+
+	strbuf_put(out, strbuf_get_string(&entry->svg), strbuf_strlen(&entry->svg));
+	pthread_mutex_unlock(&entry->lock);
+}
+
+/*
+ * Server interface.
+ */
+
+static int period_lookup(const char *name)
+{
+	int p;
+
+	for (p = 0; p < GRAPH_PERIOD_MAX; p++)
+		if (strcmp(periods[p].name, name) == 0)
+			return p;
+
+	return -1;
+}
+
+/*
+ * graph <series> <period>
+ */
+static void cmd_graph(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct graph_cache *cache = (struct graph_cache *)arg;
+	int series, period;
+
+	if (argc != 3) {
+		server_error(out, "Usage: graph <series> <day|week|month>");
+		return;
+	}
+
+	if ((series = series_lookup(argv[1])) < 0) {
+		server_error(out, "Unknown series '%s'", argv[1]);
+		return;
+	}
+
+	if ((period = period_lookup(argv[2])) < 0) {
+		server_error(out, "Unknown period '%s'", argv[2]);
+		return;
+	}
+
+	graph_get(cache, series, period, out);
+}
+
+/*
+ * /graph/<series>-<period>.svg
+ */
+static const char *page_graph(struct wmr_server *srv, const char *path,
+	struct strbuf *body, void *arg)
+{
+	(void) srv;
+	struct graph_cache *cache = (struct graph_cache *)arg;
+	char name[32], *dash, *ext;
+	int series, period;
+
+	if (strlen(path) >= sizeof(name))
+		return NULL;
+	strcpy(name, path);
+
+	if ((dash = strchr(name, '-')) == NULL || (ext = strchr(dash, '.')) == NULL
+		|| strcmp(ext, ".svg") != 0)
+		return NULL;
+	*dash = *ext = '\0';
+
+	if ((series = series_lookup(name)) < 0 || (period = period_lookup(dash + 1)) < 0)
+		return NULL;
+
+	graph_get(cache, series, period, body);
+	return "image/svg+xml";
+}
+
+void graph_serve(struct graph_cache *cache, struct wmr_server *srv)
+{
+	server_register_command(srv, "graph", cmd_graph, cache);
+	server_register_page(srv, "/graph/", page_graph, cache);
+}
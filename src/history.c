@@ -0,0 +1,354 @@
+/*
+ * In-memory full-resolution history of readings.
+ */
+
+#include "common.h"
+#include "history.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Number of samples a ring is allocated for when the first sample
+ * arrives. Rings grow by doubling up to cfg.capacity samples.
+ */
+#define	RING_INIT_SIZE		1024
+
+/*
+ * Maximum number of buckets a single downsample query may return.
+ */
+#define	MAX_BUCKETS		4096
+
+/*
+ * Physical index of @i-th oldest sample of @ring.
+ */
+static inline size_t ring_index(struct history_ring *ring, size_t i)
+{
+	size_t j = ring->first + i;
+	return j < ring->size ? j : j - ring->size;
+}
+
+static inline time_t ring_time(struct history_ring *ring, size_t i)
+{
+	return ring->time[ring_index(ring, i)];
+}
+
+static void ring_resize(struct history_ring *ring, size_t new_size)
+{
+	time_t *time;
+	float *values;
+	size_t f, i;
+
+	assert(new_size >= ring->count);
+
+	time = malloc_safe(new_size * sizeof(*time));
+	for (i = 0; i < ring->count; i++)
+		time[i] = ring_time(ring, i);
+	free(ring->time);
+	ring->time = time;
+
+	for (f = 0; f < ring->num_fields; f++) {
+		values = malloc_safe(new_size * sizeof(*values));
+		for (i = 0; i < ring->count; i++)
+			values[i] = ring->values[f][ring_index(ring, i)];
+		free(ring->values[f]);
+		ring->values[f] = values;
+	}
+
+	ring->first = 0;
+	ring->size = new_size;
+}
+
+static void ring_drop_oldest(struct history_ring *ring)
+{
+	assert(ring->count > 0);
+	ring->first = ring_index(ring, 1);
+	ring->count--;
+}
+
+/*
+ * Insert a sample into @ring. Readings are mostly delivered in order,
+ * but historic records may arrive late; such samples are moved back
+ * to keep the ring sorted by time.
+ */
+static void ring_insert(struct history_ring *ring, size_t capacity,
+	time_t time, float *values)
+{
+	size_t pos, src, dst;
+	size_t f;
+
+	if (ring->count == ring->size) {
+		if (ring->size < capacity) {
+			ring_resize(ring, MIN(MAX(2 * ring->size, RING_INIT_SIZE), capacity));
+		}
+		else {
+			if (time < ring_time(ring, 0))
+				return;
+			ring_drop_oldest(ring);
+		}
+	}
+
+	for (pos = ring->count; pos > 0 && ring_time(ring, pos - 1) > time; pos--) {
+		src = ring_index(ring, pos - 1);
+		dst = ring_index(ring, pos);
+		ring->time[dst] = ring->time[src];
+		for (f = 0; f < ring->num_fields; f++)
+			ring->values[f][dst] = ring->values[f][src];
+	}
+
+	dst = ring_index(ring, pos);
+	ring->time[dst] = time;
+	for (f = 0; f < ring->num_fields; f++)
+		ring->values[f][dst] = values[f];
+	ring->count++;
+}
+
+/*
+ * Logical index of the first sample of @ring not older than @time.
+ */
+static size_t ring_lower_bound(struct history_ring *ring, time_t time)
+{
+	size_t lo = 0, hi = ring->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ring_time(ring, mid) < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Aggregate logical samples [@i, @j) of @field into @agg. The samples
+ * are scanned as (at most) two contiguous runs of the column.
+ */
+static void agg_column(struct history_ring *ring, size_t field,
+	size_t i, size_t j, struct series_agg *agg)
+{
+	float *col = ring->values[field];
+	size_t start, end, k;
+
+	while (i < j) {
+		start = ring_index(ring, i);
+		end = MIN(start + (j - i), ring->size);
+
+		for (k = start; k < end; k++) {
+			agg->min = MIN(agg->min, col[k]);
+			agg->max = MAX(agg->max, col[k]);
+			agg->sum += col[k];
+		}
+
+		agg->count += end - start;
+		i += end - start;
+	}
+}
+
+void history_init(struct history *hist, struct history_cfg *cfg)
+{
+	int s;
+
+	assert(cfg->capacity > 0);
+
+	hist->cfg = *cfg;
+	pthread_rwlock_init(&hist->lock, NULL);
+
+	for (s = 0; s < SERIES_MAX; s++) {
+		memset(&hist->ring[s], 0, sizeof(hist->ring[s]));
+		hist->ring[s].num_fields = series_num_fields(s);
+	}
+}
+
+void history_free(struct history *hist)
+{
+	size_t f;
+	int s;
+
+	for (s = 0; s < SERIES_MAX; s++) {
+		free(hist->ring[s].time);
+		for (f = 0; f < hist->ring[s].num_fields; f++)
+			free(hist->ring[s].values[f]);
+	}
+
+	pthread_rwlock_destroy(&hist->lock);
+}
+
+void history_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	struct history *hist = (struct history *)arg;
+	struct history_ring *ring;
+	float values[SERIES_MAX_FIELDS];
+	time_t newest;
+	int series;
+
+	if ((series = series_of(reading)) < 0)
+		return;
+
+	ring = &hist->ring[series];
+	(void) series_get_values(reading, values);
+
+	pthread_rwlock_wrlock(&hist->lock);
+	ring_insert(ring, hist->cfg.capacity, reading->time, values);
+
+	newest = ring_time(ring, ring->count - 1);
+	while (ring->count > 0 && ring_time(ring, 0) + (time_t)hist->cfg.span < newest)
+		ring_drop_oldest(ring);
+	pthread_rwlock_unlock(&hist->lock);
+}
+
+size_t history_range(struct history *hist, int series, time_t from, time_t to,
+	series_visit_t *visit, void *arg)
+{
+	struct history_ring *ring = &hist->ring[series];
+	float values[SERIES_MAX_FIELDS];
+	size_t i, j, k, f;
+
+	pthread_rwlock_rdlock(&hist->lock);
+
+	i = ring_lower_bound(ring, from);
+	j = ring_lower_bound(ring, to);
+
+	for (k = i; k < j; k++) {
+		for (f = 0; f < ring->num_fields; f++)
+			values[f] = ring->values[f][ring_index(ring, k)];
+		visit(ring_time(ring, k), values, ring->num_fields, arg);
+	}
+
+	pthread_rwlock_unlock(&hist->lock);
+	return j > i ? j - i : 0;
+}
+
+void history_aggregate(struct history *hist, int series, size_t field,
+	time_t from, time_t to, struct series_agg *agg)
+{
+	struct history_ring *ring = &hist->ring[series];
+
+	assert(field < ring->num_fields);
+	series_agg_reset(agg, from);
+
+	pthread_rwlock_rdlock(&hist->lock);
+	agg_column(ring, field, ring_lower_bound(ring, from),
+		ring_lower_bound(ring, to), agg);
+	pthread_rwlock_unlock(&hist->lock);
+}
+
+size_t history_downsample(struct history *hist, int series, size_t field,
+	time_t from, time_t to, time_t step,
+	struct series_agg *buckets, size_t num_buckets)
+{
+	struct history_ring *ring = &hist->ring[series];
+	size_t n, i, j;
+	time_t t, end;
+
+	assert(field < ring->num_fields);
+	assert(step > 0);
+
+	pthread_rwlock_rdlock(&hist->lock);
+
+	/* the distance to @to is taken unsigned, so that nothing overflows */
+	i = ring_lower_bound(ring, from);
+	for (n = 0, t = from; n < num_buckets && t < to; n++, t = end) {
+		if ((uint64_t)step >= (uint64_t)to - (uint64_t)t)
+			end = to;
+		else
+			end = t + step;
+
+		series_agg_reset(&buckets[n], t);
+		j = ring_lower_bound(ring, end);
+		agg_column(ring, field, i, j, &buckets[n]);
+		i = j;
+	}
+
+	pthread_rwlock_unlock(&hist->lock);
+	return n;
+}
+
+/*
+ * Server interface.
+ */
+
+/*
+ * range <series> <from> <to>
+ */
+static void cmd_range(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct history *hist = (struct history *)arg;
+	struct series_print_ctx ctx = { .out = out };
+	time_t from, to;
+
+	if (series_parse_args(argc, argv, false, &ctx.series, NULL, &from, &to, out) == 0)
+		(void) history_range(hist, ctx.series, from, to, series_print_sample, &ctx);
+}
+
+/*
+ * aggregate <series> <field> <from> <to>
+ */
+static void cmd_aggregate(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct history *hist = (struct history *)arg;
+	struct series_agg agg;
+	int series, field;
+	time_t from, to;
+
+	if (series_parse_args(argc, argv, true, &series, &field, &from, &to, out) != 0)
+		return;
+
+	history_aggregate(hist, series, field, from, to, &agg);
+	series_print_agg(out, &agg);
+}
+
+/*
+ * downsample <series> <field> <from> <to> <step>
+ */
+static void cmd_downsample(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	struct history *hist = (struct history *)arg;
+	struct series_agg *buckets;
+	size_t num_buckets, i;
+	int series, field;
+	time_t from, to;
+	char *end;
+	long step;
+
+	if (series_parse_args(argc, argv, true, &series, &field, &from, &to, out) != 0)
+		return;
+
+	if (argc < 6) {
+		server_error(out, "Invalid step");
+		return;
+	}
+
+	errno = 0;
+	step = strtol(argv[5], &end, 10);
+	if (errno != 0 || *end != '\0' || end == argv[5] || step <= 0
+		|| (from < to && (uint64_t)step > (uint64_t)to - (uint64_t)from)) {
+		server_error(out, "Invalid step");
+		return;
+	}
+
+	buckets = malloc_safe(MAX_BUCKETS * sizeof(*buckets));
+	num_buckets = history_downsample(hist, series, field, from, to, step,
+		buckets, MAX_BUCKETS);
+	for (i = 0; i < num_buckets; i++)
+		series_print_agg(out, &buckets[i]);
+	free(buckets);
+}
+
+void history_serve(struct history *hist, struct wmr_server *srv)
+{
+	server_register_command(srv, "range", cmd_range, hist);
+	server_register_command(srv, "aggregate", cmd_aggregate, hist);
+	server_register_command(srv, "downsample", cmd_downsample, hist);
+}
@@ -0,0 +1,178 @@
+/*
+ * Hotplug events of USB devices from kernel uevents.
+ */
+
+#include "hotplug.h"
+#include "log.h"
+
+#include <errno.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define	UEVENT_MAX_LEN		8192
+#define	UEVENT_GROUP_KERNEL	1	/* multicast group of kernel uevents */
+
+/*
+ * Fields of a uevent the listener is interested in.
+ */
+struct uevent
+{
+	const char *action;
+	const char *subsystem;
+	const char *devtype;
+	const char *product;	/* "<vendor>/<product>/<bcdDevice>" in hex */
+};
+
+/*
+ * Parse uevent @msg of length @len. A uevent is a "<action>@<devpath>"
+ * header followed by "<key>=<value>" pairs, all NUL-terminated.
+ *
+ * Return value:
+ *	Zero on success, -1 if @msg is not a kernel uevent.
+ */
+static int parse_uevent(char *msg, size_t len, struct uevent *ev)
+{
+	char *p, *end = msg + len;
+
+	memset(ev, 0, sizeof(*ev));
+	if (len == 0 || msg[len - 1] != '\0' || strchr(msg, '@') == NULL)
+		return -1;
+
+	for (p = msg + strlen(msg) + 1; p < end; p += strlen(p) + 1) {
+		if (strncmp(p, "ACTION=", 7) == 0)
+			ev->action = p + 7;
+		else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+			ev->subsystem = p + 10;
+		else if (strncmp(p, "DEVTYPE=", 8) == 0)
+			ev->devtype = p + 8;
+		else if (strncmp(p, "PRODUCT=", 8) == 0)
+			ev->product = p + 8;
+	}
+
+	return ev->action && ev->subsystem ? 0 : -1;
+}
+
+static bool is_device(struct hotplug *hp, struct uevent *ev)
+{
+	unsigned vendor, product;
+
+	if (strcmp(ev->subsystem, "usb") != 0 || ev->product == NULL)
+		return false;
+
+	if (sscanf(ev->product, "%x/%x/", &vendor, &product) != 2)
+		return false;
+
+	return vendor == hp->vendor && product == hp->product;
+}
+
+static void handle_uevent(struct hotplug *hp, char *msg, size_t len)
+{
+	struct uevent ev;
+
+	if (parse_uevent(msg, len, &ev) != 0 || !is_device(hp, &ev) || ev.devtype == NULL)
+		return;
+
+	if (strcmp(ev.action, "bind") == 0 && strcmp(ev.devtype, "usb_interface") == 0) {
+		log_debug("hotplug: device %04x:%04x added", hp->vendor, hp->product);
+		hp->handler(HOTPLUG_ADD, hp->arg);
+	}
+	else if (strcmp(ev.action, "remove") == 0 && strcmp(ev.devtype, "usb_device") == 0) {
+		log_debug("hotplug: device %04x:%04x removed", hp->vendor, hp->product);
+		hp->handler(HOTPLUG_REMOVE, hp->arg);
+	}
+}
+
+static void *listener_pthread(void *arg)
+{
+	struct hotplug *hp = (struct hotplug *)arg;
+	char msg[UEVENT_MAX_LEN];
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	ssize_t len;
+
+	while (1) {
+		addr_len = sizeof(addr);
+		len = recvfrom(hp->fd, msg, sizeof(msg), 0,
+			hp->netlink ? (struct sockaddr *)&addr : NULL,
+			hp->netlink ? &addr_len : NULL);
+
+		if (len < 0) {
+			if (errno == EINTR || errno == ENOBUFS)
+				continue;
+			log_error("hotplug: recv: %s", strerror(errno));
+			break;
+		}
+
+		/* only trust the kernel */
+		if (hp->netlink && addr.nl_pid != 0)
+			continue;
+
+		handle_uevent(hp, msg, len);
+	}
+
+	return NULL;
+}
+
+static int start_listener(struct hotplug *hp, int fd, bool netlink,
+	uint16_t vendor, uint16_t product, hotplug_handler_t *handler, void *arg)
+{
+	hp->fd = fd;
+	hp->netlink = netlink;
+	hp->vendor = vendor;
+	hp->product = product;
+	hp->handler = handler;
+	hp->arg = arg;
+
+	if (pthread_create(&hp->thread, NULL, listener_pthread, hp) != 0) {
+		log_error("hotplug: cannot start listener thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+int hotplug_open(struct hotplug *hp, uint16_t vendor, uint16_t product,
+	hotplug_handler_t *handler, void *arg)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = UEVENT_GROUP_KERNEL,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd == -1) {
+		log_error("hotplug: socket: %s", strerror(errno));
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		log_error("hotplug: bind: %s", strerror(errno));
+		goto out_close;
+	}
+
+	if (start_listener(hp, fd, true, vendor, product, handler, arg) != 0)
+		goto out_close;
+
+	return 0;
+
+out_close:
+	(void) close(fd);
+	return -1;
+}
+
+int hotplug_open_fd(struct hotplug *hp, int fd, uint16_t vendor, uint16_t product,
+	hotplug_handler_t *handler, void *arg)
+{
+	return start_listener(hp, fd, false, vendor, product, handler, arg);
+}
+
+void hotplug_close(struct hotplug *hp)
+{
+	pthread_cancel(hp->thread);
+	pthread_join(hp->thread, NULL);
+	(void) close(hp->fd);
+}
@@ -0,0 +1,76 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Admission control configuration.
+ */
+struct admit_cfg
+{
+	unsigned rate;			/* connections per second per address, 0 = no limit */
+	unsigned burst;			/* connections per address at once */
+	unsigned max_conns;		/* concurrent connections */
+	unsigned priority_conns;	/* extra connections for priority clients */
+};
+
+/*
+ * Outcome of admission control.
+ */
+enum admit_verdict
+{
+	ADMIT_OK,			/* connection admitted */
+	ADMIT_RATE_LIMITED,		/* address exceeded its rate */
+	ADMIT_OVERLOADED,		/* too many connections being handled */
+};
+
+struct admit_bucket;
+
+/*
+ * Admission control of server connections.
+ *
+ * Every source address has a token bucket which is refilled at @cfg.rate
+ * tokens per second up to @cfg.burst tokens, and a connection takes one
+ * token. IPv6 addresses share a bucket per /64 network, which is what
+ * a single host is usually given. Buckets are kept in a fixed-size table;
+ * when it's full, the least recently used bucket of the few candidates is
+ * reused, as a full bucket is as good as none.
+ *
+ * Besides that, at most @cfg.max_conns connections may be handled at once.
+ *
+ * Local clients (Unix socket or loopback) have priority: they are not
+ * rate limited and may use @cfg.priority_conns connections in excess of
+ * @cfg.max_conns, so they get served while the server is being hammered.
+ *
+ * The buckets are only ever touched by the thread which accepts the
+ * connections, so no locking is needed; connection slots are atomic, as
+ * they are released by the threads which handled the connections.
+ */
+struct admit
+{
+	struct admit_cfg cfg;		/* configuration */
+	struct admit_bucket *buckets;	/* token buckets */
+	atomic_uint num_conns;		/* connections being handled */
+};
+
+void admit_init(struct admit *adm, struct admit_cfg *cfg);
+void admit_free(struct admit *adm);
+
+/*
+ * Decide whether to admit a connection from @addr (any address family).
+ * If @slot is true, the connection takes one of the concurrent connection
+ * slots if admitted, which has to be returned with admit_release. Rejected
+ * connections are counted in metrics.
+ */
+enum admit_verdict admit_connection(struct admit *adm, const struct sockaddr *addr,
+	bool slot);
+
+/*
+ * Return a connection slot taken by admit_connection.
+ */
+void admit_release(struct admit *adm);
+
+#endif
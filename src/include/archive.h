@@ -0,0 +1,108 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "series.h"
+#include "server.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Maximum number of samples in an archive block.
+ */
+#define	ARCHIVE_BLOCK_MAX	256
+
+/*
+ * Archive logger configuration.
+ */
+struct archive_cfg
+{
+	char *root;		/* archive root directory */
+	unsigned block_len;	/* samples per block, at most ARCHIVE_BLOCK_MAX */
+	unsigned flush_interval;	/* max age of unwritten samples (seconds) */
+};
+
+/*
+ * Samples of a series not yet written to the archive, together with
+ * the partition file they belong to.
+ */
+struct archive_pending
+{
+	time_t day;			/* partition (start of UTC day), -1 if none */
+	int fd;				/* partition file, -1 if not open */
+	size_t count;			/* number of samples */
+	time_t time[ARCHIVE_BLOCK_MAX];	/* sample times */
+	float values[SERIES_MAX_FIELDS][ARCHIVE_BLOCK_MAX];	/* sample fields */
+};
+
+/*
+ * Full-resolution on-disk archive of numeric readings.
+ *
+ * Each series is stored in a directory of its own, one file per UTC day.
+ * Files consist of a header and a sequence of blocks. Every block holds
+ * up to ARCHIVE_BLOCK_MAX samples in columns: delta-of-delta encoded
+ * timestamps followed by XOR-compressed fields. Block headers carry
+ * per-field min/max/sum and the sample count, so that range queries can
+ * skip or summarize whole blocks without decompressing them.
+ */
+struct archive
+{
+	struct archive_cfg cfg;
+	pthread_mutex_t lock;			/* protects pending samples */
+	struct archive_pending pending[SERIES_MAX];	/* per-series pending samples */
+	uint8_t *scratch;			/* block encoding buffer */
+};
+
+void archive_init(struct archive *arch, struct archive_cfg *cfg);
+
+/*
+ * Write all pending samples and release resources held by @arch.
+ */
+void archive_free(struct archive *arch);
+
+/*
+ * Logger which appends @reading to the archive @arg.
+ */
+void archive_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+/*
+ * High-water mark of archived samples of @series (see series_hwm_t), @arg
+ * is the archive. Samples not yet written count too, so it has to be used
+ * before readings of @series are logged.
+ */
+void archive_hwm(void *arg, int series, time_t since, struct series_hwm *hwm);
+
+/*
+ * Write all pending samples to disk.
+ */
+void archive_flush(struct archive *arch);
+
+/*
+ * Write all pending samples of the archive @arg to disk and sync the
+ * partitions they were written to (see wal_sync_t).
+ */
+void archive_sync(void *arg);
+
+/*
+ * Call @visit for each archived sample of @series with time in [@from, @to).
+ * Samples are visited block by block, in the order they were archived.
+ * Return the number of samples visited.
+ */
+size_t archive_range(struct archive *arch, int series, time_t from, time_t to,
+	series_visit_t *visit, void *arg);
+
+/*
+ * Aggregate @field of @series over [@from, @to) into @agg. Blocks which
+ * lie in the range completely are summarized from their headers.
+ */
+void archive_aggregate(struct archive *arch, int series, size_t field,
+	time_t from, time_t to, struct series_agg *agg);
+
+/*
+ * Make the archive queryable through @srv.
+ */
+void archive_serve(struct archive *arch, struct wmr_server *srv);
+
+#endif
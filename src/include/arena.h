@@ -0,0 +1,73 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Arena allocator for transient buffers. Memory is carved out of large
+ * chunks and released all at once by returning to a previously saved
+ * position, so that a code path which runs over and over again (such as
+ * handling of a packet or a request) allocates from the system only
+ * until the chunks are large enough. Chunks are kept until the arena is
+ * freed.
+ *
+ * An arena must only be used by a single thread.
+ */
+struct arena
+{
+	struct arena_chunk *chunks;	/* linked list of chunks, current first */
+	struct arena_chunk *current;	/* chunk allocations are made from */
+	size_t pos;			/* position in @current */
+	size_t chunk_size;		/* default size of a chunk */
+};
+
+/*
+ * Position in an arena, see arena_save.
+ */
+struct arena_mark
+{
+	struct arena_chunk *chunk;
+	size_t pos;
+};
+
+void arena_init(struct arena *arena, size_t chunk_size);
+void arena_free(struct arena *arena);
+
+/*
+ * Allocate @size bytes from @arena. The memory is suitably aligned for
+ * any object and remains valid until the arena is reset past it.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Save the current position of @arena, or return to position @mark,
+ * releasing everything allocated since.
+ */
+struct arena_mark arena_save(struct arena *arena);
+void arena_reset(struct arena *arena, struct arena_mark mark);
+
+/*
+ * Arena of the calling thread. The arena is created on first use and
+ * freed when the thread exits.
+ */
+struct arena *arena_thread(void);
+
+/*
+ * Pool of objects of a fixed size. Objects are allocated from an arena of
+ * the pool and are recycled when put back, never freed before the pool.
+ *
+ * A pool must only be used by a single thread.
+ */
+struct pool
+{
+	struct arena arena;		/* memory of the objects */
+	size_t obj_size;		/* size of an object */
+	void *free_list;		/* objects put back */
+};
+
+void pool_init(struct pool *pool, size_t obj_size, size_t objs_per_chunk);
+void pool_free(struct pool *pool);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *obj);
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef CLIMATE_H
+#define CLIMATE_H
+
+#include "series.h"
+#include "server.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Calendar summaries configuration.
+ */
+struct climate_cfg
+{
+	char *path;			/* summary file, NULL if not persisted */
+	unsigned flush_interval;	/* max age of unwritten summaries (seconds) */
+};
+
+/*
+ * Calendar units summaries are kept for. Periods are aligned to local time.
+ */
+enum climate_unit
+{
+	CLIMATE_DAY,
+	CLIMATE_MONTH,
+	CLIMATE_YEAR,
+	CLIMATE_UNIT_MAX
+};
+
+/*
+ * Summary of a field over a period. Unlike struct series_agg, it tells
+ * when the extremes occurred. The layout is part of the file format.
+ */
+struct climate_agg
+{
+	float min;			/* minimum value */
+	float max;			/* maximum value */
+	uint32_t min_time;		/* time of the minimum (UNIX time) */
+	uint32_t max_time;		/* time of the maximum (UNIX time) */
+	double sum;			/* sum of the values */
+	uint32_t count;			/* number of samples, zero if none */
+	uint32_t reserved;
+};
+
+/*
+ * Summaries of all fields of a series over a period.
+ */
+struct climate_period
+{
+	time_t start;			/* start of the period */
+	struct climate_agg agg[SERIES_MAX_FIELDS];	/* per-field summaries */
+};
+
+/*
+ * Periods of a series, sorted by start.
+ */
+struct climate_table
+{
+	struct climate_period *periods;	/* the periods */
+	size_t count;			/* number of periods */
+	size_t size;			/* allocated size */
+};
+
+/*
+ * Summary of a series over a day which is to be written to the file.
+ */
+struct climate_pending
+{
+	int series;			/* the series */
+	struct climate_period day;	/* readings of the day logged since open */
+	struct series_hwm newest;	/* newest of those readings */
+	off_t off;			/* offset of its entry, -1 if not written yet */
+};
+
+/*
+ * Start and end of a period, see period_bounds.
+ */
+struct climate_bounds
+{
+	time_t start;			/* start of the period */
+	time_t end;			/* start of the next period */
+};
+
+/*
+ * Daily, monthly and yearly summaries and all-time records of all series,
+ * maintained incrementally as readings are logged, so that summaries are
+ * looked up rather than computed from archives.
+ *
+ * Only daily summaries are persisted; the others are derived from them
+ * when the summary file is loaded. Readings logged since the file was
+ * loaded are written as partial summaries of their days, which are merged
+ * when the file is loaded. The partial summary of the current day is
+ * rewritten in place as readings come in, days which are over are left
+ * alone and late readings of them get new entries, so the file grows by
+ * about an entry per day and series. Entries are checksummed and the file
+ * is synced once a day is over and on close. The file is compacted to a
+ * single entry per day and series on every load.
+ */
+struct climate
+{
+	struct climate_cfg cfg;
+	pthread_mutex_t lock;		/* protects the fields below */
+	int fd;				/* summary file, -1 if not persisted */
+	off_t size;			/* size of the summary file */
+	struct climate_table tables[SERIES_MAX][CLIMATE_UNIT_MAX];	/* summaries */
+	struct climate_agg records[SERIES_MAX][SERIES_MAX_FIELDS];	/* all-time */
+	struct series_hwm hwm[SERIES_MAX];	/* newest readings loaded from the file */
+	struct climate_pending *pending;	/* daily summaries to be written */
+	size_t num_pending;		/* number of @pending summaries */
+	size_t pending_size;		/* allocated size of @pending */
+	time_t pending_since;		/* time of the oldest unwritten reading, 0 if none */
+	struct climate_bounds cur[CLIMATE_UNIT_MAX];	/* periods of the last reading */
+};
+
+/*
+ * Initialize @clim and load the summaries from @cfg->path, if not NULL,
+ * creating the file if necessary.
+ *
+ * Return value:
+ *	Zero on success. If the summary file cannot be used, -1 is returned;
+ *	@clim is usable, but summaries are not persisted.
+ */
+int climate_open(struct climate *clim, struct climate_cfg *cfg);
+
+/*
+ * Write unwritten summaries and release resources held by @clim.
+ */
+void climate_close(struct climate *clim);
+
+/*
+ * Logger which adds @reading to the summaries @arg.
+ */
+void climate_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+/*
+ * High-water mark of readings of @series in the summary file, as it was
+ * loaded (see series_hwm_t). @arg is the summaries.
+ */
+void climate_hwm(void *arg, int series, time_t since, struct series_hwm *hwm);
+
+/*
+ * Write unwritten summaries to the summary file.
+ */
+void climate_flush(struct climate *clim);
+
+/*
+ * Write unwritten summaries of @arg to the summary file and sync it (see
+ * wal_sync_t).
+ */
+void climate_sync(void *arg);
+
+/*
+ * Copy the summary of @series over the @unit which contains @time into
+ * @period.
+ *
+ * Return value:
+ *	Zero on success, -1 if there are no readings of the period.
+ */
+int climate_get(struct climate *clim, int series, enum climate_unit unit,
+	time_t time, struct climate_period *period);
+
+/*
+ * Register the "summary" and "records" commands with @srv.
+ */
+void climate_serve(struct climate *clim, struct wmr_server *srv);
+
+#endif
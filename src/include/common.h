@@ -38,4 +38,9 @@ typedef uint64_t		ulong_t;
 void *malloc_safe(size_t size);
 void *realloc_safe(void *x, size_t size);
 
+/*
+ * Number of allocations made by malloc_safe and realloc_safe so far.
+ */
+uint64_t alloc_count(void);
+
 #endif
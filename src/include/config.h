@@ -1,8 +1,15 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "archive.h"
+#include "climate.h"
+#include "history.h"
+#include "log.h"
+#include "order.h"
 #include "rrd-logger.h"
 #include "server.h"
+#include "stats.h"
+#include "wal.h"
 #include <sys/types.h>
 
 /*
@@ -15,12 +22,23 @@ struct
 {
 	struct rrd_cfg rrd;		/* RRD logger configuration */
 	struct wmr_server_cfg srv;	/* WMR server configuration */
+	struct history_cfg history;	/* history store configuration */
+	struct stats_cfg stats;		/* rolling statistics configuration */
+	struct archive_cfg archive;	/* archive logger configuration */
+	struct climate_cfg climate;	/* calendar summaries configuration */
+	struct wal_cfg wal;		/* write-ahead log configuration */
+	struct order_cfg order;		/* ordering stage configuration */
 	unsigned reconnect_default;	/* default reconnection interval */
 	unsigned reconnect_max;		/* maximum reconnection interval */
+	unsigned plug_retries;		/* quick attempts after a plug event */
+	unsigned plug_retry_interval;	/* time between quick attempts (ms) */
 	mode_t umask;			/* umask to be set */
 	char *user;			/* setuid user name */
 	char *group;			/* setgid user name */
 	char *chdir;			/* directory to chroot to */
+	char *trace_path;		/* flight recorder dump file */
+	char *latest_path;		/* latest data state file */
+	int log_level;			/* least important priority logged */
 	uid_t uid;			/* uid obtained from user name */
 	gid_t gid;			/* gid obtained from group name */
 } cfg = {
@@ -31,16 +49,60 @@ struct
 		.uvi_rrd = "uvi.rrd",
 		.baro_rrd = "baro.rrd",
 		.temp_N_rrd = "temp%i.rrd",
+		.num_writers = 4,
 	},
 	.srv = {
 		.port = 20892,
+		.query_port = 20893,
+		.unix_path = "meteod.sock",
+		.admit = {
+			.rate = 5,
+			.burst = 20,
+			.max_conns = 64,
+			.priority_conns = 16,
+		},
+	},
+	.history = {
+		.span = 7 * 24 * 3600,
+		.capacity = 7 * 24 * 3600 / 2,
+	},
+	.stats = {
+		.windows = { 3600, 24 * 3600 },
+	},
+	.archive = {
+		.root = "/var/meteod/archive",
+		.block_len = 256,
+		.flush_interval = 3600,
+	},
+	.climate = {
+		.path = "meteod.climate",
+		.flush_interval = 600,
+	},
+	.wal = {
+		.path = "meteod.wal",
+		.commit_interval = 200,
+		.commit_count = 256,
+		.max_size = 1 << 20,
+		/* as often as the archive writes blocks anyway */
+		.checkpoint_interval = 3600,
+	},
+	.order = {
+		.path = "meteod.hwm",
+		.window = 8,
+		.sync_interval = 10,
+		.max_skew = 6 * 3600,
 	},
 	.reconnect_default = 1,
 	.reconnect_max = 300,
+	.plug_retries = 10,
+	.plug_retry_interval = 200,
 	.umask = 0227,
 	.user = "meteod",
 	.group = "meteod",
-	.chdir = "/var/meteod"
+	.chdir = "/var/meteod",
+	.trace_path = "meteod.trace",
+	.latest_path = "meteod.latest",
+	.log_level = LOG_INFO,
 };
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "archive.h"
+#include "history.h"
+#include "series.h"
+#include "server.h"
+#include "strbuf.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*
+ * Time periods graphs are drawn for.
+ */
+enum graph_period
+{
+	GRAPH_DAY,
+	GRAPH_WEEK,
+	GRAPH_MONTH,
+	GRAPH_PERIOD_MAX
+};
+
+/*
+ * A cached graph.
+ */
+struct graph_entry
+{
+	pthread_mutex_t lock;		/* serializes rendering, protects @svg */
+	atomic_llong to;		/* end of the range drawn, 0 if none */
+	atomic_uint_fast64_t gen;	/* bumped when data of the range changes */
+	uint64_t gen_drawn;		/* @gen when the graph was drawn */
+	struct strbuf svg;		/* the graph */
+};
+
+/*
+ * SVG graphs of series, and a cache of them.
+ *
+ * A graph shows a period which ends with the last complete step of the
+ * graph (a pixel column), so readings which are just coming in do not
+ * change it. Graphs are cached until the period moves on by a step or
+ * a reading which falls into the period drawn arrives (such as historic
+ * data), so most requests are served from the cache.
+ *
+ * Recent data come from @hist, older data from @arch if there's any.
+ */
+struct graph_cache
+{
+	struct history *hist;		/* recent data */
+	struct archive *arch;		/* older data, or NULL */
+	struct graph_entry entries[SERIES_MAX][GRAPH_PERIOD_MAX];
+};
+
+void graph_init(struct graph_cache *cache, struct history *hist, struct archive *arch);
+void graph_free(struct graph_cache *cache);
+
+/*
+ * Logger which invalidates cached graphs of the series of @reading.
+ */
+void graph_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+/*
+ * Draw the graph of @series over @period ending at @now into @out,
+ * bypassing the cache.
+ */
+void graph_render(struct graph_cache *cache, int series, enum graph_period period,
+	time_t now, struct strbuf *out);
+
+/*
+ * Append the graph of @series over @period to @out, drawing it only if
+ * the cached one is out of date.
+ */
+void graph_get(struct graph_cache *cache, int series, enum graph_period period,
+	struct strbuf *out);
+
+/*
+ * Make the graphs available through @srv, as the "graph" command and
+ * over HTTP as /graph/<series>-<period>.svg.
+ */
+void graph_serve(struct graph_cache *cache, struct wmr_server *srv);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "series.h"
+#include "server.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * History store configuration.
+ */
+struct history_cfg
+{
+	unsigned span;		/* how long readings are kept (seconds) */
+	size_t capacity;	/* maximum number of samples kept per series */
+};
+
+/*
+ * Full-resolution history of a single series. Samples are held in
+ * a ring buffer, column by column: timestamps are in one array and
+ * each field is in an array of its own. Samples are kept sorted by
+ * time, the oldest one being at index @first.
+ */
+struct history_ring
+{
+	time_t *time;				/* sample times */
+	float *values[SERIES_MAX_FIELDS];	/* sample fields */
+	size_t num_fields;			/* number of fields */
+	size_t size;				/* allocated number of samples */
+	size_t first;				/* index of the oldest sample */
+	size_t count;				/* number of samples */
+};
+
+/*
+ * In-memory history of all numeric readings.
+ */
+struct history
+{
+	struct history_cfg cfg;
+	pthread_rwlock_t lock;			/* protects the rings */
+	struct history_ring ring[SERIES_MAX];	/* one ring per series */
+};
+
+void history_init(struct history *hist, struct history_cfg *cfg);
+void history_free(struct history *hist);
+
+/*
+ * Logger which stores @reading in the history store @arg.
+ */
+void history_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+/*
+ * Call @visit for each sample of @series with time in [@from, @to),
+ * in chronological order. Return the number of samples visited.
+ *
+ * NOTE: @visit is called with the store locked for reading, it must
+ *       not call back into the store.
+ */
+size_t history_range(struct history *hist, int series, time_t from, time_t to,
+	series_visit_t *visit, void *arg);
+
+/*
+ * Aggregate @field of @series over [@from, @to) into @agg.
+ */
+void history_aggregate(struct history *hist, int series, size_t field,
+	time_t from, time_t to, struct series_agg *agg);
+
+/*
+ * Split [@from, @to) into intervals of length @step and aggregate @field
+ * of @series over each of them. At most @num_buckets buckets are filled.
+ * Return the number of buckets filled (including empty ones).
+ */
+size_t history_downsample(struct history *hist, int series, size_t field,
+	time_t from, time_t to, time_t step,
+	struct series_agg *buckets, size_t num_buckets);
+
+/*
+ * Make the store queryable through @srv.
+ */
+void history_serve(struct history *hist, struct wmr_server *srv);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Hotplug event of the watched USB device.
+ */
+enum hotplug_event
+{
+	HOTPLUG_ADD,		/* device plugged in and bound to a driver */
+	HOTPLUG_REMOVE,		/* device unplugged */
+};
+
+/*
+ * Hotplug handler prototype. Handlers are called from the listener thread.
+ */
+typedef void hotplug_handler_t(enum hotplug_event event, void *arg);
+
+/*
+ * Listener of hotplug events of a USB device.
+ *
+ * Kernel uevents are received from a netlink socket. The device is ready
+ * to be opened only once its interface is bound to a driver, so an add
+ * event is reported on the "bind" uevent of an interface of the device
+ * (Linux 4.14 and newer), and a remove event on the "remove" uevent of
+ * the device itself.
+ *
+ * Kernel uevents come before udev has processed them, so the device node
+ * may not have its permissions (such as the ones set by 90-wmr200.rules)
+ * yet when an add event is reported. Opening it may take a few attempts.
+ */
+struct hotplug
+{
+	int fd;				/* socket uevents are received from */
+	bool netlink;			/* @fd is a netlink socket */
+	uint16_t vendor;		/* vendor ID of the device */
+	uint16_t product;		/* product ID of the device */
+	hotplug_handler_t *handler;	/* event handler */
+	void *arg;			/* argument to @handler */
+	pthread_t thread;		/* listener thread */
+};
+
+/*
+ * Start listening for kernel uevents of USB device @vendor:@product.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+int hotplug_open(struct hotplug *hp, uint16_t vendor, uint16_t product,
+	hotplug_handler_t *handler, void *arg);
+
+/*
+ * Like hotplug_open, but receive uevents from datagram socket @fd instead
+ * of the kernel, one uevent per datagram in the format used by the kernel.
+ * This allows for fake uevent sources. @fd is closed by hotplug_close.
+ */
+int hotplug_open_fd(struct hotplug *hp, int fd, uint16_t vendor, uint16_t product,
+	hotplug_handler_t *handler, void *arg);
+
+/*
+ * Stop listening.
+ */
+void hotplug_close(struct hotplug *hp);
+
+#endif
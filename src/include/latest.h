@@ -0,0 +1,71 @@
+#ifndef LATEST_H
+#define LATEST_H
+
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+struct latest_file;
+
+/*
+ * Latest data, i.e. the latest reading of every source.
+ *
+ * The latest data is held independently of the connection to the station,
+ * so that it can be served while the daemon is (re)connecting. Readings
+ * which were not received over the current connection, either because
+ * they were restored from the state file or because the connection was
+ * lost since, are stale (see @stale).
+ *
+ * Readings are held as records (see struct wmr_record). If a state file
+ * is used, it is mapped to memory and the records are kept in the file,
+ * so they survive the daemon (though not the system) crashing at no extra
+ * cost. Meta-readings are not persisted. Updates are thread-safe.
+ */
+struct latest
+{
+	pthread_mutex_t lock;		/* protects the fields below */
+	struct latest_file *file;	/* latest readings, mapped state file or not */
+	bool mapped;			/* @file is the mapped state file */
+	struct wmr_reading meta;	/* latest meta-reading */
+	uint_t stale;			/* stale sources, see WMR_SRC_BIT */
+};
+
+/*
+ * Initialize @latest and restore the readings from state file @path, if
+ * not NULL, creating the file if necessary. Restored readings are stale.
+ *
+ * Return value:
+ *	Zero on success. If the state file cannot be used, -1 is returned;
+ *	@latest is usable, but readings are not persisted.
+ */
+int latest_open(struct latest *latest, const char *path);
+
+/*
+ * Write the state file and close it.
+ */
+void latest_close(struct latest *latest);
+
+/*
+ * Assign @reading the next sequence number and update the latest reading
+ * of its source, unless the current one is newer.
+ *
+ * Sequence numbers are global and persisted in the state file, so they
+ * keep increasing across restarts. As every reading received passes this
+ * function before it's passed on, they identify readings in the order
+ * they were received.
+ */
+void latest_update(struct latest *latest, struct wmr_reading *reading);
+
+/*
+ * Copy the latest readings into @data. A reading has changed since
+ * a previous call if its sequence number is greater.
+ */
+void latest_get(struct latest *latest, struct wmr_latest_data *data);
+
+/*
+ * Mark all readings stale, such as when the connection is lost.
+ */
+void latest_mark_stale(struct latest *latest);
+
+#endif
@@ -11,21 +11,69 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdbool.h>
 #include <syslog.h>
 
+/*
+ * Least important priority compiled in. Messages of less important
+ * priorities are removed at compile time, arguments and all.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define	LOG_COMPILE_LEVEL	LOG_DEBUG
+#endif
 
-void log_open_syslog(void);
+/*
+ * Least important priority logged at run time, see log_set_level.
+ */
+extern int log_level;
 
-void log_msg(int priority, char *msg, ...);
+static inline bool log_enabled(int priority)
+{
+	return priority <= LOG_COMPILE_LEVEL && priority <= log_level;
+}
+
+/*
+ * Log a message of priority @priority if the priority is enabled. When it's
+ * not, the arguments are neither evaluated nor formatted.
+ */
+#define	LOG_IF(priority, ...) do { \
+	if (log_enabled(priority)) \
+		log_msg(priority, __VA_ARGS__); \
+} while (0)
+
+#define	log_error(...)		LOG_IF(LOG_ERR, __VA_ARGS__)
+#define	log_warning(...)	LOG_IF(LOG_WARNING, __VA_ARGS__)
+#define	log_info(...)		LOG_IF(LOG_INFO, __VA_ARGS__)
+#define	log_debug(...)		LOG_IF(LOG_DEBUG, __VA_ARGS__)
 
-void log_warning(char *msg, ...);
+void log_open_syslog(void);
 
-void log_error(char *msg, ...);
+void log_set_level(int priority);
 
-void log_debug(char *msg, ...);
+/*
+ * Start the writer thread. From then on, messages are formatted into
+ * a ring buffer of the calling thread and passed to syslog by the writer,
+ * so that logging never blocks. When a ring is full, messages are dropped
+ * and the number of dropped messages is logged later.
+ *
+ * Until the writer is started (and once it's stopped), messages are
+ * passed to syslog directly.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+int log_start_writer(void);
 
-void log_info(char *msg, ...);
+/*
+ * Log all pending messages and stop the writer thread.
+ */
+void log_stop_writer(void);
+
+void log_msg(int priority, char *msg, ...);
 
+/*
+ * Log a message, flush all pending messages and exit.
+ */
 void log_exit(char *msg, ...);
 
 #endif
@@ -0,0 +1,120 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+#include "strbuf.h"
+
+#include <stdint.h>
+
+/*
+ * Maximum number of loggers metrics are collected for.
+ */
+#define	METRICS_MAX_LOGGERS	16
+
+/*
+ * Number of packet type counters; packets of types 0xD0..0xDF are
+ * counted separately, all other types share the last counter.
+ */
+#define	METRICS_PACKET_TYPES	17
+
+struct wmr_server;
+
+/*
+ * Counters.
+ */
+enum metric_counter
+{
+	METRIC_FRAMES,			/* HID frames received */
+	METRIC_BYTES,			/* bytes received */
+	METRIC_CHECKSUM_FAILURES,	/* packets dropped due to bad checksum */
+	METRIC_DISCARDED_BYTES,		/* bytes discarded to find a packet */
+	METRIC_RESYNCS,			/* packet boundaries found again */
+	METRIC_RECONNECTS,		/* reconnection attempts scheduled */
+	METRIC_QUERIES,			/* server requests handled */
+	METRIC_LATE_READINGS,		/* readings dropped as late */
+	METRIC_DUPLICATE_READINGS,	/* readings dropped as duplicates */
+	METRIC_REORDERED_READINGS,	/* readings passed on out of arrival order */
+	METRIC_REJECTED_RATE,		/* connections rejected by rate limits */
+	METRIC_REJECTED_OVERLOAD,	/* connections rejected by connection cap */
+	METRIC_GRAPHS_DRAWN,		/* graphs drawn */
+	METRIC_GRAPH_CACHE_HITS,	/* graphs served from the cache */
+	METRIC_PACKETS,			/* packets received, by packet type */
+	METRIC_LOGGER_CALLS = METRIC_PACKETS + METRICS_PACKET_TYPES,
+	METRIC_COUNTER_MAX = METRIC_LOGGER_CALLS + METRICS_MAX_LOGGERS
+};
+
+/*
+ * Gauges.
+ */
+enum metric_gauge
+{
+	METRIC_BATCH_DEPTH,		/* readings waiting in logger batches */
+	METRIC_WAL_PENDING,		/* WAL entries waiting for commit */
+	METRIC_QUERIES_ACTIVE,		/* query connections being handled */
+	METRIC_GAUGE_MAX
+};
+
+/*
+ * Latency histograms of processing stages.
+ */
+enum metric_histogram
+{
+	METRIC_DECODE,			/* packet verification and decoding */
+	METRIC_DISPATCH,		/* passing a reading to loggers */
+	METRIC_RRD_UPDATE,		/* a single rrd_update call */
+	METRIC_REQUEST,			/* handling of a server request */
+	METRIC_DELIVERY,		/* from receipt of a packet to its loggers */
+	METRIC_HISTOGRAM_MAX
+};
+
+/*
+ * Add @n to counter @counter.
+ *
+ * Counters are kept per thread and only summed up when metrics are
+ * printed, so counting is cheap and needs no locking. Invalid counters
+ * (such as -1 for a logger which could not be registered) are ignored.
+ */
+void metrics_count(unsigned counter, uint64_t n);
+
+/*
+ * Count a packet of type @type.
+ */
+void metrics_count_packet(byte_t type);
+
+/*
+ * Add @delta to gauge @gauge, or set it to @value.
+ */
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta);
+void metrics_gauge_set(enum metric_gauge gauge, int64_t value);
+
+/*
+ * Current time (monotonic) in nanoseconds, for use with metrics_observe.
+ */
+uint64_t metrics_now(void);
+
+/*
+ * Record that stage @hist took @ns nanoseconds.
+ */
+void metrics_observe(enum metric_histogram hist, uint64_t ns);
+
+/*
+ * Register a logger called @name.
+ *
+ * Return value:
+ *	Counter of calls of the logger, or -1 if there are too many loggers.
+ */
+int metrics_register_logger(const char *name);
+
+/*
+ * Print all metrics in Prometheus text exposition format to @out.
+ */
+void metrics_print(struct strbuf *out);
+
+/*
+ * Register server commands which expose the metrics. Besides the plain
+ * "metrics" command, they are served as the /metrics HTTP page, so that
+ * the query port can be scraped directly.
+ */
+void metrics_serve(struct wmr_server *srv);
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef ORDER_H
+#define ORDER_H
+
+#include "wmr200.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Maximum number of readings held per source, and of readings remembered
+ * per source for detection of duplicates.
+ */
+#define	ORDER_WINDOW_MAX	16
+#define	ORDER_MAX_HASHES	32
+
+/*
+ * Ordering stage configuration.
+ */
+struct order_cfg
+{
+	char *path;			/* watermark file path */
+	unsigned window;		/* readings held per source (reorder window) */
+	unsigned sync_interval;		/* min. time between watermark writes (s) */
+	unsigned max_skew;		/* max. station clock step tolerated (s) */
+};
+
+/*
+ * A reading held in the reorder window.
+ */
+struct order_held
+{
+	struct wmr_record rec;		/* the reading */
+	uint32_t hash;			/* see record_hash in order.c */
+	uint64_t seq;			/* see struct wmr_reading */
+	uint64_t recv_ns;		/* see struct wmr_reading */
+};
+
+/*
+ * Ordering state of a single source.
+ */
+struct order_source
+{
+	time_t hwm;			/* high-watermark, time of newest reading passed */
+	uint32_t hashes[ORDER_MAX_HASHES];	/* readings passed at time @hwm */
+	size_t num_hashes;		/* number of readings passed at time @hwm */
+	time_t resend;			/* readings up to this time may be sent again */
+	struct order_held held[ORDER_WINDOW_MAX + 1];	/* held readings, oldest first */
+	size_t num_held;		/* number of readings held */
+};
+
+/*
+ * Ordering and de-duplication stage.
+ *
+ * Readings of each source are passed on in order of their time. A reading
+ * older than the newest reading of its source passed so far (the source's
+ * high-watermark) is dropped as late. Historic records and readings the
+ * station may be sending again after a reconnect (those not newer than
+ * the watermark at the time of the reconnect) are also dropped if they
+ * are identical to one already passed or held. Live readings are not,
+ * as the station may well send identical readings within a minute. To
+ * let slightly late readings in, up to @cfg.window readings of a source
+ * are held and sorted by time; they are passed on when the window
+ * overflows or when the stage is flushed.
+ *
+ * High-watermarks are persisted, so that readings the station sends
+ * again after a restart of the daemon are dropped, too. Watermarks
+ * ahead of the host clock by more than @cfg.max_skew are not loaded, and
+ * when a live reading is older than the watermark of its source by more
+ * than @cfg.max_skew, the station clock is assumed to have been set back
+ * and the watermark is reset.
+ *
+ * The stage is not thread-safe. Meta-readings, which come from another
+ * thread, must not be pushed.
+ */
+struct order
+{
+	struct order_cfg cfg;
+	int fd;				/* watermark file, -1 if not persisted */
+	struct order_source src[WMR_SRC_MAX];
+	size_t num_held;		/* readings held in all sources */
+	bool dirty;			/* watermarks changed since written */
+	time_t synced;			/* time watermarks were last written */
+};
+
+/*
+ * Function readings are passed on to.
+ */
+typedef void order_release_t(struct wmr_reading *reading, void *arg);
+
+/*
+ * Initialize the stage and load watermarks from @cfg->path, creating the
+ * file if necessary. If @cfg->path is NULL, watermarks are not persisted.
+ *
+ * Return value:
+ *	Zero on success. If the watermark file cannot be used, -1 is
+ *	returned; the stage is usable, but watermarks are not persisted.
+ */
+int order_open(struct order *order, struct order_cfg *cfg);
+
+/*
+ * Write the watermarks and close the watermark file. Readings still held
+ * are discarded.
+ */
+void order_close(struct order *order);
+
+/*
+ * Push @reading into the stage. @historic tells whether the reading is
+ * a historic record. Readings which are due are passed to @release, along
+ * with @arg.
+ */
+void order_push(struct order *order, struct wmr_reading *reading, bool historic,
+	order_release_t *release, void *arg);
+
+/*
+ * Pass all held readings to @release and write the watermarks if they
+ * were not written in the last @cfg.sync_interval seconds.
+ */
+void order_flush(struct order *order, order_release_t *release, void *arg);
+
+/*
+ * Return true if order_flush has anything to do.
+ */
+bool order_pending(struct order *order);
+
+/*
+ * Record that the station (re)connected, so that readings it sends again
+ * are recognized.
+ */
+void order_reconnect(struct order *order);
+
+/*
+ * Record that @reading was passed on outside of the stage (such as when
+ * it's replayed from the write-ahead log), raising watermarks accordingly.
+ */
+void order_note(struct order *order, struct wmr_reading *reading);
+
+#endif
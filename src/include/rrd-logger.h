@@ -1,8 +1,13 @@
 #ifndef RRD_LOGGER_H
 #define	RRD_LOGGER_H
 
-#include "wmr200.h"
+#include "series.h"
 #include "strbuf.h"
+#include "wmr200.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 /*
  * RRD logger configuration.
@@ -15,20 +20,67 @@ struct rrd_cfg
 	char *uvi_rrd;		/* UV index database */
 	char *baro_rrd;		/* barometric database */
 	char *temp_N_rrd;	/* temperature database of Nth sensor */
+	unsigned num_writers;	/* writer threads, zero to write synchronously */
+};
+
+/*
+ * Context of a thread writing RRD files.
+ */
+struct rrd_writer
+{
+	struct rrd_cfg *cfg;		/* configuration of the logger */
+	struct strbuf data;		/* update being built */
+	char path[PATH_MAX];		/* path of the file being updated */
+};
+
+/*
+ * A writer thread, and the readings it is given to log.
+ */
+struct rrd_shard
+{
+	struct rrd_logger *logger;	/* the logger */
+	struct rrd_writer writer;	/* writer of the thread */
+	pthread_t thread;		/* writer thread */
+	struct wmr_reading *todo[SERIES_MAX];	/* readings to log */
+	size_t num_todo;		/* number of readings in @todo */
 };
 
 /*
  * Execution context of an RRD logger.
+ *
+ * Every RRD file is independent, so batches are written in parallel by
+ * a pool of @cfg.num_writers threads. Each file is pinned to one of the
+ * threads (the shard of series s is s modulo the number of threads),
+ * so updates of a file are never reordered. rrd_log_batch returns once
+ * all shards are done with the batch, as with synchronous writes.
  */
 struct rrd_logger
 {
 	struct rrd_cfg cfg;
-	struct strbuf data;
+	struct rrd_writer writer;	/* writer for synchronous updates */
+	struct rrd_shard *shards;	/* writer threads or NULL */
+	size_t num_shards;		/* number of writer threads */
+	pthread_mutex_t lock;		/* protects the fields below and @shards */
+	pthread_cond_t work_cond;	/* signalled when shards are given work */
+	pthread_cond_t done_cond;	/* signalled when all shards are done */
+	size_t num_busy;		/* number of shards with work */
+	bool quit;			/* writer threads should exit */
 };
 
 void rrd_logger_init(struct rrd_logger *logger);
 void rrd_logger_free(struct rrd_logger *logger);
 
+/*
+ * Start @logger->cfg.num_writers writer threads. Without them, batches
+ * are written synchronously.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+int rrd_logger_start(struct rrd_logger *logger);
+
 void rrd_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+void rrd_log_batch(struct wmr200 *wmr, struct wmr_reading *readings, size_t count,
+	bool flush, void *arg);
 
 #endif
@@ -0,0 +1,134 @@
+#ifndef SERIES_H
+#define SERIES_H
+
+#include "strbuf.h"
+#include "wmr200.h"
+
+#include <time.h>
+
+/*
+ * Numeric series. Each sensor which produces numeric readings is seen
+ * as a series of samples, each sample having up to SERIES_MAX_FIELDS
+ * float fields. This is the common view of readings for modules which
+ * store or aggregate readings field-by-field.
+ */
+enum series
+{
+	SERIES_WIND,
+	SERIES_RAIN,
+	SERIES_UVI,
+	SERIES_BARO,
+	SERIES_TEMP0,	/* console, SERIES_TEMP0 + i is i-th external sensor */
+	SERIES_MAX = SERIES_TEMP0 + WMR200_MAX_TEMP_SENSORS
+};
+
+#define	SERIES_MAX_FIELDS	4
+
+/*
+ * Return the series @reading belongs to, or -1 if @reading is not
+ * a numeric reading (status and meta readings are not).
+ */
+int series_of(struct wmr_reading *reading);
+
+/*
+ * Store numeric fields of @reading in @values, in the order given
+ * by series_field_name. Return the number of fields stored.
+ */
+size_t series_get_values(struct wmr_reading *reading, float *values);
+
+/*
+ * Series name, such as "wind" or "temp3".
+ */
+const char *series_name(int series);
+
+size_t series_num_fields(int series);
+const char *series_field_name(int series, size_t field);
+
+/*
+ * Name to series (field) lookup. Return -1 if there's no such series
+ * (field).
+ */
+int series_lookup(const char *name);
+int series_field_lookup(int series, const char *name);
+
+/*
+ * Aggregate of a single field over a time range.
+ */
+struct series_agg
+{
+	time_t time;		/* start of the range */
+	float min;		/* minimum value */
+	float max;		/* maximum value */
+	double sum;		/* sum of the values */
+	size_t count;		/* number of samples, zero if none */
+};
+
+void series_agg_reset(struct series_agg *agg, time_t time);
+
+/*
+ * Print @agg to @out as a single line.
+ */
+void series_print_agg(struct strbuf *out, struct series_agg *agg);
+
+/*
+ * High-water mark of the readings of a series a logger has persisted:
+ * time of the newest reading and the number of readings of that time
+ * (reading times have a resolution of a minute). Used to skip readings
+ * replayed from the write-ahead log which were persisted, but were not
+ * acknowledged before the daemon went down.
+ */
+struct series_hwm
+{
+	time_t time;		/* time of the newest reading, zero if none */
+	size_t count;		/* number of readings of @time */
+};
+
+/*
+ * Get high-water mark of @series of a logger @arg. Persisted readings
+ * older than @since need not be considered.
+ */
+typedef void series_hwm_t(void *arg, int series, time_t since, struct series_hwm *hwm);
+
+/*
+ * Tell whether a reading of @time, of a series with high-water mark @hwm,
+ * was persisted already. Readings at the high-water time are counted off,
+ * so readings of a series have to be passed in order.
+ */
+bool series_hwm_covers(struct series_hwm *hwm, time_t time);
+
+/*
+ * Account for @count persisted readings of @time in high-water mark @hwm.
+ */
+void series_hwm_add(struct series_hwm *hwm, time_t time, size_t count);
+
+/*
+ * Visitor callback for range queries of series stores.
+ */
+typedef void series_visit_t(time_t time, float *values, size_t num_fields, void *arg);
+
+/*
+ * Context of series_print_sample.
+ */
+struct series_print_ctx
+{
+	struct strbuf *out;	/* where to print */
+	int series;		/* series being printed */
+};
+
+/*
+ * A series_visit_t which prints samples to a series_print_ctx, one
+ * sample per line.
+ */
+void series_print_sample(time_t time, float *values, size_t num_fields, void *arg);
+
+/*
+ * Parse arguments of series queries: <series> [<field>] <from> <to>.
+ * Errors are reported to @out.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+int series_parse_args(int argc, char *argv[], bool want_field,
+	int *series, int *field, time_t *from, time_t *to, struct strbuf *out);
+
+#endif
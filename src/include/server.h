@@ -1,27 +1,113 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "admit.h"
+#include "stats.h"
+#include "strbuf.h"
 #include "wmr200.h"
 #include <pthread.h>
+#include <time.h>
 
 struct wmr_server_cfg
 {
 	unsigned port;		/* TCP port number */
+	unsigned query_port;	/* TCP port number of the query interface */
+	char *unix_path;	/* Unix socket of the query interface, or NULL */
+	struct admit_cfg admit;	/* admission control of connections */
 };
 
+struct wmr_server;
+struct latest;
+
+/*
+ * Query command handler prototype. The command name and its arguments
+ * are passed in @argv, the response should be written to @out.
+ */
+typedef void server_cmd_t(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg);
+
+/*
+ * HTTP page handler prototype. The part of the requested path which
+ * follows the prefix the page was registered with is passed in @path,
+ * the page should be written to @body.
+ *
+ * Return value:
+ *	Content type of the page, or NULL if there's no such page.
+ */
+typedef const char *server_page_t(struct wmr_server *srv, const char *path,
+	struct strbuf *body, void *arg);
+
 /*
  * TCP/IP server execution context.
  */
 struct wmr_server
 {
-	struct wmr200 *wmr;	/* the device we serve data for */
-	int fd;			/* server socket descriptor */
-	pthread_t thread_id;	/* server thread ID */
+	struct wmr_server_cfg cfg;	/* configuration */
+	struct wmr200 *wmr;		/* the device we serve data for */
+	struct latest *latest;		/* latest data to serve instead of @wmr's */
+	struct stats *stats;		/* rolling statistics to serve */
+	int fd;				/* server socket descriptor */
+	int query_fd;			/* query socket descriptor */
+	int unix_fd;			/* Unix query socket descriptor, or -1 */
+	struct admit admit;		/* admission control */
+	pthread_mutex_t query_lock;	/* protects @num_queries */
+	pthread_cond_t query_done;	/* signalled when the last query is done */
+	unsigned num_queries;		/* query threads running */
+	struct server_cmd *cmds;	/* linked list of query commands */
+	struct server_page *pages;	/* linked list of HTTP pages */
+	pthread_t thread_id;		/* server thread ID */
 };
 
 void server_init(struct wmr_server *srv);
+
+/*
+ * Configure @srv with @cfg rather than the default configuration, which
+ * has no Unix socket.
+ */
+void server_set_cfg(struct wmr_server *srv, struct wmr_server_cfg *cfg);
 void server_set_device(struct wmr_server *srv, struct wmr200 *wmr);
+void server_set_stats(struct wmr_server *srv, struct stats *stats);
+
+/*
+ * Serve latest data from @latest, which outlives connections to the
+ * station, rather than from the device set by server_set_device.
+ * Stale readings are marked with their age.
+ */
+void server_set_latest(struct wmr_server *srv, struct latest *latest);
 int server_start(struct wmr_server *srv);
 void server_stop(struct wmr_server *srv);
 
+/*
+ * Register query command @name with @srv. When a client sends a line
+ * whose first word is @name, @func will be invoked and @arg passed to it.
+ *
+ * Commands have to be registered before the server is started.
+ */
+void server_register_command(struct wmr_server *srv, const char *name,
+	server_cmd_t *func, void *arg);
+
+/*
+ * Register HTTP pages whose paths start with @prefix with @srv. The query
+ * interface answers "GET <path> HTTP/1.x" requests with the page @func
+ * writes for @path, if any, so that browsers and scrapers can use it.
+ *
+ * Pages have to be registered before the server is started.
+ */
+void server_register_page(struct wmr_server *srv, const char *prefix,
+	server_page_t *func, void *arg);
+
+/*
+ * Write an error message to query response @out.
+ */
+void server_error(struct strbuf *out, char *fmt, ...);
+
+/*
+ * Parse time argument of a query. Accepts absolute UNIX time, "now" and
+ * times relative to now such as "-3600".
+ *
+ * Return value:
+ *	Zero on success, -1 if @str is not a valid time.
+ */
+int server_parse_time(const char *str, time_t *time);
+
 #endif
@@ -0,0 +1,100 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "series.h"
+#include "strbuf.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define	STATS_MAX_WINDOWS	2
+
+/*
+ * Rolling statistics configuration.
+ */
+struct stats_cfg
+{
+	unsigned windows[STATS_MAX_WINDOWS];	/* window lengths (seconds) */
+};
+
+/*
+ * A sample in a statistics queue. Samples are numbered consecutively,
+ * so that it's easy to tell whether a sample is still in the window.
+ */
+struct stats_sample
+{
+	ulong_t seq;		/* sample number */
+	time_t time;		/* sample time */
+	float value;		/* sample value */
+};
+
+/*
+ * Double-ended queue of samples, held in a growing ring buffer.
+ */
+struct stats_queue
+{
+	struct stats_sample *buf;	/* the ring buffer */
+	size_t size;			/* allocated size */
+	size_t head;			/* index of the front sample */
+	size_t count;			/* number of samples */
+};
+
+/*
+ * Sliding window of a single field. Minimum and maximum are maintained
+ * using monotonic queues, mean using a running sum, so each update
+ * takes (amortized) constant time.
+ */
+struct stats_window
+{
+	struct stats_queue fifo;	/* samples in the window */
+	struct stats_queue min;		/* increasing queue of minimum candidates */
+	struct stats_queue max;		/* decreasing queue of maximum candidates */
+	double sum;			/* sum of samples in the window */
+	ulong_t next_seq;		/* number of the next sample */
+	time_t newest;			/* time of the newest sample */
+};
+
+/*
+ * Rolling statistics of all numeric readings.
+ */
+struct stats
+{
+	struct stats_cfg cfg;
+	pthread_mutex_t lock;		/* protects the windows */
+	struct stats_window win[SERIES_MAX][SERIES_MAX_FIELDS][STATS_MAX_WINDOWS];
+};
+
+/*
+ * Current statistics of a single window.
+ */
+struct stats_value
+{
+	float min;		/* minimum */
+	float max;		/* maximum */
+	float mean;		/* arithmetic mean */
+	size_t count;		/* number of samples, zero if none */
+};
+
+void stats_init(struct stats *stats, struct stats_cfg *cfg);
+void stats_free(struct stats *stats);
+
+/*
+ * Logger which updates statistics @arg with @reading.
+ */
+void stats_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+/*
+ * Get statistics of @field of @series over @window-th window, which ends
+ * now. Statistics of a sensor which went silent are thus empty once the
+ * window has passed.
+ */
+void stats_get(struct stats *stats, int series, size_t field, size_t window,
+	struct stats_value *value);
+
+/*
+ * Print all non-empty statistics to @out, one per line.
+ */
+void stats_print(struct stats *stats, struct strbuf *out);
+
+#endif
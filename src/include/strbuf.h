@@ -5,18 +5,36 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+struct arena;
+
 struct strbuf
 {
 	char *str;		/* the buffer itself */
 	size_t size;	/* current size of the buffer */
 	size_t len;		/* length of the string */
+	struct arena *arena;	/* arena the buffer lives in, or NULL */
 };
 
 void strbuf_init(struct strbuf *buf, size_t init_size);
+
+/*
+ * Initialize a buffer which lives in @arena. The buffer is released by
+ * a reset of the arena, strbuf_free does nothing.
+ */
+void strbuf_init_arena(struct strbuf *buf, size_t init_size, struct arena *arena);
 void strbuf_free(struct strbuf *buf);
 void strbuf_reset(struct strbuf *buf);
 size_t strbuf_putc(struct strbuf *buf, char c);
-size_t strbuf_puts(struct strbuf *buf, char *str);
+size_t strbuf_put(struct strbuf *buf, const char *str, size_t len);
+size_t strbuf_puts(struct strbuf *buf, const char *str);
+
+/*
+ * Fast equivalents of strbuf_printf with "%lu", "%li" and "%.*f"
+ * respectively. The output is exactly the same.
+ */
+size_t strbuf_put_uint(struct strbuf *buf, unsigned long value);
+size_t strbuf_put_int(struct strbuf *buf, long value);
+size_t strbuf_put_fixed(struct strbuf *buf, double value, unsigned decimals);
 
 void strbuf_prepare_write(struct strbuf *buf, size_t count);
 
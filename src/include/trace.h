@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Trace events. Every event is both a static USDT probe meteod:<name>
+ * (if <sys/sdt.h> is available at build time) and an entry in the flight
+ * recorder. Each event carries a single numeric argument.
+ */
+#define	TRACE_EVENTS(X) \
+	X(frame_receive)	/* HID frame received, arg = number of bytes */ \
+	X(packet_complete)	/* packet received, arg = packet type */ \
+	X(checksum_failure)	/* bad packet dropped, arg = packet type */ \
+	X(dispatch_start)	/* reading dispatch started, arg = reading type */ \
+	X(dispatch_end)		/* reading dispatch done, arg = reading type */ \
+	X(logger_call)		/* logger called, arg = logger counter */ \
+	X(server_accept)	/* connection accepted, arg = socket */ \
+	X(server_write)		/* response written, arg = socket */ \
+	X(server_reject)	/* connection rejected, arg = enum admit_verdict */ \
+	X(error)		/* fatal device error, arg = 0 */
+
+#define	TRACE_ENUM(name)	TRACE_EV_##name,
+
+enum trace_event
+{
+	TRACE_EVENTS(TRACE_ENUM)
+	TRACE_EV_MAX
+};
+
+#undef	TRACE_ENUM
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define	TRACE_HAVE_USDT		1
+#endif
+#endif
+
+#ifdef TRACE_HAVE_USDT
+#define	TRACE_PROBE(name, arg)	DTRACE_PROBE1(meteod, name, arg)
+#else
+#define	TRACE_PROBE(name, arg)	do {} while (0)
+#endif
+
+/*
+ * Record trace event @name with argument @arg.
+ */
+#define	TRACE(name, arg) do { \
+	uint64_t trace_arg__ = (uint64_t)(arg); \
+	TRACE_PROBE(name, trace_arg__); \
+	trace_record(TRACE_EV_##name, trace_arg__); \
+} while (0)
+
+/*
+ * Append an event to the flight recorder of the calling thread. The flight
+ * recorder of each thread is a ring which keeps the most recent events;
+ * recording an event takes just a few nanoseconds.
+ */
+void trace_record(enum trace_event event, uint64_t arg);
+
+/*
+ * Set the file flight recorder dumps are written to.
+ */
+void trace_set_dump_path(const char *path);
+
+/*
+ * Write the contents of flight recorders of all threads to the dump file.
+ * The dump is safe to take while events are being recorded, although the
+ * events recorded meanwhile may be missing or torn.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+int trace_dump(void);
+
+#endif
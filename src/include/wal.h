@@ -0,0 +1,111 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Maximum number of loggers which can be synced at checkpoints.
+ */
+#define	WAL_MAX_SYNCS		8
+
+/*
+ * Write-ahead log configuration.
+ */
+struct wal_cfg
+{
+	char *path;			/* log file path */
+	unsigned commit_interval;	/* max time between commits (ms) */
+	unsigned commit_count;		/* max number of uncommitted entries */
+	size_t max_size;		/* log size which triggers truncation */
+	unsigned checkpoint_interval;	/* max time between checkpoints (s) */
+};
+
+/*
+ * Function which makes all readings a logger was passed so far durable.
+ */
+typedef void wal_sync_t(void *arg);
+
+/*
+ * Write-ahead log of readings.
+ *
+ * Each reading received from the station is appended to the log before
+ * it is dispatched to loggers. The log is made durable by a commit thread,
+ * which calls fdatasync(2) once for all entries appended since the last
+ * commit (group commit).
+ *
+ * Loggers may keep readings in memory or write them without syncing, so
+ * a dispatched reading is not acknowledged until it's durable. At
+ * checkpoints, every @cfg.checkpoint_interval seconds or when the log
+ * grows over @cfg.max_size, the commit thread makes the loggers
+ * registered with wal_add_sync write what they were passed durably, and
+ * then acknowledges all entries dispatched before. Entries which were not
+ * acknowledged when the daemon went down are replayed into the loggers at
+ * startup.
+ */
+struct wal
+{
+	struct wal_cfg cfg;
+	int fd;				/* log file descriptor */
+	pthread_mutex_t lock;		/* protects the fields below */
+	pthread_cond_t cond;		/* signalled when a commit is due */
+	pthread_t commit_thread;	/* commit thread */
+	bool running;			/* commit thread is running */
+	uint64_t next_lsn;		/* sequence number of next entry */
+	uint64_t dispatched_lsn;	/* last entry dispatched to loggers */
+	uint64_t acked_lsn;		/* last acknowledged entry */
+	uint64_t committed_lsn;		/* last entry known to be on disk */
+	uint64_t header_lsn;		/* acknowledged entry recorded in the header */
+	size_t num_pending;		/* entries appended since last commit */
+	size_t size;			/* current log size */
+	time_t checkpointed;		/* time of the last checkpoint */
+	struct
+	{
+		wal_sync_t *func;
+		void *arg;
+	} syncs[WAL_MAX_SYNCS];		/* loggers synced at checkpoints */
+	size_t num_syncs;		/* number of @syncs */
+};
+
+/*
+ * Open the log at @cfg->path, creating it if necessary.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+int wal_open(struct wal *wal, struct wal_cfg *cfg);
+
+/*
+ * Have @func called with @arg at checkpoints, see struct wal. Must be
+ * called before the log is replayed.
+ */
+void wal_add_sync(struct wal *wal, wal_sync_t *func, void *arg);
+
+/*
+ * Pass all unacknowledged entries of the log to @func as a single batch
+ * and acknowledge them. Return the number of entries replayed.
+ */
+size_t wal_replay(struct wal *wal, wmr_batch_logger_t *func, void *arg);
+
+/*
+ * Start the commit thread.
+ */
+int wal_start(struct wal *wal);
+
+/*
+ * Commit the log, stop the commit thread and close the log.
+ */
+void wal_close(struct wal *wal);
+
+/*
+ * Journal which appends readings to the log @arg and records when they
+ * were dispatched. See wmr_set_journal.
+ */
+void wal_journal(struct wmr200 *wmr, struct wmr_reading *reading,
+	bool dispatched, void *arg);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <hidapi.h>
 #include <pthread.h>
@@ -10,6 +12,12 @@
 
 #define	WMR200_MAX_TEMP_SENSORS		10
 
+/*
+ * USB IDs of the station, see also 90-wmr200.rules.
+ */
+#define	WMR200_VENDOR_ID		0x0FDE
+#define	WMR200_PRODUCT_ID		0xCA01
+
 struct wmr200;
 
 /*
@@ -143,7 +151,9 @@ struct wmr_meta
 struct wmr_reading
 {
 	byte_t type;
-	time_t time;
+	time_t time;		/* station time of the reading (minute resolution) */
+	uint64_t seq;		/* sequence number (see latest_update), zero if none */
+	uint64_t recv_ns;	/* host time the packet was received, zero if unknown */
 	union
 	{
 		struct wmr_wind wind;
@@ -162,6 +172,108 @@ struct wmr_reading
  */
 const char *wmr_sensor_name(struct wmr_reading *reading);
 
+/*
+ * Sources of readings. Every temperature sensor is a source of its own.
+ */
+enum wmr_source
+{
+	WMR_SRC_WIND,
+	WMR_SRC_RAIN,
+	WMR_SRC_UVI,
+	WMR_SRC_BARO,
+	WMR_SRC_STATUS,
+	WMR_SRC_META,
+	WMR_SRC_TEMP0,
+	WMR_SRC_MAX = WMR_SRC_TEMP0 + WMR200_MAX_TEMP_SENSORS
+};
+
+#define	WMR_SRC_BIT(src)	(1U << (src))
+#define	WMR_SRC_ALL		(WMR_SRC_BIT(WMR_SRC_MAX) - 1)
+#define	WMR_SRC_ALL_TEMP	(WMR_SRC_ALL & ~(WMR_SRC_BIT(WMR_SRC_TEMP0) - 1))
+
+/*
+ * Readings of outdoor and indoor sensors, i.e. all sources except for the
+ * status and meta-readings.
+ */
+#define	WMR_SRC_WEATHER		(WMR_SRC_ALL \
+	& ~(WMR_SRC_BIT(WMR_SRC_STATUS) | WMR_SRC_BIT(WMR_SRC_META)))
+
+/*
+ * For a given reading, return its source, or -1 if the reading is invalid.
+ */
+int wmr_source_of(struct wmr_reading *reading);
+
+/*
+ * Strings which may appear in readings (wind directions, forecasts, levels
+ * and statuses) have numeric codes, so that readings can be stored without
+ * pointers. Code zero stands for NULL.
+ */
+byte_t wmr_string_code(const char *str);
+const char *wmr_code_string(byte_t code);
+
+/*
+ * Compact representation of a reading, used wherever readings are queued
+ * or stored. It has no pointers, so it can be copied as is (to a file or
+ * to another process): strings are stored as string codes and numbers as
+ * scaled integers, in the units given below. Converting a reading to
+ * a record and back is lossless. Meta-readings cannot be encoded.
+ */
+struct wmr_record
+{
+	uint32_t time;			/* reading time (UNIX time) */
+	uint8_t type;			/* reading type, zero if none */
+	uint8_t reserved;
+	union
+	{
+		struct
+		{
+			uint8_t dir;		/* string code */
+			uint8_t reserved;
+			uint16_t gust_speed;	/* 0.1 m/s */
+			uint16_t avg_speed;	/* 0.1 m/s */
+			int16_t chill;		/* 0.1 deg C */
+		} wind;
+		struct
+		{
+			uint16_t rate;		/* in WMR_RAIN_UNIT */
+			uint16_t accum_hour;	/* in WMR_RAIN_UNIT */
+			uint16_t accum_24h;	/* in WMR_RAIN_UNIT */
+			uint16_t accum_2007;	/* in WMR_RAIN_UNIT */
+		} rain;
+		struct
+		{
+			uint8_t index;
+		} uvi;
+		struct
+		{
+			uint16_t pressure;	/* hPa */
+			uint16_t alt_pressure;	/* hPa */
+			uint8_t forecast;	/* string code */
+		} baro;
+		struct
+		{
+			uint8_t sensor_id;
+			uint8_t humidity;	/* percent */
+			uint8_t heat_index;
+			uint8_t reserved;
+			int16_t temp;		/* 0.1 deg C */
+			int16_t dew_point;	/* 0.1 deg C */
+		} temp;
+		struct
+		{
+			uint8_t codes[9];	/* string codes, in field order */
+		} status;
+	};
+};
+
+/*
+ * Unit of rain amounts as reported by the station, in mm/m^2.
+ */
+#define	WMR_RAIN_UNIT		0.0254
+
+void wmr_record_encode(struct wmr_reading *reading, struct wmr_record *rec);
+void wmr_record_decode(struct wmr_record *rec, struct wmr_reading *reading);
+
 /*
  * A structure to hold latest data, i.e. the latest reading of every
  * possible kind. And for each temperature sensor, too.
@@ -175,6 +287,7 @@ struct wmr_latest_data
 	struct wmr_reading temp[10]; /* TODO */
 	struct wmr_reading status;
 	struct wmr_reading meta;
+	uint_t stale;		/* sources not received over this connection */
 };
 
 void wmr_get_latest_data(struct wmr200 *wmr, struct wmr_latest_data *latest);
@@ -184,6 +297,36 @@ void wmr_get_latest_data(struct wmr200 *wmr, struct wmr_latest_data *latest);
  */
 typedef void wmr_logger_t(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
 
+/*
+ * Batch logger function prototype. Batch loggers are given readings
+ * in batches of @count readings. Unless an ordering stage is set (see
+ * wmr_set_order), all readings of a packet are always delivered in the
+ * same batch; @flush is a hint that no more readings are immediately
+ * available, i.e. that buffered output should be written.
+ */
+typedef void wmr_batch_logger_t(struct wmr200 *wmr, struct wmr_reading *readings,
+	size_t count, bool flush, void *arg);
+
+/*
+ * Journal callback prototype. The journal is given every reading received
+ * from the station before it is passed to loggers (@dispatched is false),
+ * and a reading once more when loggers are done with it and with all
+ * readings journaled before (@dispatched is true). Readings dropped by the
+ * ordering stage count as done.
+ */
+typedef void wmr_journal_t(struct wmr200 *wmr, struct wmr_reading *reading,
+	bool dispatched, void *arg);
+
+/*
+ * Subscription of a logger to readings.
+ */
+struct wmr_subscription
+{
+	const char *name;		/* logger name for instrumentation or NULL */
+	uint_t sources;			/* bitmask of sources, see WMR_SRC_BIT */
+	uint_t min_interval[WMR_SRC_MAX];	/* min. time between readings (s) */
+};
+
 /*
  * Error handler prototype.
  */
@@ -242,6 +385,36 @@ void wmr_stop(struct wmr200 *wmr);
  */
 void wmr_register_logger(struct wmr200 *wmr, wmr_logger_t *logger, void *arg);
 
+/*
+ * Register a batch logger @logger with @wmr.
+ *
+ * Readings are collected while packets keep coming from the station and
+ * passed to @logger once the burst of packets is over (or the batch is
+ * full). Backends which do I/O per call should prefer this interface.
+ * It is possible to pass an extra argument @arg to @logger.
+ */
+void wmr_register_batch_logger(struct wmr200 *wmr, wmr_batch_logger_t *logger, void *arg);
+
+/*
+ * Register logger @logger with @wmr, like wmr_register_logger does, but
+ * only pass readings of sources in @sub->sources to it.
+ *
+ * If @sub->min_interval of a source is non-zero, a reading of that source
+ * is only passed to @logger when it is at least that many seconds newer
+ * than the previous reading passed. Older readings (such as late historic
+ * records) always are.
+ *
+ * Loggers must be registered before the communication is started.
+ */
+void wmr_subscribe_logger(struct wmr200 *wmr, wmr_logger_t *logger, void *arg,
+	const struct wmr_subscription *sub);
+
+/*
+ * Batch logger equivalent of wmr_subscribe_logger.
+ */
+void wmr_subscribe_batch_logger(struct wmr200 *wmr, wmr_batch_logger_t *logger,
+	void *arg, const struct wmr_subscription *sub);
+
 /*
  * Register error handler @handler with @wmr. Extra argument @arg will
  * be passed to @handler upon invocation.
@@ -257,4 +430,29 @@ void wmr_register_logger(struct wmr200 *wmr, wmr_logger_t *logger, void *arg);
  */
 void wmr_set_error_handler(struct wmr200 *wmr, wmr_err_handler_t *handler, void *arg);
 
+/*
+ * Set journal @journal of @wmr. Extra argument @arg will be passed to
+ * @journal upon invocation.
+ *
+ * System meta-readings are not journaled.
+ */
+void wmr_set_journal(struct wmr200 *wmr, wmr_journal_t *journal, void *arg);
+
+struct order;
+
+/*
+ * Set ordering stage @order of @wmr. Readings received from the station
+ * are journaled and then pass through @order before they are passed to
+ * loggers, see order.h. The stage may outlive the connection.
+ */
+void wmr_set_order(struct wmr200 *wmr, struct order *order);
+
+struct latest;
+
+/*
+ * Keep latest data of @wmr in @latest instead of a private store, see
+ * latest.h. @latest is updated as soon as a reading is received.
+ */
+void wmr_set_latest(struct wmr200 *wmr, struct latest *latest);
+
 #endif
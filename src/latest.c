@@ -0,0 +1,261 @@
+/*
+ * Latest data, persisted in a memory-mapped state file.
+ */
+
+#include "common.h"
+#include "latest.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define	LATEST_MAGIC		0x54414c4d	/* "MLAT" */
+#define	LATEST_VERSION		3
+#define	LATEST_MODE		0600	/* state file mode */
+
+/*
+ * A reading in the state file. Slots are written in place, so each has
+ * a checksum of its own to detect partially written slots.
+ */
+struct latest_slot
+{
+	uint32_t checksum;	/* checksum of the rest of the slot */
+	uint32_t reserved;
+	uint64_t seq;		/* see struct wmr_reading */
+	uint64_t recv_ns;	/* see struct wmr_reading */
+	struct wmr_record rec;	/* the reading, type zero if none */
+};
+
+/*
+ * State file, one slot per source.
+ */
+struct latest_file
+{
+	uint32_t magic;		/* LATEST_MAGIC */
+	uint32_t version;	/* LATEST_VERSION */
+	uint64_t seq;		/* last sequence number assigned */
+	struct latest_slot slots[WMR_SRC_MAX];
+};
+
+/*
+ * FNV-1a hash of @slot, the checksum excluded.
+ */
+static uint32_t slot_checksum(struct latest_slot *slot)
+{
+	uint8_t *p = (uint8_t *)&slot->seq;
+	uint8_t *end = (uint8_t *)(slot + 1);
+	uint32_t hash = 2166136261U;
+
+	for (; p < end; p++)
+		hash = (hash ^ *p) * 16777619U;
+
+	return hash;
+}
+
+/*
+ * Drop corrupt records of the state file and mark the others stale.
+ */
+static void restore(struct latest *latest)
+{
+	struct latest_slot *slot;
+	size_t num_restored = 0;
+	int src;
+
+	for (src = 0; src < WMR_SRC_MAX; src++) {
+		slot = &latest->file->slots[src];
+		if (slot->rec.type == 0)
+			continue;
+
+		if (src == WMR_SRC_META || slot->checksum != slot_checksum(slot)) {
+			log_warning("latest: ignoring corrupt reading of source %i", src);
+			memset(slot, 0, sizeof(*slot));
+			continue;
+		}
+
+		/* receive times are only valid within a boot */
+		slot->recv_ns = 0;
+		slot->checksum = slot_checksum(slot);
+		latest->file->seq = MAX(latest->file->seq, slot->seq);
+		latest->stale |= WMR_SRC_BIT(src);
+		num_restored++;
+	}
+
+	log_info("latest: restored %zu readings", num_restored);
+}
+
+/*
+ * Map state file @path, initializing it unless it's valid.
+ */
+static int map_file(struct latest *latest, const char *path)
+{
+	struct latest_file *file;
+	struct stat st;
+	bool valid;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, LATEST_MODE)) == -1) {
+		log_error("latest: cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	/* the file is mapped writable after a restart, which umask may prevent */
+	if (fchmod(fd, LATEST_MODE) != 0)
+		log_warning("latest: chmod %s: %s", path, strerror(errno));
+
+	if (fstat(fd, &st) != 0) {
+		log_error("latest: cannot stat %s: %s", path, strerror(errno));
+		goto out_close;
+	}
+
+	valid = (size_t)st.st_size == sizeof(*file);
+	if (!valid && ftruncate(fd, sizeof(*file)) != 0) {
+		log_error("latest: cannot resize %s: %s", path, strerror(errno));
+		goto out_close;
+	}
+
+	file = mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (file == MAP_FAILED) {
+		log_error("latest: cannot map %s: %s", path, strerror(errno));
+		goto out_close;
+	}
+	(void) close(fd);
+
+	if (valid && (file->magic != LATEST_MAGIC || file->version != LATEST_VERSION)) {
+		log_warning("latest: ignoring invalid state file %s", path);
+		valid = false;
+	}
+
+	if (!valid) {
+		memset(file, 0, sizeof(*file));
+		file->magic = LATEST_MAGIC;
+		file->version = LATEST_VERSION;
+	}
+
+	latest->file = file;
+	return 0;
+
+out_close:
+	(void) close(fd);
+	return -1;
+}
+
+int latest_open(struct latest *latest, const char *path)
+{
+	pthread_mutex_init(&latest->lock, NULL);
+	memset(&latest->meta, 0, sizeof(latest->meta));
+	latest->stale = 0;
+	latest->mapped = false;
+
+	if (path != NULL && map_file(latest, path) == 0) {
+		latest->mapped = true;
+		restore(latest);
+		return 0;
+	}
+
+	latest->file = malloc_safe(sizeof(*latest->file));
+	memset(latest->file, 0, sizeof(*latest->file));
+	return path == NULL ? 0 : -1;
+}
+
+void latest_close(struct latest *latest)
+{
+	if (latest->mapped) {
+		if (msync(latest->file, sizeof(*latest->file), MS_SYNC) != 0)
+			log_error("latest: msync: %s", strerror(errno));
+		(void) munmap(latest->file, sizeof(*latest->file));
+	}
+	else {
+		free(latest->file);
+	}
+
+	latest->file = NULL;
+	pthread_mutex_destroy(&latest->lock);
+}
+
+void latest_update(struct latest *latest, struct wmr_reading *reading)
+{
+	struct latest_slot *slot;
+	int src;
+
+	if ((src = wmr_source_of(reading)) < 0)
+		return;
+
+	pthread_mutex_lock(&latest->lock);
+	reading->seq = ++latest->file->seq;
+
+	if (src == WMR_SRC_META) {
+		if (reading->time >= latest->meta.time)
+			latest->meta = *reading;
+		latest->stale &= ~WMR_SRC_BIT(src);
+		goto out_unlock;
+	}
+
+	slot = &latest->file->slots[src];
+	if (slot->rec.type == 0 || reading->time >= (time_t)slot->rec.time) {
+		wmr_record_encode(reading, &slot->rec);
+		slot->seq = reading->seq;
+		slot->recv_ns = reading->recv_ns;
+		slot->checksum = slot_checksum(slot);
+		latest->stale &= ~WMR_SRC_BIT(src);
+	}
+
+out_unlock:
+	pthread_mutex_unlock(&latest->lock);
+}
+
+/*
+ * Return the reading of source @src within @data.
+ */
+static struct wmr_reading *source_reading(struct wmr_latest_data *data, int src)
+{
+	switch (src) {
+	case WMR_SRC_WIND:
+		return &data->wind;
+	case WMR_SRC_RAIN:
+		return &data->rain;
+	case WMR_SRC_UVI:
+		return &data->uvi;
+	case WMR_SRC_BARO:
+		return &data->baro;
+	case WMR_SRC_STATUS:
+		return &data->status;
+	case WMR_SRC_META:
+		return &data->meta;
+	}
+
+	return &data->temp[src - WMR_SRC_TEMP0];
+}
+
+void latest_get(struct latest *latest, struct wmr_latest_data *data)
+{
+	struct wmr_reading *reading;
+	struct latest_slot *slot;
+	int src;
+
+	pthread_mutex_lock(&latest->lock);
+	for (src = 0; src < WMR_SRC_MAX; src++) {
+		if (src == WMR_SRC_META)
+			continue;
+
+		slot = &latest->file->slots[src];
+		reading = source_reading(data, src);
+		wmr_record_decode(&slot->rec, reading);
+		reading->seq = slot->seq;
+		reading->recv_ns = slot->recv_ns;
+	}
+	data->meta = latest->meta;
+	data->stale = latest->stale;
+	pthread_mutex_unlock(&latest->lock);
+}
+
+void latest_mark_stale(struct latest *latest)
+{
+	pthread_mutex_lock(&latest->lock);
+	latest->stale = WMR_SRC_ALL;
+	pthread_mutex_unlock(&latest->lock);
+}
@@ -9,85 +9,267 @@
  */
 
 
+#include "log.h"
+
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
+
+
+#define	MSG_MAX		256	/* maximum length of a message, incl. '\0' */
+#define	RING_SIZE	128	/* messages per thread, must be a power of two */
+#define	DRAIN_INTERVAL	100	/* writer wakes up at least this often (ms) */
+
+
+/*
+ * A message waiting to be logged.
+ */
+struct entry
+{
+	int priority;
+	char msg[MSG_MAX];
+};
+
+
+/*
+ * Messages of a thread. A ring has a single producer (the owning thread)
+ * and a single consumer (whoever holds drain_lock), so it needs no locks.
+ * Like trace rings, rings are reused when their thread exits and never
+ * freed, so pending messages of exited threads are not lost.
+ */
+struct ring
+{
+	struct ring *next;		/* linked list of rings */
+	atomic_bool in_use;		/* owned by a thread */
+	atomic_size_t head;		/* number of messages written */
+	atomic_size_t tail;		/* number of messages logged */
+	atomic_size_t dropped;		/* number of messages dropped */
+	struct entry entries[RING_SIZE];
+};
+
+
+int log_level = LOG_INFO;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static _Atomic(struct ring *) rings;		/* all rings */
+static __thread struct ring *my_ring;		/* ring of this thread */
+
+static atomic_bool async;			/* writer is running */
+static atomic_bool stopping;			/* writer should stop */
+static pthread_t writer;
+static sem_t writer_sem;
 
 
 static void
-log_vmsg(int priority, char *format, va_list ap)
+release_ring(void *arg)
+{
+	struct ring *ring = (struct ring *)arg;
+	atomic_store(&ring->in_use, false);
+}
+
+
+static void
+init(void)
 {
-	vsyslog(priority, format, ap); 
+	(void) pthread_key_create(&ring_key, release_ring);
+	(void) sem_init(&writer_sem, 0, 0);
 }
 
 
 /*
- * public interface
+ * Get the ring of the calling thread, acquire one if the thread has none.
+ * Returns NULL if a new ring cannot be allocated.
  */
+static struct ring *
+get_ring(void)
+{
+	struct ring *ring;
 
+	if (my_ring != NULL)
+		return my_ring;
 
-void
-log_open_syslog(void)
+	pthread_once(&once, init);
+
+	pthread_mutex_lock(&rings_lock);
+	for (ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+		if (!atomic_load(&ring->in_use))
+			break;
+
+	if (ring == NULL && (ring = calloc(1, sizeof(*ring))) != NULL) {
+		ring->next = atomic_load(&rings);
+		atomic_store(&rings, ring);
+	}
+
+	if (ring != NULL)
+		atomic_store(&ring->in_use, true);
+	pthread_mutex_unlock(&rings_lock);
+
+	if (ring != NULL)
+		(void) pthread_setspecific(ring_key, ring);
+	return my_ring = ring;
+}
+
+
+/*
+ * Pass pending messages of all rings to syslog.
+ */
+static void
+drain(void)
 {
-	openlog(NULL, LOG_NOWAIT | LOG_PID, LOG_USER);
+	struct ring *ring;
+	size_t head, tail, dropped;
+
+	pthread_mutex_lock(&drain_lock);
+	for (ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+		for (; tail != head; tail++) {
+			struct entry *entry = &ring->entries[tail & (RING_SIZE - 1)];
+			syslog(entry->priority, "%s", entry->msg);
+			atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+		}
+
+		if ((dropped = atomic_exchange(&ring->dropped, 0)) > 0)
+			syslog(LOG_WARNING, "%zu log messages dropped", dropped);
+	}
+	pthread_mutex_unlock(&drain_lock);
 }
 
 
-void
-log_msg(int priority, char *format, ...)
+static void *
+writer_pthread(void *arg)
 {
-	va_list ap;
-	va_start(ap, format);
+	struct timespec deadline;
 
-	log_vmsg(priority, format, ap);
+	(void) arg;
 
-	va_end(ap);
+	while (!atomic_load(&stopping)) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += DRAIN_INTERVAL * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		(void) sem_timedwait(&writer_sem, &deadline);
+		drain();
+	}
+
+	drain();
+	return NULL;
 }
 
 
-void
-log_error(char *format, ...)
+/*
+ * Format the message into the ring of the calling thread.
+ *
+ * Return value:
+ *	false if the message should be logged synchronously instead.
+ */
+static bool
+log_vmsg_async(int priority, char *format, va_list ap)
 {
-	va_list ap;
-	va_start(ap, format);
+	struct ring *ring;
+	struct entry *entry;
+	size_t head;
+
+	if ((ring = get_ring()) == NULL)
+		return false;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return true;
+	}
+
+	entry = &ring->entries[head & (RING_SIZE - 1)];
+	entry->priority = priority;
+	(void) vsnprintf(entry->msg, sizeof(entry->msg), format, ap);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	/* does not block, only wakes the writer up if it's waiting */
+	(void) sem_post(&writer_sem);
+	return true;
+}
 
-	log_vmsg(LOG_ERR, format, ap);
 
-	va_end(ap);
+static void
+log_vmsg(int priority, char *format, va_list ap)
+{
+	if (atomic_load_explicit(&async, memory_order_relaxed)
+		&& log_vmsg_async(priority, format, ap))
+		return;
+
+	vsyslog(priority, format, ap);
+}
+
+
+/*
+ * public interface
+ */
+
+
+void
+log_open_syslog(void)
+{
+	openlog(NULL, LOG_NOWAIT | LOG_PID, LOG_USER);
 }
 
 
 void
-log_warning(char *format, ...)
+log_set_level(int priority)
 {
-	va_list ap;
-	va_start(ap, format);
+	log_level = priority;
+}
 
-	log_vmsg(LOG_WARNING, format, ap);
 
-	va_end(ap);
+int
+log_start_writer(void)
+{
+	if (atomic_load(&async))
+		return 0;
+
+	pthread_once(&once, init);
+
+	atomic_store(&stopping, false);
+	if (pthread_create(&writer, NULL, writer_pthread, NULL) != 0)
+		return -1;
+
+	atomic_store(&async, true);
+	return 0;
 }
 
 
 void
-log_info(char *format, ...)
+log_stop_writer(void)
 {
-	va_list ap;
-	va_start(ap, format);
-
-	log_vmsg(LOG_INFO, format, ap);
+	if (!atomic_load(&async))
+		return;
 
-	va_end(ap);
+	atomic_store(&async, false);
+	atomic_store(&stopping, true);
+	(void) sem_post(&writer_sem);
+	pthread_join(writer, NULL);
 }
 
 
 void
-log_debug(char *format, ...)
+log_msg(int priority, char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
 
-	log_vmsg(LOG_DEBUG, format, ap);
+	log_vmsg(priority, format, ap);
 
 	va_end(ap);
 }
@@ -99,7 +281,10 @@ log_exit(char *format, ...)
 	va_list ap;
 	va_start(ap, format);
 
-	log_vmsg(LOG_ALERT, format, ap);
+	/* the writer may be gone with the process any moment, log directly */
+	if (atomic_load(&async))
+		drain();
+	vsyslog(LOG_ALERT, format, ap);
 
 	va_end(ap);
 	exit(EXIT_FAILURE);
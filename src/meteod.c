@@ -7,10 +7,21 @@
  * Copyright (c) 2015-2017 David Čepelík <d@dcepelik.cz>
  */
 
+#include "archive.h"
+#include "climate.h"
 #include "config.h"
+#include "graph.h"
+#include "history.h"
+#include "hotplug.h"
+#include "latest.h"
 #include "log.h"
+#include "metrics.h"
+#include "order.h"
 #include "rrd-logger.h"
 #include "server.h"
+#include "stats.h"
+#include "trace.h"
+#include "wal.h"
 #include "wmr200.h"
 
 #include <assert.h>
@@ -28,6 +39,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 /* TODO make these configurable */
@@ -35,14 +47,17 @@ bool reconnect_on_error = true;
 
 char *prog;
 unsigned reconnect_interval;
+unsigned plug_retries;		/* quick attempts left, see schedule_plug_retry */
 sem_t ev_sem;
 
 volatile sig_atomic_t ev_error;	/* an error occured */
 volatile sig_atomic_t ev_alarm;	/* alarm has expired */
 volatile sig_atomic_t ev_quit;	/* quit request */
+volatile sig_atomic_t ev_dump;	/* flight recorder dump request */
+volatile sig_atomic_t ev_plug;	/* station was plugged in */
 
 /*
- * Handle SIGINT, SIGINT and SIGALRM.
+ * Handle SIGINT, SIGTERM, SIGALRM and SIGUSR1.
  */
 static void signal_dispatch(int signum)
 {
@@ -54,6 +69,9 @@ static void signal_dispatch(int signum)
 	case SIGALRM:
 		ev_alarm = true;
 		break;
+	case SIGUSR1:
+		ev_dump = true;
+		break;
 	default:
 		return; /* to avoid sem_post */
 	}
@@ -75,6 +93,148 @@ static void error_handler(struct wmr200 *wmr, void *arg)
 	ev_error = true;
 }
 
+/*
+ * Hotplug handler. Called from the hotplug listener thread.
+ */
+static void hotplug_handler(enum hotplug_event event, void *arg)
+{
+	(void) arg;
+
+	if (event == HOTPLUG_REMOVE) {
+		log_info("Station unplugged");
+		return;
+	}
+
+	ev_plug = true;
+	sem_post(&ev_sem);
+}
+
+/*
+ * A logger to be registered with every connection.
+ */
+struct logger_ref
+{
+	wmr_logger_t *func;		/* logger callback */
+	wmr_batch_logger_t *batch;	/* batch logger callback (if @func is NULL) */
+	void *arg;			/* extra argument to @func */
+	struct wmr_subscription sub;	/* readings passed to the logger */
+	series_hwm_t *hwm;		/* high-water marks of readings the logger
+					   persisted, NULL if it's idempotent */
+	wal_sync_t *sync;		/* makes the readings durable, NULL if
+					   the logger is idempotent */
+};
+
+/*
+ * Context of replay_batch.
+ */
+struct replay
+{
+	struct logger_ref *loggers;	/* terminated by an entry with NULL @arg */
+	struct order *order;		/* ordering stage */
+	struct series_hwm (*hwm)[SERIES_MAX];	/* per logger, time -1 if unknown */
+	struct wmr_reading *readings;	/* readings released by the replay stage */
+	size_t count;			/* number of @readings */
+};
+
+/*
+ * Tell whether @reading of @series was persisted by the @i-th logger of
+ * @replay before the daemon went down.
+ */
+static bool replay_persisted(struct replay *replay, size_t i, int series,
+	struct wmr_reading *reading)
+{
+	struct logger_ref *logger = &replay->loggers[i];
+	struct series_hwm *hwm = &replay->hwm[i][series];
+
+	if (logger->hwm == NULL || series < 0)
+		return false;
+
+	/* the first replayed reading of a series is the oldest one */
+	if (hwm->time == -1)
+		logger->hwm(logger->arg, series, reading->time, hwm);
+
+	return series_hwm_covers(hwm, reading->time);
+}
+
+/*
+ * Collect a replayed reading released by the ordering stage of the replay
+ * context @arg, raising the watermarks of the daemon's ordering stage.
+ */
+static void replay_release(struct wmr_reading *reading, void *arg)
+{
+	struct replay *replay = (struct replay *)arg;
+
+	order_note(replay->order, reading);
+	replay->readings[replay->count++] = *reading;
+}
+
+/*
+ * Pass readings replayed from the write-ahead log to all loggers of the
+ * replay context @arg.
+ *
+ * Readings are journaled before they enter the ordering stage, so they are
+ * ordered again here. They are not checked against the persisted
+ * watermarks, which may have been written before loggers made the readings
+ * durable; a stage of their own sorts them instead.
+ *
+ * Entries are replayed at least once: loggers may have persisted readings
+ * which were not acknowledged yet. Loggers which are not idempotent skip
+ * the readings they have already persisted, which are told by their
+ * high-water marks, as readings of a series are logged in order.
+ *
+ * Like live readings, the readings are passed to batch loggers as a batch
+ * rather than one by one; RRD would refuse all but the first update of
+ * a file within a second.
+ */
+static void replay_batch(struct wmr200 *wmr, struct wmr_reading *readings,
+	size_t count, bool flush, void *arg)
+{
+	struct replay *replay = (struct replay *)arg;
+	struct order_cfg order_cfg = {
+		.path = NULL,
+		.window = cfg.order.window,
+		.sync_interval = 0,
+		.max_skew = cfg.order.max_skew
+	};
+	struct wmr_reading *batch;
+	struct logger_ref *logger;
+	struct order order;
+	size_t i, j, batch_len;
+	int src;
+
+	replay->readings = malloc_safe(count * sizeof(*replay->readings));
+	replay->count = 0;
+	(void) order_open(&order, &order_cfg);
+	for (j = 0; j < count; j++)
+		order_push(&order, &readings[j], false, replay_release, replay);
+	order_flush(&order, replay_release, replay);
+	order_close(&order);
+
+	batch = malloc_safe(count * sizeof(*batch));
+	for (i = 0; (logger = &replay->loggers[i])->arg != NULL; i++) {
+		batch_len = 0;
+		for (j = 0; j < replay->count; j++) {
+			if ((src = wmr_source_of(&replay->readings[j])) < 0
+				|| !(logger->sub.sources & WMR_SRC_BIT(src)))
+				continue;
+			if (replay_persisted(replay, i, series_of(&replay->readings[j]),
+				&replay->readings[j]))
+				continue;
+
+			if (logger->func)
+				logger->func(wmr, &replay->readings[j], logger->arg);
+			else
+				batch[batch_len++] = replay->readings[j];
+		}
+
+		if (batch_len > 0)
+			logger->batch(wmr, batch, batch_len, flush, logger->arg);
+	}
+
+	free(batch);
+	free(replay->readings);
+}
+
 static void usage(int status)
 {
 	errx(status, "Usage: %s\n", prog);
@@ -89,10 +249,33 @@ static void usage(int status)
 void schedule_reconnect(void)
 {
 	alarm(reconnect_interval);
+	metrics_count(METRIC_RECONNECTS, 1);
 	log_info("Will attempt to reconnect in %lu seconds.", reconnect_interval);
 	reconnect_interval = MIN(2 * reconnect_interval, cfg.reconnect_max);
 }
 
+/*
+ * Schedule a quick reconnection attempt after the station was plugged in.
+ * The station is reported plugged in once its interface is bound, which
+ * may be before udev makes its device node accessible, so the first
+ * attempts may fail without the station being in trouble.
+ */
+static void schedule_plug_retry(void)
+{
+	struct itimerval timer = {
+		.it_interval = { 0, 0 },
+		.it_value = {
+			.tv_sec = cfg.plug_retry_interval / 1000,
+			.tv_usec = (cfg.plug_retry_interval % 1000) * 1000,
+		},
+	};
+
+	plug_retries--;
+	setitimer(ITIMER_REAL, &timer, NULL);
+	metrics_count(METRIC_RECONNECTS, 1);
+	log_info("Will attempt to reconnect in %u ms.", cfg.plug_retry_interval);
+}
+
 static void detach_from_parent(void)
 {
 	pid_t pid1, pid2;
@@ -185,6 +368,9 @@ static void drop_root_privileges(void)
  *
  *     - A SIGALRM signal is received. In that case, we want to start connecting
  *       again, because the reconnection delay has expired.
+ *
+ *     - The station is plugged in (see hotplug.h). In that case, we want to
+ *       connect right away, without waiting for the reconnection delay.
  */
 int main(int argc, char *argv[])
 {
@@ -198,6 +384,37 @@ int main(int argc, char *argv[])
 	sigset_t oldset;
 	bool running = false;
 	struct wmr_server srv;
+	struct history hist;
+	struct stats stats;
+	struct archive arch;
+	struct graph_cache graphs;
+	struct climate clim;
+	struct wal wal;
+	bool wal_ok;
+	struct order order;
+	struct latest latest;
+	struct replay replay;
+	struct hotplug hp;
+	bool hotplug_ok;
+	struct logger_ref *logger;
+	struct logger_ref loggers[] = {
+		/* RRD refuses updates which are not newer than the last one */
+		{ NULL, rrd_log_batch, &rrd, { "rrd", WMR_SRC_WEATHER, { 0 } }, NULL, NULL },
+		{ history_log_reading, NULL, &hist, { "history", WMR_SRC_WEATHER, { 0 } },
+			NULL, NULL },
+		{ stats_log_reading, NULL, &stats, { "stats", WMR_SRC_WEATHER, { 0 } },
+			NULL, NULL },
+		{ archive_log_reading, NULL, &arch, { "archive", WMR_SRC_WEATHER, { 0 } },
+			archive_hwm, archive_sync },
+		{ climate_log_reading, NULL, &clim, { "climate", WMR_SRC_WEATHER, { 0 } },
+			climate_hwm, climate_sync },
+		/* after the stores the graphs are drawn from */
+		{ graph_log_reading, NULL, &graphs, { "graph", WMR_SRC_WEATHER, { 0 } },
+			NULL, NULL },
+		{ NULL, NULL, NULL, { NULL, 0, { 0 } }, NULL, NULL }
+	};
+	struct series_hwm replay_hwm[ARRAY_SIZE(loggers)][SERIES_MAX];
+	size_t i, s;
 
 	prog = basename(argv[0]);
 
@@ -206,52 +423,150 @@ int main(int argc, char *argv[])
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGALRM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
 
 	log_open_syslog();
+	log_set_level(cfg.log_level);
 	sem_init(&ev_sem, false, 0);
 
 	wmr_init();
+	trace_set_dump_path(cfg.trace_path);
+
+	rrd_logger_init(&rrd);
+	rrd.cfg.rrd_root = "/tmp";
+	rrd.cfg.wind_rrd = "wind.rrd";
+	rrd.cfg.rain_rrd = "rain.rrd";
+	rrd.cfg.uvi_rrd = "uvi.rrd";
+	rrd.cfg.baro_rrd = "baro.rrd";
+	rrd.cfg.temp_N_rrd = "temp%u.rrd";
+	rrd.cfg.num_writers = cfg.rrd.num_writers;
+
+	history_init(&hist, &cfg.history);
+	stats_init(&stats, &cfg.stats);
+	archive_init(&arch, &cfg.archive);
+	graph_init(&graphs, &hist, &arch);
 
 	server_init(&srv);
-	if (server_start(&srv) != 0)
-		errx(EXIT_FAILURE, "Cannot start the TCP/IP server, see the logs.");
+	server_set_cfg(&srv, &cfg.srv);
+	server_set_stats(&srv, &stats);
+	history_serve(&hist, &srv);
+	archive_serve(&arch, &srv);
+	graph_serve(&graphs, &srv);
+	climate_serve(&clim, &srv);
+	metrics_serve(&srv);
 
 	resolve_names();
 	detach_from_parent();
 	chdir_umask();
 	drop_root_privileges();
 
+	/*
+	 * Like the server, the log and RRD writer threads have to be started
+	 * after fork.
+	 */
+	if (log_start_writer() != 0)
+		log_warning("Cannot start log writer thread, logging synchronously");
+
+	if (rrd_logger_start(&rrd) != 0)
+		log_warning("Cannot start RRD writer threads, writing synchronously");
+
+	/*
+	 * Latest data is restored before the server is started, so that
+	 * clients get the (stale) readings before the station is connected.
+	 */
+	if (latest_open(&latest, cfg.latest_path) != 0)
+		log_warning("Cannot persist latest data, it will be lost on restart");
+	server_set_latest(&srv, &latest);
+
+	if (climate_open(&clim, &cfg.climate) != 0)
+		log_warning("Cannot persist calendar summaries, they will be lost on restart");
+
+	/*
+	 * Threads do not survive fork(2), so the server has to be started
+	 * in the detached process.
+	 */
+	if (server_start(&srv) != 0)
+		log_exit("Cannot start the TCP/IP server");
+
+	/*
+	 * Reconnect as soon as the station is plugged in, not only when the
+	 * reconnection interval expires.
+	 */
+	hotplug_ok = (hotplug_open(&hp, WMR200_VENDOR_ID, WMR200_PRODUCT_ID,
+		hotplug_handler, NULL) == 0);
+	if (!hotplug_ok)
+		log_warning("Cannot listen for hotplug events, reconnecting periodically");
+
+	if (order_open(&order, &cfg.order) != 0)
+		log_warning("Cannot persist high-watermarks, duplicate readings "
+			"may be logged after restart");
+
+	/*
+	 * Readings which were received but not logged before the daemon went
+	 * down are replayed before anything else is received.
+	 */
+	if ((wal_ok = (wal_open(&wal, &cfg.wal) == 0))) {
+		for (logger = loggers; logger->arg != NULL; logger++)
+			if (logger->sync != NULL)
+				wal_add_sync(&wal, logger->sync, logger->arg);
+
+		replay.loggers = loggers;
+		replay.order = &order;
+		replay.hwm = replay_hwm;
+		for (i = 0; i < ARRAY_SIZE(loggers); i++)
+			for (s = 0; s < SERIES_MAX; s++)
+				replay_hwm[i][s].time = -1;
+		(void) wal_replay(&wal, replay_batch, &replay);
+		if (wal_start(&wal) != 0) {
+			wal_close(&wal);
+			wal_ok = false;
+		}
+	}
+
+	if (!wal_ok)
+		log_warning("Running without write-ahead log, readings may be lost");
+
 	reconnect_interval = cfg.reconnect_default;
 
 connect:
 	/*
-	 * Block SIGINT, SIGTERM and SIGALRM. Spawned threads will inherit
+	 * Block SIGINT, SIGTERM, SIGALRM and SIGUSR1. Spawned threads will inherit
 	 * the sigmask, so signals will be received by this "main" thread.
 	 */
 	sigemptyset(&set);
 	sigaddset(&set, SIGINT);
 	sigaddset(&set, SIGTERM);
 	sigaddset(&set, SIGALRM);
+	sigaddset(&set, SIGUSR1);
 	pthread_sigmask(SIG_BLOCK, &set, &oldset);
 
 	assert(!running);
 
 	if ((wmr = wmr_open()) != NULL) {
 		wmr_set_error_handler(wmr, error_handler, NULL);
+
+		/*
+		 * Loggers and journal must be in place before the communication
+		 * starts, as the station's data logger is erased on start.
+		 */
+		for (logger = loggers; logger->arg != NULL; logger++) {
+			if (logger->func)
+				wmr_subscribe_logger(wmr, logger->func,
+					logger->arg, &logger->sub);
+			else
+				wmr_subscribe_batch_logger(wmr, logger->batch,
+					logger->arg, &logger->sub);
+		}
+		if (wal_ok)
+			wmr_set_journal(wmr, wal_journal, &wal);
+		order_reconnect(&order);
+		wmr_set_order(wmr, &order);
+		wmr_set_latest(wmr, &latest);
+
 		if (wmr_start(wmr) == 0) {
 			running = true;
 			reconnect_interval = cfg.reconnect_default;
-
-			rrd_logger_init(&rrd);
-			rrd.cfg.rrd_root = "/tmp";
-			rrd.cfg.wind_rrd = "wind.rrd";
-			rrd.cfg.rain_rrd = "rain.rrd";
-			rrd.cfg.uvi_rrd = "uvi.rrd";
-			rrd.cfg.baro_rrd = "baro.rrd";
-			rrd.cfg.temp_N_rrd = "temp%u.rrd";
-
-			wmr_register_logger(wmr, rrd_log_reading, &rrd);
-			server_set_device(&srv, wmr);
+			plug_retries = 0;
 		}
 		else {
 			wmr_close(wmr);
@@ -259,7 +574,9 @@ connect:
 	}
 
 	if (!running) {
-		if (reconnect_on_error)
+		if (plug_retries > 0)
+			schedule_plug_retry();
+		else if (reconnect_on_error)
 			schedule_reconnect();
 		else
 			goto quit;
@@ -276,19 +593,50 @@ connect:
 wait:
 	while (sem_wait(&ev_sem) != 0);
 
+	if (ev_dump) {
+		ev_dump = false;
+		(void) trace_dump();
+	}
+
+	/*
+	 * The station was plugged in. Unless connected already, connect right
+	 * away rather than when the alarm expires, and start over with the
+	 * backoff; a few failed attempts are retried quickly first. Errors
+	 * are handled first, as the station is usually replugged after one.
+	 */
+	if (ev_plug && !ev_quit && !ev_error) {
+		ev_plug = false;
+		if (!running) {
+			log_info("Station plugged in, reconnecting");
+			alarm(0);
+			ev_alarm = false;
+			reconnect_interval = cfg.reconnect_default;
+			plug_retries = cfg.plug_retries;
+			goto connect;
+		}
+	}
+
 	if (ev_alarm) {
 		ev_alarm = false;
-		goto connect;
+		if (!running)
+			goto connect;
 	}
 
+	/*
+	 * Nothing else to do, such as when the alarm was cancelled after
+	 * it had expired.
+	 */
+	if (!ev_quit && !ev_error)
+		goto wait;
+
 	/*
 	 * We're handling a quit request or an error has occurred. In any case,
 	 * if we're connected, we should disconnect now.
 	 */
 	if (running) {
-		server_set_device(&srv, NULL);
 		wmr_stop(wmr);
 		wmr_close(wmr);
+		latest_mark_stale(&latest);
 		running = false;
 	}
 
@@ -306,9 +654,21 @@ wait:
 		log_info("Shutting down gracefully on SIGINT/SIGTERM");
 
 quit:
+	if (hotplug_ok)
+		hotplug_close(&hp);
 	server_stop(&srv);
+	if (wal_ok)
+		wal_close(&wal);
+	order_close(&order);
+	latest_close(&latest);
+	climate_close(&clim);
 	rrd_logger_free(&rrd);
+	history_free(&hist);
+	stats_free(&stats);
+	archive_free(&arch);
+	graph_free(&graphs);
 
 	wmr_end();
+	log_stop_writer();
 	return ev_error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
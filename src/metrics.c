@@ -0,0 +1,387 @@
+/*
+ * Instrumentation counters, gauges and latency histograms.
+ */
+
+#include "log.h"
+#include "metrics.h"
+#include "server.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Histogram buckets. Upper bound of bucket i is 2^(i + HIST_MIN_SHIFT) ns,
+ * i.e. the first bucket holds observations up to about a microsecond and
+ * the last one up to about half a minute. Longer observations only fall
+ * into the implicit +Inf bucket.
+ */
+#define	HIST_MIN_SHIFT		10
+#define	HIST_BUCKETS		26
+
+/*
+ * Counters of a single thread. Every shard is only ever written by the
+ * thread which owns it, so values are updated with plain (relaxed)
+ * loads and stores; atomics just make sure readers see whole values.
+ *
+ * When a thread exits, its shard is released and later reused by another
+ * thread, which keeps adding to the values. Shards are never freed, so
+ * counters remain monotonic.
+ */
+struct shard
+{
+	struct shard *next;			/* linked list of shards */
+	atomic_bool in_use;			/* owned by a thread */
+	atomic_uint_fast64_t counters[METRIC_COUNTER_MAX];
+	atomic_uint_fast64_t buckets[METRIC_HISTOGRAM_MAX][HIST_BUCKETS + 1];
+	atomic_uint_fast64_t sum_ns[METRIC_HISTOGRAM_MAX];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static struct shard *shards;			/* all shards */
+static __thread struct shard *my_shard;		/* shard of this thread */
+
+static atomic_int_fast64_t gauges[METRIC_GAUGE_MAX];
+
+static const char *logger_names[METRICS_MAX_LOGGERS];
+static size_t num_loggers;
+
+static const struct
+{
+	const char *name;
+	const char *help;
+}
+counter_info[] = {
+	[METRIC_FRAMES] = { "meteod_frames_total", "HID frames received." },
+	[METRIC_BYTES] = { "meteod_bytes_total", "Bytes received." },
+	[METRIC_CHECKSUM_FAILURES] = { "meteod_checksum_failures_total",
+		"Packets dropped due to bad checksum." },
+	[METRIC_DISCARDED_BYTES] = { "meteod_discarded_bytes_total",
+		"Bytes discarded while looking for the next packet." },
+	[METRIC_RESYNCS] = { "meteod_resyncs_total",
+		"Packet boundaries found again after being lost." },
+	[METRIC_RECONNECTS] = { "meteod_reconnects_total",
+		"Reconnection attempts scheduled." },
+	[METRIC_QUERIES] = { "meteod_requests_total", "Server requests handled." },
+	[METRIC_LATE_READINGS] = { "meteod_late_readings_total",
+		"Readings dropped as older than the newest reading of their sensor." },
+	[METRIC_DUPLICATE_READINGS] = { "meteod_duplicate_readings_total",
+		"Readings dropped as duplicates." },
+	[METRIC_REORDERED_READINGS] = { "meteod_reordered_readings_total",
+		"Readings put back in order." },
+	[METRIC_REJECTED_RATE] = { "meteod_rejected_rate_limited_total",
+		"Connections rejected by per-address rate limits." },
+	[METRIC_REJECTED_OVERLOAD] = { "meteod_rejected_overload_total",
+		"Connections rejected as too many were being handled." },
+	[METRIC_GRAPHS_DRAWN] = { "meteod_graphs_drawn_total", "Graphs drawn." },
+	[METRIC_GRAPH_CACHE_HITS] = { "meteod_graph_cache_hits_total",
+		"Graphs served from the cache." },
+},
+gauge_info[] = {
+	[METRIC_BATCH_DEPTH] = { "meteod_batch_depth",
+		"Readings waiting in logger batches." },
+	[METRIC_WAL_PENDING] = { "meteod_wal_pending",
+		"Write-ahead log entries waiting for commit." },
+	[METRIC_QUERIES_ACTIVE] = { "meteod_requests_active",
+		"Server requests being handled." },
+},
+hist_info[] = {
+	[METRIC_DECODE] = { "decode", NULL },
+	[METRIC_DISPATCH] = { "dispatch", NULL },
+	[METRIC_RRD_UPDATE] = { "rrd_update", NULL },
+	[METRIC_REQUEST] = { "request", NULL },
+	[METRIC_DELIVERY] = { "delivery", NULL },
+};
+
+static void release_shard(void *arg)
+{
+	struct shard *shard = (struct shard *)arg;
+	atomic_store(&shard->in_use, false);
+}
+
+static void create_key(void)
+{
+	if (pthread_key_create(&shard_key, release_shard) != 0)
+		log_error("Cannot create metrics thread key");
+}
+
+/*
+ * Get the shard of the calling thread, acquire one if the thread has none.
+ */
+static struct shard *get_shard(void)
+{
+	struct shard *shard;
+
+	if (my_shard != NULL)
+		return my_shard;
+
+	pthread_once(&once, create_key);
+
+	pthread_mutex_lock(&lock);
+	for (shard = shards; shard != NULL; shard = shard->next)
+		if (!atomic_load(&shard->in_use))
+			break;
+
+	if (shard == NULL) {
+		shard = malloc_safe(sizeof(*shard));
+		memset(shard, 0, sizeof(*shard));
+		shard->next = shards;
+		shards = shard;
+	}
+
+	atomic_store(&shard->in_use, true);
+	pthread_mutex_unlock(&lock);
+
+	(void) pthread_setspecific(shard_key, shard);
+	return my_shard = shard;
+}
+
+static inline void add(atomic_uint_fast64_t *value, uint64_t n)
+{
+	atomic_store_explicit(value,
+		atomic_load_explicit(value, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+void metrics_count(unsigned counter, uint64_t n)
+{
+	if (counter < METRIC_COUNTER_MAX)
+		add(&get_shard()->counters[counter], n);
+}
+
+void metrics_count_packet(byte_t type)
+{
+	unsigned index = METRICS_PACKET_TYPES - 1;
+
+	if (type >= 0xD0 && type < 0xD0 + METRICS_PACKET_TYPES - 1)
+		index = type - 0xD0;
+
+	metrics_count(METRIC_PACKETS + index, 1);
+}
+
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta)
+{
+	atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+void metrics_gauge_set(enum metric_gauge gauge, int64_t value)
+{
+	atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Index of the bucket for an observation of @ns nanoseconds, i.e.
+ * ceil(log2(@ns)) - HIST_MIN_SHIFT, within bounds.
+ */
+static inline size_t bucket_of(uint64_t ns)
+{
+	size_t log2;
+
+	if (ns <= (1ULL << HIST_MIN_SHIFT))
+		return 0;
+
+	log2 = 64 - __builtin_clzll(ns - 1);
+	return MIN(log2 - HIST_MIN_SHIFT, (size_t)HIST_BUCKETS);
+}
+
+void metrics_observe(enum metric_histogram hist, uint64_t ns)
+{
+	struct shard *shard = get_shard();
+
+	add(&shard->buckets[hist][bucket_of(ns)], 1);
+	add(&shard->sum_ns[hist], ns);
+}
+
+int metrics_register_logger(const char *name)
+{
+	size_t i;
+	int counter = -1;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < num_loggers; i++)
+		if (strcmp(logger_names[i], name) == 0)
+			break;
+
+	if (i == num_loggers && num_loggers < METRICS_MAX_LOGGERS)
+		logger_names[num_loggers++] = name;
+
+	if (i < num_loggers)
+		counter = METRIC_LOGGER_CALLS + i;
+	pthread_mutex_unlock(&lock);
+
+	return counter;
+}
+
+/*
+ * Sum of counter @counter over all shards. Must be called with @lock held.
+ */
+static uint64_t sum_counter(unsigned counter)
+{
+	struct shard *shard;
+	uint64_t sum = 0;
+
+	for (shard = shards; shard != NULL; shard = shard->next)
+		sum += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+
+	return sum;
+}
+
+static void print_header(struct strbuf *out, const char *name,
+	const char *help, const char *type)
+{
+	strbuf_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void print_packets(struct strbuf *out)
+{
+	const char *type_name;
+	char buf[8];
+	uint64_t count;
+	size_t i;
+
+	print_header(out, "meteod_packets_total", "Packets received, by type.",
+		"counter");
+
+	for (i = 0; i < METRICS_PACKET_TYPES; i++) {
+		count = sum_counter(METRIC_PACKETS + i);
+		if (i == METRICS_PACKET_TYPES - 1) {
+			type_name = "other";
+		}
+		else if ((type_name = packet_type_to_string(0xD0 + i)) == NULL) {
+			if (count == 0)
+				continue;
+			snprintf(buf, sizeof(buf), "0x%02zX", 0xD0 + i);
+			type_name = buf;
+		}
+
+		strbuf_printf(out, "meteod_packets_total{type=\"%s\"} %lu\n",
+			type_name, (unsigned long)count);
+	}
+}
+
+static void print_histograms(struct strbuf *out)
+{
+	struct shard *shard;
+	uint64_t buckets[HIST_BUCKETS + 1];
+	uint64_t sum_ns, count;
+	size_t h, b;
+
+	print_header(out, "meteod_stage_seconds",
+		"Time spent in processing stages.", "histogram");
+
+	for (h = 0; h < METRIC_HISTOGRAM_MAX; h++) {
+		memset(buckets, 0, sizeof(buckets));
+		sum_ns = 0;
+		for (shard = shards; shard != NULL; shard = shard->next) {
+			for (b = 0; b <= HIST_BUCKETS; b++)
+				buckets[b] += atomic_load_explicit(&shard->buckets[h][b],
+					memory_order_relaxed);
+			sum_ns += atomic_load_explicit(&shard->sum_ns[h], memory_order_relaxed);
+		}
+
+		for (b = 0, count = 0; b < HIST_BUCKETS; b++) {
+			count += buckets[b];
+			strbuf_printf(out,
+				"meteod_stage_seconds_bucket{stage=\"%s\",le=\"%.12g\"} %lu\n",
+				hist_info[h].name, (1ULL << (b + HIST_MIN_SHIFT)) / 1e9,
+				(unsigned long)count);
+		}
+
+		count += buckets[HIST_BUCKETS];
+		strbuf_printf(out,
+			"meteod_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+			"meteod_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+			"meteod_stage_seconds_count{stage=\"%s\"} %lu\n",
+			hist_info[h].name, (unsigned long)count,
+			hist_info[h].name, sum_ns / 1e9,
+			hist_info[h].name, (unsigned long)count);
+	}
+}
+
+void metrics_print(struct strbuf *out)
+{
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+
+	for (i = 0; i < METRIC_PACKETS; i++) {
+		print_header(out, counter_info[i].name, counter_info[i].help, "counter");
+		strbuf_printf(out, "%s %lu\n", counter_info[i].name,
+			(unsigned long)sum_counter(i));
+	}
+
+	print_packets(out);
+
+	print_header(out, "meteod_allocations_total",
+		"Memory allocations made by meteod.", "counter");
+	strbuf_printf(out, "meteod_allocations_total %lu\n",
+		(unsigned long)alloc_count());
+
+	print_header(out, "meteod_logger_calls_total", "Logger invocations.", "counter");
+	for (i = 0; i < num_loggers; i++)
+		strbuf_printf(out, "meteod_logger_calls_total{logger=\"%s\"} %lu\n",
+			logger_names[i], (unsigned long)sum_counter(METRIC_LOGGER_CALLS + i));
+
+	for (i = 0; i < METRIC_GAUGE_MAX; i++) {
+		print_header(out, gauge_info[i].name, gauge_info[i].help, "gauge");
+		strbuf_printf(out, "%s %li\n", gauge_info[i].name,
+			(long)atomic_load_explicit(&gauges[i], memory_order_relaxed));
+	}
+
+	print_histograms(out);
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Server interface.
+ */
+
+/*
+ * metrics
+ */
+static void cmd_metrics(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) srv;
+	(void) argc;
+	(void) argv;
+	(void) arg;
+
+	metrics_print(out);
+}
+
+/*
+ * /metrics
+ */
+static const char *page_metrics(struct wmr_server *srv, const char *path,
+	struct strbuf *body, void *arg)
+{
+	(void) srv;
+	(void) arg;
+
+	if (path[0] != '\0')
+		return NULL;
+
+	metrics_print(body);
+	return "text/plain; version=0.0.4";
+}
+
+void metrics_serve(struct wmr_server *srv)
+{
+	server_register_command(srv, "metrics", cmd_metrics, NULL);
+	server_register_page(srv, "/metrics", page_metrics, NULL);
+}
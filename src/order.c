@@ -0,0 +1,327 @@
+/*
+ * Ordering and de-duplication of readings.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "metrics.h"
+#include "order.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define	ORDER_MAGIC		0x4d57484d	/* "MHWM" */
+#define	ORDER_VERSION		2
+#define	ORDER_MODE		0600
+
+#define	FNV_BASIS		2166136261U
+#define	FNV_PRIME		16777619U
+
+/*
+ * Watermark file. Hashes are stored in the order they were recorded.
+ */
+struct order_file
+{
+	uint32_t magic;		/* ORDER_MAGIC */
+	uint32_t version;	/* ORDER_VERSION */
+	uint32_t checksum;	/* checksum of @src */
+	uint32_t reserved;
+	struct
+	{
+		int64_t hwm;
+		uint32_t num_hashes;
+		uint32_t hashes[ORDER_MAX_HASHES];
+	} src[WMR_SRC_MAX];
+};
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	const uint8_t *end = p + len;
+
+	for (; p < end; p++)
+		hash = (hash ^ *p) * FNV_PRIME;
+
+	return hash;
+}
+
+/*
+ * FNV-1a hash of the contents of @rec, time excluded. Records have no
+ * pointers, so hashes are stable across restarts.
+ */
+static uint32_t record_hash(struct wmr_record *rec)
+{
+	return hash_bytes(FNV_BASIS, &rec->type, sizeof(*rec) - offsetof(struct wmr_record, type));
+}
+
+/*
+ * Was a reading with hash @hash passed at time @src->hwm?
+ */
+static bool was_passed(struct order_source *src, uint32_t hash)
+{
+	size_t i;
+
+	for (i = 0; i < MIN(src->num_hashes, ORDER_MAX_HASHES); i++)
+		if (src->hashes[i] == hash)
+			return true;
+
+	return false;
+}
+
+static bool is_held(struct order_source *src, time_t time, uint32_t hash)
+{
+	size_t i;
+
+	for (i = 0; i < src->num_held; i++)
+		if ((time_t)src->held[i].rec.time == time && src->held[i].hash == hash)
+			return true;
+
+	return false;
+}
+
+/*
+ * Raise the watermark of @src to @time and remember the reading with hash
+ * @hash. When more readings than ORDER_MAX_HASHES are passed at the same
+ * time, the oldest hashes are overwritten.
+ */
+static void advance(struct order *order, struct order_source *src, time_t time,
+	uint32_t hash)
+{
+	if (time > src->hwm) {
+		src->hwm = time;
+		src->num_hashes = 0;
+	}
+
+	src->hashes[src->num_hashes++ % ORDER_MAX_HASHES] = hash;
+	order->dirty = true;
+}
+
+static void release_oldest(struct order *order, struct order_source *src,
+	order_release_t *release, void *arg)
+{
+	struct order_held held = src->held[0];
+	struct wmr_reading reading;
+
+	memmove(&src->held[0], &src->held[1], --src->num_held * sizeof(*src->held));
+	order->num_held--;
+
+	wmr_record_decode(&held.rec, &reading);
+	reading.seq = held.seq;
+	reading.recv_ns = held.recv_ns;
+	advance(order, src, reading.time, held.hash);
+	release(&reading, arg);
+}
+
+static int write_watermarks(struct order *order)
+{
+	struct order_file file;
+	size_t s;
+
+	memset(&file, 0, sizeof(file));
+	file.magic = ORDER_MAGIC;
+	file.version = ORDER_VERSION;
+
+	for (s = 0; s < WMR_SRC_MAX; s++) {
+		file.src[s].hwm = order->src[s].hwm;
+		file.src[s].num_hashes = MIN(order->src[s].num_hashes, ORDER_MAX_HASHES);
+		memcpy(file.src[s].hashes, order->src[s].hashes, sizeof(file.src[s].hashes));
+	}
+	file.checksum = hash_bytes(FNV_BASIS, file.src, sizeof(file.src));
+
+	if (pwrite(order->fd, &file, sizeof(file), 0) != sizeof(file)) {
+		log_error("order: cannot write %s: %s", order->cfg.path, strerror(errno));
+		return -1;
+	}
+
+	order->dirty = false;
+	order->synced = time(NULL);
+	return 0;
+}
+
+static void read_watermarks(struct order *order)
+{
+	struct order_file file;
+	time_t now = time(NULL);
+	ssize_t ret;
+	size_t s;
+
+	if ((ret = pread(order->fd, &file, sizeof(file), 0)) == 0)
+		return;	/* new file */
+
+	if (ret != sizeof(file) || file.magic != ORDER_MAGIC
+		|| file.version != ORDER_VERSION
+		|| file.checksum != hash_bytes(FNV_BASIS, file.src, sizeof(file.src))) {
+		log_warning("order: ignoring invalid watermark file %s", order->cfg.path);
+		return;
+	}
+
+	for (s = 0; s < WMR_SRC_MAX; s++) {
+		if (file.src[s].hwm > now + (time_t)order->cfg.max_skew) {
+			log_warning("order: ignoring watermark of source %zu, "
+				"%lld s ahead of the clock", s,
+				(long long)(file.src[s].hwm - now));
+			order->dirty = true;
+			continue;
+		}
+		order->src[s].hwm = file.src[s].hwm;
+		order->src[s].num_hashes = MIN(file.src[s].num_hashes, ORDER_MAX_HASHES);
+		memcpy(order->src[s].hashes, file.src[s].hashes, sizeof(file.src[s].hashes));
+	}
+}
+
+int order_open(struct order *order, struct order_cfg *cfg)
+{
+	memset(order, 0, sizeof(*order));
+	order->cfg = *cfg;
+	order->cfg.window = MIN(cfg->window, ORDER_WINDOW_MAX);
+	order->fd = -1;
+
+	if (cfg->path == NULL)
+		return 0;
+
+	if ((order->fd = open(cfg->path, O_RDWR | O_CREAT | O_CLOEXEC, ORDER_MODE)) == -1) {
+		log_error("order: cannot open %s: %s", cfg->path, strerror(errno));
+		return -1;
+	}
+
+	/* the file is reopened for writing, which umask may have prevented */
+	if (fchmod(order->fd, ORDER_MODE) != 0)
+		log_warning("order: chmod %s: %s", cfg->path, strerror(errno));
+
+	read_watermarks(order);
+	order_reconnect(order);
+	order->synced = time(NULL);
+	return 0;
+}
+
+void order_close(struct order *order)
+{
+	if (order->num_held > 0)
+		log_warning("order: discarding %zu held readings", order->num_held);
+
+	if (order->fd == -1)
+		return;
+
+	if (order->dirty && write_watermarks(order) == 0 && fdatasync(order->fd) != 0)
+		log_error("order: fdatasync: %s", strerror(errno));
+
+	(void) close(order->fd);
+	order->fd = -1;
+}
+
+/*
+ * The station clock of @src was set back, so its watermark no longer
+ * tells which readings were passed. Release the held readings, which are
+ * newer than the new ones, and forget the watermark.
+ */
+static void reset(struct order *order, struct order_source *src,
+	order_release_t *release, void *arg)
+{
+	while (src->num_held > 0)
+		release_oldest(order, src, release, arg);
+
+	src->hwm = 0;
+	src->num_hashes = 0;
+	src->resend = 0;
+	order->dirty = true;
+}
+
+void order_push(struct order *order, struct wmr_reading *reading, bool historic,
+	order_release_t *release, void *arg)
+{
+	struct order_source *src;
+	struct wmr_record rec;
+	uint32_t hash;
+	size_t i;
+	int s;
+
+	if ((s = wmr_source_of(reading)) < 0 || reading->type == WMR_META) {
+		release(reading, arg);
+		return;
+	}
+
+	src = &order->src[s];
+	wmr_record_encode(reading, &rec);
+	hash = record_hash(&rec);
+
+	if (!historic && reading->time + (time_t)order->cfg.max_skew < src->hwm) {
+		log_warning("order: %s time went back by %lld s, resetting watermark",
+			wmr_sensor_name(reading), (long long)(src->hwm - reading->time));
+		reset(order, src, release, arg);
+	}
+
+	if (reading->time < src->hwm) {
+		log_debug("order: dropping late %s reading", wmr_sensor_name(reading));
+		metrics_count(METRIC_LATE_READINGS, 1);
+		return;
+	}
+
+	if ((historic || reading->time <= src->resend)
+		&& ((reading->time == src->hwm && was_passed(src, hash))
+		|| is_held(src, reading->time, hash))) {
+		log_debug("order: dropping duplicate %s reading", wmr_sensor_name(reading));
+		metrics_count(METRIC_DUPLICATE_READINGS, 1);
+		return;
+	}
+
+	/* readings of the same time are kept in order of arrival */
+	for (i = src->num_held; i > 0 && (time_t)src->held[i - 1].rec.time > reading->time; i--)
+		src->held[i] = src->held[i - 1];
+	if (i < src->num_held)
+		metrics_count(METRIC_REORDERED_READINGS, 1);
+
+	src->held[i].rec = rec;
+	src->held[i].seq = reading->seq;
+	src->held[i].recv_ns = reading->recv_ns;
+	src->held[i].hash = hash;
+	src->num_held++;
+	order->num_held++;
+
+	if (src->num_held > order->cfg.window)
+		release_oldest(order, src, release, arg);
+}
+
+void order_flush(struct order *order, order_release_t *release, void *arg)
+{
+	size_t s;
+
+	for (s = 0; s < WMR_SRC_MAX && order->num_held > 0; s++)
+		while (order->src[s].num_held > 0)
+			release_oldest(order, &order->src[s], release, arg);
+
+	if (order->dirty && order->fd != -1
+		&& time(NULL) - order->synced >= (time_t)order->cfg.sync_interval)
+		(void) write_watermarks(order);
+}
+
+void order_reconnect(struct order *order)
+{
+	size_t s;
+
+	for (s = 0; s < WMR_SRC_MAX; s++)
+		order->src[s].resend = order->src[s].hwm;
+}
+
+bool order_pending(struct order *order)
+{
+	return order->num_held > 0 || (order->dirty && order->fd != -1);
+}
+
+void order_note(struct order *order, struct wmr_reading *reading)
+{
+	struct order_source *src;
+	struct wmr_record rec;
+	int s;
+
+	if ((s = wmr_source_of(reading)) < 0 || reading->type == WMR_META)
+		return;
+
+	src = &order->src[s];
+	wmr_record_encode(reading, &rec);
+	if (reading->time >= src->hwm)
+		advance(order, src, reading->time, record_hash(&rec));
+}
@@ -5,25 +5,55 @@
 
 #include "common.h"
 #include "log.h"
+#include "metrics.h"
 #include "rrd-logger.h"
+#include "series.h"
 
-#include <assert.h>
-#include <limits.h>
 #include <rrd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-char path_buf[PATH_MAX];	/* static path buffer */
-
 /*
- * Paste paths p1 and p2.
+ * Paste paths @p1 and @p2 into @w->path.
  *
- * NOTE: The resulting string is alloc'd in a static buffer, don't pass it
- *       to free(3).
+ * Return value:
+ *	Zero on success, -1 if the path is too long.
+ */
+static int paste_path(struct rrd_writer *w, char *p1, char *p2)
+{
+	if ((size_t)snprintf(w->path, sizeof(w->path), "%s/%s", p1, p2) >= sizeof(w->path)) {
+		log_error("rrd: path %s/%s is too long", p1, p2);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start an update of an RRD database file in @w->data.
+ */
+static void begin_update(struct rrd_writer *w)
+{
+	/* TODO: insert reading time instead of current time */
+	strbuf_reset(&w->data);
+	strbuf_put_int(&w->data, time(NULL));
+}
+
+/*
+ * Append value @value with @decimals decimal places to the update.
  */
-static char *paste_path(char *p1, char *p2)
+static void add_value(struct rrd_writer *w, double value, unsigned decimals)
 {
-	assert(snprintf(path_buf, sizeof(path_buf), "%s/%s", p1, p2) >= 0);
-	return path_buf;
+	strbuf_putc(&w->data, ':');
+	strbuf_put_fixed(&w->data, value, decimals);
+}
+
+static void add_uint(struct rrd_writer *w, unsigned value)
+{
+	strbuf_putc(&w->data, ':');
+	strbuf_put_uint(&w->data, value);
 }
 
 /*
@@ -31,115 +61,94 @@ static char *paste_path(char *p1, char *p2)
  * root is @rel_path.
  *
  * NOTE: One parameter is implicit: the data which should be written to the
- *       database file, which is contained in @logger->data.
+ *       database file, which is contained in @w->data.
+ *
+ * rrd_update_r is the thread-safe variant of rrd_update; errors are kept
+ * per thread by librrd.
  */
-static void update(struct rrd_logger *logger, char *rel_path)
+static void update(struct rrd_writer *w, char *rel_path)
 {
+	const char *data = strbuf_get_string(&w->data);
+	uint64_t start;
 	int ret;
-	char *cpy;
 
-	/* TODO: insert reading time instead of current time */
-	cpy = strbuf_strcpy(&logger->data);
-	strbuf_reset(&logger->data);
-	strbuf_printf(&logger->data, "%li:%s", time(NULL), cpy);
-	free(cpy);
-
-	char *update_params[] = {
-		"rrdupdate",
-		paste_path(logger->cfg.rrd_root, rel_path),
-		strbuf_get_string(&logger->data),
-		NULL
-	};
-
-	ret = rrd_update(ARRAY_SIZE(update_params) - 1, update_params);
+	if (paste_path(w, w->cfg->rrd_root, rel_path) != 0)
+		return;
+
+	start = metrics_now();
+	ret = rrd_update_r(w->path, NULL, 1, &data);
+	metrics_observe(METRIC_RRD_UPDATE, metrics_now() - start);
 	if (ret != 0) {
 		log_error("rrd_update: %s", rrd_get_error()); /* TODO quit */
 		rrd_clear_error();
 	}
 }
 
-static void log_wind(struct rrd_logger *logger, struct wmr_wind *wind)
+static void log_wind(struct rrd_writer *w, struct wmr_wind *wind)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%.1f:%.1f",
-		wind->avg_speed,
-		wind->gust_speed);
+	begin_update(w);
+	add_value(w, wind->avg_speed, 1);
+	add_value(w, wind->gust_speed, 1);
 
-	update(logger, logger->cfg.wind_rrd);
+	update(w, w->cfg->wind_rrd);
 }
 
-static void log_rain(struct rrd_logger *logger, struct wmr_rain *rain)
+static void log_rain(struct rrd_writer *w, struct wmr_rain *rain)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%.1f:%.0f",
-		rain->rate,
-		rain->accum_2007);
+	begin_update(w);
+	add_value(w, rain->rate, 1);
+	add_value(w, rain->accum_2007, 0);
 
-	update(logger, logger->cfg.rain_rrd);
+	update(w, w->cfg->rain_rrd);
 }
 
-static void log_uvi(struct rrd_logger *logger, struct wmr_uvi *uvi)
+static void log_uvi(struct rrd_writer *w, struct wmr_uvi *uvi)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%u",
-		uvi->index);
+	begin_update(w);
+	add_uint(w, uvi->index);
 
-	update(logger, logger->cfg.uvi_rrd);
+	update(w, w->cfg->uvi_rrd);
 }
 
-static void log_baro(struct rrd_logger *logger, struct wmr_baro *baro)
+static void log_baro(struct rrd_writer *w, struct wmr_baro *baro)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%u:%u",
-		baro->pressure,
-		baro->alt_pressure);
+	begin_update(w);
+	add_uint(w, baro->pressure);
+	add_uint(w, baro->alt_pressure);
 
-	update(logger, logger->cfg.baro_rrd);
+	update(w, w->cfg->baro_rrd);
 }
 
-static void log_temp(struct rrd_logger *logger, struct wmr_temp *temp)
+static void log_temp(struct rrd_writer *w, struct wmr_temp *temp)
 {
-	struct strbuf filename; /* filename depends on sensor ID */
+	char filename[NAME_MAX + 1]; /* filename depends on sensor ID */
 
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%.1f:%u:%.1f",
-		temp->temp,
-		temp->humidity,
-		temp->dew_point);
+	begin_update(w);
+	add_value(w, temp->temp, 1);
+	add_uint(w, temp->humidity);
+	add_value(w, temp->dew_point, 1);
 
-	strbuf_init(&filename, 128);
-	strbuf_printf(&filename, logger->cfg.temp_N_rrd, temp->sensor_id);
-	update(logger, strbuf_get_string(&filename));
-	strbuf_free(&filename);
+	(void) snprintf(filename, sizeof(filename), w->cfg->temp_N_rrd, temp->sensor_id);
+	update(w, filename);
 }
 
-static void log_reading(struct rrd_logger *logger, struct wmr_reading *reading)
+static void log_reading(struct rrd_writer *w, struct wmr_reading *reading)
 {
 	switch (reading->type) {
 	case WMR_WIND:
-		log_wind(logger, &reading->wind);
+		log_wind(w, &reading->wind);
 		break;
 	case WMR_RAIN:
-		log_rain(logger, &reading->rain);
+		log_rain(w, &reading->rain);
 		break;
 	case WMR_UVI:
-		log_uvi(logger, &reading->uvi);
+		log_uvi(w, &reading->uvi);
 		break;
 	case WMR_BARO:
-		log_baro(logger, &reading->baro);
+		log_baro(w, &reading->baro);
 		break;
 	case WMR_TEMP:
-		log_temp(logger, &reading->temp);
+		log_temp(w, &reading->temp);
 		break;
 	}
 }
@@ -148,15 +157,179 @@ void rrd_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
 {
 	(void) wmr;
 	struct rrd_logger *logger = (struct rrd_logger *)arg;
-	log_reading(logger, reading);
+	log_reading(&logger->writer, reading);
+}
+
+static void *writer_pthread(void *arg)
+{
+	struct rrd_shard *shard = (struct rrd_shard *)arg;
+	struct rrd_logger *logger = shard->logger;
+	size_t i;
+
+	pthread_mutex_lock(&logger->lock);
+	while (1) {
+		while (!logger->quit && shard->num_todo == 0)
+			pthread_cond_wait(&logger->work_cond, &logger->lock);
+
+		if (logger->quit)
+			break;
+
+		/* the readings are not touched until the batch is done */
+		pthread_mutex_unlock(&logger->lock);
+		for (i = 0; i < shard->num_todo; i++)
+			log_reading(&shard->writer, shard->todo[i]);
+		pthread_mutex_lock(&logger->lock);
+
+		shard->num_todo = 0;
+		if (--logger->num_busy == 0)
+			pthread_cond_signal(&logger->done_cond);
+	}
+	pthread_mutex_unlock(&logger->lock);
+
+	return NULL;
+}
+
+/*
+ * Hand readings @latest of each series over to the shards and wait until
+ * they are logged.
+ */
+static void log_sharded(struct rrd_logger *logger, struct wmr_reading **latest)
+{
+	struct rrd_shard *shard;
+	int old_state;
+	int series;
+
+	/*
+	 * The caller must not be cancelled while waiting, as the shards
+	 * would be left with readings it owns and the lock held.
+	 */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+	pthread_mutex_lock(&logger->lock);
+
+	for (series = 0; series < SERIES_MAX; series++) {
+		if (latest[series] == NULL)
+			continue;
+
+		shard = &logger->shards[series % logger->num_shards];
+		if (shard->num_todo++ == 0)
+			logger->num_busy++;
+		shard->todo[shard->num_todo - 1] = latest[series];
+	}
+
+	pthread_cond_broadcast(&logger->work_cond);
+	while (logger->num_busy > 0)
+		pthread_cond_wait(&logger->done_cond, &logger->lock);
+
+	pthread_mutex_unlock(&logger->lock);
+	pthread_setcancelstate(old_state, NULL);
+}
+
+/*
+ * All updates are timestamped with current time and RRD does not accept
+ * two updates of a file with the same timestamp. Therefore, only the latest
+ * reading in @readings is logged for each of the files, which makes it
+ * a single rrd_update per file per batch.
+ */
+void rrd_log_batch(struct wmr200 *wmr, struct wmr_reading *readings, size_t count,
+	bool flush, void *arg)
+{
+	(void) wmr;
+	(void) flush;
+	struct rrd_logger *logger = (struct rrd_logger *)arg;
+	struct wmr_reading *latest[SERIES_MAX] = { NULL };
+	size_t i;
+	int series;
+
+	for (i = 0; i < count; i++)
+		if ((series = series_of(&readings[i])) >= 0)
+			latest[series] = &readings[i];
+
+	if (logger->num_shards > 0) {
+		log_sharded(logger, latest);
+		return;
+	}
+
+	for (series = 0; series < SERIES_MAX; series++)
+		if (latest[series] != NULL)
+			log_reading(&logger->writer, latest[series]);
+}
+
+static void writer_init(struct rrd_writer *w, struct rrd_cfg *cfg)
+{
+	w->cfg = cfg;
+	strbuf_init(&w->data, 128);
+}
+
+/*
+ * Stop the first @count writer threads of @logger.
+ */
+static void stop_shards(struct rrd_logger *logger, size_t count)
+{
+	size_t i;
+
+	pthread_mutex_lock(&logger->lock);
+	logger->quit = true;
+	pthread_cond_broadcast(&logger->work_cond);
+	pthread_mutex_unlock(&logger->lock);
+
+	for (i = 0; i < count; i++) {
+		pthread_join(logger->shards[i].thread, NULL);
+		strbuf_free(&logger->shards[i].writer.data);
+	}
+
+	free(logger->shards);
+	logger->shards = NULL;
+	logger->num_shards = 0;
+	logger->quit = false;
+}
+
+int rrd_logger_start(struct rrd_logger *logger)
+{
+	size_t n = MIN(logger->cfg.num_writers, SERIES_MAX);
+	size_t i;
+
+	if (n == 0)
+		return 0;
+
+	logger->shards = malloc_safe(n * sizeof(*logger->shards));
+	for (i = 0; i < n; i++) {
+		logger->shards[i].logger = logger;
+		logger->shards[i].num_todo = 0;
+		writer_init(&logger->shards[i].writer, &logger->cfg);
+
+		if (pthread_create(&logger->shards[i].thread, NULL,
+			writer_pthread, &logger->shards[i]) != 0) {
+			log_error("rrd: cannot start writer thread");
+			strbuf_free(&logger->shards[i].writer.data);
+			stop_shards(logger, i);
+			return -1;
+		}
+	}
+
+	logger->num_shards = n;
+	return 0;
 }
 
 void rrd_logger_init(struct rrd_logger *logger)
 {
-	strbuf_init(&logger->data, 128);
+	memset(&logger->cfg, 0, sizeof(logger->cfg));
+	writer_init(&logger->writer, &logger->cfg);
+	logger->shards = NULL;
+	logger->num_shards = 0;
+	pthread_mutex_init(&logger->lock, NULL);
+	pthread_cond_init(&logger->work_cond, NULL);
+	pthread_cond_init(&logger->done_cond, NULL);
+	logger->num_busy = 0;
+	logger->quit = false;
 }
 
 void rrd_logger_free(struct rrd_logger *logger)
 {
-	strbuf_free(&logger->data);
+	if (logger->shards != NULL)
+		stop_shards(logger, logger->num_shards);
+
+	strbuf_free(&logger->writer.data);
+	pthread_cond_destroy(&logger->done_cond);
+	pthread_cond_destroy(&logger->work_cond);
+	pthread_mutex_destroy(&logger->lock);
 }
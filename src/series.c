@@ -0,0 +1,245 @@
+/*
+ * Numeric view of readings.
+ */
+
+#include "common.h"
+#include "series.h"
+#include "server.h"
+
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *wind_fields[] = { "gust_speed", "avg_speed", "chill" };
+static const char *rain_fields[] = { "rate", "accum_hour", "accum_24h", "accum_2007" };
+static const char *uvi_fields[] = { "index" };
+static const char *baro_fields[] = { "pressure", "alt_pressure" };
+static const char *temp_fields[] = { "temp", "humidity", "dew_point" };
+
+static const char *temp_names[WMR200_MAX_TEMP_SENSORS] = {
+	"temp0", "temp1", "temp2", "temp3", "temp4",
+	"temp5", "temp6", "temp7", "temp8", "temp9"
+};
+
+int series_of(struct wmr_reading *reading)
+{
+	switch (reading->type) {
+	case WMR_WIND:
+		return SERIES_WIND;
+	case WMR_RAIN:
+		return SERIES_RAIN;
+	case WMR_UVI:
+		return SERIES_UVI;
+	case WMR_BARO:
+		return SERIES_BARO;
+	case WMR_TEMP:
+		if (reading->temp.sensor_id >= WMR200_MAX_TEMP_SENSORS)
+			return -1;
+		return SERIES_TEMP0 + reading->temp.sensor_id;
+	}
+
+	return -1;
+}
+
+size_t series_get_values(struct wmr_reading *reading, float *values)
+{
+	switch (reading->type) {
+	case WMR_WIND:
+		values[0] = reading->wind.gust_speed;
+		values[1] = reading->wind.avg_speed;
+		values[2] = reading->wind.chill;
+		return 3;
+	case WMR_RAIN:
+		values[0] = reading->rain.rate;
+		values[1] = reading->rain.accum_hour;
+		values[2] = reading->rain.accum_24h;
+		values[3] = reading->rain.accum_2007;
+		return 4;
+	case WMR_UVI:
+		values[0] = reading->uvi.index;
+		return 1;
+	case WMR_BARO:
+		values[0] = reading->baro.pressure;
+		values[1] = reading->baro.alt_pressure;
+		return 2;
+	case WMR_TEMP:
+		values[0] = reading->temp.temp;
+		values[1] = reading->temp.humidity;
+		values[2] = reading->temp.dew_point;
+		return 3;
+	}
+
+	return 0;
+}
+
+static const char **fields_of(int series, size_t *num_fields)
+{
+	switch (series) {
+	case SERIES_WIND:
+		*num_fields = ARRAY_SIZE(wind_fields);
+		return wind_fields;
+	case SERIES_RAIN:
+		*num_fields = ARRAY_SIZE(rain_fields);
+		return rain_fields;
+	case SERIES_UVI:
+		*num_fields = ARRAY_SIZE(uvi_fields);
+		return uvi_fields;
+	case SERIES_BARO:
+		*num_fields = ARRAY_SIZE(baro_fields);
+		return baro_fields;
+	}
+
+	*num_fields = ARRAY_SIZE(temp_fields);
+	return temp_fields;
+}
+
+const char *series_name(int series)
+{
+	switch (series) {
+	case SERIES_WIND:
+		return "wind";
+	case SERIES_RAIN:
+		return "rain";
+	case SERIES_UVI:
+		return "uvi";
+	case SERIES_BARO:
+		return "baro";
+	}
+
+	if (series >= SERIES_TEMP0 && series < SERIES_MAX)
+		return temp_names[series - SERIES_TEMP0];
+	return NULL;
+}
+
+size_t series_num_fields(int series)
+{
+	size_t num_fields;
+	(void) fields_of(series, &num_fields);
+	return num_fields;
+}
+
+const char *series_field_name(int series, size_t field)
+{
+	size_t num_fields;
+	const char **fields = fields_of(series, &num_fields);
+
+	if (field >= num_fields)
+		return NULL;
+	return fields[field];
+}
+
+int series_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SERIES_MAX; i++)
+		if (strcmp(series_name(i), name) == 0)
+			return i;
+
+	return -1;
+}
+
+int series_field_lookup(int series, const char *name)
+{
+	size_t num_fields;
+	const char **fields = fields_of(series, &num_fields);
+	size_t i;
+
+	for (i = 0; i < num_fields; i++)
+		if (strcmp(fields[i], name) == 0)
+			return i;
+
+	return -1;
+}
+
+void series_agg_reset(struct series_agg *agg, time_t time)
+{
+	agg->time = time;
+	agg->min = FLT_MAX;
+	agg->max = -FLT_MAX;
+	agg->sum = 0;
+	agg->count = 0;
+}
+
+void series_print_agg(struct strbuf *out, struct series_agg *agg)
+{
+	if (agg->count == 0) {
+		strbuf_printf(out, "%li\tcount=0\n", agg->time);
+		return;
+	}
+
+	strbuf_printf(out, "%li\tmin=%.1f\tmax=%.1f\tavg=%.1f\tcount=%zu\n",
+		agg->time, agg->min, agg->max, agg->sum / agg->count, agg->count);
+}
+
+bool series_hwm_covers(struct series_hwm *hwm, time_t time)
+{
+	if (time < hwm->time)
+		return true;
+
+	if (time == hwm->time && hwm->count > 0) {
+		hwm->count--;
+		return true;
+	}
+
+	return false;
+}
+
+void series_hwm_add(struct series_hwm *hwm, time_t time, size_t count)
+{
+	if (time > hwm->time) {
+		hwm->time = time;
+		hwm->count = count;
+	}
+	else if (time == hwm->time) {
+		hwm->count += count;
+	}
+}
+
+void series_print_sample(time_t time, float *values, size_t num_fields, void *arg)
+{
+	struct series_print_ctx *ctx = (struct series_print_ctx *)arg;
+	size_t f;
+
+	/* this is called for every sample of a range, avoid printf */
+	strbuf_put_int(ctx->out, time);
+	for (f = 0; f < num_fields; f++) {
+		strbuf_putc(ctx->out, '\t');
+		strbuf_puts(ctx->out, series_field_name(ctx->series, f));
+		strbuf_putc(ctx->out, '=');
+		strbuf_put_fixed(ctx->out, values[f], 1);
+	}
+	strbuf_putc(ctx->out, '\n');
+}
+
+int series_parse_args(int argc, char *argv[], bool want_field,
+	int *series, int *field, time_t *from, time_t *to, struct strbuf *out)
+{
+	int argi = 1;
+
+	if (argc < (want_field ? 5 : 4)) {
+		server_error(out, "Not enough arguments");
+		return -1;
+	}
+
+	if ((*series = series_lookup(argv[argi++])) < 0) {
+		server_error(out, "Unknown series '%s'", argv[1]);
+		return -1;
+	}
+
+	if (want_field) {
+		if ((*field = series_field_lookup(*series, argv[argi])) < 0) {
+			server_error(out, "Unknown field '%s'", argv[argi]);
+			return -1;
+		}
+		argi++;
+	}
+
+	if (server_parse_time(argv[argi], from) != 0
+		|| server_parse_time(argv[argi + 1], to) != 0) {
+		server_error(out, "Invalid time range");
+		return -1;
+	}
+
+	return 0;
+}
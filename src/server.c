@@ -2,145 +2,594 @@
  * Make data available over TCP/IP.
  */
 
+#include "arena.h"
+#include "latest.h"
 #include "log.h"
+#include "metrics.h"
 #include "server.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
 #define	DEFAULT_PORT		20892
+#define	DEFAULT_QUERY_PORT	20893
 
-static void print_wind(struct wmr_wind *wind, int fd)
+#define	QUERY_MAX_LEN		512	/* maximum length of a query line */
+#define	QUERY_MAX_ARGS		16	/* maximum number of query words */
+#define	QUERY_TIMEOUT_SEC	5	/* time to wait for the query line */
+
+#define	UNIX_SOCKET_MODE	0660	/* group members may query */
+
+#define	IS_STALE(latest, src)	(((latest)->stale & WMR_SRC_BIT(src)) != 0)
+
+/*
+ * A registered query command.
+ */
+struct server_cmd
+{
+	struct server_cmd *next;	/* linked list of commands */
+	const char *name;		/* command name */
+	server_cmd_t *func;		/* command handler */
+	void *arg;			/* extra argument to @func */
+};
+
+/*
+ * A registered HTTP page (or pages sharing a path prefix).
+ */
+struct server_page
 {
-	dprintf(fd, "wind\tdir=%s\tgust_speed=%.1f m/s\tavg_speed=%.1f m/s\tchill=%.1f \u00B0C\n",
-		wind->dir,
-		wind->gust_speed,
-		wind->avg_speed,
-		wind->chill);
+	struct server_page *next;	/* linked list of pages */
+	const char *prefix;		/* path prefix */
+	server_page_t *func;		/* page handler */
+	void *arg;			/* extra argument to @func */
+};
+
+static const struct wmr_server_cfg default_cfg = {
+	.port = DEFAULT_PORT,
+	.query_port = DEFAULT_QUERY_PORT,
+	.unix_path = NULL,
+	.admit = {
+		.rate = 5,
+		.burst = 20,
+		.max_conns = 64,
+		.priority_conns = 16,
+	},
+};
+
+/*
+ * A query connection being handled.
+ */
+struct query
+{
+	struct wmr_server *srv;		/* the server */
+	int fd;				/* client socket */
+};
+
+static void print_wind(struct wmr_wind *wind, struct strbuf *out)
+{
+	strbuf_puts(out, "wind\tdir=");
+	strbuf_puts(out, wind->dir);
+	strbuf_puts(out, "\tgust_speed=");
+	strbuf_put_fixed(out, wind->gust_speed, 1);
+	strbuf_puts(out, " m/s\tavg_speed=");
+	strbuf_put_fixed(out, wind->avg_speed, 1);
+	strbuf_puts(out, " m/s\tchill=");
+	strbuf_put_fixed(out, wind->chill, 1);
+	strbuf_puts(out, " \u00B0C");
 }
 
-static void print_rain(struct wmr_rain *rain, int fd)
+static void print_rain(struct wmr_rain *rain, struct strbuf *out)
 {
-	dprintf(fd, "rain\trate=%.1f mm/m^2\taccum_hour=%.1f mm/m^2\t"
-		"accum_24h=%1.f mm/m^2\taccum_2007=%.1f mm/m^2\n",
-		rain->rate,
-		rain->accum_hour,
-		rain->accum_24h,
-		rain->accum_2007);
+	strbuf_puts(out, "rain\trate=");
+	strbuf_put_fixed(out, rain->rate, 1);
+	strbuf_puts(out, " mm/m^2\taccum_hour=");
+	strbuf_put_fixed(out, rain->accum_hour, 1);
+	strbuf_puts(out, " mm/m^2\taccum_24h=");
+	strbuf_put_fixed(out, rain->accum_24h, 0);
+	strbuf_puts(out, " mm/m^2\taccum_2007=");
+	strbuf_put_fixed(out, rain->accum_2007, 1);
+	strbuf_puts(out, " mm/m^2");
 }
 
-static void print_uvi(struct wmr_uvi *uvi, int fd)
+static void print_uvi(struct wmr_uvi *uvi, struct strbuf *out)
 {
-	dprintf(fd, "uvi\tindex=%u\n", uvi->index);
+	strbuf_puts(out, "uvi\tindex=");
+	strbuf_put_uint(out, uvi->index);
 }
 
-static void print_baro(struct wmr_baro *baro, int fd)
+static void print_baro(struct wmr_baro *baro, struct strbuf *out)
 {
-	dprintf(fd, "baro\talt_pressure=%u hPa\tforecast=%s\n",
-		baro->alt_pressure,
-		baro->forecast);
+	strbuf_puts(out, "baro\talt_pressure=");
+	strbuf_put_uint(out, baro->alt_pressure);
+	strbuf_puts(out, " hPa\tforecast=");
+	strbuf_puts(out, baro->forecast);
 }
 
-static void print_temp(struct wmr_temp *temp, int fd)
+static void print_temp(struct wmr_temp *temp, struct strbuf *out)
 {
-	dprintf(fd, "temp\tsensor=%s\ttemp=%.1f \u00B0C\thumidity=%u %%\tdew_point=%.1f \u00B0C\n",
-		"console",
-		temp->temp,
-		temp->humidity,
-		temp->dew_point);
+	strbuf_puts(out, "temp\tsensor=console\ttemp=");
+	strbuf_put_fixed(out, temp->temp, 1);
+	strbuf_puts(out, " \u00B0C\thumidity=");
+	strbuf_put_uint(out, temp->humidity);
+	strbuf_puts(out, " %\tdew_point=");
+	strbuf_put_fixed(out, temp->dew_point, 1);
+	strbuf_puts(out, " \u00B0C");
 }
 
-static void print_status(struct wmr_status *status, int fd)
+static void print_status(struct wmr_status *status, struct strbuf *out)
 {
-	dprintf(fd, "status\twind_bat=%s\ttemp_bat=%s\train_bat=%s\tuv_bat=%s\t"
+	strbuf_printf(out, "status\twind_bat=%s\ttemp_bat=%s\train_bat=%s\tuv_bat=%s\t"
 		"wind_sensor=%s\ttemp_sensor=%s\train_sensor=%s\tuv_sensor=%s\t"
-		"rtc_signal=%s\n",
+		"rtc_signal=%s",
 		status->wind_bat, status->temp_bat, status->rain_bat, status->uv_bat,
 		status->wind_sensor, status->temp_sensor, status->rain_sensor,
 		status->uv_sensor, status->rtc_signal_level);
 }
 
-static void print_meta(struct wmr_meta *meta, int fd)
+static void print_meta(struct wmr_meta *meta, struct strbuf *out)
 {
+	char time_buf[26];
 
-	(void) meta;
-	dprintf(fd, "meta\tnpackets=%u\tnfailed=%u\tnframes=%u\terror_rate=%.1f\t"
-		"nbytes=%lu\tlatest_packet=%s\tuptime=%02lu:%02lu:%02lu\n",
+	strbuf_printf(out, "meta\tnpackets=%u\tnfailed=%u\tnframes=%u\terror_rate=%.1f\t"
+		"nbytes=%lu\tlatest_packet=%s\tuptime=%02lu:%02lu:%02lu",
 		meta->num_packets,
 		meta->num_failed,
 		meta->num_frames,
 		meta->error_rate,
 		meta->num_bytes,
-		ctime(&meta->latest_packet),
+		ctime_r(&meta->latest_packet, time_buf),
 		meta->uptime / 3600, (meta->uptime % 3600) / 60, meta->uptime % 60);
 }
 
-static void print_reading(struct wmr_reading *reading, int fd)
+/*
+ * Print @reading as a line of @out, followed by its sequence number and
+ * receive time (CLOCK_MONOTONIC, ns) if known. If the reading is @stale,
+ * its age is appended, in seconds.
+ */
+static void print_reading(struct wmr_reading *reading, bool stale, time_t now,
+	struct strbuf *out)
 {
 	switch (reading->type) {
 	case 0: /* not measured yet */
-		break;
+		return;
 	case WMR_WIND:
-		print_wind(&reading->wind, fd);
+		print_wind(&reading->wind, out);
 		break;
 	case WMR_RAIN:
-		print_rain(&reading->rain, fd);
+		print_rain(&reading->rain, out);
 		break;
 	case WMR_UVI:
-		print_uvi(&reading->uvi, fd);
+		print_uvi(&reading->uvi, out);
 		break;
 	case WMR_BARO:
-		print_baro(&reading->baro, fd);
+		print_baro(&reading->baro, out);
 		break;
 	case WMR_TEMP:
-		print_temp(&reading->temp, fd);
+		print_temp(&reading->temp, out);
 		break;
 	case WMR_STATUS:
-		print_status(&reading->status, fd);
+		print_status(&reading->status, out);
 		break;
 	case WMR_META:
-		print_meta(&reading->meta, fd);
+		print_meta(&reading->meta, out);
 		break;
 	default:
 		assert(0);
 	}
+
+	if (reading->seq != 0) {
+		strbuf_puts(out, "\tseq=");
+		strbuf_put_uint(out, reading->seq);
+	}
+	if (reading->recv_ns != 0) {
+		strbuf_puts(out, "\trecv_ns=");
+		strbuf_put_uint(out, reading->recv_ns);
+	}
+	if (stale) {
+		strbuf_puts(out, "\tstale=");
+		strbuf_put_uint(out, now > reading->time ? now - reading->time : 0);
+		strbuf_puts(out, " s");
+	}
+	strbuf_putc(out, '\n');
 }
 
-static void mainloop(struct wmr_server *srv)
+static int write_all(int fd, char *buf, size_t len)
 {
+	ssize_t ret;
+
+	while (len > 0) {
+		if ((ret = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Print the latest readings of @srv whose sequence number is greater than
+ * @since into @out.
+ */
+static void print_latest(struct wmr_server *srv, uint64_t since, struct strbuf *out)
+{
+	struct wmr_reading *readings[WMR_SRC_MAX];
 	struct wmr_latest_data latest;
+	time_t now = time(NULL);
+	size_t i, n = 0;
+
+	if (srv->latest != NULL)
+		latest_get(srv->latest, &latest);
+	else if (srv->wmr != NULL)
+		wmr_get_latest_data(srv->wmr, &latest);
+	else
+		return;
+
+	readings[n++] = &latest.wind;
+	readings[n++] = &latest.rain;
+	readings[n++] = &latest.baro;
+	readings[n++] = &latest.uvi;
+	for (i = 0; i < WMR200_MAX_TEMP_SENSORS; i++)
+		readings[n++] = &latest.temp[i];
+	readings[n++] = &latest.meta;
+	readings[n++] = &latest.status;
+
+	for (i = 0; i < n; i++)
+		if (readings[i]->seq > since || since == 0)
+			print_reading(readings[i], IS_STALE(&latest, wmr_source_of(readings[i])),
+				now, out);
+}
+
+static void serve_latest(struct wmr_server *srv, int fd)
+{
+	struct arena *arena = arena_thread();
+	struct arena_mark mark = arena_save(arena);
+	struct strbuf out;
+
+	/* the response is written at once */
+	strbuf_init_arena(&out, 4096, arena);
+
+	print_latest(srv, 0, &out);
+
+	if (srv->stats != NULL)
+		stats_print(srv->stats, &out);
+
+	(void) write_all(fd, strbuf_get_string(&out), strbuf_strlen(&out));
+	arena_reset(arena, mark);
+}
+
+/*
+ * since <seq>
+ *
+ * Print the latest readings which changed since the reading with sequence
+ * number <seq>. Clients polling for changes pass the greatest sequence
+ * number seen so far.
+ */
+static void cmd_since(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) arg;
+	unsigned long long since;
+	char *end;
+
+	if (argc != 2) {
+		server_error(out, "Usage: since <seq>");
+		return;
+	}
+
+	errno = 0;
+	since = strtoull(argv[1], &end, 10);
+	if (errno != 0 || *end != '\0' || end == argv[1]) {
+		server_error(out, "Invalid sequence number");
+		return;
+	}
+
+	print_latest(srv, since, out);
+}
+
+/*
+ * latest
+ *
+ * Print the latest data as served on the data port, for clients of the
+ * Unix socket.
+ */
+static void cmd_latest(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) argc;
+	(void) argv;
+	(void) arg;
+
+	print_latest(srv, 0, out);
+	if (srv->stats != NULL)
+		stats_print(srv->stats, out);
+}
+
+/*
+ * GET <path> [HTTP/1.x]
+ */
+static void cmd_http_get(struct wmr_server *srv, int argc, char *argv[],
+	struct strbuf *out, void *arg)
+{
+	(void) arg;
+	const char *type = NULL;
+	struct server_page *page;
+	struct strbuf body;
+
+	strbuf_init(&body, 4096);
+	for (page = srv->pages; argc >= 2 && page != NULL; page = page->next) {
+		if (strncmp(argv[1], page->prefix, strlen(page->prefix)) == 0) {
+			type = page->func(srv, argv[1] + strlen(page->prefix),
+				&body, page->arg);
+			if (type != NULL)
+				break;
+		}
+	}
+
+	if (type == NULL) {
+		strbuf_printf(out, "HTTP/1.0 404 Not Found\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n");
+	}
+	else {
+		strbuf_printf(out, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\nConnection: close\r\n\r\n",
+			type, strbuf_strlen(&body));
+		strbuf_puts(out, strbuf_get_string(&body));
+	}
+	strbuf_free(&body);
+}
+
+/*
+ * Read a single query line from @fd into @line. The line is NUL-terminated
+ * and the trailing newline (if any) is removed.
+ */
+static int read_query(int fd, char *line, size_t size)
+{
+	size_t len = 0;
+	ssize_t ret;
+	char *nl;
+
+	while (len < size - 1) {
+		if ((ret = read(fd, line + len, size - 1 - len)) <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		len += ret;
+		line[len] = '\0';
+		if ((nl = strchr(line, '\n')) != NULL) {
+			*nl = '\0';
+			return 0;
+		}
+	}
+
+	line[len] = '\0';
+	return len > 0 ? 0 : -1;
+}
+
+static void run_query(struct wmr_server *srv, char *line, struct strbuf *out)
+{
+	char *argv[QUERY_MAX_ARGS];
+	struct server_cmd *cmd;
+	char *saveptr;
+	int argc = 0;
+	char *word;
+
+	for (word = strtok_r(line, " \t\r", &saveptr); word != NULL;
+		word = strtok_r(NULL, " \t\r", &saveptr)) {
+		if (argc == QUERY_MAX_ARGS) {
+			server_error(out, "Too many arguments");
+			return;
+		}
+		argv[argc++] = word;
+	}
+
+	if (argc == 0) {
+		server_error(out, "Empty query");
+		return;
+	}
+
+	for (cmd = srv->cmds; cmd != NULL; cmd = cmd->next) {
+		if (strcmp(cmd->name, argv[0]) == 0) {
+			cmd->func(srv, argc, argv, out, cmd->arg);
+			return;
+		}
+	}
+
+	server_error(out, "Unknown command '%s'", argv[0]);
+}
+
+/*
+ * Account for a query thread which is done. This has to be the last thing
+ * the thread does with @srv, as server_stop may free it right after.
+ */
+static void query_end(struct wmr_server *srv)
+{
+	pthread_mutex_lock(&srv->query_lock);
+	if (--srv->num_queries == 0)
+		pthread_cond_broadcast(&srv->query_done);
+	pthread_mutex_unlock(&srv->query_lock);
+}
+
+/*
+ * Wait until all query threads are done. Queries are bounded by the
+ * socket timeouts, so this does not take long.
+ */
+static void drain_queries(struct wmr_server *srv)
+{
+	pthread_mutex_lock(&srv->query_lock);
+	while (srv->num_queries > 0)
+		pthread_cond_wait(&srv->query_done, &srv->query_lock);
+	pthread_mutex_unlock(&srv->query_lock);
+}
+
+/*
+ * Handle a query connection. Each query connection is handled in a thread
+ * of its own, so that a slow client cannot hold up the others.
+ */
+static void *query_pthread(void *arg)
+{
+	struct query *query = (struct query *)arg;
+	struct timeval timeout = { .tv_sec = QUERY_TIMEOUT_SEC };
+	char line[QUERY_MAX_LEN];
+	struct strbuf out;
+	uint64_t start;
+
+	metrics_gauge_add(METRIC_QUERIES_ACTIVE, 1);
+	setsockopt(query->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(query->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	if (read_query(query->fd, line, sizeof(line)) == 0) {
+		start = metrics_now();
+		strbuf_init(&out, 1024);
+		run_query(query->srv, line, &out);
+		(void) write_all(query->fd, strbuf_get_string(&out), strbuf_strlen(&out));
+		TRACE(server_write, query->fd);
+		strbuf_free(&out);
+		metrics_observe(METRIC_REQUEST, metrics_now() - start);
+		metrics_count(METRIC_QUERIES, 1);
+	}
+
+	/*
+	 * Discard the rest of the request (such as HTTP headers) which has
+	 * already arrived. Closing a socket with unread data resets the
+	 * connection, and the client might then lose the response.
+	 */
+	while (recv(query->fd, line, sizeof(line), MSG_DONTWAIT) > 0);
+
+	(void) close(query->fd);
+	metrics_gauge_add(METRIC_QUERIES_ACTIVE, -1);
+	admit_release(&query->srv->admit);
+	query_end(query->srv);
+	free(query);
+	return NULL;
+}
+
+/*
+ * Accept a connection on @listen_fd and decide whether to admit it. If @slot
+ * is true, the connection takes a connection slot (see admit_connection).
+ * Rejected query connections are told so.
+ *
+ * Return value:
+ *	Client socket, or -1 if the connection was not accepted or admitted.
+ */
+static int accept_client(struct wmr_server *srv, int listen_fd, bool slot)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	enum admit_verdict verdict;
+	int fd;
+
+	if ((fd = accept(listen_fd, (struct sockaddr *)&addr, &addr_len)) == -1) {
+		log_error("accept: %s", strerror(errno));
+		return -1;
+	}
+
+	TRACE(server_accept, fd);
+	verdict = admit_connection(&srv->admit, (struct sockaddr *)&addr, slot);
+	if (verdict == ADMIT_OK)
+		return fd;
+
+	TRACE(server_reject, verdict);
+	if (slot) {
+		static char busy[] = "error\tToo many requests\n";
+		(void) send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT);
+	}
+	(void) close(fd);
+	return -1;
+}
+
+static void accept_query(struct wmr_server *srv, int listen_fd)
+{
+	struct query *query;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd;
+
+	if ((fd = accept_client(srv, listen_fd, true)) == -1)
+		return;
+
+	query = malloc_safe(sizeof(*query));
+	query->srv = srv;
+	query->fd = fd;
+
+	pthread_mutex_lock(&srv->query_lock);
+	srv->num_queries++;
+	pthread_mutex_unlock(&srv->query_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, query_pthread, query) != 0) {
+		log_error("Cannot start query thread");
+		(void) close(fd);
+		admit_release(&srv->admit);
+		query_end(srv);
+		free(query);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void mainloop(struct wmr_server *srv)
+{
+	/* a negative descriptor (no Unix socket) is ignored by poll */
+	struct pollfd fds[3] = {
+		{ .fd = srv->fd, .events = POLLIN },
+		{ .fd = srv->query_fd, .events = POLLIN },
+		{ .fd = srv->unix_fd, .events = POLLIN },
+	};
+	uint64_t start;
 	int fd;
-	size_t i;
 
 	log_info("%s", "Entering server main loop");
 	while (1) {
-		/* POSIX.1: accept is a cancellation point */
-		if ((fd = accept(srv->fd, NULL, 0)) == -1)
-			err(1, "accept"); /* TODO don't use err */
-
-		if (srv->wmr != NULL) {
-			wmr_get_latest_data(srv->wmr, &latest);
-
-			print_reading(&latest.wind, fd);
-			print_reading(&latest.rain, fd);
-			print_reading(&latest.baro, fd);
-			print_reading(&latest.uvi, fd);
-			for (i = 0; i < WMR200_MAX_TEMP_SENSORS; i++)
-				print_reading(&latest.temp[i], fd);
-			print_reading(&latest.meta, fd);
-			print_reading(&latest.status, fd);
+		/* POSIX.1: poll and accept are cancellation points */
+		if (poll(fds, ARRAY_SIZE(fds), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll"); /* TODO don't use err */
 		}
 
+		/* priority clients first */
+		if (fds[2].revents & POLLIN)
+			accept_query(srv, srv->unix_fd);
+
+		if (fds[1].revents & POLLIN)
+			accept_query(srv, srv->query_fd);
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		/* served right away, so it needs no connection slot */
+		if ((fd = accept_client(srv, srv->fd, false)) == -1)
+			continue;
+
+		start = metrics_now();
+		serve_latest(srv, fd);
+		TRACE(server_write, fd);
 		(void) close(fd);
+		metrics_observe(METRIC_REQUEST, metrics_now() - start);
+		metrics_count(METRIC_QUERIES, 1);
 	}
 }
 
@@ -149,6 +598,9 @@ static void cleanup(void *arg)
 	struct wmr_server *srv = (struct wmr_server *)arg;
 	assert(srv->fd >= 0);
 	(void) close(srv->fd);
+	(void) close(srv->query_fd);
+	if (srv->unix_fd >= 0)
+		(void) close(srv->unix_fd);
 }
 
 /*
@@ -167,8 +619,25 @@ static void *mainloop_pthread(void *arg)
 
 void server_init(struct wmr_server *srv)
 {
+	srv->cfg = default_cfg;
 	srv->wmr = NULL;
-	srv->fd = srv->thread_id = -1;
+	srv->latest = NULL;
+	srv->stats = NULL;
+	srv->fd = srv->query_fd = srv->unix_fd = -1;
+	srv->cmds = NULL;
+	srv->pages = NULL;
+	pthread_mutex_init(&srv->query_lock, NULL);
+	pthread_cond_init(&srv->query_done, NULL);
+	srv->num_queries = 0;
+
+	server_register_command(srv, "latest", cmd_latest, NULL);
+	server_register_command(srv, "GET", cmd_http_get, NULL);
+	server_register_command(srv, "since", cmd_since, NULL);
+}
+
+void server_set_cfg(struct wmr_server *srv, struct wmr_server_cfg *cfg)
+{
+	srv->cfg = *cfg;
 }
 
 /*
@@ -179,14 +648,34 @@ void server_set_device(struct wmr_server *srv, struct wmr200 *wmr)
 	srv->wmr = wmr;
 }
 
-int server_start(struct wmr_server *srv)
+void server_set_latest(struct wmr_server *srv, struct latest *latest)
+{
+	srv->latest = latest;
+}
+
+/*
+ * Configure the @srv server to serve rolling statistics @stats along
+ * with the latest data.
+ */
+void server_set_stats(struct wmr_server *srv, struct stats *stats)
+{
+	srv->stats = stats;
+}
+
+/*
+ * Open a listening TCP socket on @port.
+ *
+ * Return value:
+ *	Socket descriptor on success, -1 on failure.
+ */
+static int open_socket(int port)
 {
 	struct addrinfo *ai_head, *ai_cur;
 	struct addrinfo ai_hints; 
-	int port = DEFAULT_PORT;
 	char portstr[6];
 	int optval = 1;
 	int ret;
+	int fd = -1;
 
 	memset(&ai_hints, 0, sizeof(ai_hints));
 	ai_hints.ai_family = AF_UNSPEC;
@@ -201,17 +690,17 @@ int server_start(struct wmr_server *srv)
 	}
 
 	for (ai_cur = ai_head; ai_cur != NULL; ai_cur = ai_cur->ai_next) {
-		srv->fd = socket(ai_cur->ai_family, ai_cur->ai_socktype,
+		fd = socket(ai_cur->ai_family, ai_cur->ai_socktype,
 			ai_cur->ai_protocol);
 
-		if (srv->fd == -1)
+		if (fd == -1)
 			continue;
 
-		setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-		if (bind(srv->fd, ai_cur->ai_addr, ai_cur->ai_addrlen) == 0)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+		if (bind(fd, ai_cur->ai_addr, ai_cur->ai_addrlen) == 0)
 			break;
 
-		(void) close(srv->fd);
+		(void) close(fd);
 	}
 
 	freeaddrinfo(ai_head);
@@ -222,23 +711,170 @@ int server_start(struct wmr_server *srv)
 		return -1;
 	}
 
-	if (listen(srv->fd, SOMAXCONN) == -1) {
+	if (listen(fd, SOMAXCONN) == -1) {
 		log_error("listen: %s", "Cannot start listening");
+		(void) close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Open a listening Unix socket at @path, replacing any stale socket.
+ *
+ * Return value:
+ *	Socket descriptor on success, -1 on failure.
+ */
+static int open_unix_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("Unix socket path %s is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		log_error("socket: %s", strerror(errno));
 		return -1;
 	}
 
-	log_info("Server start successful, descriptor is %d", srv->fd);
+	(void) unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		log_error("Cannot bind to %s: %s", path, strerror(errno));
+		goto out_close;
+	}
+
+	/* connecting takes write permission, which umask may have taken */
+	if (chmod(path, UNIX_SOCKET_MODE) != 0)
+		log_warning("chmod %s: %s", path, strerror(errno));
+
+	if (listen(fd, SOMAXCONN) == -1) {
+		log_error("listen: %s", "Cannot start listening");
+		goto out_close;
+	}
+
+	return fd;
 
+out_close:
+	(void) close(fd);
+	return -1;
+}
+
+int server_start(struct wmr_server *srv)
+{
+	if ((srv->fd = open_socket(srv->cfg.port)) == -1)
+		return -1;
+
+	if ((srv->query_fd = open_socket(srv->cfg.query_port)) == -1)
+		goto out_close;
+
+	/* local clients can still query the server over TCP */
+	if (srv->cfg.unix_path != NULL
+		&& (srv->unix_fd = open_unix_socket(srv->cfg.unix_path)) == -1)
+		log_warning("Cannot open Unix socket %s", srv->cfg.unix_path);
+
+	log_info("Server start successful, descriptors are %d, %d and %d",
+		srv->fd, srv->query_fd, srv->unix_fd);
+
+	admit_init(&srv->admit, &srv->cfg.admit);
 	if (pthread_create(&srv->thread_id, NULL, mainloop_pthread, srv) != 0) {
 		log_error("%s", "Cannot start server main loop thread");
+		admit_free(&srv->admit);
 		return -1;
 	}
 
 	return 0;
+
+out_close:
+	(void) close(srv->fd);
+	return -1;
 }
 
 void server_stop(struct wmr_server *srv)
 {
+	struct server_page *page;
+	struct server_cmd *cmd;
+
 	pthread_cancel(srv->thread_id);
 	pthread_join(srv->thread_id, NULL);
+
+	/* no more queries are accepted, wait for those being handled */
+	drain_queries(srv);
+	pthread_mutex_destroy(&srv->query_lock);
+	pthread_cond_destroy(&srv->query_done);
+	admit_free(&srv->admit);
+	if (srv->unix_fd >= 0)
+		(void) unlink(srv->cfg.unix_path);
+
+	while ((cmd = srv->cmds) != NULL) {
+		srv->cmds = cmd->next;
+		free(cmd);
+	}
+
+	while ((page = srv->pages) != NULL) {
+		srv->pages = page->next;
+		free(page);
+	}
+}
+
+void server_register_command(struct wmr_server *srv, const char *name,
+	server_cmd_t *func, void *arg)
+{
+	struct server_cmd *cmd;
+
+	cmd = malloc_safe(sizeof(*cmd));
+	cmd->name = name;
+	cmd->func = func;
+	cmd->arg = arg;
+	cmd->next = srv->cmds;
+
+	srv->cmds = cmd;
+}
+
+void server_register_page(struct wmr_server *srv, const char *prefix,
+	server_page_t *func, void *arg)
+{
+	struct server_page *page;
+
+	page = malloc_safe(sizeof(*page));
+	page->prefix = prefix;
+	page->func = func;
+	page->arg = arg;
+	page->next = srv->pages;
+
+	srv->pages = page;
+}
+
+void server_error(struct strbuf *out, char *fmt, ...)
+{
+	va_list args;
+
+	strbuf_puts(out, "error\t");
+	va_start(args, fmt);
+	strbuf_vprintf(out, fmt, args);
+	va_end(args);
+	strbuf_putc(out, '\n');
+}
+
+int server_parse_time(const char *str, time_t *time_out)
+{
+	char *end;
+	long val;
+
+	if (strcmp(str, "now") == 0) {
+		*time_out = time(NULL);
+		return 0;
+	}
+
+	errno = 0;
+	val = strtol(str, &end, 10);
+	if (errno != 0 || *end != '\0' || end == str)
+		return -1;
+
+	*time_out = val <= 0 ? time(NULL) + val : val;
+	return 0;
 }
@@ -0,0 +1,238 @@
+/*
+ * Rolling-window statistics computed incrementally as readings arrive.
+ */
+
+#include "common.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	QUEUE_INIT_SIZE		64
+
+static inline size_t queue_index(struct stats_queue *q, size_t i)
+{
+	size_t j = q->head + i;
+	return j < q->size ? j : j - q->size;
+}
+
+static inline struct stats_sample *queue_front(struct stats_queue *q)
+{
+	assert(q->count > 0);
+	return &q->buf[q->head];
+}
+
+static inline struct stats_sample *queue_back(struct stats_queue *q)
+{
+	assert(q->count > 0);
+	return &q->buf[queue_index(q, q->count - 1)];
+}
+
+static void queue_grow(struct stats_queue *q)
+{
+	size_t new_size = MAX(2 * q->size, QUEUE_INIT_SIZE);
+	struct stats_sample *buf;
+	size_t i;
+
+	buf = malloc_safe(new_size * sizeof(*buf));
+	for (i = 0; i < q->count; i++)
+		buf[i] = q->buf[queue_index(q, i)];
+
+	free(q->buf);
+	q->buf = buf;
+	q->size = new_size;
+	q->head = 0;
+}
+
+static void queue_push_back(struct stats_queue *q, struct stats_sample *sample)
+{
+	if (q->count == q->size)
+		queue_grow(q);
+	q->buf[queue_index(q, q->count++)] = *sample;
+}
+
+static void queue_pop_front(struct stats_queue *q)
+{
+	assert(q->count > 0);
+	q->head = queue_index(q, 1);
+	q->count--;
+}
+
+static void queue_pop_back(struct stats_queue *q)
+{
+	assert(q->count > 0);
+	q->count--;
+}
+
+static void queue_free(struct stats_queue *q)
+{
+	free(q->buf);
+}
+
+/*
+ * Remove samples which are @length seconds older than @now from window
+ * @win.
+ */
+static void window_expire(struct stats_window *win, unsigned length, time_t now)
+{
+	struct stats_sample *oldest;
+
+	while (win->fifo.count > 0) {
+		oldest = queue_front(&win->fifo);
+		if (oldest->time + (time_t)length > now)
+			break;
+
+		win->sum -= oldest->value;
+		if (win->min.count > 0 && queue_front(&win->min)->seq == oldest->seq)
+			queue_pop_front(&win->min);
+		if (win->max.count > 0 && queue_front(&win->max)->seq == oldest->seq)
+			queue_pop_front(&win->max);
+		queue_pop_front(&win->fifo);
+	}
+}
+
+/*
+ * Add a sample to window @win.
+ *
+ * NOTE: Monotonic queues require samples to be added in order. Samples
+ *       older than the newest one (such as late historic records) are
+ *       therefore treated as if they arrived at the time of the newest
+ *       sample, unless they are already out of the window.
+ */
+static void window_add(struct stats_window *win, unsigned length,
+	time_t time, float value)
+{
+	struct stats_sample sample;
+
+	if (win->fifo.count > 0 && time < win->newest) {
+		if (time + (time_t)length <= win->newest)
+			return;
+		time = win->newest;
+	}
+
+	sample.seq = win->next_seq++;
+	sample.time = time;
+	sample.value = value;
+
+	while (win->min.count > 0 && queue_back(&win->min)->value >= value)
+		queue_pop_back(&win->min);
+	queue_push_back(&win->min, &sample);
+
+	while (win->max.count > 0 && queue_back(&win->max)->value <= value)
+		queue_pop_back(&win->max);
+	queue_push_back(&win->max, &sample);
+
+	queue_push_back(&win->fifo, &sample);
+	win->sum += value;
+	win->newest = time;
+
+	window_expire(win, length, win->newest);
+}
+
+void stats_init(struct stats *stats, struct stats_cfg *cfg)
+{
+	stats->cfg = *cfg;
+	pthread_mutex_init(&stats->lock, NULL);
+	memset(stats->win, 0, sizeof(stats->win));
+}
+
+void stats_free(struct stats *stats)
+{
+	struct stats_window *win;
+	size_t f, w;
+	int s;
+
+	for (s = 0; s < SERIES_MAX; s++) {
+		for (f = 0; f < SERIES_MAX_FIELDS; f++) {
+			for (w = 0; w < STATS_MAX_WINDOWS; w++) {
+				win = &stats->win[s][f][w];
+				queue_free(&win->fifo);
+				queue_free(&win->min);
+				queue_free(&win->max);
+			}
+		}
+	}
+
+	pthread_mutex_destroy(&stats->lock);
+}
+
+void stats_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	struct stats *stats = (struct stats *)arg;
+	float values[SERIES_MAX_FIELDS];
+	size_t num_fields, f, w;
+	int series;
+
+	if ((series = series_of(reading)) < 0)
+		return;
+
+	num_fields = series_get_values(reading, values);
+
+	pthread_mutex_lock(&stats->lock);
+	for (f = 0; f < num_fields; f++)
+		for (w = 0; w < STATS_MAX_WINDOWS; w++)
+			if (stats->cfg.windows[w] > 0)
+				window_add(&stats->win[series][f][w],
+					stats->cfg.windows[w], reading->time, values[f]);
+	pthread_mutex_unlock(&stats->lock);
+}
+
+/*
+ * Get statistics of window @win of length @length which ends at @now, or
+ * at the newest sample if it's newer (the station clock may be ahead).
+ * Samples of sensors which went silent expire as time goes by.
+ */
+static void window_get(struct stats_window *win, unsigned length, time_t now,
+	struct stats_value *value)
+{
+	window_expire(win, length, MAX(now, win->newest));
+
+	value->count = win->fifo.count;
+	if (value->count == 0)
+		return;
+
+	value->min = queue_front(&win->min)->value;
+	value->max = queue_front(&win->max)->value;
+	value->mean = win->sum / win->fifo.count;
+}
+
+void stats_get(struct stats *stats, int series, size_t field, size_t window,
+	struct stats_value *value)
+{
+	assert(series >= 0 && series < SERIES_MAX);
+	assert(field < SERIES_MAX_FIELDS && window < STATS_MAX_WINDOWS);
+
+	pthread_mutex_lock(&stats->lock);
+	window_get(&stats->win[series][field][window], stats->cfg.windows[window],
+		time(NULL), value);
+	pthread_mutex_unlock(&stats->lock);
+}
+
+void stats_print(struct stats *stats, struct strbuf *out)
+{
+	struct stats_value value;
+	time_t now = time(NULL);
+	size_t f, w;
+	int s;
+
+	pthread_mutex_lock(&stats->lock);
+	for (s = 0; s < SERIES_MAX; s++) {
+		for (f = 0; f < series_num_fields(s); f++) {
+			for (w = 0; w < STATS_MAX_WINDOWS; w++) {
+				window_get(&stats->win[s][f][w], stats->cfg.windows[w],
+					now, &value);
+				if (value.count == 0)
+					continue;
+
+				strbuf_printf(out, "stats\tsensor=%s\tfield=%s\twindow=%u s\t"
+					"min=%.1f\tmax=%.1f\tmean=%.1f\tcount=%zu\n",
+					series_name(s), series_field_name(s, f),
+					stats->cfg.windows[w],
+					value.min, value.max, value.mean, value.count);
+			}
+		}
+	}
+	pthread_mutex_unlock(&stats->lock);
+}
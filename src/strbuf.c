@@ -1,17 +1,45 @@
+#include "arena.h"
 #include "common.h"
 #include "memory.h"
 #include "strbuf.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 
+/*
+ * Values of fixed-decimal numbers (scaled by 10^decimals) up to this bound
+ * are formatted by strbuf_put_fixed itself, larger ones by printf. Below
+ * the bound, the error of the scaling is under 2^-22, so ties can be told
+ * apart reliably, see strbuf_put_fixed.
+ */
+#define	FIXED_MAX	4e9
+#define	FIXED_TIE_EPS	1e-6
+
+static const double powers_of_10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+
 static void strbuf_resize(struct strbuf *buf, size_t new_size)
 {
+	char *str;
+
 	assert(new_size > 0);
 
-	buf->str = realloc_safe(buf->str, new_size);
+	if (buf->arena != NULL) {
+		/* the old buffer is released with the arena */
+		str = arena_alloc(buf->arena, new_size);
+		if (buf->str != NULL)
+			memcpy(str, buf->str, MIN(buf->size, new_size));
+		buf->str = str;
+	}
+	else {
+		buf->str = realloc_safe(buf->str, new_size);
+	}
 
 	buf->size = new_size;
 	if (buf->len > buf->size - 1)
@@ -20,12 +48,19 @@ static void strbuf_resize(struct strbuf *buf, size_t new_size)
 
 
 void strbuf_init(struct strbuf *buf, size_t init_size)
+{
+	strbuf_init_arena(buf, init_size, NULL);
+}
+
+
+void strbuf_init_arena(struct strbuf *buf, size_t init_size, struct arena *arena)
 {
 	assert(init_size > 0);
 
 	buf->str = NULL;
 	buf->len = 0;
 	buf->size = 0;
+	buf->arena = arena;
 
 	strbuf_resize(buf, init_size);
 }
@@ -46,10 +81,86 @@ size_t strbuf_putc(struct strbuf *buf, char c)
 }
 
 
-size_t strbuf_puts(struct strbuf *buf, char *str)
+size_t strbuf_put(struct strbuf *buf, const char *str, size_t len)
 {
-	strbuf_printf(buf, "%s", str);
-	return strlen(str);
+	strbuf_prepare_append(buf, len);
+	memcpy(buf->str + buf->len, str, len);
+	buf->len += len;
+	return len;
+}
+
+
+size_t strbuf_puts(struct strbuf *buf, const char *str)
+{
+	return strbuf_put(buf, str, strlen(str));
+}
+
+
+size_t strbuf_put_uint(struct strbuf *buf, unsigned long value)
+{
+	char digits[3 * sizeof(value)];
+	char *p = digits + sizeof(digits);
+
+	do {
+		*--p = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	return strbuf_put(buf, p, digits + sizeof(digits) - p);
+}
+
+
+size_t strbuf_put_int(struct strbuf *buf, long value)
+{
+	if (value >= 0)
+		return strbuf_put_uint(buf, value);
+
+	strbuf_putc(buf, '-');
+	return 1 + strbuf_put_uint(buf, -(unsigned long)value);
+}
+
+
+/*
+ * The value is scaled to an integer which is then printed. The scaling is
+ * inexact, but the error is small enough to decide the rounding correctly,
+ * unless the value is (almost) exactly halfway between two results. Such
+ * values, as well as large and non-finite ones, are left to printf, so the
+ * output is always the same as that of "%.*f".
+ */
+size_t strbuf_put_fixed(struct strbuf *buf, double value, unsigned decimals)
+{
+	char digits[16];
+	char *p = digits + sizeof(digits);
+	double scaled, whole, frac;
+	uint64_t n;
+	size_t len = 0;
+	unsigned i;
+
+	if (decimals >= ARRAY_SIZE(powers_of_10) || !isfinite(value)
+		|| (scaled = fabs(value) * powers_of_10[decimals]) >= FIXED_MAX)
+		return strbuf_printf(buf, "%.*f", decimals, value);
+
+	whole = floor(scaled);
+	frac = scaled - whole;
+	if (fabs(frac - 0.5) < FIXED_TIE_EPS)
+		return strbuf_printf(buf, "%.*f", decimals, value);
+
+	n = (uint64_t)whole + (frac > 0.5);
+	for (i = 0; i < decimals; i++) {
+		*--p = '0' + n % 10;
+		n /= 10;
+	}
+	if (decimals > 0)
+		*--p = '.';
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+
+	if (signbit(value))
+		len += strbuf_putc(buf, '-');
+
+	return len + strbuf_put(buf, p, digits + sizeof(digits) - p);
 }
 
 
@@ -85,32 +196,38 @@ void strbuf_reset(struct strbuf *buf)
 
 void strbuf_free(struct strbuf *buf)
 {
-	free(buf->str);
+	if (buf->arena == NULL)
+		free(buf->str);
 }
 
 
+/*
+ * The string is formatted right into the buffer. Only if it does not fit,
+ * the buffer is enlarged and the string is formatted again.
+ */
 size_t strbuf_vprintf_at(struct strbuf *buf, size_t offset, char *fmt, va_list args)
 {
 	va_list args2;
 	int num_written;
 	size_t size_needed;
 
+	if (offset >= buf->size)
+		strbuf_resize(buf, MAX(2 * buf->size, offset + 1));
+
 	va_copy(args2, args);
+	num_written = vsnprintf(buf->str + offset, buf->size - offset, fmt, args2);
+	va_end(args2);
 
-	num_written = vsnprintf(NULL, 0, fmt, args2);
 	if (num_written < 0)
 		return -1;
 
 	size_needed = offset + num_written + 1;
-	if (size_needed > buf->size)
+	if (size_needed > buf->size) {
 		strbuf_resize(buf, MAX(2 * buf->size, size_needed));
+		vsnprintf(buf->str + offset, num_written + 1, fmt, args);
+	}
 
-	vsnprintf(buf->str + offset, (num_written + 1), fmt, args);
 	buf->len = MAX(buf->len, offset + num_written);
-
-	va_end(args2);
-	va_end(args);
-
 	return num_written;
 }
 
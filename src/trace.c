@@ -0,0 +1,222 @@
+/*
+ * Flight recorder of trace events.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Number of most recent events kept per thread. Must be a power of two.
+ */
+#define	RING_SIZE		512
+
+/*
+ * Mode of the dump file.
+ */
+#define	DUMP_MODE		0600
+
+struct entry
+{
+	uint64_t ticks;			/* time of the event, see ticks() */
+	uint32_t event;			/* enum trace_event */
+	uint64_t arg;			/* argument of the event */
+};
+
+/*
+ * Flight recorder of a thread. Like metrics shards, rings are only written
+ * by the thread which owns them, they are reused after the thread exits
+ * and never freed. The events of an exited thread are kept until another
+ * thread takes over the ring.
+ */
+struct ring
+{
+	struct ring *next;		/* linked list of rings */
+	atomic_bool in_use;		/* owned by a thread */
+	pid_t tid;			/* ID of the owning thread */
+	atomic_uint_fast64_t pos;	/* number of events recorded */
+	struct entry entries[RING_SIZE];
+};
+
+static const char *event_names[] = {
+#define	TRACE_NAME(name)	#name,
+	TRACE_EVENTS(TRACE_NAME)
+#undef	TRACE_NAME
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static struct ring *rings;			/* all rings */
+static __thread struct ring *my_ring;		/* ring of this thread */
+static const char *dump_path = "meteod.trace";
+
+static uint64_t base_ticks;			/* ticks() at initialization */
+static uint64_t base_ns;			/* monotonic time at initialization */
+
+/*
+ * Cheap timestamp. On x86 this is the TSC, which is converted to real time
+ * only when a dump is taken; elsewhere, the monotonic clock.
+ */
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void release_ring(void *arg)
+{
+	struct ring *ring = (struct ring *)arg;
+	atomic_store(&ring->in_use, false);
+}
+
+static void init(void)
+{
+	if (pthread_key_create(&ring_key, release_ring) != 0)
+		log_error("Cannot create trace thread key");
+
+	base_ticks = ticks();
+	base_ns = monotonic_ns();
+}
+
+/*
+ * Acquire a ring for the calling thread.
+ */
+static struct ring *get_ring(void)
+{
+	struct ring *ring;
+
+	pthread_once(&once, init);
+
+	pthread_mutex_lock(&lock);
+	for (ring = rings; ring != NULL; ring = ring->next)
+		if (!atomic_load(&ring->in_use))
+			break;
+
+	if (ring == NULL) {
+		ring = malloc_safe(sizeof(*ring));
+		memset(ring, 0, sizeof(*ring));
+		ring->next = rings;
+		rings = ring;
+	}
+
+	atomic_store(&ring->in_use, true);
+	ring->tid = syscall(SYS_gettid);
+	pthread_mutex_unlock(&lock);
+
+	(void) pthread_setspecific(ring_key, ring);
+	return my_ring = ring;
+}
+
+void trace_record(enum trace_event event, uint64_t arg)
+{
+	struct ring *ring = my_ring;
+	struct entry *entry;
+	uint64_t pos;
+
+	if (ring == NULL)
+		ring = get_ring();
+
+	pos = atomic_load_explicit(&ring->pos, memory_order_relaxed);
+	entry = &ring->entries[pos & (RING_SIZE - 1)];
+	entry->ticks = ticks();
+	entry->event = event;
+	entry->arg = arg;
+	atomic_store_explicit(&ring->pos, pos + 1, memory_order_release);
+}
+
+void trace_set_dump_path(const char *path)
+{
+	dump_path = path;
+}
+
+/*
+ * Write events of @ring to @fd. Event times are converted from ticks to
+ * real time using the rate between now and initialization.
+ */
+static void dump_ring(int fd, struct ring *ring, uint64_t now_ticks,
+	struct timespec *now)
+{
+	double ns_per_tick = 1;
+	uint64_t pos, i, ns_ago;
+	struct entry entry;
+	struct timespec ts;
+	int64_t ns;
+
+	if (now_ticks > base_ticks)
+		ns_per_tick = (double)(monotonic_ns() - base_ns) / (now_ticks - base_ticks);
+
+	pos = atomic_load_explicit(&ring->pos, memory_order_acquire);
+	dprintf(fd, "thread %li%s\t%lu events\n", (long)ring->tid,
+		atomic_load(&ring->in_use) ? "" : " (exited)", (unsigned long)pos);
+
+	for (i = pos > RING_SIZE ? pos - RING_SIZE : 0; i < pos; i++) {
+		entry = ring->entries[i & (RING_SIZE - 1)];
+		if (entry.event >= TRACE_EV_MAX)
+			continue;
+
+		ns_ago = entry.ticks < now_ticks ? (now_ticks - entry.ticks) * ns_per_tick : 0;
+		ns = (int64_t)now->tv_sec * 1000000000 + now->tv_nsec - ns_ago;
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+
+		dprintf(fd, "%li.%09li\t%s\t%lu\n", (long)ts.tv_sec, ts.tv_nsec,
+			event_names[entry.event], (unsigned long)entry.arg);
+	}
+}
+
+int trace_dump(void)
+{
+	struct timespec now;
+	uint64_t now_ticks;
+	struct ring *ring;
+	int fd;
+
+	if ((fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, DUMP_MODE)) < 0) {
+		log_error("Cannot open trace dump file %s: %s", dump_path, strerror(errno));
+		return -1;
+	}
+
+	/* the next dump overwrites the file, which umask may have prevented */
+	if (fchmod(fd, DUMP_MODE) != 0)
+		log_warning("chmod %s: %s", dump_path, strerror(errno));
+
+	pthread_once(&once, init);
+
+	pthread_mutex_lock(&lock);
+	now_ticks = ticks();
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (ring = rings; ring != NULL; ring = ring->next)
+		dump_ring(fd, ring, now_ticks, &now);
+	pthread_mutex_unlock(&lock);
+
+	(void) close(fd);
+	log_info("Flight recorder dumped to %s", dump_path);
+	return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * Write-ahead log of readings with group commit.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "metrics.h"
+#include "wal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	WAL_MAGIC		0x4c41574d	/* "MWAL" */
+#define	WAL_VERSION		2
+#define	ENTRY_MAGIC		0x544e4557	/* "WENT" */
+#define	WAL_MODE		0600
+
+/*
+ * Log file header. Entries follow the header.
+ */
+struct wal_header
+{
+	uint32_t magic;		/* WAL_MAGIC */
+	uint32_t version;	/* WAL_VERSION */
+	uint64_t acked_lsn;	/* last acknowledged entry */
+	uint8_t reserved[16];
+};
+
+/*
+ * Log entry.
+ */
+struct wal_entry
+{
+	uint32_t magic;		/* ENTRY_MAGIC */
+	uint32_t checksum;	/* checksum of the rest of the entry */
+	uint64_t lsn;		/* log sequence number */
+	struct wmr_record rec;	/* the reading */
+};
+
+/*
+ * FNV-1a hash of the entry, magic and checksum excluded.
+ */
+static uint32_t entry_checksum(struct wal_entry *entry)
+{
+	uint8_t *p = (uint8_t *)&entry->lsn;
+	uint8_t *end = (uint8_t *)(entry + 1);
+	uint32_t hash = 2166136261U;
+
+	for (; p < end; p++)
+		hash = (hash ^ *p) * 16777619U;
+
+	return hash;
+}
+
+
+/*
+ * Read @off-th entry of the log into @entry.
+ *
+ * Return value:
+ *	Zero if a valid entry was read, -1 otherwise (torn or missing entry).
+ */
+static int read_entry(struct wal *wal, off_t off, struct wal_entry *entry)
+{
+	if (pread(wal->fd, entry, sizeof(*entry), off) != sizeof(*entry))
+		return -1;
+
+	if (entry->magic != ENTRY_MAGIC || entry->checksum != entry_checksum(entry))
+		return -1;
+
+	return 0;
+}
+
+static int write_header(struct wal *wal, uint64_t acked_lsn)
+{
+	struct wal_header hdr = {
+		.magic = WAL_MAGIC,
+		.version = WAL_VERSION,
+		.acked_lsn = acked_lsn,
+	};
+
+	if (pwrite(wal->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		log_error("wal: cannot write header of %s: %s", wal->cfg.path,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Discard all entries. Caller must make sure all of them are acknowledged.
+ */
+static void truncate_log(struct wal *wal)
+{
+	if (ftruncate(wal->fd, sizeof(struct wal_header)) != 0) {
+		log_error("wal: cannot truncate %s: %s", wal->cfg.path, strerror(errno));
+		return;
+	}
+
+	wal->size = sizeof(struct wal_header);
+}
+
+int wal_open(struct wal *wal, struct wal_cfg *cfg)
+{
+	struct wal_header hdr;
+	struct wal_entry entry;
+	struct stat st;
+	uint64_t last_lsn = 0;
+	off_t off;
+
+	wal->cfg = *cfg;
+	wal->running = false;
+	wal->num_pending = 0;
+	wal->num_syncs = 0;
+	wal->checkpointed = time(NULL);
+
+	if ((wal->fd = open(cfg->path, O_RDWR | O_CREAT | O_CLOEXEC, WAL_MODE)) == -1) {
+		log_error("wal: cannot open %s: %s", cfg->path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(wal->fd, &st) != 0)
+		goto out_close;
+
+	/* the log is reopened for writing, which umask may have prevented */
+	if (st.st_size == 0 && fchmod(wal->fd, WAL_MODE) != 0)
+		log_warning("wal: chmod %s: %s", cfg->path, strerror(errno));
+
+	if ((size_t)st.st_size < sizeof(hdr)) {
+		if (write_header(wal, 0) != 0)
+			goto out_close;
+		hdr.acked_lsn = 0;
+		st.st_size = sizeof(hdr);
+	}
+	else if (pread(wal->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+		|| hdr.magic != WAL_MAGIC) {
+		log_error("wal: %s is not a write-ahead log", cfg->path);
+		goto out_close;
+	}
+	else if (hdr.version != WAL_VERSION) {
+		/* entries of other versions cannot be read */
+		log_warning("wal: discarding log %s of version %u", cfg->path, hdr.version);
+		if (ftruncate(wal->fd, 0) != 0 || write_header(wal, 0) != 0)
+			goto out_close;
+		hdr.acked_lsn = 0;
+		st.st_size = sizeof(hdr);
+	}
+
+	/*
+	 * Find the end of the log. Entries past the first invalid entry
+	 * were not committed, the log is truncated there.
+	 */
+	for (off = sizeof(hdr); read_entry(wal, off, &entry) == 0; off += sizeof(entry))
+		last_lsn = entry.lsn;
+
+	if (off < st.st_size) {
+		log_warning("wal: discarding torn entries at the end of %s", cfg->path);
+		if (ftruncate(wal->fd, off) != 0)
+			goto out_close;
+	}
+
+	wal->size = off;
+	wal->dispatched_lsn = wal->acked_lsn = wal->header_lsn = hdr.acked_lsn;
+	wal->committed_lsn = MAX(last_lsn, hdr.acked_lsn);
+	wal->next_lsn = wal->committed_lsn + 1;
+
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->cond, NULL);
+	return 0;
+
+out_close:
+	(void) close(wal->fd);
+	return -1;
+}
+
+void wal_add_sync(struct wal *wal, wal_sync_t *func, void *arg)
+{
+	assert(!wal->running && wal->num_syncs < WAL_MAX_SYNCS);
+
+	wal->syncs[wal->num_syncs].func = func;
+	wal->syncs[wal->num_syncs].arg = arg;
+	wal->num_syncs++;
+}
+
+/*
+ * Make the loggers write what they were passed durably. The syncs are
+ * only changed before the commit thread is started, so no lock is needed.
+ */
+static void sync_loggers(struct wal *wal)
+{
+	size_t i;
+
+	for (i = 0; i < wal->num_syncs; i++)
+		wal->syncs[i].func(wal->syncs[i].arg);
+}
+
+size_t wal_replay(struct wal *wal, wmr_batch_logger_t *func, void *arg)
+{
+	struct wmr_reading *readings;
+	struct wal_entry entry;
+	size_t count = 0;
+	off_t off;
+
+	assert(!wal->running);
+
+	/* the log holds at most a checkpoint's worth of entries */
+	readings = malloc_safe(MAX(wal->size / sizeof(entry), 1) * sizeof(*readings));
+	for (off = sizeof(struct wal_header); off < (off_t)wal->size; off += sizeof(entry)) {
+		if (read_entry(wal, off, &entry) != 0)
+			break;
+		if (entry.lsn <= wal->acked_lsn)
+			continue;
+
+		wmr_record_decode(&entry.rec, &readings[count++]);
+	}
+
+	if (count > 0) {
+		func(NULL, readings, count, true, arg);
+		sync_loggers(wal);
+	}
+	free(readings);
+
+	wal->dispatched_lsn = wal->acked_lsn = wal->next_lsn - 1;
+	if (write_header(wal, wal->acked_lsn) == 0 && fdatasync(wal->fd) == 0) {
+		wal->header_lsn = wal->acked_lsn;
+		truncate_log(wal);
+	}
+
+	if (count > 0)
+		log_info("wal: replayed %zu readings", count);
+
+	return count;
+}
+
+/*
+ * Is a checkpoint due? Called with @wal->lock held.
+ */
+static bool checkpoint_due(struct wal *wal)
+{
+	return wal->dispatched_lsn > wal->acked_lsn
+		&& (time(NULL) - wal->checkpointed >= (time_t)wal->cfg.checkpoint_interval
+		|| wal->size > wal->cfg.max_size);
+}
+
+/*
+ * Make all entries appended so far durable, and persist the position
+ * of the last acknowledged entry. If @checkpoint is true, the loggers are
+ * synced and the dispatched entries acknowledged first. Called with
+ * @wal->lock held.
+ */
+static void commit(struct wal *wal, bool checkpoint)
+{
+	uint64_t lsn = wal->next_lsn - 1;
+	uint64_t acked_lsn = checkpoint ? wal->dispatched_lsn : wal->acked_lsn;
+
+	wal->num_pending = 0;
+	metrics_gauge_set(METRIC_WAL_PENDING, 0);
+
+	/* appends may proceed while the data are being synced */
+	pthread_mutex_unlock(&wal->lock);
+	if (checkpoint)
+		sync_loggers(wal);
+	if (fdatasync(wal->fd) != 0)
+		log_error("wal: fdatasync: %s", strerror(errno));
+	if (write_header(wal, acked_lsn) == 0)
+		wal->header_lsn = acked_lsn;
+	pthread_mutex_lock(&wal->lock);
+
+	wal->committed_lsn = lsn;
+	if (checkpoint) {
+		wal->acked_lsn = acked_lsn;
+		wal->checkpointed = time(NULL);
+	}
+
+	if (wal->acked_lsn == wal->next_lsn - 1 && wal->size > wal->cfg.max_size) {
+		if (write_header(wal, wal->acked_lsn) == 0 && fdatasync(wal->fd) == 0) {
+			wal->header_lsn = wal->acked_lsn;
+			truncate_log(wal);
+		}
+	}
+}
+
+/*
+ * Commit loop. A commit is started either when cfg.commit_count entries
+ * are pending or when cfg.commit_interval elapses since the first of
+ * the pending entries was appended. When nothing is pending, the loop
+ * waits for the next checkpoint of the dispatched entries, if any.
+ */
+static void *commit_pthread(void *arg)
+{
+	struct wal *wal = (struct wal *)arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&wal->lock);
+	while (wal->running) {
+		if (wal->num_pending == 0 && wal->acked_lsn == wal->header_lsn) {
+			if (wal->dispatched_lsn == wal->acked_lsn) {
+				pthread_cond_wait(&wal->cond, &wal->lock);
+				continue;
+			}
+
+			deadline.tv_sec = wal->checkpointed + wal->cfg.checkpoint_interval;
+			deadline.tv_nsec = 0;
+			if (!checkpoint_due(wal)
+				&& pthread_cond_timedwait(&wal->cond, &wal->lock, &deadline) != ETIMEDOUT)
+				continue;
+
+			commit(wal, true);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += wal->cfg.commit_interval / 1000;
+		deadline.tv_nsec += (wal->cfg.commit_interval % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while (wal->running && wal->num_pending < wal->cfg.commit_count)
+			if (pthread_cond_timedwait(&wal->cond, &wal->lock, &deadline) == ETIMEDOUT)
+				break;
+
+		commit(wal, checkpoint_due(wal));
+	}
+	pthread_mutex_unlock(&wal->lock);
+
+	return NULL;
+}
+
+int wal_start(struct wal *wal)
+{
+	wal->running = true;
+	if (pthread_create(&wal->commit_thread, NULL, commit_pthread, wal) != 0) {
+		log_error("wal: cannot start commit thread");
+		wal->running = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+void wal_close(struct wal *wal)
+{
+	pthread_mutex_lock(&wal->lock);
+	if (wal->running) {
+		wal->running = false;
+		pthread_cond_signal(&wal->cond);
+		pthread_mutex_unlock(&wal->lock);
+		pthread_join(wal->commit_thread, NULL);
+		pthread_mutex_lock(&wal->lock);
+	}
+	commit(wal, wal->dispatched_lsn > wal->acked_lsn);
+	pthread_mutex_unlock(&wal->lock);
+
+	(void) close(wal->fd);
+	pthread_cond_destroy(&wal->cond);
+	pthread_mutex_destroy(&wal->lock);
+}
+
+void wal_journal(struct wmr200 *wmr, struct wmr_reading *reading,
+	bool dispatched, void *arg)
+{
+	(void) wmr;
+	struct wal *wal = (struct wal *)arg;
+	struct wal_entry entry;
+
+	if (dispatched) {
+		pthread_mutex_lock(&wal->lock);
+		wal->dispatched_lsn = wal->next_lsn - 1;
+		if (wal->num_pending == 0)
+			pthread_cond_signal(&wal->cond);
+		pthread_mutex_unlock(&wal->lock);
+		return;
+	}
+
+	memset(&entry, 0, sizeof(entry));
+	entry.magic = ENTRY_MAGIC;
+	wmr_record_encode(reading, &entry.rec);
+
+	pthread_mutex_lock(&wal->lock);
+	entry.lsn = wal->next_lsn;
+	entry.checksum = entry_checksum(&entry);
+
+	if (pwrite(wal->fd, &entry, sizeof(entry), wal->size) != sizeof(entry)) {
+		log_error("wal: cannot append to %s: %s", wal->cfg.path, strerror(errno));
+	}
+	else {
+		wal->next_lsn++;
+		wal->size += sizeof(entry);
+		if (++wal->num_pending == 1 || wal->num_pending >= wal->cfg.commit_count)
+			pthread_cond_signal(&wal->cond);
+		metrics_gauge_set(METRIC_WAL_PENDING, wal->num_pending);
+	}
+
+	pthread_mutex_unlock(&wal->lock);
+}
@@ -9,14 +9,21 @@
  * [1] https://www.bashewa.com/wmr200-protocol.php
  */
 
+#include "arena.h"
 #include "common.h"
+#include "latest.h"
 #include "log.h"
+#include "metrics.h"
+#include "order.h"
+#include "trace.h"
 #include "wmr200.h"
 
 #include <assert.h>
 #include <hidapi.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -41,17 +48,33 @@
 /*
  * Although packet length is validated for each reading as it is
  * processed, packet length is checked against MAX_PACKET_LEN before
- * memory is allocated for the packet.
+ * the packet is read. Packet buffers are MAX_PACKET_LEN bytes long and
+ * recycled, PACKET_POOL_SIZE of them are allocated at a time.
  *
  * 112 bytes is the maximum length of HISTORIC_DATA reading, which
  * is the length of the largest well-formed packet the station will
  * send with all external sensors attached.
  */
 #define MAX_PACKET_LEN		112
+#define	PACKET_POOL_SIZE	8
+
+/*
+ * When a packet is found to be invalid, the decoder looks for the next
+ * packet at the following byte (see receive_packet), so it has to look
+ * ahead up to a packet. Only when RESYNC_MAX_BYTES bytes have been
+ * discarded without finding a valid packet, the connection is given up.
+ */
+#define	RX_SIZE			(2 * MAX_PACKET_LEN)
+#define	RESYNC_MAX_BYTES	2048
+
+/*
+ * Maximum number of readings passed to batch loggers at once. A batch
+ * is delivered early when it might not fit all readings of the next
+ * packet, which is at most MAX_PACKET_READINGS (HISTORIC_DATA packet).
+ */
+#define	BATCH_MAX		64
+#define	MAX_PACKET_READINGS	(4 + WMR200_MAX_TEMP_SENSORS)
 
-#define	VENDOR_ID		0x0FDE
-#define	PRODUCT_ID		0xCA01
-#define	TENTH_OF_INCH		0.0254
 
 /*
  * The following HIST_* constants are offsets into the HISTORIC_DATA
@@ -86,22 +109,47 @@ struct wmr200
 {
 	hid_device *dev;		/* HIDAPI device handle */
 	struct wmr_logger *logger;	/* linked list of loggers */
+	struct wmr_logger **dispatch[WMR_SRC_MAX];	/* subscribers of each source */
 	pthread_t mainloop_thread;	/* main loop thread */
 	pthread_t heartbeat_thread;	/* heartbeat loop thread */
-	struct wmr_latest_data latest;	/* latest readings */
+	struct latest own_latest;	/* private latest readings */
+	struct latest *latest;		/* latest readings */
 	struct wmr_meta meta;		/* system metadata packet (updated on the fly) */
 	time_t conn_since;		/* time the connection was established */
 
 	byte_t buf[FRAME_SIZE];		/* RX buffer */
 	size_t buf_avail;		/* number of bytes available in the buffer */
 	size_t buf_pos;			/* read position within the buffer */
+	uint64_t frame_ns;		/* time the frame in @buf was received */
+
+	byte_t rx[RX_SIZE];		/* bytes received but not decoded yet */
+	size_t rx_start;		/* first byte not decoded yet */
+	size_t rx_end;			/* end of the bytes received */
+	size_t discarded;		/* bytes discarded since the last valid packet */
 
 	byte_t *packet;			/* current packet */
+	uint64_t packet_ns;		/* time the packet was received */
 	size_t packet_len;		/* length of the packet */
 	byte_t packet_type;		/* type of the packet */
+	struct pool packets;		/* buffers of packets */
+
+	byte_t hour_key[4];		/* hour, day, month and year of @hour_start */
+	time_t hour_start;		/* start of the hour of the latest reading */
 
 	wmr_err_handler_t *err_handler;	/* error handler */
 	void *err_arg;			/* argument to error handler */
+	atomic_bool failed;		/* an error was reported, see error() */
+
+	wmr_journal_t *journal;		/* journal */
+	void *journal_arg;		/* argument to journal */
+
+	struct order *order;		/* ordering stage or NULL */
+
+	size_t batch_len;		/* number of readings batched since delivery */
+	struct wmr_reading batch_last;	/* latest reading to be acknowledged */
+	struct wmr_reading batch_buf[BATCH_MAX];	/* batch being delivered */
+
+	uint64_t dispatch_ns;		/* time spent in loggers (current packet) */
 };
 
 /*
@@ -147,11 +195,27 @@ enum sign
 	SIGN_NEGATIVE = 0x8
 };
 
+/*
+ * A reading waiting in a batch.
+ */
+struct batch_entry
+{
+	struct wmr_record rec;		/* the reading */
+	uint64_t seq;			/* see struct wmr_reading */
+	uint64_t recv_ns;		/* see struct wmr_reading */
+};
+
 struct wmr_logger
 {
 	struct wmr_logger *next;	/* linked list of loggers */
 	wmr_logger_t *func;		/* logger callback */
+	wmr_batch_logger_t *batch_func;	/* batch logger callback (if @func is NULL) */
 	void *arg;			/* extra argument to @logger */
+	struct wmr_subscription sub;	/* readings the logger is interested in */
+	time_t last[WMR_SRC_MAX];	/* time of last reading passed, per source */
+	struct batch_entry *batch;	/* batched readings (batch loggers only) */
+	size_t batch_len;		/* number of batched readings */
+	int metric;			/* counter of calls, or -1 */
 };
 
 /*
@@ -206,31 +270,62 @@ static const char *wind_dir_string[] = {
 	"NNW"
 };
 
+/*
+ * Report an error of the connection. Only the first error is reported:
+ * once the device is gone, reads keep failing until the connection is
+ * closed, and dumping the trace each time would replace the events which
+ * led to the failure with the errors.
+ */
 static void error(struct wmr200 *wmr, char *msg, ...)
 {
 	va_list args;
 
+	if (atomic_exchange(&wmr->failed, true))
+		return;
+
 	va_start(args, msg);
 	vsyslog(LOG_ERR, msg, args); /* TODO */
 	va_end(args);
 
+	TRACE(error, 0);
+	(void) trace_dump();
+
 	if (wmr->err_handler)
 		wmr->err_handler(wmr, wmr->err_arg);
 }
 
-static byte_t read_byte(struct wmr200 *wmr)
+/*
+ * Receive a HID frame into the RX buffer. Wait at most @timeout ms for
+ * the frame to arrive, or indefinitely if @timeout is -1.
+ *
+ * Return value:
+ *	true if a frame was received, false otherwise.
+ */
+static bool read_frame(struct wmr200 *wmr, int timeout)
 {
-	ssize_t ret;
+	int ret;
 
-	if (wmr->buf_avail == 0) {
-		ret = hid_read(wmr->dev, wmr->buf, FRAME_SIZE);
-		if (ret < 0)
-			error(wmr, "hid_read: read error\n");
+	ret = hid_read_timeout(wmr->dev, wmr->buf, FRAME_SIZE, timeout);
+	if (ret < 0)
+		error(wmr, "hid_read: read error\n");
+	if (ret <= 0)
+		return false;
 
-		wmr->meta.num_frames++;
-		wmr->buf_avail = wmr->buf[0];
-		wmr->buf_pos = 1;
-	}
+	wmr->frame_ns = metrics_now();
+	wmr->meta.num_frames++;
+	wmr->buf_avail = MIN(wmr->buf[0], FRAME_SIZE - 1);
+	wmr->buf_pos = 1;
+
+	metrics_count(METRIC_FRAMES, 1);
+	metrics_count(METRIC_BYTES, wmr->buf_avail);
+	TRACE(frame_receive, wmr->buf_avail);
+	return true;
+}
+
+static byte_t read_byte(struct wmr200 *wmr)
+{
+	while (wmr->buf_avail == 0)
+		(void) read_frame(wmr, -1);
 
 	wmr->meta.num_bytes++;
 	wmr->buf_avail--;
@@ -256,32 +351,244 @@ static void send_heartbeat(struct wmr200 *wmr)
  * data processing
  */
 
+/*
+ * Readings come in the same hour over and over again, so the start of the
+ * hour is only computed when the hour changes. Besides being slow, mktime
+ * allocates memory on each call when TZ is not set.
+ */
 static time_t get_reading_time_from_packet(struct wmr200 *wmr)
 {
-	struct tm tm = {
-		.tm_year = (2000 + wmr->packet[6]) - 1900,
-		.tm_mon = wmr->packet[5],
-		.tm_mday = wmr->packet[4],
-		.tm_hour = wmr->packet[3],
-		.tm_min = wmr->packet[2],
-		.tm_sec = 0,
-		.tm_isdst = -1
-	};
-	return mktime(&tm);
+	byte_t *key = wmr->packet + 3;
+
+	if (memcmp(key, wmr->hour_key, sizeof(wmr->hour_key)) != 0) {
+		struct tm tm = {
+			.tm_year = (2000 + wmr->packet[6]) - 1900,
+			.tm_mon = wmr->packet[5] - 1,	/* the station counts months from 1 */
+			.tm_mday = wmr->packet[4],
+			.tm_hour = wmr->packet[3],
+			.tm_min = 0,
+			.tm_sec = 0,
+			.tm_isdst = -1
+		};
+		wmr->hour_start = mktime(&tm);
+		memcpy(wmr->hour_key, key, sizeof(wmr->hour_key));
+	}
+
+	return wmr->hour_start + 60 * wmr->packet[2];
 }
 
+/*
+ * Tell the journal that @reading and all readings before it were passed
+ * to loggers. Readings held by the ordering stage were journaled before
+ * those just passed, so acknowledgement waits until none are held.
+ */
+static void acknowledge(struct wmr200 *wmr, struct wmr_reading *reading)
+{
+	if (wmr->order != NULL && wmr->order->num_held > 0)
+		return;
+
+	wmr->journal(wmr, reading, true, wmr->journal_arg);
+}
+
+/*
+ * Pass the batch of readings collected so far to batch loggers. @flush is
+ * true if no more readings are immediately available.
+ *
+ * Journal acknowledgement of readings is deferred until the batch has
+ * been delivered.
+ */
+static void deliver_batch(struct wmr200 *wmr, bool flush)
+{
+	struct wmr_logger *logger;
+	uint64_t start;
+	size_t i;
+
+	if (wmr->batch_len == 0)
+		return;
+
+	start = metrics_now();
+	for (logger = wmr->logger; logger != NULL; logger = logger->next) {
+		if (logger->batch_len > 0) {
+			for (i = 0; i < logger->batch_len; i++) {
+				wmr_record_decode(&logger->batch[i].rec, &wmr->batch_buf[i]);
+				wmr->batch_buf[i].seq = logger->batch[i].seq;
+				wmr->batch_buf[i].recv_ns = logger->batch[i].recv_ns;
+			}
+
+			TRACE(logger_call, logger->metric);
+			logger->batch_func(wmr, wmr->batch_buf, logger->batch_len,
+				flush, logger->arg);
+			logger->batch_len = 0;
+			metrics_count(logger->metric, 1);
+		}
+	}
+	metrics_observe(METRIC_DISPATCH, metrics_now() - start);
+
+	if (wmr->journal)
+		acknowledge(wmr, &wmr->batch_last);
+
+	wmr->batch_len = 0;
+	metrics_gauge_set(METRIC_BATCH_DEPTH, 0);
+}
+
+/*
+ * Decide whether @reading of source @src is due to be passed to @logger
+ * with respect to the minimum interval of its subscription.
+ */
+static bool is_due(struct wmr_logger *logger, int src, struct wmr_reading *reading)
+{
+	uint_t interval = logger->sub.min_interval[src];
+	time_t last = logger->last[src];
+
+	if (interval > 0 && last != 0
+		&& reading->time >= last && reading->time < last + (time_t)interval)
+		return false;
+
+	logger->last[src] = reading->time;
+	return true;
+}
+
+/*
+ * Pass @reading to the loggers subscribed to its source.
+ *
+ * NOTE: Meta-readings are emitted by the heartbeat thread, while all other
+ *       readings come from the main loop. Every source is therefore only
+ *       ever dispatched from a single thread.
+ */
 static void invoke_handlers(struct wmr200 *wmr, struct wmr_reading *reading)
 {
+	struct wmr_logger **subscriber;
 	struct wmr_logger *logger;
+	bool journaled = wmr->journal != NULL && reading->type != WMR_META;
+	bool batched = false;
+	struct batch_entry entry;
+	uint64_t start, elapsed;
+	int src;
+
+	if ((src = wmr_source_of(reading)) < 0) {
+		log_warning("Dropping reading of unknown source (type=0x%02X)",
+			reading->type);
+		return;
+	}
+
+	start = metrics_now();
+	TRACE(dispatch_start, reading->type);
+
+	if (reading->recv_ns != 0 && reading->type != WMR_META)
+		metrics_observe(METRIC_DELIVERY, start - reading->recv_ns);
 
-	for (logger = wmr->logger; logger != NULL; logger = logger->next)
-		logger->func(wmr, reading, logger->arg);
+	/* readings which passed the ordering stage were journaled before it */
+	if (journaled && wmr->order == NULL)
+		wmr->journal(wmr, reading, false, wmr->journal_arg);
+
+	for (subscriber = wmr->dispatch[src]; *subscriber != NULL; subscriber++) {
+		logger = *subscriber;
+		if (!is_due(logger, src, reading))
+			continue;
+
+		TRACE(logger_call, logger->metric);
+
+		if (logger->func != NULL) {
+			logger->func(wmr, reading, logger->arg);
+			metrics_count(logger->metric, 1);
+		}
+		else if (reading->type == WMR_META) {
+			/*
+			 * The heartbeat thread must not touch the batches of the
+			 * main loop, meta-readings make a batch of their own.
+			 */
+			logger->batch_func(wmr, reading, 1, true, logger->arg);
+			metrics_count(logger->metric, 1);
+		}
+		else {
+			assert(logger->batch_len < BATCH_MAX);
+			if (!batched) {
+				wmr_record_encode(reading, &entry.rec);
+				entry.seq = reading->seq;
+				entry.recv_ns = reading->recv_ns;
+			}
+			logger->batch[logger->batch_len++] = entry;
+			batched = true;
+		}
+	}
+
+	if (batched)
+		metrics_gauge_set(METRIC_BATCH_DEPTH, ++wmr->batch_len);
+
+	/*
+	 * The journal acknowledges all readings up to the given one, so
+	 * while any reading waits in a batch, acknowledgement is deferred
+	 * until the batch is delivered.
+	 */
+	if (journaled) {
+		if (wmr->batch_len > 0)
+			wmr->batch_last = *reading;
+		else
+			acknowledge(wmr, reading);
+	}
+
+	TRACE(dispatch_end, reading->type);
+	elapsed = metrics_now() - start;
+	metrics_observe(METRIC_DISPATCH, elapsed);
+	if (reading->type != WMR_META)
+		wmr->dispatch_ns += elapsed;
 }
 
-static void update_if_newer(struct wmr_reading *old, struct wmr_reading *new)
+/*
+ * Pass a reading released by the ordering stage to loggers. A flush of the
+ * stage may release more readings than one packet holds, so the batch is
+ * delivered whenever it's full.
+ */
+static void release_reading(struct wmr_reading *reading, void *arg)
 {
-	if (new->time >= old->time)
-		*old = *new;
+	struct wmr200 *wmr = (struct wmr200 *)arg;
+
+	if (wmr->batch_len == BATCH_MAX)
+		deliver_batch(wmr, false);
+	invoke_handlers(wmr, reading);
+}
+
+/*
+ * Pass a decoded reading on, through the ordering stage if there's one.
+ * The stage may hold the reading for a while, so it's journaled first.
+ */
+static void submit_reading(struct wmr200 *wmr, struct wmr_reading *reading)
+{
+	if (wmr->order == NULL) {
+		invoke_handlers(wmr, reading);
+		return;
+	}
+
+	if (wmr->journal != NULL)
+		wmr->journal(wmr, reading, false, wmr->journal_arg);
+	order_push(wmr->order, reading, wmr->packet_type == HISTORIC_DATA,
+		release_reading, wmr);
+}
+
+/*
+ * Rebuild the NULL-terminated arrays of subscribers of every source, so
+ * that dispatching a reading only visits the loggers interested in it.
+ */
+static void update_dispatch(struct wmr200 *wmr)
+{
+	struct wmr_logger *logger;
+	size_t src, n;
+
+	for (src = 0; src < WMR_SRC_MAX; src++) {
+		n = 0;
+		for (logger = wmr->logger; logger != NULL; logger = logger->next)
+			if (logger->sub.sources & WMR_SRC_BIT(src))
+				n++;
+
+		free(wmr->dispatch[src]);
+		wmr->dispatch[src] = malloc_safe((n + 1) * sizeof(*wmr->dispatch[src]));
+
+		n = 0;
+		for (logger = wmr->logger; logger != NULL; logger = logger->next)
+			if (logger->sub.sources & WMR_SRC_BIT(src))
+				wmr->dispatch[src][n++] = logger;
+		wmr->dispatch[src][n] = NULL;
+	}
 }
 
 static void process_wind_data(struct wmr200 *wmr, byte_t *data)
@@ -296,6 +603,7 @@ static void process_wind_data(struct wmr200 *wmr, byte_t *data)
 	struct wmr_reading reading = {
 		.type = WMR_WIND,
 		.time = get_reading_time_from_packet(wmr),
+		.recv_ns = wmr->packet_ns,
 		.wind = {
 			.dir = wind_dir_string[dir_flag],
 			.gust_speed = gust_speed,
@@ -304,20 +612,21 @@ static void process_wind_data(struct wmr200 *wmr, byte_t *data)
 		}
 	};
 
-	update_if_newer(&wmr->latest.wind, &reading);
-	invoke_handlers(wmr, &reading);
+	latest_update(wmr->latest, &reading);
+	submit_reading(wmr, &reading);
 }
 
 static void process_rain_data(struct wmr200 *wmr, byte_t *data)
 {
-	float rate = ((data[8] << 8) + data[7]) * TENTH_OF_INCH;
-	float accum_hour = ((data[10] << 8) + data[9]) * TENTH_OF_INCH;
-	float accum_24h	= ((data[12] << 8) + data[11]) * TENTH_OF_INCH;
-	float accum_2007 = ((data[14] << 8) + data[13]) * TENTH_OF_INCH;
+	float rate = ((data[8] << 8) + data[7]) * WMR_RAIN_UNIT;
+	float accum_hour = ((data[10] << 8) + data[9]) * WMR_RAIN_UNIT;
+	float accum_24h	= ((data[12] << 8) + data[11]) * WMR_RAIN_UNIT;
+	float accum_2007 = ((data[14] << 8) + data[13]) * WMR_RAIN_UNIT;
 
 	struct wmr_reading reading = {
 		.type = WMR_RAIN,
 		.time = get_reading_time_from_packet(wmr),
+		.recv_ns = wmr->packet_ns,
 		.rain = {
 			.rate = rate,
 			.accum_hour = accum_hour,
@@ -326,8 +635,8 @@ static void process_rain_data(struct wmr200 *wmr, byte_t *data)
 		}
 	};
 
-	update_if_newer(&wmr->latest.rain, &reading);
-	invoke_handlers(wmr, &reading);
+	latest_update(wmr->latest, &reading);
+	submit_reading(wmr, &reading);
 }
 
 /*
@@ -340,13 +649,14 @@ static void process_uvi_data(struct wmr200 *wmr, byte_t *data)
 	struct wmr_reading reading = {
 		.type = WMR_UVI,
 		.time = get_reading_time_from_packet(wmr),
+		.recv_ns = wmr->packet_ns,
 		.uvi = {
 			.index = index
 		}
 	};
 
-	update_if_newer(&wmr->latest.uvi, &reading);
-	invoke_handlers(wmr, &reading);
+	latest_update(wmr->latest, &reading);
+	submit_reading(wmr, &reading);
 }
 
 /*
@@ -364,6 +674,7 @@ static void process_baro_data(struct wmr200 *wmr, byte_t *data)
 	struct wmr_reading reading = {
 		.type = WMR_BARO,
 		.time = get_reading_time_from_packet(wmr),
+		.recv_ns = wmr->packet_ns,
 		.baro = {
 			.pressure = pressure,
 			.alt_pressure = alt_pressure,
@@ -371,8 +682,8 @@ static void process_baro_data(struct wmr200 *wmr, byte_t *data)
 		}
 	};
 
-	update_if_newer(&wmr->latest.baro, &reading);
-	invoke_handlers(wmr, &reading);
+	latest_update(wmr->latest, &reading);
+	submit_reading(wmr, &reading);
 }
 
 /*
@@ -395,6 +706,7 @@ static void process_temp_data(struct wmr200 *wmr, byte_t *data)
 	struct wmr_reading reading = {
 		.type = WMR_TEMP,
 		.time = get_reading_time_from_packet(wmr),
+		.recv_ns = wmr->packet_ns,
 		.temp = {
 			.humidity = humidity,
 			.heat_index = heat_index,
@@ -406,8 +718,8 @@ static void process_temp_data(struct wmr200 *wmr, byte_t *data)
 
 	log_debug("The reading belongs to sensor '%s'", wmr_sensor_name(&reading));
 
-	update_if_newer(&wmr->latest.temp[sensor_id], &reading);
-	invoke_handlers(wmr, &reading);
+	latest_update(wmr->latest, &reading);
+	submit_reading(wmr, &reading);
 }
 
 /*
@@ -431,6 +743,7 @@ static void process_status_data(struct wmr200 *wmr, byte_t *data)
 	struct wmr_reading reading = {
 		.type = WMR_STATUS,
 		.time = get_reading_time_from_packet(wmr),
+		.recv_ns = wmr->packet_ns,
 		.status = {
 			.wind_bat = level_string[wind_bat],
 			.temp_bat = level_string[temp_bat],
@@ -444,8 +757,8 @@ static void process_status_data(struct wmr200 *wmr, byte_t *data)
 		}
 	};
 
-	update_if_newer(&wmr->latest.status, &reading);
-	invoke_handlers(wmr, &reading);
+	latest_update(wmr->latest, &reading);
+	submit_reading(wmr, &reading);
 }
 
 /*
@@ -483,16 +796,40 @@ static void emit_meta_packet(struct wmr200 *wmr)
 	log_debug("Emitting system WMR_META packet");
 
 	wmr->meta.uptime = time(NULL) - wmr->conn_since;
+	if (wmr->meta.num_packets > 0)
+		wmr->meta.error_rate = (float)wmr->meta.num_failed / wmr->meta.num_packets;
 	struct wmr_reading reading = {
 		.time = time(NULL),
+		.recv_ns = metrics_now(),
 		.type = WMR_META,
 		.meta = wmr->meta,
 	};
-	wmr->latest.meta = reading;
+	latest_update(wmr->latest, &reading);
 
 	invoke_handlers(wmr, &reading);
 }
 
+/*
+ * Check whether a packet of type @type may be @len bytes long. The length
+ * of HISTORIC_DATA packets is only checked roughly, as it depends on the
+ * contents (see verify_packet).
+ *
+ * Return value:
+ *	false if @type is not a reading packet type or @len is not a valid
+ *	length, true otherwise.
+ */
+static bool plausible_packet(byte_t type, size_t len)
+{
+	if (packet_len[type] > 0)
+		return len == packet_len[type];
+
+	if (type != HISTORIC_DATA)
+		return false;
+
+	return len >= HIST_SENSORS_OFFSET + HIST_SENSOR_LEN + 2 && len <= MAX_PACKET_LEN
+		&& (len - HIST_SENSORS_OFFSET - 2) % HIST_SENSOR_LEN == 0;
+}
+
 /*
  * Verify current packet's checksum and length.
  *
@@ -506,7 +843,11 @@ static bool verify_packet(struct wmr200 *wmr)
 	size_t num_ext_sensors;
 	size_t i;
 
-	if (wmr->packet_len <= 2)
+	/*
+	 * Validate packet length so that packet processing logic
+	 * does not read invalid memory.
+	 */
+	if (!plausible_packet(wmr->packet_type, wmr->packet_len))
 		return false;
 
 	for (i = 0, sum = 0; i < wmr->packet_len - 2; i++)
@@ -518,25 +859,14 @@ static bool verify_packet(struct wmr200 *wmr)
 	if (sum != checksum)
 		return false;
 
-	/*
-	 * Validate packet length so that packet processing logic
-	 * does not read invalid memory.
-	 */
-	if (packet_len[wmr->packet_type] > 0) {
-		if (wmr->packet_len != packet_len[wmr->packet_type]) {
-			error(wmr, "Invalid %s packet length (%zu)",
-				packet_type_to_string(wmr->packet_type), wmr->packet_len);
-		}
-	}
-
 	/*
 	 * Validate length of HISTORIC_DATA packet, which depends on the number
 	 * of external sensors present in the reading.
 	 */
 	if (wmr->packet_type == HISTORIC_DATA) {
-		assert(wmr->packet_len >= HIST_NUM_EXT_OFFSET);
 		num_ext_sensors = wmr->packet[HIST_NUM_EXT_OFFSET];
-		assert(wmr->packet_len == HIST_SENSORS_OFFSET + (1 + num_ext_sensors) * HIST_SENSOR_LEN + 2);
+		if (wmr->packet_len != HIST_SENSORS_OFFSET + (1 + num_ext_sensors) * HIST_SENSOR_LEN + 2)
+			return false;
 	}
 
 	return true;
@@ -576,70 +906,198 @@ static void dispatch_packet(struct wmr200 *wmr)
 }
 
 /*
- * Main communication loop. Receives packets from the station and acts
- * accordingly.
+ * Make sure that at least @n bytes which have not been decoded yet are
+ * in the RX window, receiving more if necessary.
  */
-static void mainloop(struct wmr200 *wmr)
+static void rx_fill(struct wmr200 *wmr, size_t n)
 {
-	size_t i;
+	assert(n <= RX_SIZE);
 
-	while (1) {
-		wmr->packet_type = read_byte(wmr);
+	if (wmr->rx_start + n > RX_SIZE) {
+		memmove(wmr->rx, wmr->rx + wmr->rx_start, wmr->rx_end - wmr->rx_start);
+		wmr->rx_end -= wmr->rx_start;
+		wmr->rx_start = 0;
+	}
 
-		switch (wmr->packet_type) {
-		case PACKET_HISTDATA_NOTIF:
-			log_info("Data logger contains some unprocessed "
-				"historic records");
-			log_info("Issuing CMD_REQUEST_HISTDATA command");
+	while (wmr->rx_end - wmr->rx_start < n)
+		wmr->rx[wmr->rx_end++] = read_byte(wmr);
+}
 
-			send_cmd(wmr, CMD_REQUEST_HISTDATA);
-			continue;
+/*
+ * Discard the first byte of the RX window, which does not start a valid
+ * packet. If the decoder was in sync, it has lost it now. When too many
+ * bytes have been discarded, the connection is given up on.
+ *
+ * Return value:
+ *	false if the connection was given up on, true otherwise.
+ */
+static bool rx_discard(struct wmr200 *wmr)
+{
+	if (wmr->discarded++ == 0)
+		log_debug("Lost packet boundary, looking for the next packet");
 
-		case PACKET_ERASE_ACK:
-			log_info("Data logger database purge successful");
-			continue;
+	wmr->rx_start++;
+	metrics_count(METRIC_DISCARDED_BYTES, 1);
 
-		case PACKET_STOP_ACK:
-			/*
-			 * Ignore, this is only a response to prev CMD_STOP packet.
-			 * This packet may have been sent during previous session.
-			 */
-			log_debug("Ignoring CMD_STOP packet");
-			continue;
-		}
+	if (wmr->discarded == RESYNC_MAX_BYTES) {
+		error(wmr, "No valid packet in %u bytes", RESYNC_MAX_BYTES);
+		wmr->discarded = 0;
+		return false;
+	}
+
+	return true;
+}
 
-		wmr->packet_len = read_byte(wmr);
+/*
+ * Receive a packet from the station into @wmr->packet. Control packets
+ * are handled right away.
+ *
+ * Packets are not delimited in any way, so a corrupted type or length
+ * byte makes the decoder lose the packet boundaries. Whenever the bytes
+ * at the start of the RX window do not form a valid reading packet (of
+ * a known type, with a valid length and checksum), the first byte is
+ * discarded and the next one tried, until a valid packet is found.
+ *
+ * Return value:
+ *	true if a reading packet was received, false otherwise.
+ */
+static bool receive_packet(struct wmr200 *wmr)
+{
+	byte_t *head;
 
-		log_debug("Received %s (type=0x%02X, len=%zu)",
-			packet_type_to_string(wmr->packet_type), wmr->packet_type,
-			wmr->packet_len);
+	while (1) {
+		rx_fill(wmr, 1);
+		wmr->packet_type = wmr->rx[wmr->rx_start];
 
 		/*
-		 * If a packet is too big or too small, it is an error.
+		 * While looking for the next packet, control bytes are most
+		 * likely a part of a corrupted packet, so they're discarded
+		 * like any other byte.
 		 */
-		if (wmr->packet_len <= 2 || wmr->packet_len > MAX_PACKET_LEN)
-			error(wmr, "Unexpected packet length (len=%zu)", wmr->packet_len);
-
-		wmr->packet = malloc_safe(wmr->packet_len);
-		wmr->packet[0] = wmr->packet_type;
-		wmr->packet[1] = wmr->packet_len;
+		if (wmr->discarded == 0) {
+			switch (wmr->packet_type) {
+			case PACKET_HISTDATA_NOTIF:
+				wmr->rx_start++;
+				metrics_count_packet(wmr->packet_type);
+				log_info("Data logger contains some unprocessed "
+					"historic records");
+				log_info("Issuing CMD_REQUEST_HISTDATA command");
+
+				send_cmd(wmr, CMD_REQUEST_HISTDATA);
+				return false;
+
+			case PACKET_ERASE_ACK:
+				wmr->rx_start++;
+				metrics_count_packet(wmr->packet_type);
+				log_info("Data logger database purge successful");
+				return false;
+
+			case PACKET_STOP_ACK:
+				/*
+				 * Ignore, this is only a response to prev CMD_STOP packet.
+				 * This packet may have been sent during previous session.
+				 */
+				wmr->rx_start++;
+				metrics_count_packet(wmr->packet_type);
+				log_debug("Ignoring CMD_STOP packet");
+				return false;
+			}
+		}
 
-		for (i = 2; i < wmr->packet_len; i++)
-			wmr->packet[i] = read_byte(wmr);
+		rx_fill(wmr, 2);
+		wmr->packet_len = wmr->rx[wmr->rx_start + 1];
+		if (!plausible_packet(wmr->packet_type, wmr->packet_len)) {
+			if (!rx_discard(wmr))
+				return false;
+			continue;
+		}
 
-		wmr->meta.num_packets++;
+		rx_fill(wmr, wmr->packet_len);
+		head = wmr->rx + wmr->rx_start;
+		wmr->packet = head;
+		if (verify_packet(wmr))
+			break;
 
-		if (!verify_packet(wmr)) {
-			log_warning("Received incorrect packet, dropping");
+		/* a bad checksum of a packet in sync is a corrupted packet */
+		if (wmr->discarded == 0) {
+			log_debug("Received incorrect packet, dropping");
+			wmr->meta.num_packets++;
 			wmr->meta.num_failed++;
-			goto free_packet;
+			metrics_count_packet(wmr->packet_type);
+			metrics_count(METRIC_CHECKSUM_FAILURES, 1);
+			TRACE(checksum_failure, wmr->packet_type);
+		}
+		if (!rx_discard(wmr))
+			return false;
+	}
+
+	if (wmr->discarded > 0) {
+		log_debug("Found the next packet, %zu bytes discarded", wmr->discarded);
+		metrics_count(METRIC_RESYNCS, 1);
+		wmr->discarded = 0;
+	}
+
+	log_debug("Received %s (type=0x%02X, len=%zu)",
+		packet_type_to_string(wmr->packet_type), wmr->packet_type,
+		wmr->packet_len);
+
+	wmr->packet = pool_get(&wmr->packets);
+	memcpy(wmr->packet, head, wmr->packet_len);
+	wmr->rx_start += wmr->packet_len;
+
+	/* the packet is received once its last byte is */
+	wmr->packet_ns = wmr->frame_ns;
+	wmr->meta.num_packets++;
+	metrics_count_packet(wmr->packet_type);
+	TRACE(packet_complete, wmr->packet_type);
+	return true;
+}
+
+/*
+ * Main communication loop. Receives packets from the station and acts
+ * accordingly.
+ */
+static void mainloop(struct wmr200 *wmr)
+{
+	uint64_t start;
+	int old_state;
+
+	while (1) {
+		/*
+		 * If there's no more data to process, the current burst of
+		 * packets is over; flush the ordering stage and the batch
+		 * before waiting for more. Like dispatching a packet, this is
+		 * not cancelled halfway through.
+		 */
+		if ((wmr->batch_len > 0 || (wmr->order && order_pending(wmr->order)))
+			&& wmr->buf_avail == 0 && !read_frame(wmr, 0)) {
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+			if (wmr->order != NULL)
+				order_flush(wmr->order, release_reading, wmr);
+			deliver_batch(wmr, true);
+			pthread_setcancelstate(old_state, NULL);
 		}
 
+		/* packets are verified as they are received */
+		if (!receive_packet(wmr))
+			continue;
+
+		start = metrics_now();
 		wmr->meta.latest_packet = time(NULL);
+
+		/*
+		 * Loggers are not cancelled halfway through, so that the readings
+		 * are either processed completely or not at all when we stop.
+		 */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+		wmr->dispatch_ns = 0;
 		dispatch_packet(wmr);
+		metrics_observe(METRIC_DECODE, metrics_now() - start - wmr->dispatch_ns);
+		if (wmr->batch_len + MAX_PACKET_READINGS > BATCH_MAX)
+			deliver_batch(wmr, false);
+		pthread_setcancelstate(old_state, NULL);
 
-free_packet:
-		free(wmr->packet);
+		pool_put(&wmr->packets, wmr->packet);
 	}
 }
 
@@ -685,18 +1143,27 @@ struct wmr200 *wmr_open(void)
 {
 	struct wmr200 *wmr = malloc_safe(sizeof(*wmr));
 
-	wmr->dev = hid_open(VENDOR_ID, PRODUCT_ID, NULL);
+	wmr->dev = hid_open(WMR200_VENDOR_ID, WMR200_PRODUCT_ID, NULL);
 	if (wmr->dev == NULL) {
 		log_error("hid_open: cannot connect to WMR200");
 		return NULL;
 	}
 
 	wmr->packet = NULL;
+	pool_init(&wmr->packets, MAX_PACKET_LEN, PACKET_POOL_SIZE);
+	memset(wmr->hour_key, 0xFF, sizeof(wmr->hour_key));
 	wmr->buf_avail = wmr->buf_pos = 0;
+	wmr->frame_ns = wmr->packet_ns = 0;
+	wmr->rx_start = wmr->rx_end = wmr->discarded = 0;
 	wmr->logger = NULL;
+	wmr->batch_len = 0;
 	wmr->conn_since = time(NULL);
 	wmr->err_handler = default_error_handler;
-	memset(&wmr->latest, 0, sizeof(wmr->latest));
+	atomic_init(&wmr->failed, false);
+	wmr->journal = NULL;
+	wmr->order = NULL;
+	(void) latest_open(&wmr->own_latest, NULL);
+	wmr->latest = &wmr->own_latest;
 	memset(&wmr->meta, 0, sizeof(wmr->meta));
 
 	if (hid_write(wmr->dev, wakeup, sizeof(wakeup)) != sizeof(wakeup)) {
@@ -704,20 +1171,38 @@ struct wmr200 *wmr_open(void)
 		goto out_free;
 	}
 
+	memset(wmr->dispatch, 0, sizeof(wmr->dispatch));
+	update_dispatch(wmr);
 	return wmr;
 
 out_free:
+	latest_close(&wmr->own_latest);
+	pool_free(&wmr->packets);
 	free(wmr);
 	return NULL;
 }
 
 void wmr_close(struct wmr200 *wmr)
 {
+	struct wmr_logger *logger;
+	size_t src;
+
 	if (wmr->dev != NULL) {
 		send_cmd(wmr, CMD_STOP);
 		hid_close(wmr->dev);
 	}
 
+	while ((logger = wmr->logger) != NULL) {
+		wmr->logger = logger->next;
+		free(logger->batch);
+		free(logger);
+	}
+
+	for (src = 0; src < WMR_SRC_MAX; src++)
+		free(wmr->dispatch[src]);
+
+	latest_close(&wmr->own_latest);
+	pool_free(&wmr->packets);
 	free(wmr);
 }
 
@@ -759,19 +1244,65 @@ void wmr_stop(struct wmr200 *wmr)
 	pthread_cancel(wmr->mainloop_thread);
 	pthread_join(wmr->heartbeat_thread, NULL);
 	pthread_join(wmr->mainloop_thread, NULL);
+	deliver_batch(wmr, true);
 	send_cmd(wmr, CMD_STOP);
 }
 
-void wmr_register_logger(struct wmr200 *wmr, wmr_logger_t *func, void *arg)
+/*
+ * Subscription to all readings, used by loggers registered without one.
+ */
+static const struct wmr_subscription sub_all = {
+	.sources = WMR_SRC_ALL,
+};
+
+/*
+ * Append a new logger to the list of loggers of @wmr and add it to
+ * the subscriber arrays.
+ */
+static void add_logger(struct wmr200 *wmr, wmr_logger_t *func,
+	wmr_batch_logger_t *batch_func, void *arg,
+	const struct wmr_subscription *sub)
 {
 	struct wmr_logger *logger;
-	
+	struct wmr_logger **tail;
+
 	logger = malloc_safe(sizeof(*logger));
 	logger->func = func;
+	logger->batch_func = batch_func;
 	logger->arg = arg;
-	logger->next = wmr->logger;
+	logger->sub = *sub;
+	memset(logger->last, 0, sizeof(logger->last));
+	logger->batch = batch_func ? malloc_safe(BATCH_MAX * sizeof(*logger->batch)) : NULL;
+	logger->batch_len = 0;
+	logger->metric = sub->name ? metrics_register_logger(sub->name) : -1;
+	logger->next = NULL;
+
+	for (tail = &wmr->logger; *tail != NULL; tail = &(*tail)->next);
+	*tail = logger;
 
-	wmr->logger = logger;
+	update_dispatch(wmr);
+}
+
+void wmr_register_logger(struct wmr200 *wmr, wmr_logger_t *func, void *arg)
+{
+	add_logger(wmr, func, NULL, arg, &sub_all);
+}
+
+void wmr_register_batch_logger(struct wmr200 *wmr, wmr_batch_logger_t *func, void *arg)
+{
+	add_logger(wmr, NULL, func, arg, &sub_all);
+}
+
+void wmr_subscribe_logger(struct wmr200 *wmr, wmr_logger_t *func, void *arg,
+	const struct wmr_subscription *sub)
+{
+	add_logger(wmr, func, NULL, arg, sub);
+}
+
+void wmr_subscribe_batch_logger(struct wmr200 *wmr, wmr_batch_logger_t *func,
+	void *arg, const struct wmr_subscription *sub)
+{
+	add_logger(wmr, NULL, func, arg, sub);
 }
 
 void wmr_set_error_handler(struct wmr200 *wmr, wmr_err_handler_t handler, void *arg)
@@ -780,9 +1311,49 @@ void wmr_set_error_handler(struct wmr200 *wmr, wmr_err_handler_t handler, void *
 	wmr->err_arg = arg;
 }
 
+void wmr_set_journal(struct wmr200 *wmr, wmr_journal_t *journal, void *arg)
+{
+	wmr->journal = journal;
+	wmr->journal_arg = arg;
+}
+
+void wmr_set_order(struct wmr200 *wmr, struct order *order)
+{
+	wmr->order = order;
+}
+
+void wmr_set_latest(struct wmr200 *wmr, struct latest *latest)
+{
+	wmr->latest = latest;
+}
+
 void wmr_get_latest_data(struct wmr200 *wmr, struct wmr_latest_data *latest)
 {
-	*latest = wmr->latest;
+	latest_get(wmr->latest, latest);
+}
+
+int wmr_source_of(struct wmr_reading *reading)
+{
+	switch (reading->type) {
+	case WMR_WIND:
+		return WMR_SRC_WIND;
+	case WMR_RAIN:
+		return WMR_SRC_RAIN;
+	case WMR_UVI:
+		return WMR_SRC_UVI;
+	case WMR_BARO:
+		return WMR_SRC_BARO;
+	case WMR_STATUS:
+		return WMR_SRC_STATUS;
+	case WMR_META:
+		return WMR_SRC_META;
+	case WMR_TEMP:
+		if (reading->temp.sensor_id < WMR200_MAX_TEMP_SENSORS)
+			return WMR_SRC_TEMP0 + reading->temp.sensor_id;
+		return -1;
+	}
+
+	return -1;
 }
 
 const char *wmr_sensor_name(struct wmr_reading *reading)
@@ -830,6 +1401,167 @@ const char *wmr_sensor_name(struct wmr_reading *reading)
 	return NULL;
 }
 
+/*
+ * All string tables, in the order of string codes.
+ */
+static struct
+{
+	const char **strings;
+	size_t count;
+} string_tables[] = {
+	{ level_string, ARRAY_SIZE(level_string) },
+	{ status_string, ARRAY_SIZE(status_string) },
+	{ forecast_string, ARRAY_SIZE(forecast_string) },
+	{ wind_dir_string, ARRAY_SIZE(wind_dir_string) },
+};
+
+byte_t wmr_string_code(const char *str)
+{
+	byte_t code = 1;
+	size_t t, i;
+
+	if (str == NULL)
+		return 0;
+
+	for (t = 0; t < ARRAY_SIZE(string_tables); t++)
+		for (i = 0; i < string_tables[t].count; i++, code++)
+			if (string_tables[t].strings[i] == str)
+				return code;
+
+	assert(0);
+	return 0;
+}
+
+const char *wmr_code_string(byte_t code)
+{
+	size_t t;
+
+	if (code-- == 0)
+		return NULL;
+
+	for (t = 0; t < ARRAY_SIZE(string_tables); t++) {
+		if (code < string_tables[t].count)
+			return string_tables[t].strings[code];
+		code -= string_tables[t].count;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return a pointer to the @i-th string field of @status.
+ */
+static const char **status_field(struct wmr_status *status, size_t i)
+{
+	const char **fields[] = {
+		&status->wind_bat,
+		&status->temp_bat,
+		&status->rain_bat,
+		&status->uv_bat,
+		&status->wind_sensor,
+		&status->temp_sensor,
+		&status->rain_sensor,
+		&status->uv_sensor,
+		&status->rtc_signal_level,
+	};
+
+	assert(i < ARRAY_SIZE(fields));
+	return fields[i];
+}
+
+/*
+ * Scale float @value by @scale to the nearest integer.
+ */
+#define	SCALE(value, scale)	lroundf((value) * (scale))
+
+_Static_assert(sizeof(struct wmr_record) == 16, "struct wmr_record is not packed");
+
+void wmr_record_encode(struct wmr_reading *reading, struct wmr_record *rec)
+{
+	size_t i;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->time = reading->time;
+	rec->type = reading->type;
+
+	switch (reading->type) {
+	case WMR_WIND:
+		rec->wind.dir = wmr_string_code(reading->wind.dir);
+		rec->wind.gust_speed = SCALE(reading->wind.gust_speed, 10);
+		rec->wind.avg_speed = SCALE(reading->wind.avg_speed, 10);
+		rec->wind.chill = SCALE(reading->wind.chill, 10);
+		break;
+	case WMR_RAIN:
+		rec->rain.rate = SCALE(reading->rain.rate, 1 / WMR_RAIN_UNIT);
+		rec->rain.accum_hour = SCALE(reading->rain.accum_hour, 1 / WMR_RAIN_UNIT);
+		rec->rain.accum_24h = SCALE(reading->rain.accum_24h, 1 / WMR_RAIN_UNIT);
+		rec->rain.accum_2007 = SCALE(reading->rain.accum_2007, 1 / WMR_RAIN_UNIT);
+		break;
+	case WMR_UVI:
+		rec->uvi.index = reading->uvi.index;
+		break;
+	case WMR_BARO:
+		rec->baro.pressure = reading->baro.pressure;
+		rec->baro.alt_pressure = reading->baro.alt_pressure;
+		rec->baro.forecast = wmr_string_code(reading->baro.forecast);
+		break;
+	case WMR_TEMP:
+		rec->temp.sensor_id = reading->temp.sensor_id;
+		rec->temp.humidity = reading->temp.humidity;
+		rec->temp.heat_index = reading->temp.heat_index;
+		rec->temp.temp = SCALE(reading->temp.temp, 10);
+		rec->temp.dew_point = SCALE(reading->temp.dew_point, 10);
+		break;
+	case WMR_STATUS:
+		for (i = 0; i < ARRAY_SIZE(rec->status.codes); i++)
+			rec->status.codes[i] = wmr_string_code(status_field(&reading->status, i)[0]);
+		break;
+	}
+}
+
+void wmr_record_decode(struct wmr_record *rec, struct wmr_reading *reading)
+{
+	size_t i;
+
+	memset(reading, 0, sizeof(*reading));
+	reading->time = rec->time;
+	reading->type = rec->type;
+
+	switch (rec->type) {
+	case WMR_WIND:
+		reading->wind.dir = wmr_code_string(rec->wind.dir);
+		reading->wind.gust_speed = rec->wind.gust_speed / 10.0;
+		reading->wind.avg_speed = rec->wind.avg_speed / 10.0;
+		reading->wind.chill = rec->wind.chill / 10.0;
+		break;
+	case WMR_RAIN:
+		reading->rain.rate = rec->rain.rate * WMR_RAIN_UNIT;
+		reading->rain.accum_hour = rec->rain.accum_hour * WMR_RAIN_UNIT;
+		reading->rain.accum_24h = rec->rain.accum_24h * WMR_RAIN_UNIT;
+		reading->rain.accum_2007 = rec->rain.accum_2007 * WMR_RAIN_UNIT;
+		break;
+	case WMR_UVI:
+		reading->uvi.index = rec->uvi.index;
+		break;
+	case WMR_BARO:
+		reading->baro.pressure = rec->baro.pressure;
+		reading->baro.alt_pressure = rec->baro.alt_pressure;
+		reading->baro.forecast = wmr_code_string(rec->baro.forecast);
+		break;
+	case WMR_TEMP:
+		reading->temp.sensor_id = rec->temp.sensor_id;
+		reading->temp.humidity = rec->temp.humidity;
+		reading->temp.heat_index = rec->temp.heat_index;
+		reading->temp.temp = rec->temp.temp / 10.0;
+		reading->temp.dew_point = rec->temp.dew_point / 10.0;
+		break;
+	case WMR_STATUS:
+		for (i = 0; i < ARRAY_SIZE(rec->status.codes); i++)
+			*status_field(&reading->status, i) = wmr_code_string(rec->status.codes[i]);
+		break;
+	}
+}
+
 const char *packet_type_to_string(enum packet_type type)
 {
 	switch (type) {